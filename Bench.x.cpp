@@ -0,0 +1,1352 @@
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string.h>
+// Ahead of the runtime headers, TBB (behind <execution>) uses `defer` as an identifier
+#ifdef CPPGO_BENCH_OPENMP
+#include <omp.h>
+#endif
+#ifdef CPPGO_BENCH_PSTL
+#include <execution>
+#include <numeric>
+#endif
+
+#include "Actor.h"
+#include "Machines.h"
+#include "Parallel.h"
+#include "RemoteChannel.h"
+#include "Select.h"
+#include "SpillChannel.h"
+#ifdef CPPGO_COROUTINES
+#include "Task.h"
+#endif
+
+using namespace gocpp;
+
+/*
+Microbenchmarks for the runtime, each paired with a std::thread + std::condition_variable baseline.
+Every benchmark runs a fixed amount of work (scaled by --scale), is repeated --repeat times and the
+median run is reported, so results of two builds on the same machine can be compared directly.
+
+Usage: cppgo_bench [--json out.json] [--filter substr] [--repeat N] [--scale X]
+*/
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Result
+    {
+        std::string m_name;
+        std::string m_impl;
+        uint64_t m_ops{0};
+        double m_seconds{0};
+        std::map<std::string, double> m_extra;
+
+        double nsPerOp() const { return m_ops ? m_seconds * 1e9 / m_ops : 0; }
+    };
+
+    struct Params
+    {
+        double m_scale{1.0};
+
+        size_t scaled(size_t n) const { return std::max<size_t>(1, size_t(n * m_scale)); }
+    };
+
+    struct BenchCase
+    {
+        std::string m_name;
+        std::string m_impl;
+        std::function<Result(const Params &)> m_fn;
+    };
+
+    double secondsSince(Clock::time_point start)
+    {
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    // Main thread is not a routine, it can only poll for routine progress.
+    // Sleeping between polls keeps it from competing with the executors for cores
+    template <typename Pred>
+    void waitUntil(Pred pred)
+    {
+        using namespace std::chrono_literals;
+        while (not pred())
+        {
+            std::this_thread::sleep_for(50us);
+        }
+    }
+
+    size_t residentBytes()
+    {
+        std::ifstream statm("/proc/self/statm");
+        size_t size = 0, resident = 0;
+        statm >> size >> resident;
+        return resident * size_t(sysconf(_SC_PAGESIZE));
+    }
+
+    uint64_t contextSwitches()
+    {
+        return Machines::getInstance()->metricsSnapshot().m_total.m_counters[CONTEXT_SWITCHES];
+    }
+
+    // Runs `body` and fills in timing plus the runtime's context switch count
+    template <typename Fn>
+    Result timed(const std::string &name, const std::string &impl, uint64_t ops, Fn &&body)
+    {
+        Result result{name, impl, ops, 0, {}};
+        bool runtime = impl == "cppgo";
+        uint64_t switches = runtime ? contextSwitches() : 0;
+        auto start = Clock::now();
+        body(result);
+        result.m_seconds = secondsSince(start);
+        if (runtime)
+        {
+            result.m_extra["context_switches"] = double(contextSwitches() - switches);
+        }
+        return result;
+    }
+
+    // Bounded blocking queue, the std::thread counterpart of a buffered Channel
+    template <typename T>
+    class BlockingQueue
+    {
+        std::mutex m_lock;
+        std::condition_variable m_not_empty, m_not_full;
+        std::deque<T> m_items;
+        size_t m_capacity;
+        bool m_closed{false};
+
+    public:
+        BlockingQueue(size_t capacity) : m_capacity(std::max<size_t>(1, capacity)) {}
+
+        void push(T value)
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_not_full.wait(lock, [&]()
+                            { return m_items.size() < m_capacity; });
+            m_items.emplace_back(std::move(value));
+            m_not_empty.notify_one();
+        }
+
+        bool pop(T &out)
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_not_empty.wait(lock, [&]()
+                             { return m_closed or not m_items.empty(); });
+            if (m_items.empty())
+            {
+                return false;
+            }
+            out = std::move(m_items.front());
+            m_items.pop_front();
+            m_not_full.notify_one();
+            return true;
+        }
+
+        void close()
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_closed = true;
+            m_not_empty.notify_all();
+        }
+    };
+
+    // ---------------------------------------------------------------- spawn
+
+    Result spawnRoutines(const Params &params)
+    {
+        size_t n = params.scaled(1000);
+        return timed("spawn_exit", "cppgo", n, [&](Result &)
+                     {
+                         std::atomic<size_t> done{0};
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             go([&done]()
+                                { done.fetch_add(1, std::memory_order_relaxed); });
+                         }
+                         waitUntil([&]()
+                                   { return done == n; });
+                     });
+    }
+
+    Result spawnBatchRoutines(const Params &params)
+    {
+        size_t n = params.scaled(1000);
+        return timed("spawn_exit", "cppgo_batch", n, [&](Result &)
+                     {
+                         std::atomic<size_t> done{0};
+                         goBatch(n, [&done](size_t)
+                                 { done.fetch_add(1, std::memory_order_relaxed); });
+                         waitUntil([&]()
+                                   { return done == n; });
+                     });
+    }
+
+    Result spawnThreads(const Params &params)
+    {
+        size_t n = params.scaled(1000);
+        return timed("spawn_exit", "std_thread", n, [&](Result &)
+                     {
+                         std::atomic<size_t> done{0};
+                         std::vector<std::thread> threads;
+                         threads.reserve(n);
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             threads.emplace_back([&done]()
+                                                  { done.fetch_add(1, std::memory_order_relaxed); });
+                         }
+                         for (auto &thread : threads)
+                         {
+                             thread.join();
+                         }
+                     });
+    }
+
+    // ---------------------------------------------------------------- yield
+
+    Result yieldRoutines(const Params &params)
+    {
+        size_t rounds = params.scaled(20000);
+        return timed("yield_round_trip", "cppgo", rounds, [&](Result &)
+                     {
+                         std::atomic<size_t> done{0};
+                         for (int r = 0; r < 2; r++)
+                         {
+                             go([&]()
+                                {
+                                    for (size_t i = 0; i < rounds; i++)
+                                    {
+                                        Machines::yieldToScheduler();
+                                    }
+                                    done++;
+                                });
+                         }
+                         waitUntil([&]()
+                                   { return done == 2; });
+                     });
+    }
+
+    Result yieldThreads(const Params &params)
+    {
+        size_t rounds = params.scaled(20000);
+        return timed("yield_round_trip", "std_thread", rounds, [&](Result &)
+                     {
+                         // Two threads handing a turn back and forth
+                         std::mutex lock;
+                         std::condition_variable cv;
+                         size_t turn = 0;
+                         auto const player = [&](size_t me)
+                         {
+                             for (size_t i = 0; i < rounds; i++)
+                             {
+                                 std::unique_lock<std::mutex> guard(lock);
+                                 cv.wait(guard, [&]()
+                                         { return turn % 2 == me; });
+                                 turn++;
+                                 cv.notify_one();
+                             }
+                         };
+                         std::thread a(player, 0), b(player, 1);
+                         a.join();
+                         b.join();
+                     });
+    }
+
+    // ---------------------------------------------------------------- ping-pong
+
+    Result pingPongRoutines(const Params &params, size_t bufferSize)
+    {
+        size_t rounds = params.scaled(20000);
+        std::string name = bufferSize ? "channel_pingpong_buffered" : "channel_pingpong_unbuffered";
+        return timed(name, "cppgo", rounds, [&](Result &)
+                     {
+                         Channel<uint64_t> ping(bufferSize), pong(bufferSize);
+                         // Both sides must be out of their last channel call before the channels go away
+                         std::atomic<size_t> done{0};
+                         go([&]()
+                            {
+                                uint64_t value = 0;
+                                for (size_t i = 0; i < rounds; i++)
+                                {
+                                    ping >> value;
+                                    pong << value + 1;
+                                }
+                                done++;
+                            });
+                         go([&]()
+                            {
+                                uint64_t value = 0;
+                                for (size_t i = 0; i < rounds; i++)
+                                {
+                                    ping << value;
+                                    pong >> value;
+                                }
+                                done++;
+                            });
+                         waitUntil([&]()
+                                   { return done == 2; });
+                     });
+    }
+
+    Result pingPongThreads(const Params &params, size_t bufferSize)
+    {
+        size_t rounds = params.scaled(20000);
+        std::string name = bufferSize ? "channel_pingpong_buffered" : "channel_pingpong_unbuffered";
+        return timed(name, "std_thread", rounds, [&](Result &)
+                     {
+                         BlockingQueue<uint64_t> ping(bufferSize), pong(bufferSize);
+                         std::thread echo([&]()
+                                          {
+                                              uint64_t value = 0;
+                                              for (size_t i = 0; i < rounds; i++)
+                                              {
+                                                  ping.pop(value);
+                                                  pong.push(value + 1);
+                                              }
+                                          });
+                         uint64_t value = 0;
+                         for (size_t i = 0; i < rounds; i++)
+                         {
+                             ping.push(value);
+                             pong.pop(value);
+                         }
+                         echo.join();
+                     });
+    }
+
+    // ---------------------------------------------------------------- producers / consumers
+
+    const size_t PRODUCERS = 4, CONSUMERS = 4, MPMC_BUFFER = 128;
+
+    Result mpmcRoutines(const Params &params)
+    {
+        size_t perProducer = params.scaled(50000) / PRODUCERS;
+        return timed("mpmc_throughput", "cppgo", perProducer * PRODUCERS, [&](Result &result)
+                     {
+                         Channel<uint64_t> channel(MPMC_BUFFER);
+                         std::atomic<size_t> producersLeft{PRODUCERS}, consumersLeft{CONSUMERS}, consumed{0};
+                         for (size_t p = 0; p < PRODUCERS; p++)
+                         {
+                             go([&]()
+                                {
+                                    for (size_t i = 0; i < perProducer; i++)
+                                    {
+                                        channel << uint64_t(i);
+                                    }
+                                    if (--producersLeft == 0)
+                                    {
+                                        channel.close();
+                                    }
+                                });
+                         }
+                         for (size_t c = 0; c < CONSUMERS; c++)
+                         {
+                             go([&]()
+                                {
+                                    uint64_t value = 0;
+                                    while (channel >> value)
+                                    {
+                                        consumed.fetch_add(1, std::memory_order_relaxed);
+                                    }
+                                    consumersLeft--;
+                                });
+                         }
+                         waitUntil([&]()
+                                   { return consumersLeft == 0; });
+                         result.m_extra["consumed"] = double(consumed);
+                     });
+    }
+
+    Result mpmcThreads(const Params &params)
+    {
+        size_t perProducer = params.scaled(50000) / PRODUCERS;
+        return timed("mpmc_throughput", "std_thread", perProducer * PRODUCERS, [&](Result &result)
+                     {
+                         BlockingQueue<uint64_t> queue(MPMC_BUFFER);
+                         std::atomic<size_t> producersLeft{PRODUCERS}, consumed{0};
+                         std::vector<std::thread> threads;
+                         for (size_t p = 0; p < PRODUCERS; p++)
+                         {
+                             threads.emplace_back([&]()
+                                                  {
+                                                      for (size_t i = 0; i < perProducer; i++)
+                                                      {
+                                                          queue.push(i);
+                                                      }
+                                                      if (--producersLeft == 0)
+                                                      {
+                                                          queue.close();
+                                                      }
+                                                  });
+                         }
+                         for (size_t c = 0; c < CONSUMERS; c++)
+                         {
+                             threads.emplace_back([&]()
+                                                  {
+                                                      uint64_t value = 0;
+                                                      while (queue.pop(value))
+                                                      {
+                                                          consumed.fetch_add(1, std::memory_order_relaxed);
+                                                      }
+                                                  });
+                         }
+                         for (auto &thread : threads)
+                         {
+                             thread.join();
+                         }
+                         result.m_extra["consumed"] = double(consumed);
+                     });
+    }
+
+    // ---------------------------------------------------------------- single producer stream
+
+    const size_t STREAM_BUFFER = 64;
+
+    template <typename Kind>
+    Result streamRoutines(const Params &params, const std::string &impl)
+    {
+        size_t n = params.scaled(200000);
+        return timed("spsc_stream", impl, n, [&](Result &result)
+                     {
+                         Channel<uint64_t, Kind> channel(STREAM_BUFFER);
+                         std::atomic<size_t> done{0};
+                         uint64_t sum = 0;
+                         go([&, out = Sender(channel)]()
+                            {
+                                for (size_t i = 0; i < n; i++)
+                                {
+                                    out << uint64_t(i);
+                                }
+                                out.close();
+                                done++;
+                            });
+                         go([&, in = Receiver(channel)]()
+                            {
+                                uint64_t value = 0;
+                                while (in >> value)
+                                {
+                                    sum += value;
+                                }
+                                done++;
+                            });
+                         waitUntil([&]()
+                                   { return done == 2; });
+                         result.m_extra["checksum"] = double(sum);
+                     });
+    }
+
+    Result streamThreads(const Params &params)
+    {
+        size_t n = params.scaled(200000);
+        return timed("spsc_stream", "std_thread", n, [&](Result &result)
+                     {
+                         BlockingQueue<uint64_t> queue(STREAM_BUFFER);
+                         uint64_t sum = 0;
+                         std::thread consumer([&]()
+                                              {
+                                                  uint64_t value = 0;
+                                                  while (queue.pop(value))
+                                                  {
+                                                      sum += value;
+                                                  }
+                                              });
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             queue.push(i);
+                         }
+                         queue.close();
+                         consumer.join();
+                         result.m_extra["checksum"] = double(sum);
+                     });
+    }
+
+    // ---------------------------------------------------------------- actor mailbox
+
+    const size_t MAILBOX_SENDERS = 4;
+
+    // One routine owning a sum, the others send it small messages
+    Result mailboxChannel(const Params &params)
+    {
+        size_t perSender = params.scaled(1000000) / MAILBOX_SENDERS;
+        return timed("actor_mailbox", "cppgo_channel", perSender * MAILBOX_SENDERS, [&](Result &result)
+                     {
+                         Channel<uint64_t> mailbox(STREAM_BUFFER);
+                         std::atomic<size_t> done{0};
+                         uint64_t sum = 0;
+                         for (size_t s = 0; s < MAILBOX_SENDERS; s++)
+                         {
+                             go([&]()
+                                {
+                                    for (size_t i = 0; i < perSender; i++)
+                                    {
+                                        mailbox << uint64_t(i);
+                                    }
+                                    done++;
+                                });
+                         }
+                         go([&]()
+                            {
+                                uint64_t value = 0;
+                                for (size_t i = 0; i < perSender * MAILBOX_SENDERS; i++)
+                                {
+                                    mailbox >> value;
+                                    sum += value;
+                                }
+                                done++;
+                            });
+                         waitUntil([&]()
+                                   { return done == MAILBOX_SENDERS + 1; });
+                         result.m_extra["checksum"] = double(sum);
+                     });
+    }
+
+    Result mailboxActor(const Params &params)
+    {
+        size_t perSender = params.scaled(1000000) / MAILBOX_SENDERS;
+        return timed("actor_mailbox", "cppgo_actor", perSender * MAILBOX_SENDERS, [&](Result &result)
+                     {
+                         uint64_t sum = 0;
+                         {
+                             Actor<uint64_t> actor([&](uint64_t &value)
+                                                   { sum += value; });
+                             std::atomic<size_t> done{0};
+                             for (size_t s = 0; s < MAILBOX_SENDERS; s++)
+                             {
+                                 go([&]()
+                                    {
+                                        for (size_t i = 0; i < perSender; i++)
+                                        {
+                                            actor.send(uint64_t(i));
+                                        }
+                                        done++;
+                                    });
+                             }
+                             waitUntil([&]()
+                                       { return done == MAILBOX_SENDERS; });
+                             // The destructor waits for the actor to handle everything sent
+                         }
+                         result.m_extra["checksum"] = double(sum);
+                     });
+    }
+
+    // ---------------------------------------------------------------- bursty producer
+
+    // Whole burst buffered in memory, or only SPILL_RING of it with the rest spilled to disk
+    const size_t SPILL_RING = 4096;
+
+    struct BurstRecord
+    {
+        uint64_t m_seq;
+        char m_payload[56];
+    };
+
+    template <typename Ch>
+    Result burstRoutines(const Params &params, const std::string &impl, Ch &channel)
+    {
+        size_t n = params.scaled(1000000);
+        return timed("spill_burst", impl, n, [&](Result &result)
+                     {
+                         size_t resident = residentBytes();
+                         std::atomic<bool> written{false};
+                         std::atomic<size_t> peak{0};
+                         uint64_t sum = 0;
+                         go([&]()
+                            {
+                                for (size_t i = 0; i < n; i++)
+                                {
+                                    channel.write(BurstRecord{i, {}});
+                                }
+                                peak = residentBytes();
+                                written = true;
+                                channel.close();
+                            });
+                         waitUntil([&]()
+                                   { return written.load(); });
+                         BurstRecord record;
+                         while (channel.read(record))
+                         {
+                             sum += record.m_seq;
+                         }
+                         result.m_extra["checksum"] = double(sum);
+                         result.m_extra["rss_growth_bytes"] = double(peak > resident ? peak - resident : 0);
+                     });
+    }
+
+    Result burstChannel(const Params &params)
+    {
+        Channel<BurstRecord> channel(params.scaled(1000000));
+        return burstRoutines(params, "cppgo", channel);
+    }
+
+    Result burstSpill(const Params &params)
+    {
+        SpillChannel<BurstRecord> channel(SPILL_RING);
+        return burstRoutines(params, "cppgo_spill", channel);
+    }
+
+    // ---------------------------------------------------------------- socket stream
+
+    const size_t REMOTE_BUFFER = 64;
+
+    Result remoteRoutines(const Params &params)
+    {
+        size_t n = params.scaled(200000);
+        return timed("remote_stream", "cppgo", n, [&](Result &result)
+                     {
+                         auto batches = Machines::getInstance()->metricsSnapshot().m_total.m_counters[REMOTE_BATCHES];
+                         auto [out, in] = RemoteChannel<uint64_t>::pair(REMOTE_BUFFER);
+                         std::atomic<bool> done{false};
+                         uint64_t sum = 0;
+                         go([&, out = out.get()]()
+                            {
+                                for (size_t i = 0; i < n; i++)
+                                {
+                                    *out << uint64_t(i);
+                                }
+                                out->close();
+                            });
+                         go([&, in = in.get()]()
+                            {
+                                uint64_t value = 0;
+                                while (*in >> value)
+                                {
+                                    sum += value;
+                                }
+                                done = true;
+                            });
+                         waitUntil([&]()
+                                   { return done.load(); });
+                         batches = Machines::getInstance()->metricsSnapshot().m_total.m_counters[REMOTE_BATCHES] - batches;
+                         result.m_extra["checksum"] = double(sum);
+                         result.m_extra["values_per_frame"] = double(n) / std::max<uint64_t>(1, batches);
+                     });
+    }
+
+    // One blocking write per value over a socketpair, the hand written glue RemoteChannel replaces
+    Result remoteThreads(const Params &params)
+    {
+        size_t n = params.scaled(200000);
+        return timed("remote_stream", "std_thread", n, [&](Result &result)
+                     {
+                         int fds[2];
+                         socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+                         uint64_t sum = 0;
+                         std::thread consumer([&]()
+                                              {
+                                                  uint64_t value = 0;
+                                                  while (recv(fds[1], &value, sizeof(value), MSG_WAITALL) == sizeof(value))
+                                                  {
+                                                      sum += value;
+                                                  }
+                                              });
+                         for (uint64_t i = 0; i < n; i++)
+                         {
+                             send(fds[0], &i, sizeof(i), 0);
+                         }
+                         shutdown(fds[0], SHUT_WR);
+                         consumer.join();
+                         close(fds[0]);
+                         close(fds[1]);
+                         result.m_extra["checksum"] = double(sum);
+                     });
+    }
+
+    // ---------------------------------------------------------------- select fan-in
+
+    const size_t FAN_IN = 8;
+
+    Result selectRoutines(const Params &params)
+    {
+        size_t perChannel = params.scaled(20000) / FAN_IN;
+        return timed("select_fan_in", "cppgo", perChannel * FAN_IN, [&](Result &)
+                     {
+                         std::vector<std::unique_ptr<Channel<uint64_t>>> channels;
+                         for (size_t k = 0; k < FAN_IN; k++)
+                         {
+                             channels.emplace_back(std::make_unique<Channel<uint64_t>>());
+                         }
+                         std::atomic<size_t> done{0};
+                         for (size_t k = 0; k < FAN_IN; k++)
+                         {
+                             go([&, k]()
+                                {
+                                    for (size_t i = 0; i < perChannel; i++)
+                                    {
+                                        *channels[k] << uint64_t(i);
+                                    }
+                                    done++;
+                                });
+                         }
+                         go([&]()
+                            {
+                                uint64_t value = 0, received = 0;
+                                std::vector<Case> cases;
+                                for (auto &channel : channels)
+                                {
+                                    cases.emplace_back(value <= *channel, [&]()
+                                                       { received++; });
+                                }
+                                Select select(cases);
+                                while (received < perChannel * FAN_IN)
+                                {
+                                    select();
+                                }
+                                done++;
+                            });
+                         waitUntil([&]()
+                                   { return done == FAN_IN + 1; });
+                     });
+    }
+
+    Result selectThreads(const Params &params)
+    {
+        size_t perChannel = params.scaled(20000) / FAN_IN;
+        return timed("select_fan_in", "std_thread", perChannel * FAN_IN, [&](Result &)
+                     {
+                         // Threads have no select, fan in through one shared queue instead
+                         BlockingQueue<uint64_t> queue(FAN_IN);
+                         std::vector<std::thread> writers;
+                         for (size_t k = 0; k < FAN_IN; k++)
+                         {
+                             writers.emplace_back([&]()
+                                                  {
+                                                      for (size_t i = 0; i < perChannel; i++)
+                                                      {
+                                                          queue.push(i);
+                                                      }
+                                                  });
+                         }
+                         uint64_t value = 0;
+                         for (size_t i = 0; i < perChannel * FAN_IN; i++)
+                         {
+                             queue.pop(value);
+                         }
+                         for (auto &writer : writers)
+                         {
+                             writer.join();
+                         }
+                     });
+    }
+
+    // ---------------------------------------------------------------- steal balance
+
+    const size_t SPIN_WORK = 200000;
+
+    uint64_t spin(uint64_t seed)
+    {
+        // Opaque CPU bound work the optimizer can't drop
+        for (size_t i = 0; i < SPIN_WORK; i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        }
+        return seed;
+    }
+
+    void reportBalance(Result &result, const std::vector<size_t> &perWorker)
+    {
+        size_t total = 0, most = 0, used = 0;
+        for (auto count : perWorker)
+        {
+            total += count;
+            most = std::max(most, count);
+            used += count ? 1 : 0;
+        }
+        result.m_extra["workers"] = double(perWorker.size());
+        result.m_extra["workers_used"] = double(used);
+        // 1.0 is a perfect split, `workers` means one worker did everything
+        result.m_extra["imbalance"] = total ? double(most) * perWorker.size() / total : 0;
+    }
+
+    Result stealRoutines(const Params &params)
+    {
+        size_t tasks = params.scaled(256);
+        return timed("steal_balance", "cppgo", tasks, [&](Result &result)
+                     {
+                         std::vector<std::atomic<size_t>> perExecutor(MAX_EXECUTORS);
+                         std::atomic<size_t> done{0};
+                         std::atomic<uint64_t> sink{0};
+                         // Everything is spawned from one routine, so it all lands on a single processor
+                         // and only stealing can spread it
+                         go([&]()
+                            {
+                                for (size_t i = 0; i < tasks; i++)
+                                {
+                                    go([&, i]()
+                                       {
+                                           sink += spin(i);
+                                           perExecutor[Executor::current()->id()]++;
+                                           done++;
+                                       });
+                                }
+                            });
+                         waitUntil([&]()
+                                   { return done == tasks; });
+                         std::vector<size_t> counts(perExecutor.begin(), perExecutor.end());
+                         // Slots of executors that were never started
+                         while (counts.size() > Machines::getInstance()->maxProcs() and counts.back() == 0)
+                         {
+                             counts.pop_back();
+                         }
+                         reportBalance(result, counts);
+                     });
+    }
+
+    Result stealThreads(const Params &params)
+    {
+        size_t tasks = params.scaled(256);
+        return timed("steal_balance", "std_thread", tasks, [&](Result &result)
+                     {
+                         // Thread pool with a single shared queue, the usual alternative to stealing
+                         BlockingQueue<size_t> queue(tasks);
+                         for (size_t i = 0; i < tasks; i++)
+                         {
+                             queue.push(i);
+                         }
+                         queue.close();
+                         size_t procs = Machines::getInstance()->maxProcs();
+                         std::vector<size_t> perWorker(procs);
+                         std::atomic<uint64_t> sink{0};
+                         std::vector<std::thread> workers;
+                         for (size_t w = 0; w < procs; w++)
+                         {
+                             workers.emplace_back([&, w]()
+                                                  {
+                                                      size_t task = 0;
+                                                      while (queue.pop(task))
+                                                      {
+                                                          sink += spin(task);
+                                                          perWorker[w]++;
+                                                      }
+                                                  });
+                         }
+                         for (auto &worker : workers)
+                         {
+                             worker.join();
+                         }
+                         reportBalance(result, perWorker);
+                     });
+    }
+
+    // ---------------------------------------------------------------- idle memory
+
+    Result idleMemoryRoutines(const Params &params)
+    {
+        size_t n = params.scaled(64);
+        return timed("memory_per_idle", "cppgo", n, [&](Result &result)
+                     {
+                         Channel<int> gate;
+                         std::atomic<size_t> started{0}, finished{0};
+                         size_t before = residentBytes();
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             go([&]()
+                                {
+                                    started++;
+                                    int value = 0;
+                                    gate >> value;
+                                    finished++;
+                                });
+                         }
+                         waitUntil([&]()
+                                   { return started == n; });
+                         result.m_extra["bytes_per_idle"] = double(residentBytes() - before) / n;
+                         gate.close();
+                         waitUntil([&]()
+                                   { return finished == n; });
+                     });
+    }
+
+    Result idleMemoryThreads(const Params &params)
+    {
+        size_t n = params.scaled(64);
+        return timed("memory_per_idle", "std_thread", n, [&](Result &result)
+                     {
+                         std::mutex lock;
+                         std::condition_variable cv;
+                         bool open = false;
+                         std::atomic<size_t> started{0};
+                         size_t before = residentBytes();
+                         std::vector<std::thread> threads;
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             threads.emplace_back([&]()
+                                                  {
+                                                      std::unique_lock<std::mutex> guard(lock);
+                                                      started++;
+                                                      cv.wait(guard, [&]()
+                                                              { return open; });
+                                                  });
+                         }
+                         waitUntil([&]()
+                                   { return started == n; });
+                         result.m_extra["bytes_per_idle"] = double(residentBytes() - before) / n;
+                         {
+                             std::unique_lock<std::mutex> guard(lock);
+                             open = true;
+                         }
+                         cv.notify_all();
+                         for (auto &thread : threads)
+                         {
+                             thread.join();
+                         }
+                     });
+    }
+
+    // ---------------------------------------------------------------- foreign thread injection
+
+    // The main thread hands over one item at a time to an idle runtime and times how long until it runs
+    void reportLatencies(Result &result, std::vector<uint64_t> &latencies)
+    {
+        std::sort(latencies.begin(), latencies.end());
+        result.m_extra["p50_ns"] = double(latencies[latencies.size() / 2]);
+        result.m_extra["p99_ns"] = double(latencies[latencies.size() * 99 / 100]);
+    }
+
+    Result injectRoutines(const Params &params)
+    {
+        size_t n = params.scaled(2000);
+        return timed("inject_latency", "cppgo", n, [&](Result &result)
+                     {
+                         std::vector<uint64_t> latencies(n);
+                         std::atomic<size_t> done{0};
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             uint64_t start = nowNanos();
+                             go([&, i, start]()
+                                {
+                                    latencies[i] = nowNanos() - start;
+                                    done++;
+                                });
+                             waitUntil([&]()
+                                       { return done == i + 1; });
+                         }
+                         reportLatencies(result, latencies);
+                     });
+    }
+
+    Result injectChannel(const Params &params)
+    {
+        size_t n = params.scaled(2000);
+        return timed("inject_latency", "cppgo_channel", n, [&](Result &result)
+                     {
+                         std::vector<uint64_t> latencies(n);
+                         std::atomic<size_t> done{0};
+                         Channel<uint64_t> starts;
+                         go([&]()
+                            {
+                                uint64_t start = 0;
+                                while (starts.read(start))
+                                {
+                                    latencies[done] = nowNanos() - start;
+                                    done++;
+                                }
+                            });
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             starts << nowNanos();
+                             waitUntil([&]()
+                                       { return done == i + 1; });
+                         }
+                         starts.close();
+                         reportLatencies(result, latencies);
+                     });
+    }
+
+    Result injectThreads(const Params &params)
+    {
+        size_t n = params.scaled(2000);
+        return timed("inject_latency", "std_thread", n, [&](Result &result)
+                     {
+                         std::vector<uint64_t> latencies(n);
+                         std::atomic<size_t> done{0};
+                         BlockingQueue<uint64_t> starts(1);
+                         std::thread worker([&]()
+                                            {
+                                                uint64_t start = 0;
+                                                while (starts.pop(start))
+                                                {
+                                                    latencies[done] = nowNanos() - start;
+                                                    done++;
+                                                }
+                                            });
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             starts.push(nowNanos());
+                             waitUntil([&]()
+                                       { return done == i + 1; });
+                         }
+                         starts.close();
+                         worker.join();
+                         reportLatencies(result, latencies);
+                     });
+    }
+
+#ifdef CPPGO_COROUTINES
+    // ---------------------------------------------------------------- stackless tasks, same workloads as above
+
+    Result yieldTasks(const Params &params)
+    {
+        size_t rounds = params.scaled(20000);
+        return timed("yield_round_trip", "cppgo_task", rounds, [&](Result &)
+                     {
+                         std::atomic<size_t> done{0};
+                         for (int r = 0; r < 2; r++)
+                         {
+                             go([](size_t rounds, std::atomic<size_t> &done) -> Task<>
+                                {
+                                    for (size_t i = 0; i < rounds; i++)
+                                    {
+                                        co_await async::yield();
+                                    }
+                                    done++;
+                                }(rounds, done));
+                         }
+                         waitUntil([&]()
+                                   { return done == 2; });
+                     });
+    }
+
+    Result pingPongTasks(const Params &params, size_t bufferSize)
+    {
+        size_t rounds = params.scaled(20000);
+        std::string name = bufferSize ? "channel_pingpong_buffered" : "channel_pingpong_unbuffered";
+        return timed(name, "cppgo_task", rounds, [&](Result &)
+                     {
+                         Channel<uint64_t> ping(bufferSize), pong(bufferSize);
+                         std::atomic<size_t> done{0};
+                         go([](size_t rounds, Channel<uint64_t> &ping, Channel<uint64_t> &pong, std::atomic<size_t> &done) -> Task<>
+                            {
+                                uint64_t value = 0;
+                                for (size_t i = 0; i < rounds; i++)
+                                {
+                                    co_await async::read(ping, value);
+                                    co_await async::write(pong, value + 1);
+                                }
+                                done++;
+                            }(rounds, ping, pong, done));
+                         go([](size_t rounds, Channel<uint64_t> &ping, Channel<uint64_t> &pong, std::atomic<size_t> &done) -> Task<>
+                            {
+                                uint64_t value = 0;
+                                for (size_t i = 0; i < rounds; i++)
+                                {
+                                    co_await async::write(ping, value);
+                                    co_await async::read(pong, value);
+                                }
+                                done++;
+                            }(rounds, ping, pong, done));
+                         waitUntil([&]()
+                                   { return done == 2; });
+                     });
+    }
+
+    Result idleMemoryTasks(const Params &params)
+    {
+        // Far more of them than routines, a few hundred bytes each would drown in page granularity otherwise
+        size_t n = params.scaled(64) * 1024;
+        return timed("memory_per_idle", "cppgo_task", n, [&](Result &result)
+                     {
+                         Channel<int> gate;
+                         std::atomic<size_t> started{0}, finished{0};
+                         size_t before = residentBytes();
+                         for (size_t i = 0; i < n; i++)
+                         {
+                             go([](Channel<int> &gate, std::atomic<size_t> &started, std::atomic<size_t> &finished) -> Task<>
+                                {
+                                    started++;
+                                    int value = 0;
+                                    co_await async::read(gate, value);
+                                    finished++;
+                                }(gate, started, finished));
+                         }
+                         waitUntil([&]()
+                                   { return started == n; });
+                         result.m_extra["bytes_per_idle"] = double(residentBytes() - before) / n;
+                         gate.close();
+                         waitUntil([&]()
+                                   { return finished == n; });
+                     });
+    }
+#endif
+
+    // ---------------------------------------------------------------- data parallel loops
+
+    constexpr size_t KERNEL_WORK = 64;
+
+    // Embarrassingly parallel per element work
+    double kernel(size_t i)
+    {
+        double x = double(i);
+        for (size_t k = 0; k < KERNEL_WORK; k++)
+        {
+            x = x * 0.999 + 1.0 / (1.0 + double(k));
+        }
+        return x;
+    }
+
+    constexpr size_t KERNEL_GRAIN = 2048;
+
+    // Runs `body` on a routine, data parallel loops are meant to be called from routines
+    template <typename Fn>
+    void inRoutine(Fn &&body)
+    {
+        std::atomic_bool done{false};
+        go([&]()
+           {
+               body();
+               done = true;
+           });
+        waitUntil([&]()
+                  { return done.load(); });
+    }
+
+    Result parallelForKernel(const Params &params, const std::string &impl)
+    {
+        size_t n = params.scaled(1 << 22);
+        std::vector<double> out(n);
+        return timed("parallel_for_kernel", impl, n, [&](Result &)
+                     {
+                         if (impl == "cppgo")
+                         {
+                             inRoutine([&]()
+                                       { parallel_for(Range{0, n}, KERNEL_GRAIN, [&](size_t i)
+                                                      { out[i] = kernel(i); }); });
+                         }
+#ifdef CPPGO_BENCH_OPENMP
+                         else if (impl == "openmp")
+                         {
+#pragma omp parallel for schedule(static)
+                             for (size_t i = 0; i < n; i++)
+                             {
+                                 out[i] = kernel(i);
+                             }
+                         }
+#endif
+#ifdef CPPGO_BENCH_PSTL
+                         else if (impl == "std_par")
+                         {
+                             std::vector<size_t> indices(n);
+                             std::iota(indices.begin(), indices.end(), 0);
+                             std::for_each(std::execution::par, indices.begin(), indices.end(), [&](size_t i)
+                                           { out[i] = kernel(i); });
+                         }
+#endif
+                         else
+                         {
+                             for (size_t i = 0; i < n; i++)
+                             {
+                                 out[i] = kernel(i);
+                             }
+                         }
+                     });
+    }
+
+    Result parallelReduceKernel(const Params &params, const std::string &impl)
+    {
+        size_t n = params.scaled(1 << 22);
+        return timed("parallel_reduce_kernel", impl, n, [&](Result &result)
+                     {
+                         double sum = 0;
+                         if (impl == "cppgo")
+                         {
+                             inRoutine([&]()
+                                       { sum = parallel_reduce(
+                                             Range{0, n}, KERNEL_GRAIN, 0.0, [](const Range &chunk, double partial)
+                                             {
+                                                 for (size_t i = chunk.m_begin; i < chunk.m_end; i++)
+                                                 {
+                                                     partial += kernel(i);
+                                                 }
+                                                 return partial;
+                                             },
+                                             std::plus<double>()); });
+                         }
+#ifdef CPPGO_BENCH_OPENMP
+                         else if (impl == "openmp")
+                         {
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+                             for (size_t i = 0; i < n; i++)
+                             {
+                                 sum += kernel(i);
+                             }
+                         }
+#endif
+#ifdef CPPGO_BENCH_PSTL
+                         else if (impl == "std_par")
+                         {
+                             std::vector<size_t> indices(n);
+                             std::iota(indices.begin(), indices.end(), 0);
+                             sum = std::transform_reduce(std::execution::par, indices.begin(), indices.end(), 0.0,
+                                                         std::plus<double>(), kernel);
+                         }
+#endif
+                         else
+                         {
+                             for (size_t i = 0; i < n; i++)
+                             {
+                                 sum += kernel(i);
+                             }
+                         }
+                         result.m_extra["checksum"] = sum;
+                     });
+    }
+
+    std::vector<BenchCase> allBenchmarks()
+    {
+        std::vector<BenchCase> benchmarks{
+            {"spawn_exit", "cppgo", spawnRoutines},
+            {"spawn_exit", "cppgo_batch", spawnBatchRoutines},
+            {"spawn_exit", "std_thread", spawnThreads},
+            {"yield_round_trip", "cppgo", yieldRoutines},
+            {"yield_round_trip", "std_thread", yieldThreads},
+            {"channel_pingpong_unbuffered", "cppgo", [](const Params &p)
+             { return pingPongRoutines(p, 0); }},
+            {"channel_pingpong_unbuffered", "std_thread", [](const Params &p)
+             { return pingPongThreads(p, 0); }},
+            {"channel_pingpong_buffered", "cppgo", [](const Params &p)
+             { return pingPongRoutines(p, 16); }},
+            {"channel_pingpong_buffered", "std_thread", [](const Params &p)
+             { return pingPongThreads(p, 16); }},
+            {"mpmc_throughput", "cppgo", mpmcRoutines},
+            {"mpmc_throughput", "std_thread", mpmcThreads},
+            {"spsc_stream", "cppgo", [](const Params &p)
+             { return streamRoutines<Mpmc>(p, "cppgo"); }},
+            {"spsc_stream", "cppgo_spsc", [](const Params &p)
+             { return streamRoutines<Spsc>(p, "cppgo_spsc"); }},
+            {"spsc_stream", "std_thread", streamThreads},
+            {"actor_mailbox", "cppgo_channel", mailboxChannel},
+            {"actor_mailbox", "cppgo_actor", mailboxActor},
+            {"spill_burst", "cppgo", burstChannel},
+            {"spill_burst", "cppgo_spill", burstSpill},
+            {"remote_stream", "cppgo", remoteRoutines},
+            {"remote_stream", "std_thread", remoteThreads},
+            {"select_fan_in", "cppgo", selectRoutines},
+            {"select_fan_in", "std_thread", selectThreads},
+            {"steal_balance", "cppgo", stealRoutines},
+            {"steal_balance", "std_thread", stealThreads},
+            {"memory_per_idle", "cppgo", idleMemoryRoutines},
+            {"memory_per_idle", "std_thread", idleMemoryThreads},
+            {"inject_latency", "cppgo", injectRoutines},
+            {"inject_latency", "cppgo_channel", injectChannel},
+            {"inject_latency", "std_thread", injectThreads},
+        };
+#ifdef CPPGO_COROUTINES
+        benchmarks.insert(benchmarks.end(), {
+                                                {"yield_round_trip", "cppgo_task", yieldTasks},
+                                                {"channel_pingpong_unbuffered", "cppgo_task", [](const Params &p)
+                                                 { return pingPongTasks(p, 0); }},
+                                                {"channel_pingpong_buffered", "cppgo_task", [](const Params &p)
+                                                 { return pingPongTasks(p, 16); }},
+                                                {"memory_per_idle", "cppgo_task", idleMemoryTasks},
+                                            });
+#endif
+        // Data parallel loops against a serial loop and whichever other parallel runtimes were found at build time
+        std::vector<std::string> loopImpls{"cppgo", "serial"};
+#ifdef CPPGO_BENCH_OPENMP
+        loopImpls.emplace_back("openmp");
+#endif
+#ifdef CPPGO_BENCH_PSTL
+        loopImpls.emplace_back("std_par");
+#endif
+        for (auto &impl : loopImpls)
+        {
+            benchmarks.push_back({"parallel_for_kernel", impl, [impl](const Params &p)
+                                  { return parallelForKernel(p, impl); }});
+        }
+        for (auto &impl : loopImpls)
+        {
+            benchmarks.push_back({"parallel_reduce_kernel", impl, [impl](const Params &p)
+                                  { return parallelReduceKernel(p, impl); }});
+        }
+        return benchmarks;
+    }
+
+    void writeJson(std::ostream &out, const std::vector<Result> &results, const Params &params, size_t repeat)
+    {
+        out << "{\n  \"config\": {\"max_procs\": " << Machines::getInstance()->maxProcs()
+            << ", \"hardware_concurrency\": " << std::thread::hardware_concurrency()
+            << ", \"scale\": " << params.m_scale << ", \"repeat\": " << repeat << "},\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            auto &r = results[i];
+            out << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.m_name << "\", \"impl\": \"" << r.m_impl
+                << "\", \"ops\": " << r.m_ops << ", \"seconds\": " << r.m_seconds
+                << ", \"ns_per_op\": " << r.nsPerOp() << ", \"ops_per_sec\": " << (r.m_seconds > 0 ? r.m_ops / r.m_seconds : 0);
+            for (auto &[key, value] : r.m_extra)
+            {
+                out << ", \"" << key << "\": " << value;
+            }
+            out << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Params params;
+    std::string jsonPath, filter;
+    size_t repeat = 3;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        auto const next = [&]()
+        { return i + 1 < argc ? std::string(argv[++i]) : std::string(); };
+        if (arg == "--json")
+        {
+            jsonPath = next();
+        }
+        else if (arg == "--filter")
+        {
+            filter = next();
+        }
+        else if (arg == "--repeat")
+        {
+            repeat = std::max(1, std::stoi(next()));
+        }
+        else if (arg == "--scale")
+        {
+            params.m_scale = std::stod(next());
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0] << " [--json out.json] [--filter substr] [--repeat N] [--scale X]\n";
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (auto &bench : allBenchmarks())
+    {
+        if (not filter.empty() and (bench.m_name + "/" + bench.m_impl).find(filter) == std::string::npos)
+        {
+            continue;
+        }
+        std::vector<Result> runs;
+        for (size_t r = 0; r < repeat; r++)
+        {
+            runs.emplace_back(bench.m_fn(params));
+        }
+        std::sort(runs.begin(), runs.end(), [](const Result &a, const Result &b)
+                  { return a.m_seconds < b.m_seconds; });
+        auto &median = runs[runs.size() / 2];
+        std::cerr << median.m_name << "/" << median.m_impl << ": " << median.nsPerOp() << " ns/op\n";
+        results.emplace_back(median);
+    }
+
+    if (jsonPath.empty())
+    {
+        writeJson(std::cout, results, params, repeat);
+    }
+    else
+    {
+        std::ofstream out(jsonPath);
+        writeJson(out, results, params, repeat);
+    }
+    GO_END
+    return 0;
+}
@@ -0,0 +1,712 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Channel.h"
+#include "Executor.h"
+#include "Machines.h"
+#include "RemoteChannel.h"
+#include "SpillChannel.h"
+
+using namespace gocpp;
+
+/*
+Stress scenarios for scheduler and channel corner cases, registered as ctest tests. Each scenario
+runs in its own process (the runtime is a singleton and some scenarios change the processor count)
+and reports what went wrong on stderr. Scenarios needing more processors than the machine has are
+skipped (exit code 77).
+
+Usage: cppgo_stress <scenario>...   (no argument lists the scenarios)
+*/
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    enum Outcome
+    {
+        PASSED = 0,
+        FAILED,
+        SKIPPED
+    };
+
+    struct Scenario
+    {
+        std::string m_name;
+        std::function<Outcome()> m_fn;
+    };
+
+    // Main thread is not a routine, it can only poll for routine progress
+    template <typename Pred>
+    bool waitUntil(Pred pred, std::chrono::milliseconds timeout = std::chrono::seconds(30))
+    {
+        using namespace std::chrono_literals;
+        auto deadline = Clock::now() + timeout;
+        while (not pred())
+        {
+            if (Clock::now() > deadline)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(1ms);
+        }
+        return true;
+    }
+
+    bool check(bool ok, const std::string &what)
+    {
+        if (not ok)
+        {
+            std::cerr << "  failed: " << what << "\n";
+        }
+        return ok;
+    }
+
+    // Sets the processor count to `procs` for the scenario, false if the machine has fewer CPUs
+    bool needProcs(size_t procs)
+    {
+        if (MAX_PROCS < procs)
+        {
+            std::cerr << "  needs " << procs << " processors, MAX_PROCS is " << MAX_PROCS << "\n";
+            return false;
+        }
+        Machines::getInstance()->setMaxProcs(procs);
+        return true;
+    }
+
+    void spin(size_t iterations)
+    {
+        volatile size_t sink = 0;
+        for (size_t i = 0; i < iterations; i++)
+        {
+            sink += i;
+        }
+    }
+
+    // Locked routines whose executors lost their processor to setMaxProcs(1) keep running while unlocked
+    // routines saturate the one left, through handOffProcessor()
+    Outcome lockedHandoff()
+    {
+        using namespace std::chrono_literals;
+        const int LOCKED = 4;
+        if (not needProcs(LOCKED))
+        {
+            return SKIPPED;
+        }
+        auto *machines = Machines::getInstance();
+        std::atomic_bool stop{false};
+        std::atomic<int> slots{0}, started{0}, finished{0}, moved{0};
+        // Executors that already have a locked routine, each one gets a single one
+        std::atomic<uint64_t> claimed{0};
+        std::atomic<uint64_t> progress[LOCKED] = {};
+        // Candidates keep their executors busy for a while, so that the others start and steal some. The first
+        // one to lock itself to an executor stays, later ones on the same executor give up
+        auto candidate = [&]()
+        {
+            spin(2000000);
+            Machines::lockToExecutor();
+            auto *executor = Executor::current();
+            auto bit = uint64_t(1) << executor->id();
+            int i;
+            if ((claimed.fetch_or(bit) & bit) or (i = slots++) >= LOCKED)
+            {
+                Machines::unlockFromExecutor();
+                return;
+            }
+            started++;
+            while (not stop)
+            {
+                progress[i]++;
+                spin(20000);
+                Machines::yieldToScheduler();
+                moved += Executor::current() != executor;
+            }
+            Machines::unlockFromExecutor();
+            finished++;
+        };
+        for (int wave = 0; wave < 100 and started < LOCKED; wave++)
+        {
+            for (int i = 0; i < 4 * LOCKED; i++)
+            {
+                go(candidate);
+            }
+            std::this_thread::sleep_for(50ms);
+        }
+        bool ok = check(waitUntil([&]()
+                                  { return started == LOCKED; }),
+                        "locked routines did not start");
+        // Saturates the processor that setMaxProcs(1) leaves, it never goes idle for the locked routines
+        for (int i = 0; i < 16; i++)
+        {
+            go([&]()
+               {
+                   while (not stop)
+                   {
+                       spin(100000);
+                   }
+                   finished++;
+               });
+        }
+        std::this_thread::sleep_for(200ms);
+        machines->setMaxProcs(1);
+        std::this_thread::sleep_for(300ms);
+        uint64_t before[LOCKED];
+        for (int i = 0; i < LOCKED; i++)
+        {
+            before[i] = progress[i];
+        }
+        std::this_thread::sleep_for(2s);
+        for (int i = 0; i < LOCKED; i++)
+        {
+            ok &= check(progress[i] != before[i], "locked routine " + std::to_string(i) + " starved after setMaxProcs(1)");
+        }
+        stop = true;
+        ok &= check(waitUntil([&]()
+                              { return finished == 16 + LOCKED; }),
+                    std::to_string(16 + LOCKED - finished) + " routines did not finish");
+        ok &= check(moved == 0, "locked routines resumed on another executor");
+        return ok ? PASSED : FAILED;
+    }
+
+    // A locked routine woken by another thread's channel writes wakes only its own executor, not every
+    // idle one. Woken executors without work go stealing, so the idle ones' steal attempts must not grow
+    // with the number of messages
+    Outcome lockedWakeup()
+    {
+        using namespace std::chrono_literals;
+        if (not needProcs(4))
+        {
+            return SKIPPED;
+        }
+        auto *machines = Machines::getInstance();
+        const size_t MESSAGES = 20000;
+        // Gets every executor started, so that there are idle ones to wake
+        std::atomic<int> warm{0};
+        for (int i = 0; i < 4; i++)
+        {
+            go([&]()
+               {
+                   spin(10000000);
+                   warm++;
+               });
+        }
+        bool ok = check(waitUntil([&]()
+                                  { return warm == 4; }),
+                        "warm up routines did not finish");
+        Channel<size_t> requests(0), replies(0);
+        std::atomic<int> owner{-1};
+        go([&]()
+           {
+               Machines::lockToExecutor();
+               owner = Executor::current()->id();
+               size_t value;
+               while (requests.read(value))
+               {
+                   replies.write(value + 1);
+               }
+               Machines::unlockFromExecutor();
+           });
+        ok &= check(waitUntil([&]()
+                              { return owner >= 0; }),
+                    "locked routine did not start");
+        std::this_thread::sleep_for(100ms);
+        auto steals = [&]()
+        {
+            uint64_t others = 0;
+            for (auto &executor : machines->metricsSnapshot().m_executors)
+            {
+                if (executor.m_executor >= 0 and executor.m_executor != owner)
+                {
+                    others += executor.m_counters[STEALS_ATTEMPTED];
+                }
+            }
+            return others;
+        };
+        auto before = steals();
+        for (size_t i = 0; i < MESSAGES; i++)
+        {
+            size_t reply = 0;
+            requests.write(i);
+            ok &= replies.read(reply) and reply == i + 1;
+        }
+        auto woken = steals() - before;
+        requests.close();
+        ok &= check(woken < MESSAGES / 10, std::to_string(woken) + " steal attempts by other executors for " +
+                                                std::to_string(MESSAGES) + " wake ups of a locked routine");
+        return ok ? PASSED : FAILED;
+    }
+
+    // Writers outpace throttled readers until the spill spans several segments, every value must still arrive
+    // once and in order per writer. Segment creation, window upkeep (writeback, readahead, hole punching) and
+    // segment reuse all happen while both sides run
+    Outcome spillConcurrent()
+    {
+        struct Record
+        {
+            uint32_t m_writer;
+            uint32_t m_sequence;
+            char m_payload[1016];
+        };
+        const uint32_t WRITERS = 4, READERS = 3, RECORDS = 40000;
+        const size_t RECORD_BYTES = sizeof(Record) + detail::SpillSegment::RECORD_HEADER;
+        SpillChannel<Record> channel(256);
+        std::atomic<uint32_t> writing{WRITERS}, reading{READERS}, received{0}, bad{0};
+        for (uint32_t w = 0; w < WRITERS; w++)
+        {
+            go([&, w]()
+               {
+                   Record record;
+                   record.m_writer = w;
+                   for (uint32_t i = 0; i < RECORDS; i++)
+                   {
+                       record.m_sequence = i;
+                       memset(record.m_payload, int((w + i) & 0xff), sizeof(record.m_payload));
+                       channel.write(record);
+                   }
+                   writing--;
+               });
+        }
+        for (uint32_t r = 0; r < READERS; r++)
+        {
+            go([&]()
+               {
+                   std::vector<int64_t> last(WRITERS, -1);
+                   Record record;
+                   while (channel.read(record))
+                   {
+                       auto writer = record.m_writer;
+                       if (writer >= WRITERS or int64_t(record.m_sequence) <= last[writer] or
+                           record.m_payload[0] != char((writer + record.m_sequence) & 0xff) or
+                           record.m_payload[sizeof(record.m_payload) - 1] != record.m_payload[0])
+                       {
+                           bad++;
+                           continue;
+                       }
+                       last[writer] = record.m_sequence;
+                       received++;
+                       if (writing != 0)
+                       {
+                           // Fall behind while the writers run
+                           spin(20000);
+                       }
+                   }
+                   reading--;
+               });
+        }
+        size_t peak = 0;
+        bool ok = check(waitUntil([&]()
+                                  {
+                                      peak = std::max(peak, channel.spilled());
+                                      return writing == 0; },
+                                  std::chrono::seconds(120)),
+                        "writers did not finish");
+        ok &= check(waitUntil([&]()
+                              { return channel.size() == 0; },
+                              std::chrono::seconds(120)),
+                    std::to_string(channel.size()) + " values left unread");
+        channel.close();
+        ok &= check(waitUntil([&]()
+                              { return reading == 0; }),
+                    "readers did not finish");
+        ok &= check(peak * RECORD_BYTES > SPILL_SEGMENT_SIZE, "the spill never outgrew one segment, peak " +
+                                                                  std::to_string(peak * RECORD_BYTES) + " bytes");
+        ok &= check(bad == 0, std::to_string(bad) + " values out of order or corrupted");
+        ok &= check(received == WRITERS * RECORDS, std::to_string(received) + " values received out of " +
+                                                       std::to_string(WRITERS * RECORDS));
+        return ok ? PASSED : FAILED;
+    }
+
+    bool intact(const std::string &record, size_t size, char fill)
+    {
+        return record.size() == size and record.find_first_not_of(fill) == std::string::npos;
+    }
+
+    // Writes a hand made frame to the raw end of a socketpair, laid out as detail::RemoteEndpoint expects
+    void sendFrame(int fd, uint32_t length, const std::string &payload)
+    {
+        const char DATA = 1;
+        std::string bytes(reinterpret_cast<const char *>(&length), sizeof(length));
+        bytes.push_back(DATA);
+        bytes.append(payload);
+        for (size_t sent = 0; sent < bytes.size();)
+        {
+            ssize_t count = ::send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "send");
+            }
+            sent += size_t(count);
+        }
+    }
+
+    // Records at the frame limit: the largest one that fits goes out in a frame of its own, one byte more is
+    // refused, bursts of records are split into frames the receiver takes. A peer announcing a frame over the
+    // limit is cut off. Needs a build with small frames (GOREMOTEFRAME), 1GB ones would take gigabytes of memory
+    Outcome remoteFraming()
+    {
+        if (REMOTE_MAX_FRAME > 64 * 1024 * 1024)
+        {
+            std::cerr << "  REMOTE_MAX_FRAME is " << REMOTE_MAX_FRAME << " bytes, needs a smaller GOREMOTEFRAME\n";
+            return SKIPPED;
+        }
+        auto *machines = Machines::getInstance();
+        const size_t LARGEST = REMOTE_MAX_FRAME - sizeof(uint32_t);
+        // Two of these fill a frame exactly, every other one is a byte larger
+        const size_t HALF = REMOTE_MAX_FRAME / 2 - sizeof(uint32_t);
+        const size_t BURST = 200;
+        auto batches = [&]()
+        {
+            return machines->metricsSnapshot().m_total.m_counters[REMOTE_BATCHES];
+        };
+        auto before = batches();
+        auto channels = RemoteChannel<std::string>::pair(64);
+        auto &writer = *channels.first;
+        auto &reader = *channels.second;
+        std::atomic<int> refused{0}, bad{0};
+        std::atomic_bool written{false}, ended{false};
+        go([&]()
+           {
+               writer.write(std::string(LARGEST, 'a'));
+               try
+               {
+                   writer.write(std::string(LARGEST + 1, 'b'));
+               }
+               catch (std::length_error &)
+               {
+                   refused++;
+               }
+               for (size_t i = 0; i < BURST; i++)
+               {
+                   writer.write(std::string(HALF + i % 2, char('c' + i % 20)));
+               }
+               writer.close();
+               written = true;
+           });
+        // Lets the writer run out of credit first, so records pile up behind the frames on their way
+        bool ok = check(waitUntil([&]()
+                                  { return writer.credit() == 0; }),
+                        "the writer never ran out of credit");
+        go([&]()
+           {
+               std::string record;
+               bad += not(reader.read(record) and intact(record, LARGEST, 'a'));
+               for (size_t i = 0; i < BURST; i++)
+               {
+                   bad += not(reader.read(record) and intact(record, HALF + i % 2, char('c' + i % 20)));
+               }
+               bad += reader.read(record);
+               ended = true;
+           });
+        ok &= check(waitUntil([&]()
+                              { return written and ended; }),
+                    "records did not get through");
+        ok &= check(refused == 1, "a record one byte over the frame limit was not refused");
+        ok &= check(bad == 0, std::to_string(bad) + " records lost, corrupted or past the close");
+        ok &= check(not reader.disconnected(), "the receiver rejected a frame");
+        // A frame for the largest record, at most two per frame for the burst
+        ok &= check(batches() - before >= 1 + BURST / 2, std::to_string(batches() - before) + " frames for " +
+                                                               std::to_string(1 + BURST) + " records");
+
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "socketpair");
+        }
+        {
+            RemoteChannel<std::string> channel(fds[0], 4);
+            std::atomic<int> reads{0};
+            std::atomic_bool delivered{false};
+            std::string record(reinterpret_cast<const char *>(&LARGEST), sizeof(uint32_t));
+            record.append(LARGEST, 'z');
+            sendFrame(fds[1], REMOTE_MAX_FRAME, record);
+            go([&]()
+               {
+                   std::string out;
+                   delivered = channel.read(out) and intact(out, LARGEST, 'z');
+                   reads++;
+               });
+            ok &= check(waitUntil([&]()
+                                  { return reads == 1; }),
+                        "a frame at the limit was not delivered");
+            ok &= check(delivered, "a frame at the limit arrived corrupted");
+            sendFrame(fds[1], REMOTE_MAX_FRAME + 1, "");
+            ok &= check(waitUntil([&]()
+                                  { return channel.disconnected(); }),
+                        "a frame over the limit was accepted");
+            go([&]()
+               {
+                   std::string out;
+                   delivered = channel.read(out);
+                   reads++;
+               });
+            ok &= check(waitUntil([&]()
+                                  { return reads == 2; }) and
+                            not delivered,
+                        "reads go on after a frame over the limit");
+        }
+        ::close(fds[1]);
+        return ok ? PASSED : FAILED;
+    }
+
+    // Over TCP loopback: values stream both ways at once with small buffers, so credit has to keep coming back
+    // under load. A writer whose reader doesn't read stops once the reader's buffer is full, parked while other
+    // routines run, and goes on once it reads
+    Outcome remoteFlowControl()
+    {
+        using namespace std::chrono_literals;
+        const size_t BUFFER = 4;
+        const uint64_t STREAM = 20000, VALUES = 1000;
+        RemoteListener listener("tcp:127.0.0.1:0");
+        std::unique_ptr<RemoteChannel<uint64_t>> server, client;
+        std::atomic<int> connected{0};
+        go([&]()
+           {
+               server = RemoteChannel<uint64_t>::accept(listener, BUFFER);
+               connected++;
+           });
+        go([&]()
+           {
+               client = RemoteChannel<uint64_t>::dial(listener.address(), BUFFER);
+               connected++;
+           });
+        if (not check(waitUntil([&]()
+                                { return connected == 2; }),
+                      "could not connect over " + listener.address()))
+        {
+            return FAILED;
+        }
+
+        std::atomic<int> pumped{0};
+        std::atomic<uint64_t> bad{0};
+        auto pump = [&](RemoteChannel<uint64_t> *out, RemoteChannel<uint64_t> *in)
+        {
+            go([&, out]()
+               {
+                   for (uint64_t i = 0; i < STREAM; i++)
+                   {
+                       out->write(i);
+                   }
+                   pumped++;
+               });
+            go([&, in]()
+               {
+                   uint64_t value;
+                   for (uint64_t i = 0; i < STREAM; i++)
+                   {
+                       bad += not(in->read(value) and value == i);
+                   }
+                   pumped++;
+               });
+        };
+        pump(client.get(), server.get());
+        pump(server.get(), client.get());
+        bool ok = check(waitUntil([&]()
+                                  { return pumped == 4; },
+                                  std::chrono::seconds(120)),
+                        "streaming both ways stalled");
+        ok &= check(bad == 0, std::to_string(bad) + " values lost or out of order streaming both ways");
+
+        std::atomic<size_t> written{0};
+        std::atomic<uint64_t> ticks{0};
+        std::atomic_bool stop{false};
+        go([&]()
+           {
+               for (uint64_t i = 0; i < VALUES; i++)
+               {
+                   client->write(i);
+                   written++;
+               }
+           });
+        go([&]()
+           {
+               while (not stop)
+               {
+                   ticks++;
+                   Machines::yieldToScheduler();
+               }
+           });
+        ok &= check(waitUntil([&]()
+                              { return written == BUFFER; }),
+                    "the writer did not fill the reader's buffer");
+        std::this_thread::sleep_for(200ms);
+        auto ticked = ticks.load();
+        std::this_thread::sleep_for(50ms);
+        ok &= check(written == BUFFER, std::to_string(written) + " values written to a reader with a buffer of " +
+                                           std::to_string(BUFFER) + " that doesn't read");
+        ok &= check(client->credit() == 0 and server->size() == BUFFER, "credit left with the reader's buffer full");
+        ok &= check(ticks != ticked, "routines starved while a writer waited for credit");
+        std::atomic<size_t> peak{0}, received{0};
+        std::atomic_bool ended{false};
+        go([&]()
+           {
+               uint64_t value;
+               while (server->read(value))
+               {
+                   bad += value != received++;
+                   peak = std::max<size_t>(peak, server->size() + 1);
+               }
+               ended = true;
+           });
+        ok &= check(waitUntil([&]()
+                              { return written == VALUES; }),
+                    "the writer did not resume once the reader read");
+        client->close();
+        ok &= check(waitUntil([&]()
+                              { return ended.load(); }),
+                    "the reader did not see the close");
+        stop = true;
+        ok &= check(received == VALUES and bad == 0, std::to_string(received) + " values received out of " +
+                                                         std::to_string(VALUES) + ", " + std::to_string(bad) + " out of order");
+        ok &= check(peak <= BUFFER, std::to_string(peak) + " values buffered, over the buffer size");
+        return ok ? PASSED : FAILED;
+    }
+
+    // close() ends the other side's reads once it drained what was sent, while values still come in the other
+    // way. A peer going away wakes parked readers (returning false) and writers (throwing)
+    Outcome remotePeerClose()
+    {
+        using namespace std::chrono_literals;
+        const int VALUES = 100;
+        auto channels = RemoteChannel<int>::pair(16);
+        auto &closing = *channels.first;
+        auto &other = *channels.second;
+        std::atomic<int> received{0}, reply{-1}, done{0};
+        std::atomic_bool refused{false};
+        go([&]()
+           {
+               for (int i = 0; i < VALUES; i++)
+               {
+                   closing.write(i);
+               }
+               closing.close();
+               try
+               {
+                   closing.write(VALUES);
+               }
+               catch (std::runtime_error &)
+               {
+                   refused = true;
+               }
+               int value;
+               if (closing.read(value))
+               {
+                   reply = value;
+               }
+               done++;
+           });
+        go([&]()
+           {
+               int value;
+               while (other.read(value))
+               {
+                   received += value == received;
+               }
+               other.write(VALUES);
+               done++;
+           });
+        bool ok = check(waitUntil([&]()
+                                  { return done == 2; }),
+                        "close did not end the other side's reads");
+        ok &= check(received == VALUES, std::to_string(received) + " values read in order out of " + std::to_string(VALUES));
+        ok &= check(refused, "a write after close() went through");
+        ok &= check(reply == VALUES, "values stopped coming in after close()");
+        ok &= check(not other.closed() and not other.disconnected(), "close() took down the other side");
+
+        auto gone = RemoteChannel<int>::pair(1);
+        auto &left = *gone.first;
+        std::atomic_bool readEnded{false}, writeThrew{false};
+        go([&]()
+           {
+               int value;
+               readEnded = not left.read(value);
+               done++;
+           });
+        go([&]()
+           {
+               try
+               {
+                   // The first one takes the only credit, the next one parks
+                   while (true)
+                   {
+                       left.write(1);
+                   }
+               }
+               catch (std::runtime_error &)
+               {
+                   writeThrew = true;
+               }
+               done++;
+           });
+        ok &= check(waitUntil([&]()
+                              { return left.credit() == 0 and gone.second->size() == 1; }),
+                    "the writer did not run out of credit");
+        std::this_thread::sleep_for(100ms);
+        gone.second.reset();
+        ok &= check(waitUntil([&]()
+                              { return done == 4; }),
+                    "routines parked on a channel whose peer went away did not wake");
+        ok &= check(readEnded, "a read got a value from a peer that never wrote");
+        ok &= check(writeThrew, "a write to a peer that went away did not throw");
+        ok &= check(left.disconnected(), "the peer went away but the channel is still connected");
+        return ok ? PASSED : FAILED;
+    }
+
+    std::vector<Scenario> allScenarios()
+    {
+        return {
+            {"locked_handoff", lockedHandoff},
+            {"locked_wakeup", lockedWakeup},
+            {"spill_concurrent", spillConcurrent},
+            {"remote_framing", remoteFraming},
+            {"remote_flow_control", remoteFlowControl},
+            {"remote_peer_close", remotePeerClose},
+        };
+    }
+}
+
+int main(int argc, char **argv)
+{
+    auto scenarios = allScenarios();
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <scenario>...\n";
+        for (auto &scenario : scenarios)
+        {
+            std::cerr << "  " << scenario.m_name << "\n";
+        }
+        return 1;
+    }
+    int failed = 0, skipped = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        auto found = std::find_if(scenarios.begin(), scenarios.end(), [&](const Scenario &scenario)
+                                  { return scenario.m_name == argv[i]; });
+        if (found == scenarios.end())
+        {
+            std::cerr << "Unknown scenario " << argv[i] << "\n";
+            return 1;
+        }
+        auto start = Clock::now();
+        auto outcome = found->m_fn();
+        static const char *const OUTCOME_NAMES[] = {"ok", "FAILED", "skipped"};
+        std::cerr << found->m_name << ": " << OUTCOME_NAMES[outcome] << " in "
+                  << std::chrono::duration<double>(Clock::now() - start).count() << "s\n";
+        failed += outcome == FAILED;
+        skipped += outcome == SKIPPED;
+    }
+    if (failed != 0)
+    {
+        // Routines a failed scenario left stuck would keep GO_END waiting
+        std::_Exit(1);
+    }
+    GO_END
+    // ctest's SKIP_RETURN_CODE
+    return skipped != 0 ? 77 : 0;
+}
@@ -0,0 +1,42 @@
+#include <iostream>
+#include <string.h>
+
+#include "Trace.h"
+using namespace gocpp;
+
+// Offline converter for traces recorded with gocpp::Tracer
+// Usage: cppgo_trace <trace.bin> <out.json|out.pftrace> [--perfetto]
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::cerr << "Usage: " << argv[0] << " <trace.bin> <output> [--perfetto]\n";
+        return 1;
+    }
+    bool perfetto = argc > 3 and strcmp(argv[3], "--perfetto") == 0;
+
+    std::vector<TraceEvent> events;
+    if (not Tracer::load(argv[1], events))
+    {
+        std::cerr << "Could not read trace " << argv[1] << "\n";
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], perfetto ? "wb" : "w");
+    if (out == nullptr)
+    {
+        std::cerr << "Could not open " << argv[2] << "\n";
+        return 1;
+    }
+    if (perfetto)
+    {
+        Tracer::exportPerfetto(events, out);
+    }
+    else
+    {
+        Tracer::exportChromeJson(events, out);
+    }
+    fclose(out);
+    std::cout << "Converted " << events.size() << " events\n";
+    return 0;
+}
@@ -0,0 +1,205 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <utility>
+
+#include "Machines.h"
+#include "Slab.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    /*
+    One routine owning some state, and a mailbox everyone else sends it messages through (Erlang's process,
+    Akka's actor). The mailbox is a lock free intrusive stack: a send is one slab allocation and one CAS, and
+    wakes the owner only when the mailbox was empty. The owner takes everything sent so far in one exchange,
+    handles it oldest first, and yields after `batch` messages so that one busy actor doesn't hog its
+    processor. A plain Channel reader would instead pay for a wake up (and a switch) per message:
+        Actor<Event> counter([&](Event &event) { counts[event.m_key]++; });
+        counter.send(event);
+    Messages from one sender are handled in the order sent. send() never blocks unless `high_water` is set:
+    senders then wait while that many messages are queued (roughly, concurrent senders may overshoot by one
+    each), so the owner must not send to its own full mailbox. close() lets the owner handle what is queued
+    and return, the destructor closes and waits for it.
+    */
+    template <typename Msg>
+    class Actor
+    {
+        struct Node : public detail::SlabAllocated
+        {
+            Node *m_next{nullptr};
+            Msg m_msg;
+
+            template <typename... Args>
+            Node(Args &&...args)
+                : m_msg(std::forward<Args>(args)...)
+            {
+            }
+        };
+
+        std::function<void(Msg &)> m_handler;
+        const size_t m_batch;
+        const size_t m_high_water;
+
+        // Newest first, taken as a whole by the owner
+        alignas(64) std::atomic<Node *> m_mailbox{nullptr};
+        // Messages sent and not handled yet, only kept with a high water mark
+        std::atomic<size_t> m_queued{0};
+        std::atomic_bool m_closed{false};
+
+        // The owner, waiting for the mailbox to turn non empty
+        WaitQueue m_owner;
+        // Senders waiting for the mailbox to drop below the high water mark
+        WaitQueue m_senders;
+        // The destructor, waiting for the owner to return. Its lock guards m_done
+        WaitQueue m_finished;
+        bool m_done{false};
+
+        void run()
+        {
+            // Taken from the mailbox, oldest first
+            Node *pending = nullptr;
+            while (true)
+            {
+                if (pending == nullptr)
+                {
+                    pending = take();
+                    if (pending == nullptr)
+                    {
+                        if (m_closed)
+                        {
+                            break;
+                        }
+                        std::unique_lock<RoutineMutex> guard(m_owner.lock());
+                        m_owner.waitUnless(guard, [this]()
+                                           { return m_mailbox.load() != nullptr or m_closed; });
+                        continue;
+                    }
+                }
+                size_t handled = 0;
+                while (pending and handled < m_batch)
+                {
+                    auto *node = pending;
+                    pending = node->m_next;
+                    m_handler(node->m_msg);
+                    delete node;
+                    handled++;
+                }
+                if (m_high_water)
+                {
+                    m_queued.fetch_sub(handled);
+                    m_senders.wake(handled);
+                }
+                if (pending or m_mailbox.load(std::memory_order_relaxed))
+                {
+                    // Our turn is over, whatever else is runnable goes first
+                    Machines::yieldToScheduler();
+                }
+            }
+            std::unique_lock<RoutineMutex> guard(m_finished.lock());
+            m_done = true;
+            m_finished.notifyAll();
+        }
+
+        // Everything sent so far, oldest first
+        Node *take()
+        {
+            Node *oldest = nullptr;
+            for (auto *node = m_mailbox.exchange(nullptr); node;)
+            {
+                auto *next = node->m_next;
+                node->m_next = oldest;
+                oldest = node;
+                node = next;
+            }
+            return oldest;
+        }
+
+        bool push(Node *node)
+        {
+            if (m_high_water)
+            {
+                if (m_queued.load() >= m_high_water)
+                {
+                    std::unique_lock<RoutineMutex> guard(m_senders.lock());
+                    m_senders.waitUnless(guard, [this]()
+                                         { return m_queued.load() < m_high_water or m_closed; });
+                }
+                m_queued++;
+            }
+            if (m_closed)
+            {
+                if (m_high_water)
+                {
+                    m_queued--;
+                }
+                delete node;
+                return false;
+            }
+            node->m_next = m_mailbox.load(std::memory_order_relaxed);
+            while (not m_mailbox.compare_exchange_weak(node->m_next, node))
+            {
+            }
+            if (node->m_next == nullptr)
+            {
+                // Empty until now, so the owner may be waiting. Otherwise whoever sent the oldest message woke it
+                m_owner.wakeOne();
+            }
+            return true;
+        }
+
+    public:
+        // Spawns the owner routine, which calls `handler` for every message. `batch` is the most it handles
+        // before yielding, `high_water` (0 for none) how many queued messages make senders wait
+        explicit Actor(std::function<void(Msg &)> handler, size_t batch = ACTOR_BATCH_SIZE, size_t high_water = 0)
+            : m_handler(std::move(handler)), m_batch(std::max<size_t>(batch, 1)), m_high_water(high_water)
+        {
+            go([this]()
+               { run(); });
+        }
+
+        ~Actor()
+        {
+            close();
+            {
+                std::unique_lock<RoutineMutex> guard(m_finished.lock());
+                while (not m_done)
+                {
+                    m_finished.wait(guard);
+                }
+            }
+            // Sent concurrently with close() and never taken
+            for (auto *node = m_mailbox.exchange(nullptr); node;)
+            {
+                auto *next = node->m_next;
+                delete node;
+                node = next;
+            }
+        }
+
+        Actor(const Actor &) = delete;
+        Actor &operator=(const Actor &) = delete;
+
+        // False, and the message dropped, once closed
+        bool send(const Msg &msg) { return push(new Node(msg)); }
+        bool send(Msg &&msg) { return push(new Node(std::move(msg))); }
+
+        template <typename... Args>
+        bool emplace(Args &&...args)
+        {
+            return push(new Node(std::forward<Args>(args)...));
+        }
+
+        // The owner handles what was sent before and returns
+        void close()
+        {
+            m_closed = true;
+            m_owner.wakeOne();
+            m_senders.wakeAll();
+        }
+
+        bool closed() const { return m_closed; }
+    };
+}
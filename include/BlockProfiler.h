@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Consts.h"
+
+namespace gocpp
+{
+    // What a routine waited on, see BlockProfiler
+    enum BlockKind : uint8_t
+    {
+        BLOCK_CHANNEL = 0,
+        BLOCK_SELECT,
+        BLOCK_LOCK,
+        NUM_BLOCK_KINDS
+    };
+
+    static const char *const BLOCK_KIND_NAMES[] = {
+        "channel",
+        "select",
+        "lock",
+    };
+
+    /*
+    Sampling profile of where routines wait, like Go's block and mutex profiles together: blocking channel
+    reads/writes, Select (charged to the channel whose case ended the wait) and contended SpinYieldLocks.
+    Waits of at least the rate are all recorded, shorter ones with probability duration / rate and weighted
+    up accordingly, so totals stay unbiased while cheap waits rarely cost more than a clock read. Each sample
+    keeps the waiting call site's stack (frame pointers, bounded to the routine's stack), the channel or lock
+    and the routine's label (Profiler::setLabel()). stop() writes them as a pprof profile, contentions() sums
+    them per channel or lock while running, eg. to log the hottest channels:
+        gocpp::BlockProfiler::setName(&jobs, "jobs");
+        gocpp::BlockProfiler::start();
+        ...
+        for (auto &contention : gocpp::BlockProfiler::contentions(5)) ...
+    Names and totals are keyed by address, a channel destroyed and another created in its place share them.
+    */
+    class BlockProfiler
+    {
+    public:
+        static constexpr size_t MAX_DEPTH = 64;
+
+        struct Contention
+        {
+            const void *m_object;
+            BlockKind m_kind;
+            // setName()'s, else the address
+            std::string m_name;
+            // Estimated number of waits and their total duration
+            uint64_t m_count;
+            uint64_t m_nanos;
+        };
+
+    private:
+        // Weighted sums, so that sampled waits count for all the ones they stand for
+        struct Totals
+        {
+            double m_count{0};
+            double m_nanos{0};
+        };
+        // Kind, channel or lock, routine label and stack of the waiting call site
+        using Site = std::tuple<BlockKind, const void *, uint32_t, std::vector<uintptr_t>>;
+
+        // 0 while stopped
+        static inline std::atomic<uint64_t> s_rate{0};
+        static inline std::mutex s_lock;
+        static inline std::map<Site, Totals> s_sites;
+        static inline std::map<std::pair<const void *, BlockKind>, Totals> s_objects;
+        static inline std::unordered_map<const void *, std::string> s_names;
+        static inline uint64_t s_started{0};
+
+        // setName()'s name of `object`, else its address. Called with s_lock held
+        static std::string nameOf(const void *object);
+
+    public:
+        static bool enabled() { return s_rate.load(std::memory_order_relaxed) != 0; }
+
+        // Starts sampling waits, see above, returns false if the profiler is already running
+        static bool start(uint64_t rateNanos = BLOCK_PROFILE_RATE_NANOS);
+        // Stops sampling and writes a pprof profile to `path`, returns false if it could not be written
+        static bool stop(const std::string &path);
+
+        // Names a channel or lock in profiles and contentions(), an empty name clears it
+        static void setName(const void *object, const std::string &name);
+
+        // Totals per channel or lock since the last start(), longest total wait first
+        static std::vector<Contention> contentions(size_t limit = SIZE_MAX);
+
+        // Called once a routine (or thread) is done waiting `nanos` on `object`
+        static void record(BlockKind kind, const void *object, uint64_t nanos);
+    };
+}
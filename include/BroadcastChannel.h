@@ -0,0 +1,371 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "Channel.h"
+
+namespace gocpp
+{
+    /*
+    Single producer side, many consumer fan-out channel. Every written value is stored once, as a
+    shared immutable payload, in a ring of `capacity` slots. Each subscribed Reader consumes the ring
+    at its own cursor and receives the shared payload, so a message costs one allocation no matter how
+    many readers see it. A slot releases its payload as soon as the last reader that still had to
+    see it moves past it.
+    A reader falling `capacity` messages behind the writer is handled according to its LagPolicy:
+    * BLOCK: the writer waits for it, like a full buffered Channel
+    * DROP: the reader silently skips its oldest unread messages (counted in missed())
+    * DISCONNECT: the reader is cut off and its reads return false from then on
+    Readers must not outlive the channel they subscribed to.
+    */
+    template <typename T>
+    class BroadcastChannel : public WriteChannel<T>
+    {
+    public:
+        using Payload = std::shared_ptr<const T>;
+
+        enum LagPolicy : uint8_t
+        {
+            BLOCK = 0,
+            DROP,
+            DISCONNECT
+        };
+
+        class Reader : public ReadChannel<Payload>
+        {
+            friend class BroadcastChannel;
+
+            BroadcastChannel &m_channel;
+            const LagPolicy m_policy;
+            // Sequence number of the next message to read
+            std::atomic<uint64_t> m_cursor;
+            std::atomic_bool m_disconnected{false};
+            std::atomic<uint64_t> m_missed{0};
+
+            bool readNoBlock(Payload &out)
+            {
+                {
+                    SpinYieldLock<RoutineMutex> readLock(m_channel.m_lock);
+                    if (m_disconnected or m_cursor == m_channel.m_tail)
+                    {
+                        return false;
+                    }
+                    out = m_channel.consume(m_cursor);
+                    m_cursor++;
+                }
+                if (m_policy == LagPolicy::BLOCK)
+                {
+                    // We may have been the one holding the writer back
+                    m_channel.m_write_waiters.wakeAll();
+                }
+                return true;
+            }
+
+            bool finished()
+            {
+                return m_disconnected or (m_channel.closed() and m_cursor == m_channel.m_tail);
+            }
+
+        public:
+            Reader(BroadcastChannel &channel, LagPolicy policy, uint64_t cursor)
+                : m_channel(channel), m_policy(policy), m_cursor(cursor)
+            {
+            }
+
+            Reader(const Reader &other) = delete;
+            Reader(Reader &&other) = delete;
+
+            ~Reader()
+            {
+                m_channel.unsubscribe(this);
+            }
+
+            bool readReady() override
+            {
+                return m_cursor != m_channel.m_tail or m_disconnected;
+            }
+
+            WaitQueue *readWaiters() override
+            {
+                return &m_channel.m_read_waiters;
+            }
+
+            bool tryRead(Payload &out) override
+            {
+                return readNoBlock(out);
+            }
+
+            // Returns false once the channel is closed and drained, or this reader got disconnected
+            bool read(Payload &out) override
+            {
+                return read(out, nullptr);
+            }
+
+            // Also returns false once `context` is cancelled, without reading
+            bool read(Payload &out, CancelContext *context)
+            {
+                detail::BlockTimer blocked(this);
+                while (true)
+                {
+                    if (readNoBlock(out))
+                    {
+                        return true;
+                    }
+                    else if (finished())
+                    {
+                        out.reset();
+                        return false;
+                    }
+                    // Park until the writer publishes, disconnects us or closes
+                    blocked.park();
+                    auto &waiters = m_channel.m_read_waiters;
+                    std::unique_lock<RoutineMutex> guard(waiters.lock());
+                    if (not waiters.waitUnless(guard, [this]()
+                                               { return readReady() or m_channel.closed(); },
+                                               context))
+                    {
+                        out.reset();
+                        return false;
+                    }
+                }
+            }
+
+            LagPolicy policy() const { return m_policy; }
+            bool disconnected() const { return m_disconnected; }
+            // Messages skipped by a DROP reader that fell too far behind
+            uint64_t missed() const { return m_missed; }
+            // Number of messages written but not read yet
+            size_t lag() const { return m_channel.m_tail - m_cursor; }
+        };
+        using ReaderPtr = std::unique_ptr<Reader>;
+
+    private:
+        struct Slot
+        {
+            Payload m_payload;
+            // Readers that still have to read this slot
+            size_t m_pending{0};
+        };
+
+        RoutineMutex m_lock;
+        std::vector<Slot> m_ring;
+        std::vector<Reader *> m_readers;
+        // Every reader parks on the same queue, each publish wakes them all
+        WaitQueue m_read_waiters;
+        // Writers held back by a BLOCK reader
+        WaitQueue m_write_waiters;
+        // Sequence number of the next message to write
+        std::atomic<uint64_t> m_tail{0};
+        std::atomic_bool m_closed{false};
+
+    private:
+        bool closed()
+        {
+            return m_closed;
+        }
+
+        Slot &slot(uint64_t sequence)
+        {
+            return m_ring[sequence % m_ring.size()];
+        }
+
+        // Hands out one reader's copy of the payload, dropping the ring's reference after the last one
+        Payload consume(uint64_t sequence)
+        {
+            auto &current = slot(sequence);
+            if (--current.m_pending == 0)
+            {
+                return std::move(current.m_payload);
+            }
+            return current.m_payload;
+        }
+
+        void release(uint64_t sequence)
+        {
+            auto &current = slot(sequence);
+            if (--current.m_pending == 0)
+            {
+                current.m_payload.reset();
+            }
+        }
+
+        void unsubscribe(Reader *reader)
+        {
+            {
+                SpinYieldLock<RoutineMutex> lock(m_lock);
+                if (not reader->m_disconnected)
+                {
+                    for (auto sequence = reader->m_cursor.load(); sequence != m_tail; sequence++)
+                    {
+                        release(sequence);
+                    }
+                }
+                m_readers.erase(std::find(m_readers.begin(), m_readers.end(), reader));
+            }
+            m_write_waiters.wakeAll();
+        }
+
+        // Makes room for one more message, returns false while a BLOCK reader is still a full ring behind
+        bool makeRoom()
+        {
+            for (auto *reader : m_readers)
+            {
+                if (reader->m_disconnected or reader->m_cursor + m_ring.size() != m_tail)
+                {
+                    continue;
+                }
+                if (reader->m_policy == LagPolicy::BLOCK)
+                {
+                    return false;
+                }
+            }
+            for (auto *reader : m_readers)
+            {
+                if (reader->m_disconnected or reader->m_cursor + m_ring.size() != m_tail)
+                {
+                    continue;
+                }
+                if (reader->m_policy == LagPolicy::DROP)
+                {
+                    release(reader->m_cursor);
+                    reader->m_cursor++;
+                    reader->m_missed++;
+                }
+                else
+                {
+                    for (auto sequence = reader->m_cursor.load(); sequence != m_tail; sequence++)
+                    {
+                        release(sequence);
+                    }
+                    reader->m_disconnected = true;
+                }
+            }
+            return true;
+        }
+
+        bool publishNoBlock(Payload &payload)
+        {
+            if (closed())
+            {
+                throw std::runtime_error("Attempted write on a closed channel!");
+            }
+            {
+                SpinYieldLock<RoutineMutex> writeLock(m_lock);
+                if (not makeRoom())
+                {
+                    return false;
+                }
+                auto &next = slot(m_tail);
+                next.m_pending = 0;
+                for (auto *reader : m_readers)
+                {
+                    next.m_pending += not reader->m_disconnected;
+                }
+                // Nobody to deliver to, the payload is dropped like an unread Go broadcast
+                if (next.m_pending != 0)
+                {
+                    next.m_payload = std::move(payload);
+                }
+                m_tail++;
+            }
+            // Also wakes readers makeRoom() just disconnected
+            m_read_waiters.wakeAll();
+            return true;
+        }
+
+    public:
+        BroadcastChannel(size_t capacity)
+            : m_ring(std::max<size_t>(capacity, 1))
+        {
+        }
+
+        BroadcastChannel(const BroadcastChannel &other) = delete;
+        BroadcastChannel(BroadcastChannel &&other) = delete;
+
+        // New readers only see messages written after they subscribed
+        ReaderPtr subscribe(LagPolicy policy = LagPolicy::BLOCK)
+        {
+            SpinYieldLock<RoutineMutex> lock(m_lock);
+            auto reader = std::make_unique<Reader>(*this, policy, m_tail);
+            m_readers.push_back(reader.get());
+            return reader;
+        }
+
+        bool writeReady() override
+        {
+            SpinYieldLock<RoutineMutex> lock(m_lock);
+            for (auto *reader : m_readers)
+            {
+                if (reader->m_policy == LagPolicy::BLOCK and not reader->m_disconnected and
+                    reader->m_cursor + m_ring.size() == m_tail)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        WaitQueue *writeWaiters() override
+        {
+            return &m_write_waiters;
+        }
+
+        // Publishes an already shared payload, blocks while a BLOCK reader is a full ring behind.
+        // Gives up (returning false) once `context` is cancelled, without publishing
+        bool publish(Payload payload, CancelContext *context = nullptr)
+        {
+            detail::BlockTimer blocked(this);
+            while (not publishNoBlock(payload))
+            {
+                // Park until that reader moves on or unsubscribes
+                blocked.park();
+                std::unique_lock<RoutineMutex> guard(m_write_waiters.lock());
+                if (not m_write_waiters.waitUnless(guard, [this]()
+                                                   { return writeReady() or closed(); },
+                                                   context))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // Overrides WriteChannel's only for a copyable T, see detail::CopyingWrite
+        bool write(const T &in)
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return publish(std::make_shared<const T>(in));
+        }
+
+        bool write(T &&in) override
+        {
+            return publish(std::make_shared<const T>(std::move(in)));
+        }
+
+        bool write(const T &in, CancelContext *context)
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return publish(std::make_shared<const T>(in), context);
+        }
+
+        bool write(T &&in, CancelContext *context)
+        {
+            return publish(std::make_shared<const T>(std::move(in)), context);
+        }
+
+        template <typename... Args>
+        bool emplace(Args &&...args)
+        {
+            return publish(std::make_shared<const T>(std::forward<Args>(args)...));
+        }
+
+        // Readers drain what was already written, then their reads return false
+        void close() override
+        {
+            m_closed = true;
+            m_read_waiters.wakeAll();
+            m_write_waiters.wakeAll();
+        }
+    };
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <memory>
+#include <vector>
+
+#include "Channel.h"
+#include "Timers.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    class CancelContext;
+    using CancelContextPtr = std::shared_ptr<CancelContext>;
+
+    /*
+    Go's context.Context, minus the values: a tree of cancellation scopes with optional deadlines.
+    Cancelling a context (explicitly or through its deadline) cancels every descendant and wakes every
+    routine parked on any of them, in O(descendants + waiters), the waiters being parked on waiters().
+    Blocking operations take a CancelContext* and give up once it is done():
+        auto request = CancelContext::withTimeout(parent, 50ms);
+        if (not jobs.read(job, request.get())) ...   // closed, or timed out
+    Done() is a channel that becomes readable on cancellation, to be used in a Select.
+    A child keeps its parent alive, parents only reference their children while they exist.
+    */
+    class CancelContext : public std::enable_shared_from_this<CancelContext>
+    {
+    public:
+        enum Reason : uint8_t
+        {
+            NONE = 0,
+            CANCELLED,
+            DEADLINE_EXCEEDED
+        };
+
+        // Readable (true) once the context is done, never closed
+        class DoneChannel : public ReadChannel<bool>
+        {
+            CancelContext &m_context;
+
+        public:
+            DoneChannel(CancelContext &context)
+                : m_context(context)
+            {
+            }
+
+            bool readReady() override { return m_context.done(); }
+            bool tryRead(bool &out) override;
+            bool read(bool &out) override;
+            WaitQueue *readWaiters() override { return &m_context.m_waiters; }
+        };
+
+    private:
+        const CancelContextPtr m_parent;
+        const Clock::time_point m_deadline;
+        std::atomic<uint8_t> m_reason{NONE};
+        // Its lock also protects m_children and m_timer
+        WaitQueue m_waiters;
+        std::vector<CancelContext *> m_children;
+        detail::Timers::Handle m_timer;
+        DoneChannel m_done{*this};
+
+        // Cancels this context and its subtree, m_waiters' lock must be held
+        void cancelLocked(Reason reason);
+        static CancelContextPtr create(const CancelContextPtr &parent, Clock::time_point deadline);
+
+    public:
+        CancelContext(const CancelContextPtr &parent, Clock::time_point deadline);
+        ~CancelContext();
+        CancelContext(const CancelContext &) = delete;
+        CancelContext &operator=(const CancelContext &) = delete;
+
+        // Root (or child of `parent`) that is only cancelled explicitly
+        static CancelContextPtr withCancel(const CancelContextPtr &parent = nullptr);
+        // Cancelled at `deadline` at the latest, or earlier if the parent's deadline comes first
+        static CancelContextPtr withDeadline(const CancelContextPtr &parent, Clock::time_point deadline);
+        template <typename Rep, typename Period>
+        static CancelContextPtr withTimeout(const CancelContextPtr &parent, const std::chrono::duration<Rep, Period> &timeout)
+        {
+            return withDeadline(parent, Clock::now() + std::chrono::duration_cast<Clock::duration>(timeout));
+        }
+
+        void cancel() { cancel(CANCELLED); }
+        void cancel(Reason reason);
+
+        bool done() const { return m_reason.load() != NONE; }
+        // Why the context is done, NONE while it is not
+        Reason reason() const { return Reason(m_reason.load()); }
+        // Clock::time_point::max() without a deadline
+        Clock::time_point deadline() const { return m_deadline; }
+        const CancelContextPtr &parent() const { return m_parent; }
+
+        ReadChannel<bool> &Done() { return m_done; }
+
+        // Blocks until the context is done
+        void wait();
+
+        // Routines blocked on this context, for building cancellable waits
+        WaitQueue &waiters() { return m_waiters; }
+    };
+}
@@ -1,56 +1,207 @@
 #pragma once
 #include <mutex>
 #include <atomic>
+#include <memory>
+#include <new>
 #include <queue>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 
 #include "Machines.h"
+#include "WaitQueue.h"
 namespace gocpp
 {
+    class CancelContext;
 
-    class ChannelBase
+    namespace detail
     {
-    public:
-        virtual operator bool() = 0;
-    };
+        // co_await counterparts of the blocking operations, see Task.h
+        template <typename T, typename Kind>
+        struct ChannelTasks;
+
+        // WriteChannel's copying write, only part of the interface for copyable values
+        template <typename T, bool = std::is_copy_constructible_v<T>>
+        class CopyingWrite
+        {
+        public:
+            virtual bool write(const T &in) = 0;
+        };
+
+        template <typename T>
+        class CopyingWrite<T, false>
+        {
+        public:
+            // Move only values are written as rvalues, an lvalue doesn't compile rather than throwing
+            bool write(const T &in) = delete;
+        };
+    }
 
+    /*
+    Type erased channel interfaces, taken by Select, Pipeline sources and other code generic over the kind of
+    channel. Code holding a concrete Channel (or a Sender/Receiver of one) calls it directly instead.
+    */
     template <typename T>
-    class ReadChannel : virtual public ChannelBase
+    class ReadChannel
     {
     public:
         virtual bool readReady() = 0;
         virtual bool read(T &out) = 0;
+        // Reads only if a value is available right now
+        virtual bool tryRead(T &out) = 0;
+        // Notified whenever readReady() may have turned true, null if readiness can only be polled
+        virtual WaitQueue *readWaiters() { return nullptr; }
     };
 
     template <typename T>
-    class WriteChannel : virtual public ChannelBase
+    class WriteChannel : public detail::CopyingWrite<T>
     {
     public:
+        using detail::CopyingWrite<T>::write;
         virtual bool writeReady() = 0;
-        virtual bool write(const T &in) = 0;
+        virtual bool write(T &&in) = 0;
         virtual void close() = 0;
+        // Notified whenever writeReady() may have turned true, null if readiness can only be polled
+        virtual WaitQueue *writeWaiters() { return nullptr; }
     };
 
-    template <typename T>
-    class Channel : public ReadChannel<T>, public WriteChannel<T>
+    namespace detail
+    {
+        // Accounts one blocking channel operation in the runtime metrics and the BlockProfiler.
+        // Costs nothing unless the operation actually has to wait
+        class BlockTimer
+        {
+            const void *m_channel;
+            const BlockKind m_kind;
+            uint64_t m_start{0};
+
+        public:
+            BlockTimer(const void *channel, BlockKind kind = BLOCK_CHANNEL)
+                : m_channel(channel), m_kind(kind)
+            {
+            }
+
+            // The channel the wait ended on, once a Select knows it
+            void setChannel(const void *channel) { m_channel = channel; }
+
+            void park()
+            {
+                if (m_start == 0)
+                {
+                    m_start = nowNanos();
+                    Metrics::local().add(MetricCounter::CHANNEL_PARKS);
+                    GO_TRACE(TRACE_PARK, Tracer::currentRoutine(), uintptr_t(m_channel));
+                }
+            }
+
+            // Ends the wait early, when what follows it must not count as blocked
+            void finish()
+            {
+                if (m_start != 0)
+                {
+                    auto nanos = nowNanos() - m_start;
+                    m_start = 0;
+                    Metrics::local().m_channel_block.record(nanos);
+                    if (BlockProfiler::enabled())
+                    {
+                        BlockProfiler::record(m_kind, m_channel, nanos);
+                    }
+                    GO_TRACE(TRACE_UNPARK, Tracer::currentRoutine(), uintptr_t(m_channel));
+                }
+            }
+
+            ~BlockTimer()
+            {
+                finish();
+            }
+        };
+    }
+
+    // Outcome of `ch >> value`, false once the channel is closed and drained. Reads chained after a failed one
+    // are skipped: while (ch >> key >> value) ...
+    template <typename Ch>
+    class ReadResult
+    {
+        // Null once a read failed
+        Ch *const m_channel;
+
+    public:
+        explicit ReadResult(Ch *channel)
+            : m_channel(channel)
+        {
+        }
+
+        operator bool() const { return m_channel != nullptr; }
+
+        template <typename T>
+        ReadResult operator>>(T &out) const
+        {
+            return ReadResult(m_channel and m_channel->read(out) ? m_channel : nullptr);
+        }
+    };
+
+    // Channel kinds, picked at compile time. Any number of routines may read and write an Mpmc channel
+    struct Mpmc
+    {
+    };
+    // At most one writer and one reader at a time. Buffered values move through the ring without the channel
+    // lock, only the unbuffered handoff and close() still take it
+    struct Spsc
+    {
+    };
+
+    /*
+    Go channel, unbuffered or buffered (`buffer_size` values are written without waiting for a reader).
+    The class is final, calls on a Channel (rather than on its ReadChannel/WriteChannel interfaces) are direct
+    and inline their fast paths.
+    */
+    template <typename T, typename Kind = Mpmc>
+    class Channel final : public ReadChannel<T>, public WriteChannel<T>
     {
     private:
+        using BlockTimer = detail::BlockTimer;
+        friend struct detail::ChannelTasks<T, Kind>;
+        static_assert(std::is_same_v<Kind, Mpmc> or std::is_same_v<Kind, Spsc>, "Channel kind is Mpmc or Spsc");
+        static constexpr bool SPSC = std::is_same_v<Kind, Spsc>;
+
         // This state will be used to maintain read/write status across concurrent channel usage
         enum State : uint8_t
         {
             DEFAULT = 0b0000,
-            WRITER_BLOCKING = 0b0001,
-            READER_BLOCKING = 0b0010,
             WRITE_COMPLETE = 0b0100,
             CLOSED = 0b1000
         };
 
-        std::mutex m_lock;
-        T m_data;
+        // Raw storage for one value, constructed in place by writers and moved out by readers
+        using Slot = std::aligned_storage_t<sizeof(T), alignof(T)>;
+
+        // Holders are not preemptible, stackless tasks can only spin while another routine holds it
+        RoutineMutex m_lock;
+        Slot m_data;
         const size_t m_buffer_size{0};
-        std::deque<T> m_buffered_data;
+        // Preallocated ring of m_buffer_size slots, values live in [m_head, m_tail). Behind the lock, except
+        // for Spsc where the reader alone moves m_head and the writer m_tail, and m_count hands slots over
+        std::unique_ptr<Slot[]> m_buffered_data;
+        size_t m_head{0};
+        size_t m_tail{0};
+        std::atomic<size_t> m_count{0};
         std::atomic<uint8_t> m_state{State::DEFAULT};
+        // The writer whose value sits in m_data, blocked until a reader takes it. The reader fires it
+        // directly, so that a writer whose value got delivered never touches the channel again
+        Parking *m_handoff{nullptr};
+        // Readers parked in read(), an unbuffered write only becomes ready once there is one
+        std::atomic<uint32_t> m_blocked_readers{0};
+
+        // Parked readers wait for a value (or close), writers for room and select writers for readers
+        WaitQueue m_readers;
+        WaitQueue m_writers;
 
     private:
+        static T *value(Slot &slot)
+        {
+            return std::launder(reinterpret_cast<T *>(&slot));
+        }
+
         bool writeComplete()
         {
             return m_state & State::WRITE_COMPLETE;
@@ -70,143 +221,463 @@ namespace gocpp
             m_state &= ~st;
         }
 
+        // Moves the value out of `slot` and ends its lifetime
+        static void take(Slot &slot, T &out)
+        {
+            auto *stored = value(slot);
+            out = std::move(*stored);
+            stored->~T();
+        }
+
+        template <typename... Args>
+        void push(Args &&...args)
+        {
+            new (&m_buffered_data[m_tail]) T(std::forward<Args>(args)...);
+            m_tail = (m_tail + 1) % m_buffer_size;
+            m_count++;
+        }
+
+        void pop(T &out)
+        {
+            take(m_buffered_data[m_head], out);
+            m_head = (m_head + 1) % m_buffer_size;
+            m_count--;
+        }
+
+        bool hasValue()
+        {
+            return m_count != 0 or writeComplete();
+        }
+
+        bool hasRoom()
+        {
+            return m_count < m_buffer_size or not writeComplete();
+        }
+
         bool readNoBlock(T &out)
         {
-            if (not m_buffered_data.empty())
+            if (m_count == 0 and not writeComplete())
             {
-                SpinYieldLock<std::mutex> readLock(m_lock);
-                // Let's read
-                out = m_buffered_data.front();
-                m_buffered_data.pop_front();
-                return true;
+                if constexpr (std::is_default_constructible_v<T>)
+                {
+                    if (closed())
+                    {
+                        out = T{};
+                    }
+                }
+                return false;
             }
-            else if (writeComplete())
+            if constexpr (SPSC)
             {
-                SpinYieldLock<std::mutex> readLock(m_lock);
-                // Let's read
-                out = m_data;
-                unset(State::WRITE_COMPLETE);
-                return true;
+                // No other reader can take a value counted in m_count
+                if (m_count != 0)
+                {
+                    pop(out);
+                    m_writers.wakeOne();
+                    return true;
+                }
             }
-            else if (closed())
+            Parking *handoff = nullptr;
             {
-                out = T{};
+                // Another reader may have raced us to the value, check again under the lock
+                SpinYieldLock<RoutineMutex> readLock(m_lock);
+                if (m_count != 0)
+                {
+                    // Let's read
+                    pop(out);
+                }
+                else if (writeComplete())
+                {
+                    // Let's read
+                    take(m_data, out);
+                    unset(State::WRITE_COMPLETE);
+                    handoff = std::exchange(m_handoff, nullptr);
+                    if (handoff and not handoff->claim())
+                    {
+                        // Its writer got cancelled meanwhile and no longer waits for us
+                        handoff = nullptr;
+                    }
+                }
+                else
+                {
+                    return false;
+                }
             }
-            return false;
+            if (handoff)
+            {
+                handoff->fire();
+            }
+            // A slot just freed up
+            m_writers.wakeOne();
+            return true;
         }
 
-        uint8_t writeNoBlock(const T &in)
+        // Constructs the value straight into a free slot, `args` are only consumed on success.
+        // If the value went to m_data, `handoff` is registered to be fired once a reader takes it,
+        // otherwise it is reset to null
+        template <typename... Args>
+        bool writeNoBlock(Parking *&handoff, Args &&...args)
         {
             if (closed())
             {
                 throw std::runtime_error("Attempted write on a closed channel!");
             }
-            else if (m_buffer_size != m_buffered_data.size())
+            if constexpr (SPSC)
             {
-                SpinYieldLock<std::mutex> writeLock(m_lock);
-                // Let's write
-                m_buffered_data.emplace_back(in);
-                return true;
+                // No other writer can take the room left in the ring
+                if (m_count != m_buffer_size)
+                {
+                    push(std::forward<Args>(args)...);
+                    handoff = nullptr;
+                    m_readers.wakeOne();
+                    return true;
+                }
+            }
+            {
+                // Another writer may have raced us to the free slot, check again under the lock
+                SpinYieldLock<RoutineMutex> writeLock(m_lock);
+                if (m_buffer_size != m_count)
+                {
+                    // Let's write
+                    push(std::forward<Args>(args)...);
+                    handoff = nullptr;
+                }
+                else if (!writeComplete())
+                {
+                    // Let's write
+                    new (&m_data) T(std::forward<Args>(args)...);
+                    m_handoff = handoff;
+                    set(State::WRITE_COMPLETE);
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            m_readers.wakeOne();
+            return true;
+        }
+
+        // Blocking write, gives up while still waiting for room (or for a reader to take the
+        // value, which is then withdrawn) once `context` is cancelled
+        template <typename... Args>
+        bool put(CancelContext *context, Args &&...args)
+        {
+            BlockTimer blocked(this);
+            while (true)
+            {
+                Parking handoff;
+                auto *registered = &handoff;
+                if (writeNoBlock(registered, std::forward<Args>(args)...))
+                {
+                    if (registered)
+                    {
+                        blocked.park();
+                        return awaitHandoff(handoff, context);
+                    }
+                    return true;
+                }
+                blocked.park();
+                std::unique_lock<RoutineMutex> guard(m_writers.lock());
+                if (not m_writers.waitUnless(guard, [this]()
+                                             { return hasRoom() or closed(); },
+                                             context))
+                {
+                    return false;
+                }
             }
-            else if (!writeComplete())
+        }
+
+        bool awaitHandoff(Parking &handoff, CancelContext *context)
+        {
+            if (handoff.block(context))
             {
-                SpinYieldLock<std::mutex> writeLock(m_lock);
-                // Let's write
-                m_data = in;
-                set(State::WRITE_COMPLETE);
+                // Taken by a reader (or dropped by close()), the channel may be gone already
                 return true;
             }
+            {
+                // Cancelled, withdraw the value unless a reader took it meanwhile
+                SpinYieldLock<RoutineMutex> writeLock(m_lock);
+                if (m_handoff != &handoff)
+                {
+                    return true;
+                }
+                m_handoff = nullptr;
+                value(m_data)->~T();
+                unset(State::WRITE_COMPLETE);
+            }
+            m_writers.wakeOne();
             return false;
         }
 
     public:
         Channel(size_t buffer_size = 0)
-            : m_buffer_size(buffer_size)
+            : m_buffer_size(buffer_size), m_buffered_data(new Slot[buffer_size])
         {
         }
 
         Channel(const Channel &other) = delete;
         Channel(Channel &&other) = delete;
 
-        static inline Channel EOC{};
+        ~Channel()
+        {
+            // Destroy whatever was written but never read
+            for (size_t i = 0; i < m_count; i++)
+            {
+                value(m_buffered_data[(m_head + i) % m_buffer_size])->~T();
+            }
+            if (writeComplete())
+            {
+                value(m_data)->~T();
+            }
+        }
+
+        // Values written but not read yet, a racy snapshot meant for monitoring
+        size_t size()
+        {
+            return m_count + (writeComplete() ? 1 : 0);
+        }
 
         bool readReady() override
         {
-            return m_state & State::WRITER_BLOCKING;
+            // An already written value can be read right away
+            return hasValue();
         }
 
         bool writeReady() override
         {
-            return m_state & State::READER_BLOCKING;
+            return m_blocked_readers != 0 or m_count < m_buffer_size;
+        }
+
+        WaitQueue *readWaiters() override
+        {
+            return &m_readers;
+        }
+
+        WaitQueue *writeWaiters() override
+        {
+            return &m_writers;
+        }
+
+        bool tryRead(T &out) override
+        {
+            return readNoBlock(out);
         }
 
         // read returns true if channel can still receive data
         bool read(T &out) override
         {
-            set(State::READER_BLOCKING);
+            return read(out, nullptr);
+        }
+
+        // Also returns false once `context` is cancelled, without reading
+        bool read(T &out, CancelContext *context)
+        {
+            BlockTimer blocked(this);
             while (true)
             {
                 if (readNoBlock(out))
                 {
-                    unset(State::READER_BLOCKING);
                     return true;
                 }
                 else if (closed())
                 {
-                    unset(State::READER_BLOCKING);
                     return false;
                 }
-                // Yield coro and wait
-                Machines::yieldToScheduler();
+                // Park until a writer shows up
+                blocked.park();
+                m_blocked_readers++;
+                // Select writers wait for a reader to block
+                m_writers.wakeAll();
+                bool woken;
+                {
+                    std::unique_lock<RoutineMutex> guard(m_readers.lock());
+                    woken = m_readers.waitUnless(guard, [this]()
+                                                 { return hasValue() or closed(); },
+                                                 context);
+                }
+                m_blocked_readers--;
+                if (not woken)
+                {
+                    return false;
+                }
             }
         }
 
-        bool write(const T &in) override
+        // Not marked override: for a move only T there's nothing to override (see detail::CopyingWrite), and the
+        // body is only instantiated when called
+        bool write(const T &in)
         {
-            set(State::WRITER_BLOCKING);
-            while (true)
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return emplace(in);
+        }
+
+        bool write(T &&in) override
+        {
+            return emplace(std::move(in));
+        }
+
+        // Give up (returning false) once `context` is cancelled, before a reader took the value
+        bool write(const T &in, CancelContext *context)
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return put(context, in);
+        }
+
+        bool write(T &&in, CancelContext *context)
+        {
+            return put(context, std::move(in));
+        }
+
+        // Blocking write constructing the value in place from `args`
+        template <typename... Args>
+        bool emplace(Args &&...args)
+        {
+            return put(nullptr, std::forward<Args>(args)...);
+        }
+
+        void close() override
+        {
+            Parking *handoff = nullptr;
             {
-                if (writeNoBlock(in))
+                // A value still waiting in m_data is dropped, its writer returns
+                SpinYieldLock<RoutineMutex> closeLock(m_lock);
+                if (writeComplete())
                 {
-                    while (writeComplete())
-                    {
-                        // Yield coro and wait
-                        Machines::yieldToScheduler();
-                    }
-                    unset(State::WRITER_BLOCKING);
-                    return true;
+                    value(m_data)->~T();
+                }
+                m_state = State::CLOSED;
+                handoff = std::exchange(m_handoff, nullptr);
+                if (handoff and not handoff->claim())
+                {
+                    handoff = nullptr;
                 }
-                // Yield coro and wait
-                Machines::yieldToScheduler();
             }
+            if (handoff)
+            {
+                handoff->fire();
+            }
+            m_readers.wakeAll();
+            m_writers.wakeAll();
         }
 
-        void close() override
+        // Stream style write and read, see ReadResult
+        Channel &operator<<(const T &in)
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            write(in);
+            return *this;
+        }
+
+        Channel &operator<<(T &&in)
         {
-            m_state = State::CLOSED;
+            write(std::move(in));
+            return *this;
         }
 
-        operator bool() override
+        ReadResult<Channel> operator>>(T &out)
         {
-            return (this != &EOC);
+            return ReadResult<Channel>(read(out) ? this : nullptr);
         }
     };
 
-    template <typename T, template <typename> class WriteChannelType>
-    auto &operator<<(WriteChannelType<T> &ch, const T &in)
+    /*
+    Directional handles on a Channel, Go's chan<- T and <-chan T. A handle is a single pointer, calls the channel
+    directly and only exposes its own direction:
+        Channel<Job, Spsc> jobs(64);
+        go([in = Receiver(jobs)]() { Job job; while (in >> job) run(job); });
+        Sender out(jobs);
+        out << job;
+    The channel must outlive its handles.
+    */
+    template <typename T, typename Kind = Mpmc>
+    class Sender
     {
+        Channel<T, Kind> *m_channel;
+
+    public:
+        Sender(Channel<T, Kind> &channel)
+            : m_channel(&channel)
+        {
+        }
+
+        bool write(const T &in, CancelContext *context = nullptr) const
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return m_channel->write(in, context);
+        }
+        bool write(T &&in, CancelContext *context = nullptr) const { return m_channel->write(std::move(in), context); }
+        template <typename... Args>
+        bool emplace(Args &&...args) const
+        {
+            return m_channel->emplace(std::forward<Args>(args)...);
+        }
+        bool writeReady() const { return m_channel->writeReady(); }
+        void close() const { m_channel->close(); }
+
+        const Sender &operator<<(const T &in) const
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            write(in);
+            return *this;
+        }
+
+        const Sender &operator<<(T &&in) const
+        {
+            write(std::move(in));
+            return *this;
+        }
+
+        // Type erased write side, eg. for a Select
+        WriteChannel<T> &writeChannel() const { return *m_channel; }
+    };
+
+    template <typename T, typename Kind = Mpmc>
+    class Receiver
+    {
+        Channel<T, Kind> *m_channel;
+
+    public:
+        Receiver(Channel<T, Kind> &channel)
+            : m_channel(&channel)
+        {
+        }
+
+        bool read(T &out, CancelContext *context = nullptr) const { return m_channel->read(out, context); }
+        bool tryRead(T &out) const { return m_channel->tryRead(out); }
+        bool readReady() const { return m_channel->readReady(); }
+        size_t size() const { return m_channel->size(); }
+
+        ReadResult<Channel<T, Kind>> operator>>(T &out) const
+        {
+            return *m_channel >> out;
+        }
+
+        // Type erased read side, eg. for a Select or a Pipeline source
+        ReadChannel<T> &readChannel() const { return *m_channel; }
+    };
+
+    template <typename T>
+    auto &operator<<(WriteChannel<T> &ch, const T &in)
+    {
+        static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
         ch.write(in);
         return ch;
     }
 
-    template <typename T, template <typename> class ReadChannelType>
-    auto &operator>>(ReadChannelType<T> &ch, T &out)
+    // Rvalues are moved into the channel, lvalues of a move only type have to be std::move'd
+    template <typename T>
+    auto &operator<<(WriteChannel<T> &ch, T &&in)
     {
-        if (not ch.read(out))
-        {
-            return Channel<T>::EOC;
-        }
+        ch.write(std::move(in));
         return ch;
     }
 
+    // Other readers (eg. broadcast readers) go through the interface, Channel and Receiver have their own
+    template <typename T>
+    ReadResult<ReadChannel<T>> operator>>(ReadChannel<T> &ch, T &out)
+    {
+        return ReadResult<ReadChannel<T>>(ch.read(out) ? &ch : nullptr);
+    }
+
 }
\ No newline at end of file
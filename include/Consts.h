@@ -1,4 +1,5 @@
 #pragma once
+#include <algorithm>
 #include <stdint.h>
 #include <thread>
 #include <pthread.h>
@@ -17,21 +18,63 @@ enum ContextType : size_t
     NUM_CONTEXT_TYPES = 2
 };
 
+// Scheduling class of a routine, lower values run first. Spawned routines inherit their parent's class
+enum Priority : uint8_t
+{
+    LATENCY = 0, // request handlers and the like, preempt lower classes as soon as they become runnable
+    NORMAL = 1,
+    BATCH = 2,   // background work, only runs ahead of the others once it has waited out its slack
+    NUM_PRIORITIES = 3
+};
+
 #define TID (std::hash<std::thread::id>()(std::this_thread::get_id()) & size_t(0xFF))
 
+// Upper bound on processors, the count in use is detected at startup (CPU quota, affinity, GOMAXPROCS
+// environment variable) and adjustable with Machines::setMaxProcs
 #ifndef GOMAXPROCS
-    static const size_t MAX_PROCS = std::thread::hardware_concurrency();
+    static const size_t MAX_PROCS = std::max(1u, std::thread::hardware_concurrency());
 #else
-    static const size_t MAX_PROCS = std::min(std::thread::hardware_concurrency(), std::max(1, GOMAXPROCS));
+    static const size_t MAX_PROCS = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), std::max(1, GOMAXPROCS));
 #endif
+    // Executors beyond the processor count stand in for the ones blocked in BLOCKER sections
+    static const size_t MAX_EXECUTORS = 2 * MAX_PROCS;
 
 #ifndef GOSTACKSIZE
     static const size_t ROUTINE_STACK_SIZE = 4 * 1024 * 1024; // 4 MB
 #else
     static const size_t ROUTINE_STACK_SIZE = std::max(1024 * 64, GOSTACKSIZE); // Atleast 64 KB
 #endif
+    // Runtime objects up to this size come from the per processor slab caches (see Slab.h), larger ones from the heap
+    static const size_t SLAB_MAX_OBJECT_SIZE = 1024;
+    // Slab caches carve the objects of each size class out of chunks of this size, aligned to it
+    static const size_t SLAB_CHUNK_SIZE = 256 * 1024;
+    // SpillChannel overflow goes to sparse segment files of this size, larger records get a segment of their own
+    static const size_t SPILL_SEGMENT_SIZE = 64 * 1024 * 1024;
+    // Spilled bytes are written back, read ahead and released behind the reader in windows of this size
+    static const size_t SPILL_WINDOW_SIZE = 1024 * 1024;
+    // RemoteChannel frames carry at most this many bytes, so a record has to fit in one behind its length. Larger
+    // frames are taken for another protocol, both ends of a connection must agree on it
+#ifndef GOREMOTEFRAME
+    static const uint32_t REMOTE_MAX_FRAME = 1u << 30; // 1 GB
+#else
+    static const uint32_t REMOTE_MAX_FRAME = std::max(1024 * 64, GOREMOTEFRAME); // Atleast 64 KB
+#endif
+    // Routine labels PerfCounters accounts separately, routines with later labels count as unlabelled
+    static const size_t PERF_LABELS = 64;
+    // Default BlockProfiler rate: waits this long or longer are always recorded, shorter ones are sampled
+    static const uint64_t BLOCK_PROFILE_RATE_NANOS = 10'000;
+    // Messages an Actor handles per scheduling turn before it yields
+    static const size_t ACTOR_BATCH_SIZE = 64;
     static const size_t SCHED_STACK_SIZE = 64 * 1024; // 64 KB
     static const size_t STACK_SIZES[] = { ROUTINE_STACK_SIZE, SCHED_STACK_SIZE, 0};
     static const size_t TIMER_NANOS = 20'000'000; // 20ms
+    // Processors look at the global queue every so many schedules even when they have local work,
+    // otherwise a couple of routines yielding to each other starve everything queued globally
+    static const size_t GLOBAL_QUEUE_CHECK_INTERVAL = 61;
+    // How long a runnable routine of each class may be passed over by routines of higher classes. Processors
+    // run the queued routine with the earliest runnable timestamp + slack, which bounds starvation
+    static const uint64_t PRIORITY_SLACK_NANOS[] = {0, 2'000'000, 4 * TIMER_NANOS};
+    // Timer ticks a LATENCY routine runs for before lower classes get to preempt it
+    static const size_t LATENCY_QUANTUM_TICKS = 2;
 
 }
\ No newline at end of file
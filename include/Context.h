@@ -1,7 +1,8 @@
 #pragma once
 #include "Consts.h"
+#include "Slab.h"
 
-#include <vector>
+#include <memory>
 #include <ucontext.h>
 namespace gocpp
 {
@@ -13,10 +14,12 @@ namespace gocpp
     * SCHEDULER: This has a more limited stack size since it mainly just loops over the routine queues and masked SIGUSR since
       preemption is unnecessary. Starts the schedule function
     */
-    class Context
+    class Context : public detail::SlabAllocated
     {
         ucontext_t m_ucontext;
-        std::vector<char> m_stack;
+        // Left uninitialised, pages are only faulted in as the stack grows into them
+        std::unique_ptr<char[]> m_stack;
+        size_t m_stack_size{0};
 
     public:
         Context(const ContextType contextType, Context *nextContext = nullptr);
@@ -25,6 +28,8 @@ namespace gocpp
 
         // accessors
         ucontext_t *userContext() { return &m_ucontext; }
+        const char *stackBegin() const { return m_stack.get(); }
+        const char *stackEnd() const { return m_stack.get() + m_stack_size; }
     };
     using ContextPtr = std::unique_ptr<Context>;
 }
\ No newline at end of file
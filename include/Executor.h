@@ -1,12 +1,18 @@
 #pragma once
+#include <deque>
+#include <mutex>
+#include <signal.h>
 
 #include "Processor.h"
 #include "Context.h"
+#include "PerfCounters.h"
+#include "Trace.h"
 
 namespace gocpp
 {
 
     class Executor;
+    class Parking;
     using ExecutorPtr = std::unique_ptr<Executor>;
 
     class Executor
@@ -15,10 +21,57 @@ namespace gocpp
         RoutinePtr m_active_routine{};
         std::thread m_thread;
         ContextPtr m_scheduler_context;
+        // Native context of the executor thread, resumed once the scheduler loop ends
+        ucontext_t m_thread_context;
         std::atomic_bool m_running{false};
+        // Set only while a routine's own context is running on this executor, so that preemption
+        // signals landing mid context switch (or on the scheduler stack) are ignored
+        std::atomic_bool m_preemptible{false};
+        // Set when a higher class routine became runnable, delivered as soon as the executor is preemptible
+        std::atomic_bool m_preempt_requested{false};
+        // Class of the routine running here, NUM_PRIORITIES while in the scheduler
+        std::atomic<uint8_t> m_running_priority{NUM_PRIORITIES};
+        // Preemption ticks the active routine got spared so far
+        size_t m_spared_ticks{0};
+        TraceEventType m_switch_reason{TRACE_YIELD};
+        // Set by park(), the scheduler hands the switched out routine over to it instead of requeueing it
+        Parking *m_parking{nullptr};
         int m_id{-1};
+        // Runnable routines locked to this executor. They never enter a processor queue, where they could be stolen
+        std::mutex m_locked_lock;
+        std::deque<RoutinePtr> m_locked_ready;
+        std::atomic<uint32_t> m_locked_queued{0};
+        // Alternates between locked routines and the processor's, so that neither starves the other
+        bool m_locked_turn{false};
+        // Set while sleeping for work in Machines::pullRoutines(), queueLocked() then has to wake it up
+        std::atomic_bool m_idle{false};
+        // Without a processor but with locked routines to run, we wait in Machines::pullProcessor() for another
+        // executor to hand us its processor. Both guarded by Machines' processors lock
+        bool m_awaiting_processor{false};
+        ProcessorPtr m_handed_processor{};
+        // PerfCounters state: this thread's counters and their values at the last switch. m_perf_routine is set
+        // while the active routine's run is being counted, m_perf_switching while the way to the next one is
+        detail::PerfGroup m_perf;
+        PerfCounts m_perf_mark{};
+        uint64_t m_perf_idle_mark{0};
+        bool m_perf_routine{false};
+        bool m_perf_switching{false};
+
+        static inline thread_local Executor *t_current{nullptr};
 
     private:
+        // Runs on whichever executor resumed the routine, which need not be the one it switched out from
+        static void resumed();
+        // current() read behind a call, so that the compiler can't reuse the thread's TLS block from before a migration
+        static Executor *reread();
+        // Scheduler side of a switch out: tracing, and handing a parked routine over to its Parking
+        void switchedOut();
+        // Oldest runnable locked routine, null if none
+        RoutinePtr takeLocked();
+        // Read the counters as the active routine starts or stops running, and charge the difference
+        void perfSwitchIn(ExecutorMetrics &metrics);
+        void perfSwitchOut();
+
     public:
         Executor(int id);
         ~Executor();
@@ -35,6 +88,58 @@ namespace gocpp
 
         auto id() const { return m_id; }
 
+        // Executor owning the calling thread, null outside the runtime
+        static Executor *current() { return t_current; }
+        // current() with preemption turned off, so that the calling routine stays on it until
+        // setPreemptible(wasPreemptible). Reading current() and then turning preemption off is racy: a preemption
+        // in between resumes the routine on another executor, still holding the one it read
+        static Executor *pin(bool &wasPreemptible);
+
+        bool preemptible() const { return m_preemptible.load(std::memory_order_relaxed); }
+        void setPreemptible(bool preemptible)
+        {
+            m_preemptible.store(preemptible, std::memory_order_relaxed);
+            if (preemptible and m_preempt_requested.load(std::memory_order_relaxed))
+            {
+                // Held back while we were not preemptible
+                pthread_kill(pthread_self(), SIGUSR1);
+            }
+        }
+
+        // Asks the executor to switch its routine out for a higher class one, callable from any thread
+        void requestPreemption();
+        // Whether a requestPreemption() is pending, tells such signals from plain timer ticks
+        bool preemptionRequested() const { return m_preempt_requested.load(std::memory_order_relaxed); }
+        // Whether a timer tick should switch the active routine out, LATENCY routines get longer quanta
+        bool preemptOnTick();
+
+        Priority runningPriority() const { return Priority(m_running_priority.load(std::memory_order_relaxed)); }
+        // Changes the class of the active routine
+        void setActivePriority(Priority priority);
+
+        // Locks the active routine to this executor (nesting), see Machines::lockToExecutor()
+        void lockActiveRoutine();
+        void unlockActiveRoutine();
+        // Makes a routine locked to this executor runnable, from any thread. Returns whether we were
+        // sleeping for work, the caller then has to wake us
+        bool queueLocked(RoutinePtr &&routine);
+        // Runnable routines locked to this executor
+        uint32_t lockedQueued() const { return m_locked_queued.load(); }
+        void setIdle(bool idle) { m_idle = idle; }
+        // Bit of Machines' idle futex only this executor waits on, see Machines::pullRoutines()
+        uint32_t idleBit() const { return 1u << (m_id % 32); }
+        // See m_awaiting_processor
+        bool &awaitingProcessor() { return m_awaiting_processor; }
+        ProcessorPtr &handedProcessor() { return m_handed_processor; }
+
+        // Why the active routine last switched to the scheduler, one of the TRACE_* stop events
+        void setSwitchReason(TraceEventType reason) { m_switch_reason = reason; }
+
+        uint32_t activeRoutineId() const { return m_active_routine ? m_active_routine->id() : 0; }
+        Routine *activeRoutine() const { return m_active_routine.get(); }
+        // PerfCounters totals of the active routine, including its current run
+        PerfCounts activeRoutinePerf() const;
+
         void finalize() { m_running = false; }
 
         void yieldProcessor(ProcessorPtr& proc); 
@@ -43,9 +148,49 @@ namespace gocpp
 
         void switchToScheduler();
 
+        // Switches the active routine out without requeueing it, `parking` decides when it runs again
+        void park(Parking *parking);
+        // park() for a stackless task: it returns to the scheduler by suspending, which then hands it to `parking`
+        void parkTask(Parking *parking);
+        // Whether the active routine is a stackless task, which runs on the scheduler stack and can't switch out
+        bool inTask() const { return m_active_routine and m_active_routine->stackless(); }
+
+        // Leaves the scheduler stack and lets the executor thread return normally
+        void exitToThread();
+
         const ProcessorPtr &processor() { return m_processor; }
 
         void runActiveRoutine();
     };
 
+    /*
+    Scope in which the calling routine is neither preempted nor moved to another executor, for calls into
+    code that takes plain locks a routine switched out while holding them would deadlock its executor on:
+    a statically linked or in-program allocator, a C library's global lock. The runtime opens one around
+    its own allocation heavy paths (spawning routines). Like a RoutineMutex section it must stay short and
+    must not block or yield. Nests, and is a no-op outside of routines.
+    */
+    class NoPreemption
+    {
+        Executor *m_executor;
+        bool m_preemptible;
+
+    public:
+        NoPreemption()
+            : m_executor(Executor::pin(m_preemptible))
+        {
+        }
+
+        NoPreemption(const NoPreemption &) = delete;
+        NoPreemption &operator=(const NoPreemption &) = delete;
+
+        ~NoPreemption()
+        {
+            if (m_preemptible)
+            {
+                m_executor->setPreemptible(true);
+            }
+        }
+    };
+
 } // end namespace gocpp
\ No newline at end of file
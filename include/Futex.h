@@ -0,0 +1,50 @@
+#pragma once
+#include <atomic>
+#include <climits>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex words are plain 32 bit integers");
+
+        // Sleeps while `word` still holds `expected`. Returns on wake ups, signals and spuriously, callers re-check
+        inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, const timespec *timeout = nullptr)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+        }
+
+        inline void futexWake(std::atomic<uint32_t> &word, int count = INT_MAX)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+        }
+
+        // futexWait() that futexWakeBits() only wakes if their `bits` overlap, futexWake() always does.
+        // `deadline` is absolute, on CLOCK_MONOTONIC
+        inline void futexWaitBits(std::atomic<uint32_t> &word, uint32_t expected, uint32_t bits, const timespec *deadline = nullptr)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT_BITSET_PRIVATE, expected, deadline, nullptr, bits);
+        }
+
+        inline void futexWakeBits(std::atomic<uint32_t> &word, uint32_t bits, int count = INT_MAX)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE_BITSET_PRIVATE, count, nullptr, nullptr, bits);
+        }
+
+        // Same for words in memory shared with other processes
+        inline void futexWaitShared(std::atomic<uint32_t> &word, uint32_t expected, const timespec *timeout = nullptr)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+        }
+
+        inline void futexWakeShared(std::atomic<uint32_t> &word, int count = INT_MAX)
+        {
+            syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, count, nullptr, nullptr, 0);
+        }
+    }
+}
@@ -0,0 +1,313 @@
+#pragma once
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#include "Channel.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    template <typename T>
+    class Future;
+
+    namespace detail
+    {
+        // Future<void> carries a bool, so that it can still be read like a channel
+        template <typename T>
+        using FutureValue = std::conditional_t<std::is_void_v<T>, bool, T>;
+
+        template <typename T>
+        class FutureState
+        {
+            using Value = FutureValue<T>;
+
+            WaitQueue m_waiters;
+            // Everything below is protected by m_waiters.lock(), the flags can also be read without it
+            // (a Select checks readiness while holding it)
+            std::atomic_bool m_ready{false};
+            std::atomic_bool m_retrieved{false};
+            std::optional<Value> m_value;
+            std::exception_ptr m_error;
+            std::vector<std::function<void()>> m_continuations;
+
+            void complete()
+            {
+                std::vector<std::function<void()>> continuations;
+                {
+                    std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                    m_ready = true;
+                    m_waiters.notifyAll();
+                    continuations.swap(m_continuations);
+                }
+                for (auto &continuation : continuations)
+                {
+                    continuation();
+                }
+            }
+
+        public:
+            void set(Value &&value)
+            {
+                {
+                    std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                    m_value.emplace(std::move(value));
+                }
+                complete();
+            }
+
+            void fail(std::exception_ptr error)
+            {
+                {
+                    std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                    m_error = error;
+                }
+                complete();
+            }
+
+            bool ready() const { return m_ready; }
+            bool retrievable() const { return m_ready and not m_retrieved; }
+            bool retrieved() const { return m_retrieved; }
+
+            // False if `context` got cancelled first
+            bool wait(CancelContext *context = nullptr)
+            {
+                std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                while (not m_ready)
+                {
+                    if (not m_waiters.wait(guard, context))
+                    {
+                        return false;
+                    }
+                }
+                return true;
+            }
+
+            // Moves the result out, rethrows the routine's exception
+            Value take()
+            {
+                wait();
+                std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                if (m_retrieved)
+                {
+                    throw std::logic_error("Future result already retrieved!");
+                }
+                m_retrieved = true;
+                if (m_error)
+                {
+                    std::rethrow_exception(m_error);
+                }
+                return std::move(*m_value);
+            }
+
+            // Runs `fn` once the result is available, right away if it already is
+            void then(std::function<void()> fn)
+            {
+                {
+                    std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                    if (not m_ready)
+                    {
+                        m_continuations.emplace_back(std::move(fn));
+                        return;
+                    }
+                }
+                fn();
+            }
+
+            std::exception_ptr error()
+            {
+                std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+                return m_error;
+            }
+
+            WaitQueue &waiters() { return m_waiters; }
+        };
+    }
+
+    /*
+    Result of a routine started with goAsync(). get() parks the calling routine (or futex waits a plain
+    thread) until the routine returns, then hands over its result or rethrows its exception.
+    A Future is also a single value ReadChannel, so it can be waited on in a Select next to channels:
+        Case(future >= result, ...)      // Future<void>: Case(future.channel() >= ok, ...)
+    Like std::future the result can only be retrieved once.
+    */
+    template <typename T>
+    class Future : public ReadChannel<detail::FutureValue<T>>
+    {
+        template <typename>
+        friend class Future;
+
+        using Value = detail::FutureValue<T>;
+        std::shared_ptr<detail::FutureState<T>> m_state;
+
+    public:
+        Future() = default;
+        explicit Future(std::shared_ptr<detail::FutureState<T>> state)
+            : m_state(std::move(state))
+        {
+        }
+        Future(Future &&other) = default;
+        Future &operator=(Future &&other) = default;
+        Future(const Future &other) = delete;
+        Future &operator=(const Future &other) = delete;
+
+        bool valid() const { return m_state != nullptr; }
+        bool ready() const { return m_state->ready(); }
+        void wait() const { m_state->wait(); }
+        // Waits until ready, or until `context` is cancelled (returning false)
+        bool wait(CancelContext &context) const { return m_state->wait(&context); }
+
+        T get()
+        {
+            if constexpr (std::is_void_v<T>)
+            {
+                m_state->take();
+            }
+            else
+            {
+                return m_state->take();
+            }
+        }
+
+        // The interface a Select case works with
+        ReadChannel<Value> &channel() { return *this; }
+
+        bool readReady() override
+        {
+            return m_state->retrievable();
+        }
+
+        WaitQueue *readWaiters() override
+        {
+            return &m_state->waiters();
+        }
+
+        bool tryRead(Value &out) override
+        {
+            if (not m_state->retrievable())
+            {
+                return false;
+            }
+            out = m_state->take();
+            return true;
+        }
+
+        // Reads the result once, further reads behave like a closed channel
+        bool read(Value &out) override
+        {
+            if (m_state->retrieved())
+            {
+                return false;
+            }
+            out = m_state->take();
+            return true;
+        }
+
+        // Shared state, used by the combinators
+        const std::shared_ptr<detail::FutureState<T>> &state() const { return m_state; }
+    };
+
+    /*
+    Completes once every future has, with all their results in order. If any of them failed, the
+    combined future fails with the error of the first one (by position).
+    */
+    template <typename T>
+    auto whenAll(std::vector<Future<T>> futures)
+    {
+        using Result = std::conditional_t<std::is_void_v<T>, void, std::vector<T>>;
+        auto combined = std::make_shared<detail::FutureState<Result>>();
+        auto states = std::make_shared<std::vector<std::shared_ptr<detail::FutureState<T>>>>();
+        for (auto &future : futures)
+        {
+            states->push_back(future.state());
+        }
+        auto remaining = std::make_shared<std::atomic<size_t>>(states->size() + 1);
+        auto finish = [combined, states, remaining]()
+        {
+            if (--*remaining != 0)
+            {
+                return;
+            }
+            for (auto &state : *states)
+            {
+                if (auto error = state->error())
+                {
+                    combined->fail(error);
+                    return;
+                }
+            }
+            if constexpr (std::is_void_v<T>)
+            {
+                combined->set(true);
+            }
+            else
+            {
+                std::vector<T> results;
+                for (auto &state : *states)
+                {
+                    results.emplace_back(state->take());
+                }
+                combined->set(std::move(results));
+            }
+        };
+        for (auto &state : *states)
+        {
+            state->then(finish);
+        }
+        // Accounts for registration itself, so that an empty list completes right away
+        finish();
+        return Future<Result>(combined);
+    }
+
+    // Completes with the position of the first future to complete (successfully or not), results stay in `futures`
+    template <typename T>
+    Future<size_t> whenAny(std::vector<Future<T>> &futures)
+    {
+        auto combined = std::make_shared<detail::FutureState<size_t>>();
+        auto fired = std::make_shared<std::atomic_bool>(false);
+        for (size_t i = 0; i < futures.size(); i++)
+        {
+            futures[i].state()->then([combined, fired, i]()
+                                     {
+                                         if (not fired->exchange(true))
+                                         {
+                                             combined->set(size_t(i));
+                                         }
+                                     });
+        }
+        return Future<size_t>(combined);
+    }
+}
+
+// Like go(), but the routine's return value (or exception) comes back through a Future
+template <typename Fn, typename... Args>
+auto goAsync(Fn &&fn, Args &&...args)
+{
+    using Result = std::invoke_result_t<std::decay_t<Fn>, std::decay_t<Args>...>;
+    auto state = std::make_shared<gocpp::detail::FutureState<Result>>();
+    go([state, task = std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...)]() mutable
+       {
+           try
+           {
+               if constexpr (std::is_void_v<Result>)
+               {
+                   task();
+                   state->set(true);
+               }
+               else
+               {
+                   state->set(task());
+               }
+           }
+           catch (...)
+           {
+               state->fail(std::current_exception());
+           }
+       });
+    return gocpp::Future<Result>(state);
+}
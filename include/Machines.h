@@ -1,7 +1,6 @@
 #pragma once
 #include <vector>
 #include <algorithm>
-#include <unordered_map>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -10,12 +9,18 @@
 #include <time.h>
 #include <stdexcept>
 
+#include "BlockProfiler.h"
 #include "Processor.h"
 #include "Executor.h"
 #include "Defer.h"
+#include "Metrics.h"
 
 #define GO_END gocpp::Machines::getInstance()->finalize();
-#define BLOCKER(code) gocpp::Machines::yieldRoutinesAndProcessor();code;
+#define BLOCKER(code)                                                                       \
+    GO_TRACE(gocpp::TRACE_SYSCALL_ENTER, gocpp::Tracer::currentRoutine(), 0);               \
+    gocpp::Machines::yieldRoutinesAndProcessor();                                           \
+    code;                                                                                   \
+    GO_TRACE(gocpp::TRACE_SYSCALL_EXIT, gocpp::Tracer::currentRoutine(), 0);
 
 namespace gocpp
 {
@@ -26,58 +31,173 @@ namespace gocpp
     private:
         std::vector<RoutinePtr> m_routine_list;
         std::mutex m_routine_lock;
-        std::condition_variable m_new_routine_cv;
+        // Routines queued by threads without a processor (threads outside the runtime, routines in BLOCKER
+        // sections), newest first. Pushed without locks, moved to m_routine_list by takeGlobalRoutines()
+        std::atomic<Routine *> m_injected{nullptr};
+        // Event count idle executors sleep on in pullRoutines(), see notifyIdle()
+        std::atomic<uint32_t> m_idle_epoch{0};
+        std::atomic<uint32_t> m_idle_sleepers{0};
+        // LATENCY routines in m_routine_list, processors pull those without waiting for their periodic check
+        std::atomic<uint32_t> m_global_latency{0};
 
         std::vector<ProcessorPtr> m_idleProcessors;
+        // Processors beyond the current maxProcs(), kept for when it grows again
+        std::vector<ProcessorPtr> m_retiredProcessors;
         std::mutex m_processors_lock;
         std::condition_variable m_idle_proc_cv;
+        // m_idleProcessors.size(), checked without the lock before starting executors
+        std::atomic<uint32_t> m_idle_procs{0};
+        // Executors without a processor that have locked routines to run, oldest first, see handOffProcessor()
+        std::vector<Executor *> m_locked_waiting;
+        std::atomic<uint32_t> m_locked_waiting_count{0};
+        std::atomic<uint32_t> m_max_procs{1};
+        // Processor ids handed out so far, guarded by m_processors_lock
+        size_t m_created_procs{0};
 
         std::atomic_bool m_stopped{false};
 
-        std::unordered_map<std::thread::id, ExecutorPtr> m_executors;
+        // Started on demand and never stopped before finalize(). Fixed capacity, so that the first
+        // m_num_executors slots can be iterated without locks while another one is being started
+        std::vector<ExecutorPtr> m_executors;
+        std::atomic<size_t> m_num_executors{0};
 
         timer_t m_timer_id;
         struct sigevent m_sev;
         itimerspec m_ts;
         struct sigaction m_sa;
 
-        static inline std::thread::id s_main_thread_id;
         static inline std::atomic_uint16_t s_idle_count{0};
 
     private:
         Machines();
+        // Moves the global queue into `routines`, m_routine_lock must be held
+        bool takeGlobalRoutines(std::vector<RoutinePtr> &routines);
+        // Appends to the global queue, m_routine_lock must be held
+        void queueGlobalRoutine(RoutinePtr &&routine);
+        // Pushes the chain [first, last] (linked through nextInjected()) of one class onto m_injected, without locks
+        void inject(Routine *first, Routine *last, Priority priority);
+        // Wakes up to `count` executors sleeping in pullRoutines()
+        void notifyIdle(int count);
+        // Wakes `executor` alone if it sleeps in pullRoutines()
+        void notifyIdle(Executor &executor);
+        // Preempts an executor running a lower class routine than `priority`, if any
+        void preemptFor(Priority priority);
+        // Queues a runnable routine on the calling executor's processor if it has one, globally otherwise
+        void queueRoutine(RoutinePtr &&routine);
+        // Same for a whole batch of routines of one class, in a single queue operation
+        void queueRoutines(std::vector<RoutinePtr> &&routines);
+        // Starts another executor if processors sit idle while no executor is looking for work.
+        // `callerIdle` when called from a scheduler that counts as idle but just found work
+        void wakeExecutor(bool callerIdle = false);
+        // m_processors_lock must be held
+        void startExecutorLocked();
+        size_t executorCount() const { return m_num_executors.load(std::memory_order_acquire); }
+
         ~Machines();
 
     public:
         static Machines *getInstance();
         static auto &idleCount() { return s_idle_count; }
 
+        // Spawns a routine of the spawning routine's class
         template <typename Fn, typename... Args>
         void submitRoutine(Fn &&fn, Args &&...args)
         {
-            std::packaged_task<void(void)> task(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...));
-            auto routinePtr = std::make_unique<Routine>(std::move(task));
+            submitRoutineWithPriority(currentPriority(), std::forward<Fn>(fn), std::forward<Args>(args)...);
+        }
+
+        template <typename Fn, typename... Args>
+        void submitRoutineWithPriority(Priority priority, Fn &&fn, Args &&...args)
+        {
+            RoutinePtr routinePtr;
+            {
+                NoPreemption allocating;
+                routinePtr = std::make_unique<Routine>(detail::makeRoutineBody(std::bind(std::forward<Fn>(fn), std::forward<Args>(args)...)),
+                                                       priority);
+            }
+            Metrics::local().add(MetricCounter::ROUTINES_SPAWNED);
+            GO_TRACE(TRACE_SPAWN, routinePtr->id(), Tracer::currentRoutine());
+            queueRoutine(std::move(routinePtr));
+        }
 
-            auto threadId = std::this_thread::get_id();
-            if (threadId != s_main_thread_id)
+        // Spawns `count` routines calling fn(i) for i in [0, count), which share a single copy of `fn`.
+        // Routines are queued all at once and only get their stacks once an executor first runs them
+        template <typename Fn>
+        void submitBatch(size_t count, Fn &&fn)
+        {
+            if (count == 0)
             {
-                auto &executorPtr = Machines::getInstance()->m_executors[threadId];
-                executorPtr->processor()->submitRoutine(std::move(routinePtr));
+                return;
             }
-            else
+            auto shared = std::make_shared<std::decay_t<Fn>>(std::forward<Fn>(fn));
+            auto priority = currentPriority();
+            std::vector<RoutinePtr> routines;
+            routines.reserve(count);
+            for (size_t i = 0; i < count; i++)
             {
-                std::unique_lock<std::mutex> lock(m_routine_lock);
-                m_routine_list.emplace_back(std::move(routinePtr));
+                {
+                    NoPreemption allocating;
+                    routines.emplace_back(std::make_unique<Routine>(detail::makeRoutineBody([shared, i]()
+                                                                                            { (*shared)(i); }),
+                                                                    priority));
+                }
+                GO_TRACE(TRACE_SPAWN, routines.back()->id(), Tracer::currentRoutine());
             }
-            m_new_routine_cv.notify_one();
+            Metrics::local().add(MetricCounter::ROUTINES_SPAWNED, count);
+            queueRoutines(std::move(routines));
         }
 
+        // Spawns a stackless routine driving `task` (see Task.h)
+        void submitTask(std::unique_ptr<detail::Resumable> &&task, Priority priority);
+
+        // Class of the calling routine, NORMAL outside of routines
+        static Priority currentPriority();
+        // Moves the calling routine to another class, routines it spawns from now on inherit it
+        static void setCurrentPriority(Priority priority);
+
+        uint32_t globalLatencyRoutines() const { return m_global_latency.load(std::memory_order_relaxed); }
+
+        // Number of processors, ie. of routines running in parallel (Go's GOMAXPROCS)
+        size_t maxProcs() const { return m_max_procs.load(std::memory_order_relaxed); }
+        // Changes the number of processors (clamped to [1, MAX_PROCS]) and returns the previous one.
+        // Processors beyond the new count are retired by their executors at their next scheduling point,
+        // their routines move to the remaining ones
+        size_t setMaxProcs(size_t procs);
+        // Processor count the runtime starts with: the CPU quota of our cgroup (v1 or v2) and the CPU
+        // affinity mask, unless overridden by the GOMAXPROCS environment variable
+        static size_t detectProcs();
+
+        // Makes a parked routine runnable again: on the calling executor's processor if it has one,
+        // on the global queue otherwise. Locked routines go back to the executor they are locked to
+        static void readyRoutine(RoutinePtr &&routine);
+
+        // Keeps the calling routine on its current executor thread until the matching unlockFromExecutor()
+        // (Go's runtime.LockOSThread), for thread affine state: thread locals, OpenGL contexts, per thread
+        // handles of C libraries. Nests like a counter. It is never stolen and always resumes on that executor,
+        // which keeps running other routines in between, taking turns with its locked ones. A routine finishing
+        // while locked just unlocks. No-ops outside of routines
+        static void lockToExecutor();
+        static void unlockFromExecutor();
+
         void pullProcessor(ProcessorPtr &processor);
+        // Whether an executor waits in pullProcessor() for a processor to run its locked routines on
+        bool lockedWaiting() const { return m_locked_waiting_count.load(std::memory_order_relaxed) != 0; }
+        // Hands `processor` to the executor waiting longest for one to run its locked routines (Go's startlockedm).
+        // Returns false, keeping it, if none is waiting
+        bool handOffProcessor(ProcessorPtr &processor);
+        // Puts a processor released by its executor back in the idle (or retired) list, its routines go global
+        void releaseProcessor(ProcessorPtr &&processor);
 
         void pullRoutines(std::vector<RoutinePtr> &routines, int stealerId, bool coreIdle);
 
+        // Non blocking grab of whatever sits in the global queue
+        void pullGlobalRoutines(std::vector<RoutinePtr> &routines);
+
         void finalize();
 
+        // Aggregated scheduler counters and latency histograms, taken without pausing any executor
+        RuntimeMetrics metricsSnapshot();
+
         bool running() { return not m_stopped; }
 
         static void runRoutine();
@@ -85,7 +205,7 @@ namespace gocpp
 
         static void yieldToScheduler();
         static void yieldRoutinesAndProcessor();
-        static void sigUsrHandler(int signal);
+        static void sigUsrHandler(int signal, siginfo_t *si, void *uc);
         static void timerInterruptHandler(int sig, siginfo_t *si, void *uc);
     };
     template <typename Lock>
@@ -97,12 +217,22 @@ namespace gocpp
         SpinYieldLock(Lock &lock)
             : m_lock(lock)
         {
+            // Only taken once contended with the BlockProfiler running
+            uint64_t contended = 0;
             while (true)
             {
                 if (m_lock.try_lock())
                 {
+                    if (contended != 0)
+                    {
+                        BlockProfiler::record(BLOCK_LOCK, &m_lock, nowNanos() - contended);
+                    }
                     return;
                 }
+                if (contended == 0 and BlockProfiler::enabled())
+                {
+                    contended = nowNanos();
+                }
                 Machines::yieldToScheduler();
             }
         }
@@ -119,3 +249,17 @@ void go(Fn &&fn, Args &&...args)
 {
     gocpp::Machines::getInstance()->submitRoutine(std::forward<Fn>(fn), std::forward<Args>(args)...);
 }
+
+// Spawns `count` routines running fn(i) for i in [0, count), much cheaper than as many go() calls
+template <typename Fn>
+void goBatch(size_t count, Fn &&fn)
+{
+    gocpp::Machines::getInstance()->submitBatch(count, std::forward<Fn>(fn));
+}
+
+// Like go, for a routine of the given class rather than the spawning routine's
+template <typename Fn, typename... Args>
+void goWithPriority(gocpp::Priority priority, Fn &&fn, Args &&...args)
+{
+    gocpp::Machines::getInstance()->submitRoutineWithPriority(priority, std::forward<Fn>(fn), std::forward<Args>(args)...);
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Consts.h"
+
+namespace gocpp
+{
+    // Monotonic timestamp used by all the runtime instrumentation
+    inline uint64_t nowNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Counters kept per executor, indices into ExecutorMetrics::m_counters
+    enum MetricCounter : size_t
+    {
+        CONTEXT_SWITCHES = 0,
+        PREEMPTIONS,
+        STEALS_ATTEMPTED,
+        STEALS_SUCCEEDED,
+        GLOBAL_QUEUE_PULLS,
+        ROUTINES_SPAWNED,
+        ROUTINES_FINISHED,
+        CHANNEL_PARKS,
+        IDLE_NANOS,
+        SLAB_ALLOCS,       // served by a slab cache
+        SLAB_MISSES,       // of which had to refill from remote frees or a new chunk
+        SLAB_REMOTE_FREES, // freed away from the owning processor's executor
+        SLAB_LARGE_ALLOCS, // too big for the slab caches, went to the heap
+        SLAB_CHUNK_BYTES,  // slab chunk memory mapped so far, chunks are never unmapped
+        ROUTINES_LOCKED,   // locked to the executor, see Machines::lockToExecutor()
+        ROUTINES_UNLOCKED, // unlocked again, or finished while locked
+        SPILLED_BYTES,     // appended to SpillChannel segment files
+        REMOTE_BATCHES,    // DATA frames sent by RemoteChannels
+        REMOTE_RECORDS,    // values they carried
+        NUM_METRIC_COUNTERS
+    };
+
+    static const char *const METRIC_COUNTER_NAMES[] = {
+        "context_switches",
+        "preemptions",
+        "steals_attempted",
+        "steals_succeeded",
+        "global_queue_pulls",
+        "routines_spawned",
+        "routines_finished",
+        "channel_parks",
+        "idle_nanos",
+        "slab_allocs",
+        "slab_misses",
+        "slab_remote_frees",
+        "slab_large_allocs",
+        "slab_chunk_bytes",
+        "routines_locked",
+        "routines_unlocked",
+        "spilled_bytes",
+        "remote_batches",
+        "remote_records",
+    };
+
+    // Per thread counters PerfCounters reads at every routine switch, see PerfCounters.h
+    enum PerfCounter : size_t
+    {
+        PERF_CYCLES = 0,
+        PERF_INSTRUCTIONS,
+        PERF_LLC_MISSES,
+        PERF_NANOS, // wall clock, always available
+        NUM_PERF_COUNTERS
+    };
+
+    static const char *const PERF_COUNTER_NAMES[] = {
+        "cycles",
+        "instructions",
+        "llc_misses",
+        "nanos",
+    };
+
+    using PerfCounts = std::array<uint64_t, NUM_PERF_COUNTERS>;
+
+    // Plain copy of a LatencyHistogram, safe to merge and query off the hot path
+    struct HistogramSnapshot
+    {
+        std::vector<uint64_t> m_counts;
+        uint64_t m_count{0};
+        uint64_t m_sum{0};
+        uint64_t m_max{0};
+
+        void merge(const HistogramSnapshot &other);
+        double mean() const { return m_count ? double(m_sum) / m_count : 0.0; }
+        // Upper bound (in ns) of the bucket holding the given percentile in [0, 100]
+        uint64_t percentile(double pct) const;
+    };
+
+    /*
+    HDR style log-linear histogram of nanosecond durations.
+    Every power of two is split into 2^SUB_BUCKET_BITS linear sub buckets, which bounds the relative
+    error of any recorded value to 1/2^SUB_BUCKET_BITS while covering the whole uint64_t range in a
+    fixed array. Recording is a couple of relaxed atomic adds, so readers never stop the writer.
+    */
+    class LatencyHistogram
+    {
+    public:
+        static constexpr size_t SUB_BUCKET_BITS = 3;
+        static constexpr size_t SUB_BUCKETS = size_t(1) << SUB_BUCKET_BITS;
+        static constexpr size_t NUM_BUCKETS = (64 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+        static size_t bucketIndex(uint64_t value)
+        {
+            if (value < SUB_BUCKETS)
+            {
+                return value;
+            }
+            size_t magnitude = 63 - __builtin_clzll(value);
+            size_t sub = (value >> (magnitude - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+            return ((magnitude - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + sub;
+        }
+
+        // Largest value that falls in the given bucket
+        static uint64_t bucketUpperBound(size_t index);
+
+        void record(uint64_t value)
+        {
+            m_counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+            m_count.fetch_add(1, std::memory_order_relaxed);
+            m_sum.fetch_add(value, std::memory_order_relaxed);
+            if (value > m_max.load(std::memory_order_relaxed))
+            {
+                m_max.store(value, std::memory_order_relaxed);
+            }
+        }
+
+        HistogramSnapshot snapshot() const;
+
+    private:
+        std::array<std::atomic<uint64_t>, NUM_BUCKETS> m_counts{};
+        std::atomic<uint64_t> m_count{0};
+        std::atomic<uint64_t> m_sum{0};
+        std::atomic<uint64_t> m_max{0};
+    };
+
+    /*
+    Instrumentation owned by a single executor thread. Each executor binds its own instance in
+    thread local storage, so the hot path never touches a cache line shared with another executor.
+    Threads outside the runtime (main thread, foreign threads) share one extra instance.
+    */
+    struct alignas(64) ExecutorMetrics
+    {
+        int m_executor{-1};
+        std::array<std::atomic<uint64_t>, NUM_METRIC_COUNTERS> m_counters{};
+        // Time a routine spent runnable in a queue before an executor switched to it
+        LatencyHistogram m_sched_latency;
+        // Time a routine spent blocked inside a channel read/write
+        LatencyHistogram m_channel_block;
+        // PerfCounters deltas of the routines run here, by label (see Profiler::setLabel())
+        std::array<std::array<std::atomic<uint64_t>, NUM_PERF_COUNTERS>, PERF_LABELS> m_perf_labels{};
+        // PerfCounters deltas spent in the scheduler between two routines, idle sleeps excluded
+        std::array<std::atomic<uint64_t>, NUM_PERF_COUNTERS> m_perf_switching{};
+
+        void add(MetricCounter counter, uint64_t value = 1)
+        {
+            m_counters[counter].fetch_add(value, std::memory_order_relaxed);
+        }
+
+        void addPerf(std::array<std::atomic<uint64_t>, NUM_PERF_COUNTERS> &totals, const PerfCounts &delta)
+        {
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                totals[i].fetch_add(delta[i], std::memory_order_relaxed);
+            }
+        }
+    };
+
+    struct ExecutorMetricsSnapshot
+    {
+        int m_executor{-1};
+        std::array<uint64_t, NUM_METRIC_COUNTERS> m_counters{};
+        HistogramSnapshot m_sched_latency;
+        HistogramSnapshot m_channel_block;
+        // Indexed by label, up to the last one that counted anything
+        std::vector<PerfCounts> m_perf_labels;
+        PerfCounts m_perf_switching{};
+
+        void merge(const ExecutorMetricsSnapshot &other);
+        // Share of slab allocations served straight from the local free lists
+        double slabHitRate() const
+        {
+            auto allocs = m_counters[SLAB_ALLOCS];
+            return allocs ? 1.0 - double(m_counters[SLAB_MISSES]) / allocs : 1.0;
+        }
+        // Routines currently locked to the executor. Both counters are bumped by the executor a routine is
+        // locked to, so per executor this is exact
+        uint64_t lockedRoutines() const { return m_counters[ROUTINES_LOCKED] - m_counters[ROUTINES_UNLOCKED]; }
+    };
+
+    struct RuntimeMetrics
+    {
+        // One entry per executor plus one (executor -1) for threads outside the runtime
+        std::vector<ExecutorMetricsSnapshot> m_executors;
+        // Sum over all the above
+        ExecutorMetricsSnapshot m_total;
+        // Names of the labels m_perf_labels is indexed by, "" for unlabelled
+        std::vector<std::string> m_labels;
+    };
+
+    class Metrics
+    {
+        static inline std::mutex s_lock;
+        static inline std::vector<std::unique_ptr<ExecutorMetrics>> s_executors;
+        static inline ExecutorMetrics s_external;
+        static inline thread_local ExecutorMetrics *t_local{nullptr};
+
+    public:
+        // Binds fresh metrics storage for executor `id` to the calling thread
+        static void bindExecutor(int id);
+
+        // Metrics of the calling thread
+        static ExecutorMetrics &local()
+        {
+            return t_local ? *t_local : s_external;
+        }
+
+        // Reads every executor's metrics with relaxed loads, executors keep running meanwhile
+        static RuntimeMetrics snapshot();
+    };
+}
@@ -0,0 +1,257 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Machines.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    // Half open index range [m_begin, m_end)
+    struct Range
+    {
+        size_t m_begin{0};
+        size_t m_end{0};
+
+        size_t size() const { return m_end > m_begin ? m_end - m_begin : 0; }
+        bool empty() const { return size() == 0; }
+    };
+
+    namespace detail
+    {
+        /*
+        Shared state of one parallel loop. Every participant (the calling routine plus up to maxProcs() - 1
+        helper routines spawned on the caller's processor) owns a deque of pending ranges. A participant
+        splits the range it holds in halves down to the grain size, pushing the upper halves on the back of
+        its deque and working on the lower one, so its own pops stay depth first and cache friendly.
+        Idle participants steal from the front of other deques, where the largest, earliest split ranges sit.
+        With nothing left to steal they park until a range is pushed or the last one is done.
+        */
+        class ParallelLoop
+        {
+            struct alignas(64) Participant
+            {
+                RoutineMutex m_lock;
+                std::deque<Range, SlabAllocator<Range>> m_ranges;
+            };
+
+            std::unique_ptr<Participant[]> m_participants;
+            const size_t m_count;
+            const size_t m_grain;
+            const std::function<void(const Range &)> m_body;
+            std::atomic<size_t> m_remaining;
+            // Ranges sitting in the deques, idle participants only wait while it's 0
+            std::atomic<size_t> m_queued{0};
+            std::atomic_bool m_failed{false};
+            RoutineMutex m_error_lock;
+            std::exception_ptr m_error;
+            // Idle participants and the joiner
+            WaitQueue m_idle;
+
+            void push(size_t self, const Range &range)
+            {
+                {
+                    SpinYieldLock<RoutineMutex> lock(m_participants[self].m_lock);
+                    m_participants[self].m_ranges.push_back(range);
+                }
+                m_queued++;
+                m_idle.wakeOne();
+            }
+
+            bool pop(size_t self, Range &range)
+            {
+                SpinYieldLock<RoutineMutex> lock(m_participants[self].m_lock);
+                auto &ranges = m_participants[self].m_ranges;
+                if (ranges.empty())
+                {
+                    return false;
+                }
+                range = ranges.back();
+                ranges.pop_back();
+                m_queued--;
+                return true;
+            }
+
+            bool steal(size_t self, Range &range)
+            {
+                for (size_t i = 1; i < m_count; i++)
+                {
+                    auto &victim = m_participants[(self + i) % m_count];
+                    SpinYieldLock<RoutineMutex> lock(victim.m_lock);
+                    if (not victim.m_ranges.empty())
+                    {
+                        range = victim.m_ranges.front();
+                        victim.m_ranges.pop_front();
+                        m_queued--;
+                        return true;
+                    }
+                }
+                return false;
+            }
+
+            void execute(const Range &range)
+            {
+                // After a failure the remaining ranges are only accounted for, not run
+                if (not m_failed)
+                {
+                    try
+                    {
+                        m_body(range);
+                    }
+                    catch (...)
+                    {
+                        std::unique_lock<RoutineMutex> lock(m_error_lock);
+                        if (not m_error)
+                        {
+                            m_error = std::current_exception();
+                        }
+                        m_failed = true;
+                    }
+                }
+                if ((m_remaining -= range.size()) == 0)
+                {
+                    // Last one done, release the joiner and whoever is still idle
+                    m_idle.wakeAll();
+                }
+            }
+
+            // Parks until a range can be stolen or the loop is done
+            void idle()
+            {
+                std::unique_lock<RoutineMutex> guard(m_idle.lock());
+                m_idle.waitUnless(guard, [this]()
+                                  { return m_queued != 0 or done(); });
+            }
+
+        public:
+            ParallelLoop(const Range &range, size_t grain, size_t participants, std::function<void(const Range &)> body)
+                : m_participants(new Participant[participants]), m_count(participants), m_grain(std::max<size_t>(grain, 1)),
+                  m_body(std::move(body)), m_remaining(range.size())
+            {
+                m_participants[0].m_ranges.push_back(range);
+                m_queued++;
+            }
+
+            bool done() const { return m_remaining == 0; }
+
+            // Works on the loop as participant `self` until no range is left anywhere
+            void run(size_t self)
+            {
+                Range range;
+                while (not done())
+                {
+                    if (not pop(self, range) and not steal(self, range))
+                    {
+                        // Everything left is being worked on, wait for its holders to split it or finish
+                        idle();
+                        continue;
+                    }
+                    while (range.size() > m_grain)
+                    {
+                        size_t middle = range.m_begin + range.size() / 2;
+                        push(self, Range{middle, range.m_end});
+                        range.m_end = middle;
+                    }
+                    execute(range);
+                }
+            }
+
+            // Called by the loop's caller once it ran out of work itself, parks until the last range is done
+            void wait()
+            {
+                {
+                    std::unique_lock<RoutineMutex> guard(m_idle.lock());
+                    m_idle.waitUnless(guard, [this]()
+                                      { return done(); });
+                }
+                if (m_error)
+                {
+                    std::rethrow_exception(m_error);
+                }
+            }
+        };
+
+        inline void parallelRun(const Range &range, size_t grain, std::function<void(const Range &)> body)
+        {
+            grain = std::max<size_t>(grain, 1);
+            size_t chunks = (range.size() + grain - 1) / grain;
+            size_t participants = std::max<size_t>(1, std::min<size_t>(Machines::getInstance()->maxProcs(), chunks));
+            if (participants == 1)
+            {
+                if (not range.empty())
+                {
+                    body(range);
+                }
+                return;
+            }
+            auto loop = std::make_shared<ParallelLoop>(range, grain, participants, std::move(body));
+            // Helpers land on the caller's processor queue, idle executors steal them from there
+            for (size_t i = 1; i < participants; i++)
+            {
+                go([loop, i]()
+                   { loop->run(i); });
+            }
+            loop->run(0);
+            loop->wait();
+        }
+    }
+
+    /*
+    Runs `fn` over `range` on the routine scheduler, splitting it recursively down to `grain` indices.
+    `fn` either takes a Range (called once per chunk) or a size_t index (called once per index).
+    The caller works on the loop too and only returns once every index is done. The first exception
+    thrown by `fn` stops further chunks and is rethrown here.
+    */
+    template <typename Fn>
+    void parallel_for(const Range &range, size_t grain, Fn &&fn)
+    {
+        if constexpr (std::is_invocable_v<Fn &, const Range &>)
+        {
+            detail::parallelRun(range, grain, [&fn](const Range &chunk)
+                                { fn(chunk); });
+        }
+        else
+        {
+            detail::parallelRun(range, grain, [&fn](const Range &chunk)
+                                {
+                                    for (size_t i = chunk.m_begin; i < chunk.m_end; i++)
+                                    {
+                                        fn(i);
+                                    }
+                                });
+        }
+    }
+
+    /*
+    Reduces `range` in parallel: `body(chunk, identity)` folds one chunk into a partial result and
+    `combine(left, right)` merges partials. Partials are combined in index order, so `combine` only
+    needs to be associative, not commutative, and the result is deterministic for a given grain.
+    */
+    template <typename T, typename Body, typename Combine>
+    T parallel_reduce(const Range &range, size_t grain, T identity, Body &&body, Combine &&combine)
+    {
+        RoutineMutex lock;
+        std::vector<std::pair<size_t, T>> partials;
+        detail::parallelRun(range, grain, [&](const Range &chunk)
+                            {
+                                T partial = body(chunk, identity);
+                                SpinYieldLock<RoutineMutex> guard(lock);
+                                partials.emplace_back(chunk.m_begin, std::move(partial));
+                            });
+        std::sort(partials.begin(), partials.end(), [](const auto &a, const auto &b)
+                  { return a.first < b.first; });
+        T result = std::move(identity);
+        for (auto &[begin, partial] : partials)
+        {
+            result = combine(std::move(result), std::move(partial));
+        }
+        return result;
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+#include "Metrics.h"
+
+struct perf_event_mmap_page;
+
+namespace gocpp
+{
+    namespace detail
+    {
+        /*
+        Hardware counters of one thread, opened and read by that thread only. The counters form one perf event
+        group, each with its first page mapped: where the kernel lets user space read the PMU (cap_user_rdpmc) a read
+        is one rdpmc per counter under the page's sequence lock, otherwise a single read() of the whole group.
+        Counters the machine or perf_event_paranoid don't allow (eg. in most VMs) stay at 0.
+        */
+        class PerfGroup
+        {
+            // The hardware counters, nanos come from the clock
+            static constexpr size_t NUM_EVENTS = PERF_NANOS;
+
+            int m_fds[NUM_EVENTS];
+            perf_event_mmap_page *m_pages[NUM_EVENTS];
+            // Counter of each group member, in the order the group's read() returns them
+            PerfCounter m_members[NUM_EVENTS];
+            size_t m_count{0};
+            bool m_opened{false};
+
+            bool readMapped(PerfCounts &out) const;
+
+        public:
+            PerfGroup();
+            ~PerfGroup();
+            PerfGroup(const PerfGroup &) = delete;
+            PerfGroup &operator=(const PerfGroup &) = delete;
+
+            // Opens whichever counters the calling thread may count, only the first call does anything
+            void open();
+            bool opened() const { return m_opened; }
+            bool counts(PerfCounter counter) const;
+            void read(PerfCounts &out) const;
+        };
+    }
+
+    /*
+    Opt in accounting of hardware counters (cycles, instructions, last level cache misses) and wall clock time to
+    routines. While running, every executor reads its thread's counters at each routine switch and charges the
+    difference to the routine that just ran and to its label (Profiler::setLabel()), and what the scheduler spent
+    between two routines to switching. Label and switching totals come with the metrics snapshot, indexed like
+    RuntimeMetrics::m_labels, a routine's own totals from routine():
+        gocpp::PerfCounters::start();
+        ...
+        auto metrics = Machines::getInstance()->metricsSnapshot();
+        metrics.m_total.m_perf_labels[i][PERF_LLC_MISSES]   // misses of the routines labelled metrics.m_labels[i]
+    Reads take a few rdpmc instructions where the kernel allows them and a read() otherwise. Counters the process
+    can't open (see supported()) stay at 0.
+    */
+    class PerfCounters
+    {
+        static inline std::atomic_bool s_enabled{false};
+
+    public:
+        static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+        // Starts accounting, returns false if it is already running
+        static bool start();
+        static void stop();
+
+        // Whether the process may count `counter`, PERF_NANOS always is
+        static bool supported(PerfCounter counter);
+
+        // Totals of the calling routine so far, its current run included. All 0 outside routines
+        static PerfCounts routine();
+    };
+}
@@ -0,0 +1,520 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Channel.h"
+
+namespace gocpp
+{
+    struct StageOptions
+    {
+        // Number of routines running the stage
+        size_t m_parallelism{1};
+        // Emit results in the order the stage received its inputs, even with several routines
+        bool m_ordered{false};
+        // Capacity of the channel feeding the next stage, bounds how far ahead this stage may run
+        size_t m_buffer{64};
+    };
+
+    struct StageStats
+    {
+        std::string m_name;
+        size_t m_parallelism{1};
+        std::atomic<uint64_t> m_in{0};
+        std::atomic<uint64_t> m_out{0};
+        // Values waiting in the stage's input channel
+        std::function<size_t()> m_queue_depth;
+    };
+
+    struct StageReport
+    {
+        std::string m_name;
+        size_t m_parallelism;
+        uint64_t m_in, m_out;
+        size_t m_queue_depth;
+        // Outputs per second since the pipeline was created
+        double m_throughput;
+    };
+
+    namespace detail
+    {
+        template <typename T>
+        struct Envelope
+        {
+            uint64_t m_sequence{0};
+            // Empty only in a default constructed envelope read into, T needn't be default constructible
+            std::optional<T> m_value;
+        };
+
+        // Receives what a fused stage produces, one instance per routine of the stage
+        template <typename T>
+        struct StageSink
+        {
+            virtual ~StageSink() = default;
+            virtual void push(T &&value) = 0;
+            // Everything produced from input `sequence` has been pushed
+            virtual void complete(uint64_t sequence) = 0;
+        };
+
+        template <typename T>
+        using SinkFactory = std::function<std::unique_ptr<StageSink<T>>()>;
+
+        // Applies one stateless operation and forwards its results, this is what fusing stages boils down to
+        template <typename T, typename V>
+        class OperationSink : public StageSink<T>
+        {
+            std::unique_ptr<StageSink<V>> m_next;
+            const std::function<void(T &&, StageSink<V> &)> &m_operation;
+
+        public:
+            OperationSink(std::unique_ptr<StageSink<V>> next, const std::function<void(T &&, StageSink<V> &)> &operation)
+                : m_next(std::move(next)), m_operation(operation)
+            {
+            }
+
+            void push(T &&value) override
+            {
+                m_operation(std::move(value), *m_next);
+            }
+
+            void complete(uint64_t sequence) override
+            {
+                m_next->complete(sequence);
+            }
+        };
+
+        /*
+        End of a stage, hands values to `deliver` (the next stage's channel or the user's sink).
+        Ordered stages park each input's results until all earlier inputs are done. Whoever completes
+        the oldest missing input takes the run that became ready and delivers it outside the lock, as
+        delivering may block on the next stage's channel. Runs are delivered in the order they were taken.
+        */
+        template <typename T>
+        class StageOutput
+        {
+            const bool m_ordered;
+            StageStats &m_stats;
+            std::function<void(T &&)> m_deliver;
+            std::function<void()> m_finish;
+            std::atomic<size_t> m_running;
+
+            // Its lock guards everything below, routines wait in it for their run's turn to be delivered
+            WaitQueue m_turns;
+            uint64_t m_next{0};
+            std::map<uint64_t, std::vector<T>> m_parked;
+            // Runs taken so far and runs delivered so far
+            uint64_t m_taken{0};
+            uint64_t m_delivered{0};
+
+            void deliver(T &&value)
+            {
+                m_deliver(std::move(value));
+                m_stats.m_out++;
+            }
+
+        public:
+            StageOutput(const StageOptions &options, StageStats &stats, std::function<void(T &&)> deliver, std::function<void()> finish)
+                : m_ordered(options.m_ordered and options.m_parallelism > 1), m_stats(stats),
+                  m_deliver(std::move(deliver)), m_finish(std::move(finish)), m_running(options.m_parallelism)
+            {
+            }
+
+            class Sink : public StageSink<T>
+            {
+                StageOutput &m_output;
+                std::vector<T> m_results;
+
+            public:
+                Sink(StageOutput &output) : m_output(output) {}
+
+                void push(T &&value) override
+                {
+                    if (m_output.m_ordered)
+                    {
+                        m_results.emplace_back(std::move(value));
+                    }
+                    else
+                    {
+                        m_output.deliver(std::move(value));
+                    }
+                }
+
+                void complete(uint64_t sequence) override
+                {
+                    if (not m_output.m_ordered)
+                    {
+                        return;
+                    }
+                    std::vector<T> ready;
+                    auto &turns = m_output.m_turns;
+                    {
+                        std::unique_lock<RoutineMutex> guard(turns.lock());
+                        auto &parked = m_output.m_parked;
+                        parked.emplace(sequence, std::move(m_results));
+                        m_results.clear();
+                        while (not parked.empty() and parked.begin()->first == m_output.m_next)
+                        {
+                            auto &values = parked.begin()->second;
+                            ready.insert(ready.end(), std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()));
+                            parked.erase(parked.begin());
+                            m_output.m_next++;
+                        }
+                        if (ready.empty())
+                        {
+                            return;
+                        }
+                        auto turn = m_output.m_taken++;
+                        while (m_output.m_delivered != turn)
+                        {
+                            turns.wait(guard);
+                        }
+                    }
+                    for (auto &value : ready)
+                    {
+                        m_output.deliver(std::move(value));
+                    }
+                    std::unique_lock<RoutineMutex> guard(turns.lock());
+                    m_output.m_delivered++;
+                    turns.notifyAll();
+                }
+            };
+
+            // Called by each of the stage's routines once its input is exhausted
+            void routineDone()
+            {
+                if (--m_running == 0)
+                {
+                    m_finish();
+                }
+            }
+        };
+    }
+
+    class Pipeline;
+
+    /*
+    Output of a pipeline built so far. Consecutive stateless operations (map, filter, flatMap, sink)
+    with the same parallelism and ordering are fused and run back to back in the same routines; any
+    other boundary materializes the pending stage behind a bounded channel, which is where the
+    backpressure between stages comes from.
+    */
+    template <typename T>
+    class Flow
+    {
+        template <typename>
+        friend class Flow;
+        friend class Pipeline;
+
+        // Spawns the pending stage's routines, every value they produce goes through the sinks built by `factory`
+        using Start = std::function<void(const StageOptions &, StageStats &, detail::SinkFactory<T>, std::function<void()>)>;
+
+        Pipeline *m_pipeline;
+        Start m_start;
+        std::string m_name;
+        // Options of the pending stage, a flow reading straight from a channel takes on the next stage's options
+        std::shared_ptr<StageOptions> m_options;
+        std::function<size_t()> m_queue_depth;
+
+        Flow(Pipeline *pipeline, Start start, std::string name, std::shared_ptr<StageOptions> options, std::function<size_t()> depth)
+            : m_pipeline(pipeline), m_start(std::move(start)), m_name(std::move(name)), m_options(std::move(options)), m_queue_depth(std::move(depth))
+        {
+        }
+
+        bool fusible(const StageOptions &options) const
+        {
+            return not m_options or (m_options->m_parallelism == options.m_parallelism and
+                                     (m_options->m_ordered == options.m_ordered or options.m_parallelism == 1));
+        }
+
+        // Runs the pending stage with `options`, handing its output to `deliver`
+        void start(const StageOptions &options, std::function<void(T &&)> deliver, std::function<void()> finish);
+
+        // Runs the pending stage into a fresh channel and returns a flow reading from it
+        Flow materialize()
+        {
+            auto options = m_options ? *m_options : StageOptions{};
+            auto channel = std::make_shared<Channel<detail::Envelope<T>>>(options.m_buffer);
+            auto sequence = std::make_shared<std::atomic<uint64_t>>(0);
+            start(
+                options, [channel, sequence](T &&value)
+                { channel->write(detail::Envelope<T>{(*sequence)++, std::optional<T>(std::move(value))}); },
+                [channel]()
+                { channel->close(); });
+            return fromChannel(m_pipeline, channel);
+        }
+
+        static Flow fromChannel(Pipeline *pipeline, std::shared_ptr<Channel<detail::Envelope<T>>> channel)
+        {
+            auto start = [channel](const StageOptions &options, StageStats &stats, detail::SinkFactory<T> factory, std::function<void()> done)
+            {
+                for (size_t i = 0; i < options.m_parallelism; i++)
+                {
+                    go([channel, factory, done, &stats]()
+                       {
+                           auto sink = factory();
+                           detail::Envelope<T> item;
+                           while (*channel >> item)
+                           {
+                               stats.m_in++;
+                               sink->push(std::move(*item.m_value));
+                               sink->complete(item.m_sequence);
+                           }
+                           sink.reset();
+                           done();
+                       });
+                }
+            };
+            return Flow(pipeline, start, "", nullptr, [channel]()
+                        { return channel->size(); });
+        }
+
+        template <typename V>
+        Flow<V> then(const std::string &name, const StageOptions &options, std::function<void(T &&, detail::StageSink<V> &)> operation)
+        {
+            if (not fusible(options))
+            {
+                return materialize().template then<V>(name, options, std::move(operation));
+            }
+            auto previous = m_start;
+            // `operation` has to outlive the stage's routines, the start closure keeps it alive
+            auto keep = std::make_shared<std::function<void(T &&, detail::StageSink<V> &)>>(std::move(operation));
+            auto bound = [previous, keep](const StageOptions &stageOptions, StageStats &stats, detail::SinkFactory<V> next, std::function<void()> done)
+            {
+                previous(
+                    stageOptions, stats, [next, keep]()
+                    { return std::make_unique<detail::OperationSink<T, V>>(next(), *keep); },
+                    done);
+            };
+            return Flow<V>(m_pipeline, bound, m_name.empty() ? name : m_name + "+" + name,
+                           std::make_shared<StageOptions>(options), m_queue_depth);
+        }
+
+    public:
+        template <typename Fn, typename V = std::decay_t<std::invoke_result_t<Fn, T &&>>>
+        Flow<V> map(Fn fn, StageOptions options = {})
+        {
+            return then<V>("map", options, [fn](T &&value, detail::StageSink<V> &out)
+                           { out.push(fn(std::move(value))); });
+        }
+
+        template <typename Fn>
+        Flow<T> filter(Fn predicate, StageOptions options = {})
+        {
+            return then<T>("filter", options, [predicate](T &&value, detail::StageSink<T> &out)
+                           {
+                               if (predicate(value))
+                               {
+                                   out.push(std::move(value));
+                               }
+                           });
+        }
+
+        // `fn` returns a container, each of its elements becomes one output
+        template <typename Fn, typename C = std::decay_t<std::invoke_result_t<Fn, T &&>>, typename V = typename C::value_type>
+        Flow<V> flatMap(Fn fn, StageOptions options = {})
+        {
+            return then<V>("flatMap", options, [fn](T &&value, detail::StageSink<V> &out)
+                           {
+                               for (auto &result : fn(std::move(value)))
+                               {
+                                   out.push(std::move(result));
+                               }
+                           });
+        }
+
+        // Groups consecutive values into vectors of `size`, the last batch may be smaller
+        Flow<std::vector<T>> batch(size_t size, size_t buffer = StageOptions{}.m_buffer);
+
+        // Terminal stage, `fn` is called with every value
+        template <typename Fn>
+        void sink(Fn fn, StageOptions options = {});
+    };
+
+    /*
+    Composable pipeline of routine backed stages:
+        Pipeline pipeline;
+        pipeline.source<int>(generator)
+            .map(parse, {4})
+            .filter(valid, {4})
+            .batch(64)
+            .sink(store);
+        pipeline.wait();
+    Stages start running as soon as the sink is attached. stats() reports per stage throughput and
+    input queue depth, the stage with a full input queue and the lowest throughput is the bottleneck.
+    */
+    class Pipeline
+    {
+        template <typename>
+        friend class Flow;
+
+        std::vector<std::unique_ptr<StageStats>> m_stages;
+        std::atomic<size_t> m_sinks_running{0};
+        const uint64_t m_created{nowNanos()};
+
+        StageStats &addStage(const std::string &name, size_t parallelism, std::function<size_t()> depth)
+        {
+            auto stats = std::make_unique<StageStats>();
+            stats->m_name = name;
+            stats->m_parallelism = parallelism;
+            stats->m_queue_depth = std::move(depth);
+            m_stages.emplace_back(std::move(stats));
+            return *m_stages.back();
+        }
+
+    public:
+        Pipeline() = default;
+        Pipeline(const Pipeline &) = delete;
+        Pipeline &operator=(const Pipeline &) = delete;
+
+        // `generator` fills its argument and returns true until the input is exhausted
+        template <typename T>
+        Flow<T> source(std::function<bool(T &)> generator)
+        {
+            auto start = [generator](const StageOptions &, StageStats &stats, detail::SinkFactory<T> factory, std::function<void()> done)
+            {
+                go([generator, factory, done, &stats]()
+                   {
+                       auto sink = factory();
+                       T value{};
+                       for (uint64_t sequence = 0; generator(value); sequence++)
+                       {
+                           stats.m_in++;
+                           sink->push(std::move(value));
+                           sink->complete(sequence);
+                       }
+                       sink.reset();
+                       done();
+                   });
+            };
+            return Flow<T>(this, start, "source", std::make_shared<StageOptions>(), nullptr);
+        }
+
+        // Sources from an existing channel until it is closed
+        template <typename T>
+        Flow<T> source(ReadChannel<T> &channel)
+        {
+            return source<T>([&channel](T &value)
+                             { return channel.read(value); });
+        }
+
+        bool done() const { return m_sinks_running == 0; }
+
+        // Waits for every sink to consume its whole input
+        void wait()
+        {
+            while (not done())
+            {
+                if (Executor::current())
+                {
+                    Machines::yieldToScheduler();
+                }
+                else
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+        }
+
+        std::vector<StageReport> stats() const
+        {
+            double seconds = double(nowNanos() - m_created) / 1e9;
+            std::vector<StageReport> reports;
+            for (auto &stage : m_stages)
+            {
+                uint64_t out = stage->m_out;
+                reports.push_back(StageReport{stage->m_name, stage->m_parallelism, stage->m_in, out,
+                                              stage->m_queue_depth ? stage->m_queue_depth() : 0,
+                                              seconds > 0 ? double(out) / seconds : 0});
+            }
+            return reports;
+        }
+    };
+
+    template <typename T>
+    void Flow<T>::start(const StageOptions &options, std::function<void(T &&)> deliver, std::function<void()> finish)
+    {
+        auto &stats = m_pipeline->addStage(m_name, options.m_parallelism, m_queue_depth);
+        auto output = std::make_shared<detail::StageOutput<T>>(options, stats, std::move(deliver), std::move(finish));
+        m_start(
+            options, stats, [output]()
+            { return std::make_unique<typename detail::StageOutput<T>::Sink>(*output); },
+            [output]()
+            { output->routineDone(); });
+    }
+
+    template <typename T>
+    Flow<std::vector<T>> Flow<T>::batch(size_t size, size_t buffer)
+    {
+        // Batching is stateful, it always reads the materialized input in a single routine
+        auto channel = materialize();
+        auto input = channel.m_start;
+        auto start = [input, size](const StageOptions &options, StageStats &stats, detail::SinkFactory<std::vector<T>> factory, std::function<void()> done)
+        {
+            struct Batcher : public detail::StageSink<T>
+            {
+                std::unique_ptr<detail::StageSink<std::vector<T>>> m_next;
+                const size_t m_size;
+                std::vector<T> m_batch;
+                uint64_t m_sequence{0};
+
+                Batcher(std::unique_ptr<detail::StageSink<std::vector<T>>> next, size_t size)
+                    : m_next(std::move(next)), m_size(size)
+                {
+                }
+                ~Batcher()
+                {
+                    if (not m_batch.empty())
+                    {
+                        m_next->push(std::move(m_batch));
+                        m_next->complete(m_sequence);
+                    }
+                }
+                void push(T &&value) override
+                {
+                    m_batch.emplace_back(std::move(value));
+                    if (m_batch.size() == m_size)
+                    {
+                        m_next->push(std::move(m_batch));
+                        m_next->complete(m_sequence++);
+                        m_batch.clear();
+                    }
+                }
+                void complete(uint64_t) override {}
+            };
+            input(
+                options, stats, [factory, size]()
+                { return std::make_unique<Batcher>(factory(), size); },
+                done);
+        };
+        auto options = std::make_shared<StageOptions>();
+        options->m_buffer = buffer;
+        return Flow<std::vector<T>>(m_pipeline, start, "batch", options, channel.m_queue_depth);
+    }
+
+    template <typename T>
+    template <typename Fn>
+    void Flow<T>::sink(Fn fn, StageOptions options)
+    {
+        if (not fusible(options))
+        {
+            return materialize().sink(std::move(fn), options);
+        }
+        auto pipeline = m_pipeline;
+        pipeline->m_sinks_running++;
+        m_name = m_name.empty() ? "sink" : m_name + "+sink";
+        start(
+            m_options ? StageOptions{options.m_parallelism, options.m_ordered or m_options->m_ordered, m_options->m_buffer} : options,
+            [fn](T &&value) mutable
+            { fn(std::move(value)); },
+            [pipeline]()
+            { pipeline->m_sinks_running--; });
+    }
+}
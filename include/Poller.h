@@ -0,0 +1,75 @@
+#pragma once
+#include <stdint.h>
+#include <thread>
+#include <unordered_map>
+
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    namespace detail
+    {
+        /*
+        Readiness of one non blocking file descriptor, registered with the Poller for as long as it lives.
+        I/O is tried first, and only on EAGAIN does the caller wait for the matching direction: routines park,
+        plain threads futex wait, the executor keeps running other routines. Edges seen while nobody waits are
+        remembered, so one arriving between the EAGAIN and the wait is not lost.
+        */
+        class PollDescriptor
+        {
+            friend class Poller;
+
+            struct Direction
+            {
+                // Its lock guards m_ready
+                WaitQueue m_waiters;
+                bool m_ready{false};
+
+                bool wait(CancelContext *context);
+                void signal();
+            };
+
+            const int m_fd;
+            uint64_t m_id{0};
+            Direction m_read;
+            Direction m_write;
+
+        public:
+            explicit PollDescriptor(int fd);
+            ~PollDescriptor();
+            PollDescriptor(const PollDescriptor &) = delete;
+            PollDescriptor &operator=(const PollDescriptor &) = delete;
+
+            int fd() const { return m_fd; }
+            // Block until the descriptor may have turned readable/writable (or hung up). False if `context` got
+            // cancelled first
+            bool waitReadable(CancelContext *context = nullptr) { return m_read.wait(context); }
+            bool waitWritable(CancelContext *context = nullptr) { return m_write.wait(context); }
+            // Lets every waiter retry its I/O, eg. after a shutdown() that may not raise an event
+            void wakeAll();
+        };
+
+        /*
+        Process wide epoll set, edge triggered, served by one lazily started thread (Go's netpoller, minus the
+        integration into the scheduler loop). Descriptors are looked up by id under the lock, so an event still
+        in flight for one that just unregistered is dropped rather than touching freed memory.
+        */
+        class Poller
+        {
+            int m_epoll{-1};
+            RoutineMutex m_lock;
+            std::unordered_map<uint64_t, PollDescriptor *> m_descriptors;
+            uint64_t m_next_id{1};
+            std::thread m_thread;
+
+            Poller();
+            void run();
+
+        public:
+            static Poller &instance();
+
+            void add(PollDescriptor &descriptor);
+            void remove(PollDescriptor &descriptor);
+        };
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace gocpp
+{
+    /*
+    Accumulates stack samples and encodes them as a pprof profile.proto message
+    (github.com/google/pprof/blob/main/proto/profile.proto), readable by `go tool pprof` / `pprof`.
+    Addresses are kept raw and described by the process' executable mappings, functions are named
+    through dladdr where the dynamic symbol table allows it.
+    */
+    class PprofBuilder
+    {
+    public:
+        struct Label
+        {
+            std::string m_key;
+            std::string m_str;
+            int64_t m_num{0};
+            bool m_numeric{false};
+        };
+
+        // `sampleTypes` are (type, unit) pairs, every sample carries one value per type
+        PprofBuilder(std::vector<std::pair<std::string, std::string>> sampleTypes,
+                     std::pair<std::string, std::string> periodType = {}, int64_t period = 0);
+
+        // `stack` is leaf first, every frame after the leaf is a return address
+        void addSample(const uintptr_t *stack, size_t depth, std::vector<int64_t> values, std::vector<Label> labels = {});
+
+        void setDuration(int64_t nanos) { m_duration = nanos; }
+
+        // Serialized (uncompressed) profile.proto bytes
+        std::string encode() const;
+        bool write(const std::string &path) const;
+
+    private:
+        struct Sample
+        {
+            std::vector<uint64_t> m_locations;
+            std::vector<int64_t> m_values;
+            std::vector<Label> m_labels;
+        };
+
+        std::vector<std::pair<std::string, std::string>> m_sample_types;
+        std::pair<std::string, std::string> m_period_type;
+        int64_t m_period{0};
+        int64_t m_duration{0};
+        int64_t m_time{0};
+
+        std::vector<Sample> m_samples;
+        // address -> location id
+        std::unordered_map<uintptr_t, uint64_t> m_locations;
+        std::vector<uintptr_t> m_addresses;
+    };
+}
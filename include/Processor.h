@@ -1,4 +1,5 @@
 #pragma once
+#include <array>
 #include <queue>
 #include <mutex>
 
@@ -8,19 +9,32 @@ namespace gocpp
     /*
     Class that encapsulates all the coroutines switching on each core/thread (executor).
     An executor needs to acquire a processor to get routine work to execute from.
+    Each priority class waits in its own queue. The next routine is the queue head with the earliest
+    deadline, its runnable timestamp plus the class's PRIORITY_SLACK_NANOS, so that higher classes go
+    first without starving the lower ones.
     */
     class Processor
     {
         // Lock to avoid access race to processor routines
         std::mutex m_lock;
-        // Round robin queue for routines to run on the owning executor
-        std::deque<RoutinePtr> m_routines;
+        // Round robin queues, one per priority class, for routines to run on the owning executor
+        std::array<std::deque<RoutinePtr, SlabAllocator<RoutinePtr>>, NUM_PRIORITIES> m_routines;
+        // Queue lengths, readable without m_lock (eg. from the preemption signal handler)
+        std::array<std::atomic<uint32_t>, NUM_PRIORITIES> m_queued{};
         // Processor id
         int m_id{-1};
+        // Number of routines scheduled so far, paces the global queue checks
+        size_t m_sched_tick{0};
 
         // Helper function to pull from global routine queue or steal from other processors
         bool pullMoreRoutines(bool coreIdle);
 
+        // Queue helpers, m_lock must be held
+        void push(RoutinePtr &&routine);
+        size_t size() const;
+        // Pops the head with the earliest deadline, null if all queues are empty
+        RoutinePtr popNext();
+
     public:
         Processor(int id)
             : m_id(id)
@@ -28,14 +42,20 @@ namespace gocpp
         }
         auto id() const { return m_id; }
 
+        // Number of routines of the given class waiting to run here
+        uint32_t queued(Priority priority) const { return m_queued[priority].load(std::memory_order_relaxed); }
+
         // Adds the routine to the routine queue to be executed on this core
         void submitRoutine(RoutinePtr &&routine);
+        // Adds a batch of routines of one class under a single lock
+        void submitRoutines(std::vector<RoutinePtr> &&routines);
 
         // Returns true if more routines are present in queue, or if some routines were fetched
         // Will block if core is idle until some routine is available
         bool hasRoutines(bool coreIdle = true);
 
-        // Allows other cores to steal half of this processor's routines in a concurrent safe manner
+        // Allows other cores to steal half of this processor's routines in a concurrent safe manner,
+        // higher classes are handed over first
         bool surrenderRoutines(std::vector<RoutinePtr> &stolenRoutines, bool all = false);
 
         // Returns a next routine to run on the core, swaps out current routine (if present) to the back of the queue
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <ucontext.h>
+#include <vector>
+
+#include "Consts.h"
+
+namespace gocpp
+{
+    class Executor;
+
+    namespace detail
+    {
+        // Appends the return addresses of the frame pointer chain starting at `fp` to `stack`, up to `maxDepth` in total.
+        // Frames must stay within [low, high) and move strictly towards high. Returns the new depth
+        size_t walkFrames(uintptr_t fp, uintptr_t low, uintptr_t high, uintptr_t *stack, size_t depth, size_t maxDepth);
+    }
+
+    /*
+    Routine aware sampling CPU profiler. It piggybacks on the preemption signal: every TIMER_NANOS
+    each executor running a routine walks the interrupted routine's frame pointer chain (bounded to
+    that routine's stack, so nothing is ever dereferenced outside memory we own) into a buffer
+    preallocated per executor. Routines are sampled even where they can't be preempted, eg. holding
+    a RoutineMutex, so lock hold time shows up in the profile. No allocation, locking or libc calls happen in the signal handler.
+    Samples carry the routine id, executor and the routine's label, and stop() writes them out
+    as a pprof profile, e.g. `pprof -http=: ./binary cpu.pprof` with `-tagfocus=label=...`.
+    The library is built with -fno-omit-frame-pointer, user code needs the same for full stacks.
+    */
+    class Profiler
+    {
+    public:
+        static constexpr size_t MAX_DEPTH = 64;
+        static constexpr size_t SAMPLES_PER_EXECUTOR = 4096;
+
+        struct Sample
+        {
+            uint32_t m_routine;
+            uint32_t m_label;
+            int32_t m_executor;
+            uint32_t m_depth;
+            uintptr_t m_stack[MAX_DEPTH];
+        };
+
+    private:
+        struct SampleBuffer
+        {
+            std::unique_ptr<Sample[]> m_samples{new Sample[SAMPLES_PER_EXECUTOR]};
+            // Published with release once a sample is fully written
+            std::atomic<size_t> m_count{0};
+            std::atomic<uint64_t> m_dropped{0};
+        };
+
+        static inline std::atomic_bool s_enabled{false};
+        // Allocated by the first start() and never resized, the signal handler indexes it freely
+        static inline std::vector<std::unique_ptr<SampleBuffer>> s_buffers;
+        static inline std::mutex s_lock;
+        // Interned routine labels, index 0 is "no label"
+        static inline std::vector<std::string> s_labels{""};
+        static inline uint64_t s_started{0};
+
+    public:
+        static bool enabled() { return s_enabled.load(std::memory_order_acquire); }
+
+        // Starts sampling, returns false if the profiler is already running
+        static bool start();
+        // Stops sampling and writes a pprof profile to `path`, returns false if it could not be written
+        static bool stop(const std::string &path);
+
+        // Labels the calling routine, samples taken while it runs carry label=`label`
+        static void setLabel(const std::string &label);
+
+        // Every label handed out so far, indexed like Routine::label()
+        static std::vector<std::string> labels();
+
+        // Number of samples lost to full buffers since the last start()
+        static uint64_t dropped();
+
+        // Called by the preemption signal handler with the interrupted routine's machine context
+        static void sample(Executor &executor, const ucontext_t *context);
+    };
+}
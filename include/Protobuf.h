@@ -0,0 +1,77 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        /*
+        Minimal protobuf wire format encoder, enough for the profile/trace formats the runtime exports.
+        Nested messages are encoded into a child ProtoWriter and appended with message().
+        */
+        class ProtoWriter
+        {
+            std::string m_buffer;
+
+            void tag(uint32_t field, uint32_t wireType)
+            {
+                varint((uint64_t(field) << 3) | wireType);
+            }
+
+        public:
+            void varint(uint64_t value)
+            {
+                while (value >= 0x80)
+                {
+                    m_buffer.push_back(char((value & 0x7F) | 0x80));
+                    value >>= 7;
+                }
+                m_buffer.push_back(char(value));
+            }
+
+            void uint64(uint32_t field, uint64_t value)
+            {
+                tag(field, 0);
+                varint(value);
+            }
+
+            void int64(uint32_t field, int64_t value)
+            {
+                uint64(field, uint64_t(value));
+            }
+
+            void bytes(uint32_t field, const void *data, size_t size)
+            {
+                tag(field, 2);
+                varint(size);
+                m_buffer.append(static_cast<const char *>(data), size);
+            }
+
+            void string(uint32_t field, const std::string &value)
+            {
+                bytes(field, value.data(), value.size());
+            }
+
+            void message(uint32_t field, const ProtoWriter &child)
+            {
+                bytes(field, child.m_buffer.data(), child.m_buffer.size());
+            }
+
+            // Packed repeated varints
+            template <typename Container>
+            void packed(uint32_t field, const Container &values)
+            {
+                ProtoWriter child;
+                for (auto value : values)
+                {
+                    child.varint(uint64_t(value));
+                }
+                message(field, child);
+            }
+
+            const std::string &data() const { return m_buffer; }
+            void clear() { m_buffer.clear(); }
+        };
+    }
+}
@@ -0,0 +1,254 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <system_error>
+#include <utility>
+
+#include "Channel.h"
+#include "Poller.h"
+#include "Serializer.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    namespace detail
+    {
+        /*
+        Byte level half of a RemoteChannel: one connected stream socket carrying records both ways. Frames are
+        a 4 byte payload length, a type byte and the payload. DATA holds any number of length prefixed records,
+        CREDIT lets the peer send that many more, CLOSE says no more DATA follows.
+        Each side may have at most as many records in flight as the other side's buffer holds: both start by
+        granting their buffer size, and grant again as their readers consume. A sender routine turns whatever
+        writers queued meanwhile into DATA frames, a receiver routine splits incoming frames into the inbox.
+        Both park on the Poller whenever the socket would block.
+        */
+        class RemoteEndpoint
+        {
+            enum FrameType : uint8_t
+            {
+                DATA = 1,
+                CREDIT = 2,
+                CLOSE = 3
+            };
+            static constexpr size_t FRAME_HEADER = sizeof(uint32_t) + 1;
+
+            const int m_fd;
+            const uint32_t m_buffer_size;
+            // Consumed records are granted back to the peer in batches of this many, or once the inbox ran dry
+            const uint32_t m_credit_batch;
+            std::unique_ptr<PollDescriptor> m_poll;
+
+            // Guards the inbox and outbox
+            RoutineMutex m_lock;
+            std::deque<std::string> m_inbox;
+            // Length prefixed records not handed to the sender routine yet
+            std::string m_outbox;
+            std::atomic<uint32_t> m_outbox_records{0};
+            bool m_close_queued{false};
+            bool m_close_sent{false};
+
+            std::atomic<uint32_t> m_inbox_size{0};
+            // Records read locally and not granted back yet
+            std::atomic<uint32_t> m_consumed{0};
+            // Records we may still send
+            std::atomic<int64_t> m_credit{0};
+            std::atomic_bool m_closed{false};
+            // The peer sent CLOSE
+            std::atomic_bool m_peer_closed{false};
+            // The connection is gone, nothing moves anymore
+            std::atomic_bool m_disconnected{false};
+            std::atomic_bool m_stopping{false};
+
+            WaitQueue m_readers;
+            WaitQueue m_writers;
+            // The sender routine, waiting for something to send
+            WaitQueue m_sender;
+            // The destructor, waiting for both routines to return. Its lock guards m_routines
+            WaitQueue m_done;
+            uint32_t m_routines{2};
+
+            bool creditDue() const;
+            bool sendPending() const;
+            void sendLoop();
+            void receiveLoop();
+            // Splits complete frames off the front of `buffer`, false on a protocol violation
+            bool parse(std::string &buffer);
+            bool sendAll(const std::string &bytes);
+            void disconnect();
+            void routineDone();
+
+        public:
+            // Takes ownership of a connected stream socket
+            RemoteEndpoint(int fd, size_t bufferSize);
+            ~RemoteEndpoint();
+            RemoteEndpoint(const RemoteEndpoint &) = delete;
+            RemoteEndpoint &operator=(const RemoteEndpoint &) = delete;
+
+            // Parks for a credit. False if `context` got cancelled first, throws once closed or disconnected
+            bool send(const std::string &record, CancelContext *context);
+            bool tryReceive(std::string &out);
+            // False once the peer closed (or disconnected) and the inbox is drained, or `context` got cancelled
+            bool receive(std::string &out, CancelContext *context);
+            void close();
+
+            bool readReady() const { return m_inbox_size != 0; }
+            bool writeReady() const { return m_credit > 0; }
+            WaitQueue *readWaiters() { return &m_readers; }
+            WaitQueue *writeWaiters() { return &m_writers; }
+            size_t size() const { return m_inbox_size; }
+            size_t credit() const { return size_t(std::max<int64_t>(0, m_credit)); }
+            bool closed() const { return m_closed; }
+            bool disconnected() const { return m_disconnected; }
+        };
+
+        // Connected non blocking stream socket to "unix:/path" or "tcp:host:port", parking while connecting.
+        // -1 if `context` got cancelled first, throws std::system_error on failure
+        int dial(const std::string &address, CancelContext *context);
+    }
+
+    /*
+    Listening Unix domain or TCP socket for RemoteChannel::accept(), at "unix:/path" or "tcp:host:port"
+    (port 0 picks a free one, see address()). accept() parks like any other socket operation.
+    */
+    class RemoteListener
+    {
+        int m_fd{-1};
+        std::string m_address;
+        std::unique_ptr<detail::PollDescriptor> m_poll;
+
+    public:
+        explicit RemoteListener(const std::string &address);
+        ~RemoteListener();
+        RemoteListener(const RemoteListener &) = delete;
+        RemoteListener &operator=(const RemoteListener &) = delete;
+
+        // Where peers dial, with the port actually bound
+        const std::string &address() const { return m_address; }
+        // Next connected socket, -1 if `context` got cancelled first
+        int accept(CancelContext *context = nullptr);
+    };
+
+    /*
+    Channel between processes or hosts over a Unix domain or TCP socket. Each side writes what the other side
+    reads, values are serialized with a Serializer:
+        RemoteListener listener("tcp:0.0.0.0:7000");       // worker: RemoteChannel<Job>::dial("tcp:host:7000", 64)
+        auto jobs = RemoteChannel<Job>::accept(listener, 64);
+        *jobs << job;
+    Writes queued while the previous frame was on its way go out together, in frames of up to REMOTE_MAX_FRAME (1GB). Flow
+    control is credit based: a side never has more values in flight than the other side's `buffer_size`, so a
+    slow reader blocks remote writers like a full buffered Channel would (an unbuffered one is taken as a buffer
+    of 1). Socket I/O parks routines on the runtime's poller, executors keep running meanwhile. close() ends the
+    other side's reads once it drained what was sent, values can still come in. The destructor closes, flushes
+    and disconnects. pair() connects two channels over a socketpair, eg. across fork().
+    */
+    template <typename T, typename Codec = Serializer<T>>
+    class RemoteChannel : public ReadChannel<T>, public WriteChannel<T>
+    {
+        detail::RemoteEndpoint m_endpoint;
+
+    public:
+        // Takes ownership of a connected stream socket
+        RemoteChannel(int fd, size_t buffer_size)
+            : m_endpoint(fd, buffer_size)
+        {
+        }
+
+        RemoteChannel(const RemoteChannel &) = delete;
+        RemoteChannel &operator=(const RemoteChannel &) = delete;
+
+        // Null if `context` got cancelled while connecting
+        static std::unique_ptr<RemoteChannel> dial(const std::string &address, size_t buffer_size,
+                                                   CancelContext *context = nullptr)
+        {
+            int fd = detail::dial(address, context);
+            return fd < 0 ? nullptr : std::make_unique<RemoteChannel>(fd, buffer_size);
+        }
+
+        static std::unique_ptr<RemoteChannel> accept(RemoteListener &listener, size_t buffer_size,
+                                                     CancelContext *context = nullptr)
+        {
+            int fd = listener.accept(context);
+            return fd < 0 ? nullptr : std::make_unique<RemoteChannel>(fd, buffer_size);
+        }
+
+        static std::pair<std::unique_ptr<RemoteChannel>, std::unique_ptr<RemoteChannel>> pair(size_t buffer_size)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "socketpair");
+            }
+            return {std::make_unique<RemoteChannel>(fds[0], buffer_size), std::make_unique<RemoteChannel>(fds[1], buffer_size)};
+        }
+
+        // Values received and not read yet
+        size_t size() const { return m_endpoint.size(); }
+        // Values we may send before the other side's buffer is full
+        size_t credit() const { return m_endpoint.credit(); }
+        bool closed() const { return m_endpoint.closed(); }
+        bool disconnected() const { return m_endpoint.disconnected(); }
+
+        bool readReady() override { return m_endpoint.readReady(); }
+        bool writeReady() override { return m_endpoint.writeReady(); }
+        WaitQueue *readWaiters() override { return m_endpoint.readWaiters(); }
+        WaitQueue *writeWaiters() override { return m_endpoint.writeWaiters(); }
+
+        bool tryRead(T &out) override
+        {
+            std::string record;
+            if (not m_endpoint.tryReceive(record))
+            {
+                return false;
+            }
+            Codec::decode(record.data(), record.size(), out);
+            return true;
+        }
+
+        bool read(T &out) override
+        {
+            return read(out, nullptr);
+        }
+
+        // Also returns false once `context` is cancelled, without reading
+        bool read(T &out, CancelContext *context)
+        {
+            std::string record;
+            if (not m_endpoint.receive(record, context))
+            {
+                return false;
+            }
+            Codec::decode(record.data(), record.size(), out);
+            return true;
+        }
+
+        // Only serializes `in`, so move only values may be written from lvalues here. Not through WriteChannel
+        // though, which has no copying write for them (see detail::CopyingWrite)
+        bool write(const T &in)
+        {
+            return write(in, nullptr);
+        }
+
+        bool write(T &&in) override
+        {
+            return write(in, nullptr);
+        }
+
+        // Parks while the other side's buffer is full, gives up (returning false) once `context` is cancelled.
+        // Throws on a closed or disconnected channel
+        bool write(const T &in, CancelContext *context)
+        {
+            std::string record;
+            Codec::encode(in, record);
+            return m_endpoint.send(record, context);
+        }
+
+        void close() override
+        {
+            m_endpoint.close();
+        }
+    };
+}
@@ -1,28 +1,97 @@
 #pragma once
+#include <atomic>
 #include <functional>
 #include <future>
 #include <memory>
 
 #include "Consts.h"
 #include "Context.h"
+#include "Metrics.h"
+#include "Slab.h"
 
 namespace gocpp
 {
+    class Executor;
+
+    namespace detail
+    {
+        // Body of a stackless routine, a C++20 coroutine (see Task.h). Resumed on the scheduler's own stack
+        class Resumable
+        {
+        public:
+            virtual ~Resumable() = default;
+            // Runs the coroutine until it suspends again, true once it has finished
+            virtual bool resume() = 0;
+        };
+
+        // Body of a stackful routine. Not a std::packaged_task: its std::call_once passes the callable through thread
+        // local storage, which a routine preempted right there and resumed on another executor finds unset
+        class RoutineBody : public SlabAllocated
+        {
+        public:
+            virtual ~RoutineBody() = default;
+            virtual void operator()() = 0;
+        };
+
+        template <typename Fn>
+        class RoutineBodyOf final : public RoutineBody
+        {
+            Fn m_fn;
+
+        public:
+            template <typename F>
+            explicit RoutineBodyOf(F &&fn)
+                : m_fn(std::forward<F>(fn))
+            {
+            }
+
+            void operator()() override { m_fn(); }
+        };
+
+        template <typename Fn>
+        std::unique_ptr<RoutineBody> makeRoutineBody(Fn &&fn)
+        {
+            return std::make_unique<RoutineBodyOf<std::decay_t<Fn>>>(std::forward<Fn>(fn));
+        }
+    }
+
     /*
     This class encapsulates the [Go]Routine which is essentially a task function submitted by the user
     and the relevant stacks and context to suspend and resume it from.
     */
-    class Routine
+    class Routine : public detail::SlabAllocated
     {
+        static inline std::atomic<uint32_t> s_next_id{1};
+
         // Callable representing the routine, called via m_context
-        std::packaged_task<void(void)> m_fn;
-        // Context for the routine to suspend/resume from and scheduler context to ultimately exit to
+        std::unique_ptr<detail::RoutineBody> m_fn;
+        // Set instead of m_fn for stackless routines, which never get stacks or contexts of their own
+        std::unique_ptr<detail::Resumable> m_task;
+        // Context for the routine to suspend/resume from and scheduler context to ultimately exit to.
+        // Only set up by prepare(), once an executor is about to run the routine for the first time
         ContextPtr m_context, m_scheduler_context;
         // Boolean to indicate coroutine completion
         bool m_done{false};
+        // Unique id, used by tracing and profiling to tell routines apart
+        uint32_t m_id{0};
+        // Timestamp of the routine last becoming runnable, for scheduling latency
+        uint64_t m_runnable_since{0};
+        // Interned profiler label, 0 when unlabelled
+        uint32_t m_label{0};
+        // PerfCounters totals of the routine's runs so far
+        PerfCounts m_perf{};
+        // Scheduling class, picks the Processor queue it waits in
+        Priority m_priority{NORMAL};
+        // Link in Machines' lock free injection stack, while queued there
+        Routine *m_next_injected{nullptr};
+        // Executor the routine is locked to (see Machines::lockToExecutor()), null while it may migrate
+        Executor *m_locked_to{nullptr};
+        // Nesting of lockToExecutor() calls, the routine is unlocked once all of them are undone
+        uint32_t m_lock_depth{0};
 
     public:
-        Routine(std::packaged_task<void(void)> &&task);
+        Routine(std::unique_ptr<detail::RoutineBody> &&body, Priority priority = NORMAL);
+        Routine(std::unique_ptr<detail::Resumable> &&task, Priority priority = NORMAL);
         // No copying/moving a routine once it is created
         // Copying it around can have unwanted user side effects
         // Moving is enabled by the wrapping ptr object
@@ -31,14 +100,50 @@ namespace gocpp
         Routine &operator=(const Routine &) = delete;
         Routine &operator=(Routine &&) = delete;
 
-        // Calls the underlying callable and sets done on completion
+        // Calls the underlying callable and sets done on completion.
+        // A stackless routine only runs until its next suspension point
         void run();
 
+        // Allocates the stacks and contexts if not done yet
+        void prepare();
+
         // accessors
         bool done() const { return m_done; }
+        bool stackless() const { return m_task != nullptr; }
+        uint32_t id() const { return m_id; }
         ContextPtr& runContext() { return m_context; }
         ContextPtr& schedulerContext() { return m_scheduler_context; }
 
+        void markRunnable() { m_runnable_since = nowNanos(); }
+        uint64_t runnableSince() const { return m_runnable_since; }
+
+        uint32_t label() const { return m_label; }
+        void setLabel(uint32_t label) { m_label = label; }
+
+        PerfCounts &perf() { return m_perf; }
+
+        Priority priority() const { return m_priority; }
+        void setPriority(Priority priority) { m_priority = priority; }
+
+        Routine *&nextInjected() { return m_next_injected; }
+
+        Executor *lockedTo() const { return m_locked_to; }
+        // Returns true when this locks (resp. unlocks) the routine, rather than changing the nesting
+        bool lockTo(Executor *executor)
+        {
+            m_locked_to = executor;
+            return m_lock_depth++ == 0;
+        }
+        bool unlock()
+        {
+            if (m_lock_depth == 0 or --m_lock_depth != 0)
+            {
+                return false;
+            }
+            m_locked_to = nullptr;
+            return true;
+        }
+
     };
     using RoutinePtr = std::unique_ptr<Routine>;
 }
\ No newline at end of file
@@ -8,11 +8,17 @@ namespace gocpp
 {
     namespace detail
     {
-        struct SelectCase
+        struct SelectCase : public SlabAllocated
         {
             virtual ~SelectCase() = default;
             virtual SelectCase *copy() = 0;
             virtual bool operator()() const = 0;
+            // Whether operator() would likely succeed now, checked after queueing on waiters()
+            virtual bool ready() const = 0;
+            // Where to park until ready() may have changed, null if the channel can only be polled
+            virtual WaitQueue *waiters() const = 0;
+            // Identity of the channel for the BlockProfiler, the same address its own operations report
+            virtual const void *channel() const = 0;
         };
 
         template <typename T>
@@ -33,13 +39,20 @@ namespace gocpp
 
             bool operator()() const override
             {
-                return m_chan->readReady() and m_chan->read(*m_obj);
+                // readReady() alone could race with another reader and leave us blocked in read()
+                return m_chan->readReady() and m_chan->tryRead(*m_obj);
             }
+
+            bool ready() const override { return m_chan->readReady(); }
+            WaitQueue *waiters() const override { return m_chan->readWaiters(); }
+            const void *channel() const override { return dynamic_cast<const void *>(m_chan); }
         };
 
         template <typename T>
         struct WriteCase : public SelectCase
         {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, use an rvalue case instead");
+
             WriteChannel<T> *const m_chan{nullptr};
             const T *const m_obj{nullptr};
 
@@ -57,6 +70,37 @@ namespace gocpp
             {
                 return m_chan->writeReady() and m_chan->write(*m_obj);
             }
+
+            bool ready() const override { return m_chan->writeReady(); }
+            WaitQueue *waiters() const override { return m_chan->writeWaiters(); }
+            const void *channel() const override { return dynamic_cast<const void *>(m_chan); }
+        };
+
+        // Moves `*m_obj` into the channel once the case fires
+        template <typename T>
+        struct MoveWriteCase : public SelectCase
+        {
+            WriteChannel<T> *const m_chan{nullptr};
+            T *const m_obj{nullptr};
+
+            MoveWriteCase(WriteChannel<T> *chan, T *obj)
+                : m_chan(chan), m_obj(obj)
+            {
+            }
+
+            SelectCase *copy() override
+            {
+                return new MoveWriteCase(*this);
+            }
+
+            bool operator()() const override
+            {
+                return m_chan->writeReady() and m_chan->write(std::move(*m_obj));
+            }
+
+            bool ready() const override { return m_chan->writeReady(); }
+            WaitQueue *waiters() const override { return m_chan->writeWaiters(); }
+            const void *channel() const override { return dynamic_cast<const void *>(m_chan); }
         };
 
         struct DefaultCase : public SelectCase
@@ -73,6 +117,10 @@ namespace gocpp
                 assert(false);
                 return false;
             }
+
+            bool ready() const override { return true; }
+            WaitQueue *waiters() const override { return nullptr; }
+            const void *channel() const override { return nullptr; }
         };
     }
 
@@ -108,6 +156,12 @@ namespace gocpp
 
     public:
         Select(std::initializer_list<CaseDescriptor> list)
+            : Select(std::vector<CaseDescriptor>(list))
+        {
+        }
+
+        // Allows building the set of cases at runtime, eg. one case per channel in a fan-in
+        Select(const std::vector<CaseDescriptor> &list)
         {
             for (auto &desc : list)
             {
@@ -128,12 +182,23 @@ namespace gocpp
 
         void operator()()
         {
+            WaitQueue *wokenBy = nullptr;
+            detail::BlockTimer blocked(nullptr, BLOCK_SELECT);
             while (true)
             {
                 for (auto &desc : m_cases)
                 {
                     if ((*desc.m_condition)())
                     {
+                        blocked.setChannel(desc.m_condition->channel());
+                        auto *queue = desc.m_condition->waiters();
+                        if (wokenBy and wokenBy != queue)
+                        {
+                            // We were woken for another case, hand that notification on
+                            wokenBy->wakeOne();
+                        }
+                        // The callback runs on our time, not the channel's
+                        blocked.finish();
                         desc.m_callable();
                         return;
                     }
@@ -144,38 +209,130 @@ namespace gocpp
                     m_defaultCase.m_callable();
                     return;
                 }
+                blocked.park();
+                if (not park(wokenBy))
+                {
+                    // Nothing ready, let the routines feeding these channels run
+                    Machines::yieldToScheduler();
+                }
             }
         }
 
     private:
         std::vector<CaseDescriptor> m_cases;
         CaseDescriptor m_defaultCase{};
+
+        // Parks on every case's queue at once until one of them notifies. False if some case can only be polled
+        bool park(WaitQueue *&wokenBy)
+        {
+            for (auto &desc : m_cases)
+            {
+                if (desc.m_condition->waiters() == nullptr)
+                {
+                    return false;
+                }
+            }
+            Parking parking;
+            std::vector<WaitQueue::Waiter, SlabAllocator<WaitQueue::Waiter>> waiters(m_cases.size(), WaitQueue::Waiter{&parking});
+            size_t queued = 0;
+            bool ready = false;
+            for (; queued < m_cases.size() and not ready; queued++)
+            {
+                auto &condition = *m_cases[queued].m_condition;
+                auto *queue = condition.waiters();
+                std::unique_lock<RoutineMutex> guard(queue->lock());
+                queue->enqueue(waiters[queued]);
+                ready = condition.ready();
+            }
+            if (not ready)
+            {
+                parking.block();
+            }
+            for (size_t i = 0; i < queued; i++)
+            {
+                auto *queue = m_cases[i].m_condition->waiters();
+                std::unique_lock<RoutineMutex> guard(queue->lock());
+                queue->remove(waiters[i]);
+            }
+            wokenBy = ready ? nullptr : parking.wokenBy();
+            return true;
+        }
     };
 
     using Case = Select::CaseDescriptor;
     inline Case DefaultCase(std::function<void()> callable) { return Case(gocpp::detail::DefaultCase{}, std::move(callable)); }
 
-    template <typename T, template <typename> class WriteChannelType>
-    auto operator>=(const T &in, WriteChannelType<T> &ch)
+    template <typename T>
+    auto operator>=(const T &in, WriteChannel<T> &ch)
     {
         return detail::WriteCase<T>(&ch, &in);
     }
 
-    template <typename T, template <typename> class ReadChannelType>
-    auto operator<=(T &out, ReadChannelType<T> &ch)
+    // Rvalue operands (eg. std::move(ptr) >= ch) are moved into the channel when the case fires
+    template <typename T>
+    auto operator>=(T &&in, WriteChannel<T> &ch)
+    {
+        return detail::MoveWriteCase<T>(&ch, &in);
+    }
+
+    template <typename T>
+    auto operator<=(T &out, ReadChannel<T> &ch)
     {
         return detail::ReadCase<T>(&ch, &out);
     }
 
-    template <typename T, template <typename> class WriteChannelType>
-    auto operator<=(WriteChannelType<T> &ch, const T &in)
+    template <typename T>
+    auto operator<=(WriteChannel<T> &ch, const T &in)
     {
         return detail::WriteCase<T>(&ch, &in);
     }
 
-    template <typename T, template <typename> class ReadChannelType>
-    auto operator>=(ReadChannelType<T> &ch, T &out)
+    template <typename T>
+    auto operator<=(WriteChannel<T> &ch, T &&in)
+    {
+        return detail::MoveWriteCase<T>(&ch, &in);
+    }
+
+    template <typename T>
+    auto operator>=(ReadChannel<T> &ch, T &out)
     {
         return detail::ReadCase<T>(&ch, &out);
     }
+
+    // Directional handles take part through their side of the channel
+    template <typename T, typename Kind>
+    auto operator<=(T &out, const Receiver<T, Kind> &ch)
+    {
+        return detail::ReadCase<T>(&ch.readChannel(), &out);
+    }
+
+    template <typename T, typename Kind>
+    auto operator<=(const Sender<T, Kind> &ch, const T &in)
+    {
+        return detail::WriteCase<T>(&ch.writeChannel(), &in);
+    }
+
+    template <typename T, typename Kind>
+    auto operator<=(const Sender<T, Kind> &ch, T &&in)
+    {
+        return detail::MoveWriteCase<T>(&ch.writeChannel(), &in);
+    }
+
+    template <typename T, typename Kind>
+    auto operator>=(const Receiver<T, Kind> &ch, T &out)
+    {
+        return detail::ReadCase<T>(&ch.readChannel(), &out);
+    }
+
+    template <typename T, typename Kind>
+    auto operator>=(const T &in, const Sender<T, Kind> &ch)
+    {
+        return detail::WriteCase<T>(&ch.writeChannel(), &in);
+    }
+
+    template <typename T, typename Kind>
+    auto operator>=(T &&in, const Sender<T, Kind> &ch)
+    {
+        return detail::MoveWriteCase<T>(&ch.writeChannel(), &in);
+    }
 }
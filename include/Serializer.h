@@ -0,0 +1,46 @@
+#pragma once
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+namespace gocpp
+{
+    /*
+    How values cross a process boundary as bytes, into SpillChannel segment files or over RemoteChannel sockets.
+    Trivially copyable values and std::string come built in, other types get a specialization:
+        template <>
+        struct Serializer<Event>
+        {
+            static void encode(const Event &in, std::string &out);          // appends the bytes of `in`
+            static void decode(const char *data, size_t size, Event &out);  // from what encode() appended
+        };
+    */
+    template <typename T, typename = void>
+    struct Serializer;
+
+    template <typename T>
+    struct Serializer<T, std::enable_if_t<std::is_trivially_copyable_v<T>>>
+    {
+        static void encode(const T &in, std::string &out)
+        {
+            out.append(reinterpret_cast<const char *>(&in), sizeof(T));
+        }
+
+        static void decode(const char *data, size_t size, T &out)
+        {
+            if (size != sizeof(T))
+            {
+                throw std::runtime_error("Serialized record does not hold a value of this type!");
+            }
+            std::memcpy(&out, data, sizeof(T));
+        }
+    };
+
+    template <>
+    struct Serializer<std::string>
+    {
+        static void encode(const std::string &in, std::string &out) { out.append(in); }
+        static void decode(const char *data, size_t size, std::string &out) { out.assign(data, size); }
+    };
+}
@@ -0,0 +1,476 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "Channel.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    namespace detail
+    {
+        // Start of a shared memory channel, followed by its slots. Shared by every process mapping it
+        struct ShmHeader
+        {
+            static constexpr uint64_t MAGIC = 0x63707067'6f73686d; // "cppgoshm"
+
+            // Set last by the creator, the rest is valid from then on
+            std::atomic<uint64_t> m_magic;
+            uint64_t m_capacity;
+            uint64_t m_slot_size;
+            std::atomic<uint32_t> m_closed;
+            // Next positions to read and to write, on cache lines of their own
+            alignas(64) std::atomic<uint64_t> m_head;
+            alignas(64) std::atomic<uint64_t> m_tail;
+            // Bumped on every commit and on close(), the futex word watchers sleep on
+            alignas(64) std::atomic<uint32_t> m_events;
+            // Watchers sleeping on m_events, in all processes
+            std::atomic<uint32_t> m_sleepers;
+        };
+        static_assert(std::atomic<uint64_t>::is_always_lock_free and std::atomic<uint32_t>::is_always_lock_free,
+                      "atomics in shared memory must be address free");
+
+        // File descriptor and its shared mapping
+        class ShmMapping
+        {
+            int m_fd{-1};
+            char *m_base{nullptr};
+            size_t m_size{0};
+
+        public:
+            // Maps all of `fd`, taking ownership of it
+            explicit ShmMapping(int fd);
+            ~ShmMapping();
+            ShmMapping(const ShmMapping &) = delete;
+            ShmMapping &operator=(const ShmMapping &) = delete;
+
+            int fd() const { return m_fd; }
+            char *base() const { return m_base; }
+            size_t size() const { return m_size; }
+
+            // Anonymous memfd of `size` zeroed bytes
+            static int create(size_t size);
+            // shm_open()s `name`, creating it with `size` zeroed bytes if it does not exist yet (`created` is then set)
+            static int open(const std::string &name, size_t size, bool &created);
+            static void unlink(const std::string &name);
+        };
+
+        /*
+        Carries wake ups across processes. Routines and threads wait in our in-process queues. A commit wakes the
+        waiters of its own process directly and those of the others through a shared futex on ShmHeader::m_events,
+        which one watcher thread per channel and process sleeps on, only while its queues have waiters. Commits
+        thus only pay for a futex wake while somebody, somewhere, is blocked.
+        */
+        class ShmWatcher
+        {
+            ShmHeader &m_header;
+            WaitQueue m_readers;
+            WaitQueue m_writers;
+            // Bumped by every enqueue on either queue, the idle watcher sleeps on it
+            std::atomic<uint32_t> m_enqueues{0};
+            std::atomic_bool m_stop{false};
+            std::once_flag m_started;
+            std::thread m_thread;
+
+            void run();
+            void notify(WaitQueue &queue, size_t count);
+
+        public:
+            explicit ShmWatcher(ShmHeader &header);
+            ~ShmWatcher();
+
+            // Waiting on a queue is what needs the watcher, so handing one out starts it
+            WaitQueue &readers();
+            WaitQueue &writers();
+
+            // After a value got published, a slot freed up, or the channel closed
+            void notifyReaders() { notify(m_readers, 1); }
+            void notifyWriters() { notify(m_writers, 1); }
+            void notifyClosed();
+        };
+    }
+
+    /*
+    Channel between processes on one host, for trivially copyable values, living in a memfd (or shm_open) mapping.
+    The values sit in a lock-free ring of cache line aligned slots (Vyukov's bounded MPMC queue), which can be
+    filled and drained in place:
+        auto channel = ShmChannel<Sample>::create(1024);   // child: ShmChannel<Sample>::attach(fd)
+        if (auto slot = channel->reserveWrite())
+        {
+            capture(*slot);   // straight into shared memory
+            slot.commit();    // or let it go out of scope
+        }
+    Blocked routines park in the runtime as with a Channel, the other processes wake them through a shared futex.
+    read()/write() copy, and the ReadChannel/WriteChannel interface makes it usable in a Select. A reservation stalls
+    the ring for the other side until committed, and a process dying with one open stalls it for good.
+    */
+    template <typename T>
+    class ShmChannel : public ReadChannel<T>, public WriteChannel<T>
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "ShmChannel values are handed between processes as bytes");
+
+        struct alignas(64) Cell
+        {
+            // position + 1 once written at `position`, position + capacity once read and free again
+            std::atomic<uint64_t> m_seq;
+            T m_value;
+        };
+
+    public:
+        // Slot of the ring reserved by reserveWrite() or reserveRead(), accessed in place until commit()
+        class Reservation
+        {
+            friend class ShmChannel;
+
+            ShmChannel *m_channel{nullptr};
+            Cell *m_cell{nullptr};
+            uint64_t m_position{0};
+            bool m_write{false};
+
+            Reservation(ShmChannel *channel, Cell *cell, uint64_t position, bool write)
+                : m_channel(channel), m_cell(cell), m_position(position), m_write(write)
+            {
+            }
+
+        public:
+            Reservation() = default;
+            Reservation(Reservation &&other) noexcept
+                : m_channel(other.m_channel), m_cell(std::exchange(other.m_cell, nullptr)),
+                  m_position(other.m_position), m_write(other.m_write)
+            {
+            }
+            Reservation &operator=(Reservation &&other) noexcept
+            {
+                commit();
+                m_channel = other.m_channel;
+                m_cell = std::exchange(other.m_cell, nullptr);
+                m_position = other.m_position;
+                m_write = other.m_write;
+                return *this;
+            }
+            Reservation(const Reservation &) = delete;
+            Reservation &operator=(const Reservation &) = delete;
+
+            ~Reservation()
+            {
+                commit();
+            }
+
+            // False if nothing got reserved
+            explicit operator bool() const { return m_cell != nullptr; }
+            T &operator*() const { return m_cell->m_value; }
+            T *operator->() const { return &m_cell->m_value; }
+
+            // Publishes the written value, or hands the read slot back to writers
+            void commit()
+            {
+                if (m_cell == nullptr)
+                {
+                    return;
+                }
+                if (m_write)
+                {
+                    m_cell->m_seq.store(m_position + 1, std::memory_order_release);
+                    m_channel->m_watcher.notifyReaders();
+                }
+                else
+                {
+                    m_cell->m_seq.store(m_position + m_channel->m_mask + 1, std::memory_order_release);
+                    m_channel->m_watcher.notifyWriters();
+                }
+                m_cell = nullptr;
+            }
+        };
+
+    private:
+        using BlockTimer = detail::BlockTimer;
+
+        detail::ShmMapping m_mapping;
+        detail::ShmHeader &m_header;
+        Cell *const m_cells;
+        const uint64_t m_mask;
+        detail::ShmWatcher m_watcher;
+
+        static size_t bytes(size_t capacity)
+        {
+            return sizeof(detail::ShmHeader) + capacity * sizeof(Cell);
+        }
+
+        // Rounded up to a power of two, so that positions map to cells with a mask
+        static size_t slots(size_t capacity)
+        {
+            size_t slots = 1;
+            while (slots < capacity)
+            {
+                slots <<= 1;
+            }
+            return slots;
+        }
+
+        // Lays out a new channel, or waits for its creator to have done so
+        static detail::ShmHeader &layout(detail::ShmMapping &mapping, size_t capacity, bool create)
+        {
+            auto *header = reinterpret_cast<detail::ShmHeader *>(mapping.base());
+            if (create)
+            {
+                // The mapping is zeroed, positions and counters start out at 0
+                new (header) detail::ShmHeader();
+                header->m_capacity = capacity;
+                header->m_slot_size = sizeof(Cell);
+                auto *cells = reinterpret_cast<Cell *>(mapping.base() + sizeof(detail::ShmHeader));
+                for (size_t i = 0; i < capacity; i++)
+                {
+                    new (&cells[i]) Cell();
+                    cells[i].m_seq.store(i, std::memory_order_relaxed);
+                }
+                header->m_magic.store(detail::ShmHeader::MAGIC, std::memory_order_release);
+                return *header;
+            }
+            while (header->m_magic.load(std::memory_order_acquire) != detail::ShmHeader::MAGIC)
+            {
+                std::this_thread::yield();
+            }
+            if (header->m_slot_size != sizeof(Cell) or mapping.size() < bytes(header->m_capacity))
+            {
+                throw std::runtime_error("ShmChannel mapping does not hold a channel of this value type!");
+            }
+            return *header;
+        }
+
+        ShmChannel(int fd, size_t capacity, bool create)
+            : m_mapping(fd), m_header(layout(m_mapping, capacity, create)),
+              m_cells(reinterpret_cast<Cell *>(m_mapping.base() + sizeof(detail::ShmHeader))),
+              m_mask(m_header.m_capacity - 1), m_watcher(m_header)
+        {
+        }
+
+    public:
+        // New channel of `capacity` slots (rounded up to a power of two) in an anonymous memfd. Its fd() is
+        // inherited across fork() or sent over a unix socket, and attach()ed on the other side
+        static std::unique_ptr<ShmChannel> create(size_t capacity)
+        {
+            size_t count = slots(capacity);
+            return std::unique_ptr<ShmChannel>(new ShmChannel(detail::ShmMapping::create(bytes(count)), count, true));
+        }
+
+        // Maps the channel another process created, taking ownership of `fd`
+        static std::unique_ptr<ShmChannel> attach(int fd)
+        {
+            return std::unique_ptr<ShmChannel>(new ShmChannel(fd, 0, false));
+        }
+
+        // Channel in named POSIX shared memory, created with `capacity` slots by the first process to open it
+        static std::unique_ptr<ShmChannel> open(const std::string &name, size_t capacity)
+        {
+            size_t count = slots(capacity);
+            bool created = false;
+            int fd = detail::ShmMapping::open(name, bytes(count), created);
+            return std::unique_ptr<ShmChannel>(new ShmChannel(fd, count, created));
+        }
+
+        // Removes the name, mappings stay valid
+        static void unlink(const std::string &name) { detail::ShmMapping::unlink(name); }
+
+        ShmChannel(const ShmChannel &) = delete;
+        ShmChannel &operator=(const ShmChannel &) = delete;
+
+        int fd() const { return m_mapping.fd(); }
+        size_t capacity() const { return m_mask + 1; }
+
+        // Values written but not read yet, a racy snapshot meant for monitoring
+        size_t size() const
+        {
+            return m_header.m_tail.load() - m_header.m_head.load();
+        }
+
+        bool closed() const { return m_header.m_closed.load() != 0; }
+
+        // Reserves the next free slot if there is one right now. Empty if the ring is full or closed
+        Reservation tryReserveWrite()
+        {
+            if (closed())
+            {
+                return {};
+            }
+            uint64_t position = m_header.m_tail.load(std::memory_order_relaxed);
+            while (true)
+            {
+                auto &cell = m_cells[position & m_mask];
+                auto lag = int64_t(cell.m_seq.load(std::memory_order_acquire) - position);
+                if (lag == 0)
+                {
+                    if (m_header.m_tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        return Reservation(this, &cell, position, true);
+                    }
+                }
+                else if (lag < 0)
+                {
+                    return {};
+                }
+                else
+                {
+                    position = m_header.m_tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Reserves the oldest written value if there is one right now
+        Reservation tryReserveRead()
+        {
+            uint64_t position = m_header.m_head.load(std::memory_order_relaxed);
+            while (true)
+            {
+                auto &cell = m_cells[position & m_mask];
+                auto lag = int64_t(cell.m_seq.load(std::memory_order_acquire) - (position + 1));
+                if (lag == 0)
+                {
+                    if (m_header.m_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        return Reservation(this, &cell, position, false);
+                    }
+                }
+                else if (lag < 0)
+                {
+                    return {};
+                }
+                else
+                {
+                    position = m_header.m_head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Blocks for a free slot. Empty once the channel is closed or `context` cancelled
+        Reservation reserveWrite(CancelContext *context = nullptr)
+        {
+            BlockTimer blocked(this);
+            while (not closed())
+            {
+                if (auto reservation = tryReserveWrite())
+                {
+                    return reservation;
+                }
+                blocked.park();
+                auto &writers = m_watcher.writers();
+                std::unique_lock<RoutineMutex> guard(writers.lock());
+                if (not writers.waitUnless(guard, [this]()
+                                           { return writeReady() or closed(); },
+                                           context))
+                {
+                    return {};
+                }
+            }
+            return {};
+        }
+
+        // Blocks for a value. Empty once the channel is closed and drained, or `context` cancelled
+        Reservation reserveRead(CancelContext *context = nullptr)
+        {
+            BlockTimer blocked(this);
+            while (true)
+            {
+                if (auto reservation = tryReserveRead())
+                {
+                    return reservation;
+                }
+                else if (closed())
+                {
+                    // Values committed right before close() are still delivered
+                    return tryReserveRead();
+                }
+                blocked.park();
+                auto &readers = m_watcher.readers();
+                std::unique_lock<RoutineMutex> guard(readers.lock());
+                if (not readers.waitUnless(guard, [this]()
+                                           { return readReady() or closed(); },
+                                           context))
+                {
+                    return {};
+                }
+            }
+        }
+
+        bool readReady() override
+        {
+            uint64_t position = m_header.m_head.load(std::memory_order_relaxed);
+            return int64_t(m_cells[position & m_mask].m_seq.load(std::memory_order_acquire) - (position + 1)) >= 0;
+        }
+
+        bool writeReady() override
+        {
+            uint64_t position = m_header.m_tail.load(std::memory_order_relaxed);
+            return int64_t(m_cells[position & m_mask].m_seq.load(std::memory_order_acquire) - position) >= 0;
+        }
+
+        WaitQueue *readWaiters() override { return &m_watcher.readers(); }
+        WaitQueue *writeWaiters() override { return &m_watcher.writers(); }
+
+        bool tryRead(T &out) override
+        {
+            auto reservation = tryReserveRead();
+            if (not reservation)
+            {
+                return false;
+            }
+            out = *reservation;
+            return true;
+        }
+
+        bool read(T &out) override
+        {
+            return read(out, nullptr);
+        }
+
+        // Also returns false once `context` is cancelled, without reading
+        bool read(T &out, CancelContext *context)
+        {
+            auto reservation = reserveRead(context);
+            if (not reservation)
+            {
+                return false;
+            }
+            out = *reservation;
+            return true;
+        }
+
+        bool write(const T &in) override
+        {
+            return write(in, nullptr);
+        }
+
+        bool write(T &&in) override
+        {
+            return write(in, nullptr);
+        }
+
+        // Gives up (returning false) once `context` is cancelled
+        bool write(const T &in, CancelContext *context)
+        {
+            auto reservation = reserveWrite(context);
+            if (not reservation)
+            {
+                if (closed())
+                {
+                    throw std::runtime_error("Attempted write on a closed channel!");
+                }
+                return false;
+            }
+            *reservation = in;
+            return true;
+        }
+
+        // Readers drain what was committed, then reads return false. Closes it for every process
+        void close() override
+        {
+            m_header.m_closed.store(1);
+            m_watcher.notifyClosed();
+        }
+    };
+}
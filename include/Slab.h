@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <limits>
+#include <new>
+
+#include "Consts.h"
+
+namespace gocpp
+{
+    /*
+    Small object allocator of the runtime. Every processor owns a slab cache with one free list per size class,
+    carved out of SLAB_CHUNK_SIZE chunks dedicated to that class. The executor holding the processor allocates
+    and frees without any atomic operation. Memory freed elsewhere (another executor, a plain thread) is pushed
+    onto a lock free remote list of the owning cache, which takes it back in bulk once its own list runs dry.
+    Threads without a processor share one extra cache under a lock.
+    Objects larger than SLAB_MAX_OBJECT_SIZE or more aligned than SLAB_ALIGNMENT come from the global heap.
+    Hit rate and footprint are reported as the SLAB_* runtime metrics.
+    */
+
+    static const size_t SLAB_ALIGNMENT = alignof(std::max_align_t);
+
+    // Allocates `size` bytes from the calling processor's slab cache. Throws std::bad_alloc
+    void *alloc(size_t size, size_t align = SLAB_ALIGNMENT);
+    // Frees memory from alloc(), from any thread. `size` and `align` must be the ones it was allocated with
+    void dealloc(void *ptr, size_t size, size_t align = SLAB_ALIGNMENT) noexcept;
+
+    // STL allocator over the slab caches, eg. std::deque<T, SlabAllocator<T>>
+    template <typename T>
+    class SlabAllocator
+    {
+    public:
+        using value_type = T;
+
+        SlabAllocator() noexcept = default;
+        template <typename U>
+        SlabAllocator(const SlabAllocator<U> &) noexcept
+        {
+        }
+
+        T *allocate(size_t count)
+        {
+            if (count > std::numeric_limits<size_t>::max() / sizeof(T))
+            {
+                throw std::bad_array_new_length();
+            }
+            return static_cast<T *>(alloc(count * sizeof(T), alignof(T)));
+        }
+
+        void deallocate(T *ptr, size_t count) noexcept
+        {
+            dealloc(ptr, count * sizeof(T), alignof(T));
+        }
+
+        template <typename U>
+        bool operator==(const SlabAllocator<U> &) const noexcept { return true; }
+        template <typename U>
+        bool operator!=(const SlabAllocator<U> &) const noexcept { return false; }
+    };
+
+    namespace detail
+    {
+        // Base of the runtime classes whose instances come from the slab caches
+        class SlabAllocated
+        {
+        public:
+            static void *operator new(size_t size) { return alloc(size); }
+            static void operator delete(void *ptr, size_t size) noexcept { dealloc(ptr, size); }
+        };
+
+        // Whether the calling thread is inside the slab allocator, where it must not be preempted
+        bool slabBusy();
+    }
+}
@@ -0,0 +1,340 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Channel.h"
+#include "Serializer.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    namespace detail
+    {
+        /*
+        Spill file mapped in full, records are appended behind a 4 byte length and read back in order. Created
+        unlinked, its disk space goes back to the filesystem once closed, or the process dies. Every full window
+        gets written back, so spilled data doesn't pile up as dirty page cache, the kernel is advised of the
+        window after the one being read, and consumed windows are punched out of the file. Those system calls
+        are claimed along with appends and reads, and issued by maintain() once the channel's lock is released.
+        */
+        class SpillSegment
+        {
+            int m_fd{-1};
+            char *m_base{nullptr};
+            size_t m_size{0};
+            size_t m_written{0};
+            size_t m_read{0};
+            // Window boundaries up to which writeback got started, readahead requested and space released
+            size_t m_flushed{0};
+            size_t m_advised{0};
+            size_t m_released{0};
+
+        public:
+            static constexpr size_t RECORD_HEADER = sizeof(uint32_t);
+
+            // Byte ranges [from, to) of the file due for writeback, readahead and release
+            struct Maintenance
+            {
+                size_t m_flush_from{0};
+                size_t m_flush_to{0};
+                size_t m_advise_from{0};
+                size_t m_advise_to{0};
+                size_t m_release_from{0};
+                size_t m_release_to{0};
+
+                explicit operator bool() const
+                {
+                    return m_flush_to > m_flush_from or m_advise_to > m_advise_from or m_release_to > m_release_from;
+                }
+            };
+
+            // New segment of at least `size` bytes in `directory`
+            SpillSegment(const std::string &directory, size_t size);
+            ~SpillSegment();
+            SpillSegment(const SpillSegment &) = delete;
+            SpillSegment &operator=(const SpillSegment &) = delete;
+
+            size_t capacity() const { return m_size; }
+
+            // False if the record doesn't fit anymore
+            bool append(const std::string &record);
+            // Next record, valid until the segment is reset() or destroyed
+            std::pair<const char *, size_t> next();
+            bool drained() const { return m_read == m_written; }
+            // What the appends and reads so far call for, each range is only handed out once
+            Maintenance claimMaintenance();
+            // Safe alongside appends and reads, the ranges are never written again
+            void maintain(const Maintenance &maintenance) const;
+            // Empties a drained segment for reuse, releasing its space. Not while anyone still appends or reads
+            void reset();
+        };
+
+        // $TMPDIR if set, /var/tmp otherwise (/tmp is often a tmpfs, whose pages are memory)
+        std::string spillDirectory();
+    }
+
+    /*
+    Buffered channel that never blocks its writers and doesn't grow without bound in memory either. The first
+    `buffer_size` values wait in an in-memory ring as in a Channel. Once the ring is full, values are serialized
+    (see Serializer) and appended to memory mapped segment files in `directory`, where they stay until the
+    readers, having drained the ring, consume them in order. Drained segments are deleted. Meant for bursty
+    producers such as ingestion, where a Channel has to pick between an unbounded buffer and stalling them:
+        SpillChannel<Event> events(4096);
+        go([&] { while (auto event = poll()) events << *event; });  // bursts of millions are fine
+        Event event;
+        while (events >> event)
+            process(event);
+    Any number of routines and threads may read and write it, and it takes part in a Select like any channel.
+    Writes are always ready, bytes spilled so far are counted as the SPILLED_BYTES runtime metric.
+    */
+    template <typename T, typename Codec = Serializer<T>>
+    class SpillChannel : public ReadChannel<T>, public WriteChannel<T>
+    {
+        using BlockTimer = detail::BlockTimer;
+
+        const std::string m_directory;
+        // Holders are not preemptible, segment files are created, maintained and closed with it released
+        RoutineMutex m_lock;
+        // Values in memory live in [m_head, m_head + m_count), they are older than any spilled one
+        std::vector<T> m_ring;
+        size_t m_head{0};
+        size_t m_count{0};
+        // Spill files, oldest first, drained ones are dropped right away. Shared with whoever maintains them
+        std::deque<std::shared_ptr<detail::SpillSegment>> m_segments;
+        // The last segment drained, emptied to take the next burst
+        std::shared_ptr<detail::SpillSegment> m_spare;
+        size_t m_spilled{0};
+        // Values in the ring and on disk, read without the lock
+        std::atomic<size_t> m_size{0};
+        std::atomic_bool m_closed{false};
+        WaitQueue m_readers;
+
+        // Stores in the ring if nothing is spilled (writes must not overtake spilled values), false otherwise
+        template <typename U>
+        bool pushNoSpill(U &&in)
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            if (m_spilled != 0 or m_count == m_ring.size())
+            {
+                return false;
+            }
+            m_ring[(m_head + m_count) % m_ring.size()] = std::forward<U>(in);
+            m_count++;
+            m_size++;
+            return true;
+        }
+
+        void spill(const T &in)
+        {
+            // Serialized before taking the lock, concurrent writers only contend on the append
+            std::string record;
+            Codec::encode(in, record);
+            size_t needed = record.size() + detail::SpillSegment::RECORD_HEADER;
+            // Outlive the guard, so files get created, written back and closed without the lock
+            std::shared_ptr<detail::SpillSegment> fresh;
+            std::shared_ptr<detail::SpillSegment> segment;
+            detail::SpillSegment::Maintenance maintenance;
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                while (m_segments.empty() or not m_segments.back()->append(record))
+                {
+                    // Unless a reader's maintenance still runs on the spare, that could punch out our record
+                    if (m_spare and m_spare.use_count() == 1 and m_spare->capacity() >= needed)
+                    {
+                        m_segments.push_back(std::move(m_spare));
+                    }
+                    else if (fresh)
+                    {
+                        m_segments.push_back(std::move(fresh));
+                    }
+                    else
+                    {
+                        guard.unlock();
+                        fresh = std::make_shared<detail::SpillSegment>(m_directory, std::max(SPILL_SEGMENT_SIZE, needed));
+                        guard.lock();
+                    }
+                }
+                if (fresh and not m_spare)
+                {
+                    // Another writer made room meanwhile, ours takes the next burst
+                    m_spare = std::move(fresh);
+                }
+                m_spilled++;
+                m_size++;
+                maintenance = m_segments.back()->claimMaintenance();
+                if (maintenance)
+                {
+                    segment = m_segments.back();
+                }
+            }
+            if (segment)
+            {
+                segment->maintain(maintenance);
+            }
+            Metrics::local().add(MetricCounter::SPILLED_BYTES, needed);
+        }
+
+        // Releases the space of a segment readers drained and keeps it for the next burst
+        void retire(std::shared_ptr<detail::SpillSegment> segment)
+        {
+            segment->reset();
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            if (not m_spare)
+            {
+                m_spare = std::move(segment);
+            }
+        }
+
+        template <typename U>
+        bool put(U &&in)
+        {
+            if (closed())
+            {
+                throw std::runtime_error("Attempted write on a closed channel!");
+            }
+            if (not pushNoSpill(std::forward<U>(in)))
+            {
+                spill(in);
+            }
+            m_readers.wakeOne();
+            return true;
+        }
+
+        bool readNoBlock(T &out)
+        {
+            if (m_size == 0)
+            {
+                return false;
+            }
+            // Outlives the guard, so the segment is maintained and retired without the lock
+            std::shared_ptr<detail::SpillSegment> segment;
+            detail::SpillSegment::Maintenance maintenance;
+            bool drained = false;
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                if (m_count != 0)
+                {
+                    out = std::move(m_ring[m_head]);
+                    m_head = (m_head + 1) % m_ring.size();
+                    m_count--;
+                    m_size--;
+                    return true;
+                }
+                if (m_spilled == 0)
+                {
+                    // Another reader raced us to it
+                    return false;
+                }
+                // The front segment holds the oldest spilled value
+                auto &front = *m_segments.front();
+                auto [data, size] = front.next();
+                m_spilled--;
+                m_size--;
+                Codec::decode(data, size, out);
+                maintenance = front.claimMaintenance();
+                drained = front.drained();
+                if (maintenance or drained)
+                {
+                    segment = m_segments.front();
+                }
+                if (drained)
+                {
+                    m_segments.pop_front();
+                }
+            }
+            if (maintenance)
+            {
+                segment->maintain(maintenance);
+            }
+            if (drained)
+            {
+                retire(std::move(segment));
+            }
+            return true;
+        }
+
+    public:
+        explicit SpillChannel(size_t buffer_size, std::string directory = detail::spillDirectory())
+            : m_directory(std::move(directory)), m_ring(std::max<size_t>(1, buffer_size))
+        {
+        }
+
+        SpillChannel(const SpillChannel &) = delete;
+        SpillChannel &operator=(const SpillChannel &) = delete;
+
+        // Values written but not read yet, in memory and on disk
+        size_t size() const { return m_size; }
+        // Of which spilled to disk
+        size_t spilled()
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            return m_spilled;
+        }
+        bool closed() const { return m_closed; }
+
+        bool readReady() override { return m_size != 0; }
+        bool writeReady() override { return true; }
+        WaitQueue *readWaiters() override { return &m_readers; }
+
+        bool tryRead(T &out) override
+        {
+            return readNoBlock(out);
+        }
+
+        bool read(T &out) override
+        {
+            return read(out, nullptr);
+        }
+
+        // Blocks for a value. False once the channel is closed and drained, or `context` cancelled
+        bool read(T &out, CancelContext *context)
+        {
+            BlockTimer blocked(this);
+            while (true)
+            {
+                if (readNoBlock(out))
+                {
+                    return true;
+                }
+                else if (closed())
+                {
+                    // Values written right before close() are still delivered
+                    return readNoBlock(out);
+                }
+                blocked.park();
+                std::unique_lock<RoutineMutex> guard(m_readers.lock());
+                if (not m_readers.waitUnless(guard, [this]()
+                                             { return readReady() or closed(); },
+                                             context))
+                {
+                    return false;
+                }
+            }
+        }
+
+        // Never blocks, spills when the ring is full. Throws on a closed channel. Overrides WriteChannel's only
+        // for a copyable T, see detail::CopyingWrite
+        bool write(const T &in)
+        {
+            static_assert(std::is_copy_constructible_v<T>, "Move only values can't be copied into a channel, write an rvalue instead");
+            return put(in);
+        }
+
+        bool write(T &&in) override
+        {
+            return put(std::move(in));
+        }
+
+        void close() override
+        {
+            m_closed = true;
+            m_readers.wakeAll();
+        }
+    };
+}
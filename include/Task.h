@@ -0,0 +1,573 @@
+#pragma once
+#if __cplusplus < 202002L or not defined(__cpp_impl_coroutine)
+#error "Task.h needs C++20 coroutines, configure with -DCPPGO_COROUTINES=ON"
+#endif
+#include <cassert>
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <utility>
+
+#include "CancelContext.h"
+#include "Channel.h"
+#include "Future.h"
+#include "Machines.h"
+#include "Timers.h"
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    template <typename T = void>
+    class Task;
+
+    namespace detail
+    {
+        // Coroutine frames come from the slab caches too
+        class TaskPromiseBase : public SlabAllocated
+        {
+            // Frame co_awaiting us, resumed once we return. Null for a spawned task
+            std::coroutine_handle<> m_continuation;
+            std::exception_ptr m_error;
+
+            struct FinalAwaiter
+            {
+                bool await_ready() const noexcept { return false; }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    auto &promise = static_cast<TaskPromiseBase &>(handle.promise());
+                    return promise.m_continuation ? promise.m_continuation : std::noop_coroutine();
+                }
+
+                void await_resume() const noexcept {}
+            };
+
+        public:
+            // Tasks start once awaited or spawned
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            // The frame stays around for its owner (the Task, or the routine) to collect the result and free it
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() { m_error = std::current_exception(); }
+
+            void setContinuation(std::coroutine_handle<> continuation) { m_continuation = continuation; }
+
+        protected:
+            void rethrow()
+            {
+                if (m_error)
+                {
+                    std::rethrow_exception(m_error);
+                }
+            }
+        };
+
+        template <typename T>
+        class TaskPromise : public TaskPromiseBase
+        {
+            std::optional<T> m_value;
+
+        public:
+            Task<T> get_return_object();
+
+            template <typename U = T>
+            void return_value(U &&value)
+            {
+                m_value.emplace(std::forward<U>(value));
+            }
+
+            T result()
+            {
+                rethrow();
+                return std::move(*m_value);
+            }
+        };
+
+        template <>
+        class TaskPromise<void> : public TaskPromiseBase
+        {
+        public:
+            Task<void> get_return_object();
+            void return_void() const noexcept {}
+            void result() { rethrow(); }
+        };
+
+        /*
+        The stackless routine a spawned Task runs as. Awaited tasks run in their awaiter's routine, so resuming
+        the routine means resuming whichever nested frame suspended last: our awaitables record it on suspension.
+        */
+        class TaskRoutine : public Resumable
+        {
+            std::coroutine_handle<> m_root;
+            std::coroutine_handle<> m_resume;
+
+            static inline thread_local std::coroutine_handle<> t_suspended{};
+
+        public:
+            explicit TaskRoutine(std::coroutine_handle<> root)
+                : m_root(root), m_resume(root)
+            {
+            }
+
+            ~TaskRoutine() override
+            {
+                m_root.destroy();
+            }
+
+            bool resume() override
+            {
+                t_suspended = nullptr;
+                m_resume.resume();
+                if (m_root.done())
+                {
+                    return true;
+                }
+                // Suspended on something other than the awaitables below, nothing could ever resume it
+                assert(t_suspended);
+                m_resume = t_suspended;
+                return false;
+            }
+
+            // Called by awaitables right before `handle` suspends its routine
+            static void suspending(std::coroutine_handle<> handle) { t_suspended = handle; }
+        };
+
+        // Hands the task suspending in `handle` over to `parking`. False if it already fired, the task then goes on
+        inline bool parkTask(std::coroutine_handle<> handle, Parking &parking)
+        {
+            if (parking.fired())
+            {
+                return false;
+            }
+            TaskRoutine::suspending(handle);
+            Executor::current()->parkTask(&parking);
+            return true;
+        }
+
+        // co_await counterpart of Parking::block(context)
+        class Block
+        {
+            Parking &m_parking;
+            CancelContext *const m_context;
+            WaitQueue::Waiter m_cancellation{&m_parking};
+
+        public:
+            Block(Parking &parking, CancelContext *context)
+                : m_parking(parking), m_context(context)
+            {
+            }
+
+            bool await_ready() const { return m_parking.fired(); }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                if (m_context)
+                {
+                    auto &cancellations = m_context->waiters();
+                    std::unique_lock<RoutineMutex> guard(cancellations.lock());
+                    if (not m_context->done())
+                    {
+                        cancellations.enqueue(m_cancellation);
+                    }
+                    else if (m_parking.claim(&cancellations))
+                    {
+                        m_parking.fire();
+                    }
+                }
+                return parkTask(handle, m_parking);
+            }
+
+            // False if `context` got cancelled first
+            bool await_resume()
+            {
+                if (m_context == nullptr)
+                {
+                    return true;
+                }
+                auto &cancellations = m_context->waiters();
+                {
+                    std::unique_lock<RoutineMutex> guard(cancellations.lock());
+                    cancellations.remove(m_cancellation);
+                }
+                return m_parking.wokenBy() != &cancellations;
+            }
+        };
+
+        // co_await counterpart of WaitQueue::waitUnless(), taking the queue's lock itself
+        template <typename Ready>
+        class WaitUnless
+        {
+            WaitQueue &m_queue;
+            Ready m_ready;
+            Parking m_parking;
+            WaitQueue::Waiter m_waiter{&m_parking};
+            Block m_block;
+            bool m_was_ready{false};
+
+        public:
+            WaitUnless(WaitQueue &queue, Ready ready, CancelContext *context)
+                : m_queue(queue), m_ready(std::move(ready)), m_block(m_parking, context)
+            {
+            }
+
+            bool await_ready() const { return false; }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                {
+                    std::unique_lock<RoutineMutex> guard(m_queue.lock());
+                    m_queue.enqueue(m_waiter);
+                    m_was_ready = m_ready();
+                    if (m_was_ready)
+                    {
+                        m_queue.remove(m_waiter);
+                        return false;
+                    }
+                }
+                return m_block.await_suspend(handle);
+            }
+
+            bool await_resume()
+            {
+                if (m_was_ready)
+                {
+                    return true;
+                }
+                bool woken = m_block.await_resume();
+                // Taking the lock also waits out the notifier, which fires under it
+                std::unique_lock<RoutineMutex> guard(m_queue.lock());
+                m_queue.remove(m_waiter);
+                return woken;
+            }
+        };
+
+        class SleepUntil
+        {
+            const Clock::time_point m_deadline;
+            CancelContext *const m_context;
+            Parking m_parking;
+            Block m_block;
+            Timers::Handle m_timer;
+            bool m_elapsed{false};
+
+        public:
+            SleepUntil(Clock::time_point deadline, CancelContext *context)
+                : m_deadline(deadline), m_context(context), m_block(m_parking, context)
+            {
+            }
+
+            bool await_ready()
+            {
+                m_elapsed = m_deadline <= Clock::now();
+                return m_elapsed;
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                m_timer = Timers::instance().schedule(m_deadline, &m_parking);
+                return m_block.await_suspend(handle);
+            }
+
+            bool await_resume()
+            {
+                if (m_elapsed)
+                {
+                    return not (m_context and m_context->done());
+                }
+                bool slept = m_block.await_resume();
+                if (not slept)
+                {
+                    Timers::instance().cancel(m_timer);
+                }
+                return slept;
+            }
+        };
+
+        struct Yield
+        {
+            bool await_ready() const noexcept { return false; }
+
+            void await_suspend(std::coroutine_handle<> handle) const noexcept
+            {
+                // Not parked, so the scheduler requeues us
+                TaskRoutine::suspending(handle);
+            }
+
+            void await_resume() const noexcept {}
+        };
+    }
+
+    /*
+    Stackless routine: a C++20 coroutine that lives in a heap frame of a few hundred bytes instead of a stack
+    of its own, for fanning out to millions of mostly waiting routines. Spawned with go(), tasks are scheduled on
+    the same processors and executors as stackful routines, and run on the scheduler's stack until they suspend:
+        Task<> handle(Channel<Request> &requests)
+        {
+            Request request;
+            while (co_await async::read(requests, request))
+                co_await async::sleepFor(request.delay);
+        }
+        go(handle(requests));
+    A task can only switch out at a co_await of another Task or of the async:: operations below, which work on
+    the same channels, contexts and futures as their blocking counterparts. Blocking calls (channel operators,
+    sleepFor, Future::get, Select) abort, and since the stack is shared tasks are never preempted and should
+    keep their call depth modest: long computations and deep recursion belong in stackful routines.
+    co_await'ing a Task runs it to completion within the awaiting routine, yielding its result or rethrowing
+    its exception. Exceptions escaping a spawned task are dropped, like those of go() routines.
+    */
+    template <typename T>
+    class [[nodiscard]] Task
+    {
+    public:
+        using promise_type = detail::TaskPromise<T>;
+
+    private:
+        friend promise_type;
+        std::coroutine_handle<promise_type> m_handle;
+
+        explicit Task(std::coroutine_handle<promise_type> handle)
+            : m_handle(handle)
+        {
+        }
+
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> m_handle;
+
+            bool await_ready() const noexcept { return m_handle.done(); }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                m_handle.promise().setContinuation(awaiting);
+                return m_handle;
+            }
+
+            T await_resume() { return m_handle.promise().result(); }
+        };
+
+    public:
+        Task(Task &&other) noexcept
+            : m_handle(std::exchange(other.m_handle, nullptr))
+        {
+        }
+
+        Task &operator=(Task &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (m_handle)
+                {
+                    m_handle.destroy();
+                }
+                m_handle = std::exchange(other.m_handle, nullptr);
+            }
+            return *this;
+        }
+
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+
+        ~Task()
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+        }
+
+        Awaiter operator co_await() noexcept { return Awaiter{m_handle}; }
+
+        // Hands the coroutine frame over to the caller, to spawn it
+        std::coroutine_handle<promise_type> release() { return std::exchange(m_handle, nullptr); }
+    };
+
+    namespace detail
+    {
+        template <typename T>
+        Task<T> TaskPromise<T>::get_return_object()
+        {
+            return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+        }
+
+        inline Task<void> TaskPromise<void>::get_return_object()
+        {
+            return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+        }
+
+        template <typename T, typename Kind>
+        struct ChannelTasks
+        {
+            static Task<bool> read(Channel<T, Kind> &channel, T &out, CancelContext *context)
+            {
+                BlockTimer blocked(&channel);
+                while (true)
+                {
+                    if (channel.readNoBlock(out))
+                    {
+                        co_return true;
+                    }
+                    else if (channel.closed())
+                    {
+                        co_return false;
+                    }
+                    blocked.park();
+                    channel.m_blocked_readers++;
+                    // Select writers wait for a reader to block
+                    channel.m_writers.wakeAll();
+                    bool woken = co_await WaitUnless(channel.m_readers, [&channel]()
+                                                     { return channel.hasValue() or channel.closed(); },
+                                                     context);
+                    channel.m_blocked_readers--;
+                    if (not woken)
+                    {
+                        co_return false;
+                    }
+                }
+            }
+
+            // Owns its arguments, the awaiting frame may be gone by the time they are consumed
+            template <typename... Args>
+            static Task<bool> put(Channel<T, Kind> &channel, CancelContext *context, Args... args)
+            {
+                BlockTimer blocked(&channel);
+                while (true)
+                {
+                    Parking handoff;
+                    auto *registered = &handoff;
+                    if (channel.writeNoBlock(registered, std::move(args)...))
+                    {
+                        if (registered)
+                        {
+                            blocked.park();
+                            co_return co_await awaitHandoff(channel, handoff, context);
+                        }
+                        co_return true;
+                    }
+                    blocked.park();
+                    if (not co_await WaitUnless(channel.m_writers, [&channel]()
+                                                { return channel.hasRoom() or channel.closed(); },
+                                                context))
+                    {
+                        co_return false;
+                    }
+                }
+            }
+
+            static Task<bool> awaitHandoff(Channel<T, Kind> &channel, Parking &handoff, CancelContext *context)
+            {
+                if (co_await Block(handoff, context))
+                {
+                    co_return true;
+                }
+                {
+                    // Cancelled, withdraw the value unless a reader took it meanwhile
+                    SpinYieldLock<RoutineMutex> writeLock(channel.m_lock);
+                    if (channel.m_handoff != &handoff)
+                    {
+                        co_return true;
+                    }
+                    channel.m_handoff = nullptr;
+                    Channel<T, Kind>::value(channel.m_data)->~T();
+                    channel.unset(Channel<T, Kind>::State::WRITE_COMPLETE);
+                }
+                channel.m_writers.wakeOne();
+                co_return false;
+            }
+        };
+
+        template <typename T>
+        Task<> fulfil(Task<T> task, std::shared_ptr<FutureState<T>> state)
+        {
+            try
+            {
+                if constexpr (std::is_void_v<T>)
+                {
+                    co_await task;
+                    state->set(true);
+                }
+                else
+                {
+                    state->set(co_await task);
+                }
+            }
+            catch (...)
+            {
+                state->fail(std::current_exception());
+            }
+        }
+    }
+
+    // Suspending counterparts of the blocking operations, to be co_await'ed from within a Task
+    namespace async
+    {
+        // Channel::read(), false once the channel is closed (or `context` cancelled)
+        template <typename T, typename Kind>
+        Task<bool> read(Channel<T, Kind> &channel, T &out, CancelContext *context = nullptr)
+        {
+            return detail::ChannelTasks<T, Kind>::read(channel, out, context);
+        }
+
+        // Channel::write(), `value` is copied (or moved) into the task first
+        template <typename T, typename Kind, typename U>
+        Task<bool> write(Channel<T, Kind> &channel, U &&value, CancelContext *context = nullptr)
+        {
+            return detail::ChannelTasks<T, Kind>::put(channel, context, T(std::forward<U>(value)));
+        }
+
+        // Lets the other routines of the processor run first
+        inline detail::Yield yield() { return {}; }
+
+        // False if `context` got cancelled first
+        inline detail::SleepUntil sleepUntil(Clock::time_point deadline, CancelContext *context = nullptr)
+        {
+            return detail::SleepUntil(deadline, context);
+        }
+
+        template <typename Rep, typename Period>
+        detail::SleepUntil sleepFor(const std::chrono::duration<Rep, Period> &duration, CancelContext *context = nullptr)
+        {
+            return async::sleepUntil(Clock::now() + std::chrono::duration_cast<Clock::duration>(duration), context);
+        }
+
+        // Future::wait(), false if `context` got cancelled first
+        template <typename T>
+        Task<bool> wait(Future<T> &future, CancelContext *context = nullptr)
+        {
+            auto &state = *future.state();
+            co_return co_await detail::WaitUnless(state.waiters(), [&state]()
+                                                  { return state.ready(); },
+                                                  context);
+        }
+
+        // Future::get(), rethrowing the routine's exception
+        template <typename T>
+        Task<T> get(Future<T> &future)
+        {
+            co_await wait(future);
+            co_return future.get();
+        }
+    }
+}
+
+// Spawns `task` as a stackless routine of the spawning routine's class
+inline void go(gocpp::Task<> &&task)
+{
+    gocpp::Machines::getInstance()->submitTask(std::make_unique<gocpp::detail::TaskRoutine>(task.release()),
+                                               gocpp::Machines::currentPriority());
+}
+
+inline void goWithPriority(gocpp::Priority priority, gocpp::Task<> &&task)
+{
+    gocpp::Machines::getInstance()->submitTask(std::make_unique<gocpp::detail::TaskRoutine>(task.release()), priority);
+}
+
+// Runs `task` as a stackless routine, its result (or exception) comes back through a Future that stackful
+// routines and threads can block on
+template <typename T>
+gocpp::Future<T> goAsync(gocpp::Task<T> &&task)
+{
+    auto state = std::make_shared<gocpp::detail::FutureState<T>>();
+    go(gocpp::detail::fulfil(std::move(task), state));
+    return gocpp::Future<T>(state);
+}
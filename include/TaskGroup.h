@@ -0,0 +1,95 @@
+#pragma once
+#include <exception>
+#include <type_traits>
+
+#include "CancelContext.h"
+#include "Machines.h"
+
+namespace gocpp
+{
+    /*
+    Structured scope for a set of routines (Go's errgroup with SetLimit). At most `maxInFlight` children run
+    at once: spawn() parks the caller while the group is full, so a burst of input can't pile up routines
+    (and their stacks) faster than they complete. wait() parks until every child finished and rethrows the
+    first exception any of them threw. That first exception also cancels context(), which children can
+    pass to blocking calls to give up early, and children that did not start yet are skipped.
+        TaskGroup group(64, request);
+        for (auto &url : urls)
+            group.spawn([&, url](CancelContext *ctx) { fetch(url, ctx); });
+        group.wait();
+    Children must not spawn() into their own full group, they would wait for themselves.
+    The destructor waits for the children too, but leaves their exception unreported.
+    */
+    class TaskGroup
+    {
+        // Cancelled on the first error, or along with the parent context
+        const CancelContextPtr m_context;
+        const size_t m_max_in_flight;
+        // Spawners waiting for a slot and wait() callers, its lock guards the members below
+        WaitQueue m_waiters;
+        size_t m_in_flight{0};
+        std::exception_ptr m_error;
+
+        // Takes a slot, parking while the group is full. False once the group got cancelled
+        bool acquire();
+        // Gives the slot back and wakes whoever waits for it or for the group to drain
+        void release();
+        // Records the first error and cancels the remaining children
+        void fail(std::exception_ptr error);
+
+    public:
+        explicit TaskGroup(size_t maxInFlight = SIZE_MAX, const CancelContextPtr &parent = nullptr);
+        ~TaskGroup();
+        TaskGroup(const TaskGroup &) = delete;
+        TaskGroup &operator=(const TaskGroup &) = delete;
+
+        // Runs fn() or fn(context()) in a new routine of the caller's class. Parks while maxInFlight children run,
+        // returns false (without running fn) once the group is cancelled
+        template <typename Fn>
+        bool spawn(Fn &&fn)
+        {
+            if (not acquire())
+            {
+                return false;
+            }
+            try
+            {
+                Machines::getInstance()->submitRoutine([this, fn = std::decay_t<Fn>(std::forward<Fn>(fn))]() mutable
+                                                       {
+                                                           if (not m_context->done())
+                                                           {
+                                                               try
+                                                               {
+                                                                   if constexpr (std::is_invocable_v<std::decay_t<Fn> &, CancelContext *>)
+                                                                   {
+                                                                       fn(m_context.get());
+                                                                   }
+                                                                   else
+                                                                   {
+                                                                       fn();
+                                                                   }
+                                                               }
+                                                               catch (...)
+                                                               {
+                                                                   fail(std::current_exception());
+                                                               }
+                                                           }
+                                                           release();
+                                                       });
+            }
+            catch (...)
+            {
+                release();
+                throw;
+            }
+            return true;
+        }
+
+        // Parks until every child finished, then rethrows the first exception thrown by one of them
+        void wait();
+
+        // Children currently holding a slot
+        size_t inFlight();
+        CancelContext *context() const { return m_context.get(); }
+    };
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <thread>
+
+#include "WaitQueue.h"
+
+namespace gocpp
+{
+    using Clock = std::chrono::steady_clock;
+
+    namespace detail
+    {
+        /*
+        Process wide timer queue for sleeps and context deadlines, served by one lazily started thread.
+        Parkings are fired under the timer lock, so that cancel() returning means the parking is no longer
+        referenced. Callbacks run outside of it and may take other locks.
+        */
+        class Timers
+        {
+        public:
+            struct Handle
+            {
+                Clock::time_point m_deadline{};
+                uint64_t m_id{0};
+            };
+
+        private:
+            struct Entry
+            {
+                Parking *m_parking{nullptr};
+                std::function<void()> m_callback;
+            };
+
+            RoutineMutex m_lock;
+            std::condition_variable_any m_changed;
+            std::map<std::pair<Clock::time_point, uint64_t>, Entry> m_entries;
+            uint64_t m_next_id{1};
+            std::thread m_thread;
+
+            Timers();
+            void run();
+            Handle add(Clock::time_point deadline, Entry &&entry);
+
+        public:
+            static Timers &instance();
+
+            // Claims and fires `parking` at `deadline`, unless another notifier claimed it first
+            Handle schedule(Clock::time_point deadline, Parking *parking);
+            Handle schedule(Clock::time_point deadline, std::function<void()> callback);
+            // Drops a pending timer, false if it already fired
+            bool cancel(const Handle &handle);
+        };
+    }
+
+    // Parks the calling routine (or sleeps a plain thread) until `deadline`. Returns false if `context` got cancelled first
+    bool sleepUntil(Clock::time_point deadline, CancelContext *context = nullptr);
+
+    template <typename Rep, typename Period>
+    bool sleepFor(const std::chrono::duration<Rep, Period> &duration, CancelContext *context = nullptr)
+    {
+        return sleepUntil(Clock::now() + std::chrono::duration_cast<Clock::duration>(duration), context);
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Consts.h"
+
+#define GO_TRACE(type, routine, arg)                        \
+    do                                                      \
+    {                                                       \
+        if (__builtin_expect(gocpp::Tracer::enabled(), 0)) \
+        {                                                   \
+            gocpp::Tracer::emit((type), (routine), (arg));  \
+        }                                                   \
+    } while (0)
+
+namespace gocpp
+{
+    enum TraceEventType : uint8_t
+    {
+        TRACE_SPAWN = 0,       // arg: spawning routine
+        TRACE_START,           // arg: processor the routine was picked from
+        TRACE_PREEMPT,         // routine stopped by the timer signal
+        TRACE_YIELD,           // routine voluntarily switched to the scheduler
+        TRACE_FINISH,          // routine returned
+        TRACE_PARK,            // arg: channel the routine blocks on, 0 for other waits
+        TRACE_UNPARK,          // arg: channel the routine was blocked on, 0 for other waits
+        TRACE_STEAL,           // arg: victim processor, routine: number of routines stolen
+        TRACE_GLOBAL_PULL,     // routine: number of routines pulled from the global queue
+        TRACE_PROC_ACQUIRE,    // arg: processor id
+        TRACE_PROC_RELEASE,    // arg: processor id
+        TRACE_SYSCALL_ENTER,
+        TRACE_SYSCALL_EXIT,
+        NUM_TRACE_EVENT_TYPES
+    };
+
+    static const char *const TRACE_EVENT_NAMES[] = {
+        "spawn",
+        "start",
+        "preempt",
+        "yield",
+        "finish",
+        "park",
+        "unpark",
+        "steal",
+        "global_pull",
+        "proc_acquire",
+        "proc_release",
+        "syscall_enter",
+        "syscall_exit",
+    };
+
+    // Compact binary record, written as is into the trace file
+    struct TraceEvent
+    {
+        uint64_t m_timestamp;
+        uint64_t m_arg;
+        uint32_t m_routine;
+        int16_t m_executor;
+        uint8_t m_type;
+        uint8_t m_reserved;
+    };
+    static_assert(sizeof(TraceEvent) == 24, "TraceEvent is part of the on disk format");
+
+    /*
+    Single producer, single consumer ring of trace events owned by one thread.
+    The owning thread appends, the tracer's flush thread drains. A full ring drops events
+    (and counts them) rather than ever making the producer wait. Once its thread exits the
+    ring is drained and handed to the next thread that starts tracing.
+    */
+    class TraceBuffer
+    {
+    public:
+        static constexpr size_t CAPACITY = size_t(1) << 14;
+
+        TraceBuffer(int executor) : m_executor(executor) {}
+
+        void push(TraceEventType type, uint32_t routine, uint64_t arg, uint64_t timestamp);
+        // Hands every pending event to `sink`, returns the number of events drained
+        size_t drain(FILE *sink);
+        // Drops every pending event
+        void discard();
+
+        int executor() const { return m_executor; }
+        // Only while no thread owns the buffer
+        void setExecutor(int executor) { m_executor = executor; }
+        uint64_t dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    private:
+        TraceEvent m_events[CAPACITY];
+        int m_executor;
+        alignas(64) std::atomic<uint64_t> m_head{0};
+        alignas(64) std::atomic<uint64_t> m_tail{0};
+        std::atomic<uint64_t> m_dropped{0};
+    };
+
+    /*
+    Opt-in execution tracer. When stopped, every trace site costs a single relaxed load and a
+    well predicted branch (see GO_TRACE). When started, each thread lazily gets its own TraceBuffer
+    and a background thread streams all buffers into the trace file. Buffers of exited threads are
+    reused, so there are only ever as many as threads tracing at the same time.
+    File layout: TRACE_MAGIC followed by raw TraceEvent records.
+    */
+    class Tracer
+    {
+        static inline std::atomic_bool s_enabled{false};
+        static inline std::mutex s_lock;
+        static inline std::vector<std::unique_ptr<TraceBuffer>> s_buffers;
+        // Buffers of exited threads, drained and ready for another thread
+        static inline std::vector<TraceBuffer *> s_free;
+        static inline thread_local TraceBuffer *t_buffer{nullptr};
+        static inline FILE *s_file{nullptr};
+        static inline std::thread s_flusher;
+        static inline std::atomic_bool s_flushing{false};
+
+        static TraceBuffer *localBuffer();
+        // Drains the calling thread's buffer into the free list, at thread exit
+        static void retireBuffer();
+        static void flush();
+
+    public:
+        static constexpr char TRACE_MAGIC[8] = {'G', 'O', 'T', 'R', 'A', 'C', 'E', '1'};
+
+        static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+
+        // Starts streaming events into `path`, returns false if the file could not be opened
+        static bool start(const std::string &path);
+        // Stops tracing and flushes everything recorded so far
+        static void stop();
+
+        // Records one event on the calling thread's buffer, use GO_TRACE instead
+        static void emit(TraceEventType type, uint32_t routine, uint64_t arg);
+
+        // Id of the routine running on the calling thread, 0 outside of routines
+        static uint32_t currentRoutine();
+
+        // Number of events lost to full buffers in the current or last trace
+        static uint64_t dropped();
+
+        // Offline helpers used by the cppgo_trace converter
+        static bool load(const std::string &path, std::vector<TraceEvent> &events);
+        // Chrome trace event JSON, also opened directly by ui.perfetto.dev
+        static void exportChromeJson(const std::vector<TraceEvent> &events, FILE *out);
+        // Native Perfetto protobuf trace (TrackEvent packets)
+        static void exportPerfetto(const std::vector<TraceEvent> &events, FILE *out);
+    };
+}
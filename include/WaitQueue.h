@@ -0,0 +1,168 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+
+#include "Futex.h"
+#include "Routine.h"
+
+namespace gocpp
+{
+    class CancelContext;
+    class WaitQueue;
+
+    /*
+    std::mutex that is safe to hold from routine code: preemption of the holder is off until unlock().
+    A plain std::mutex held by a preempted routine would block every other routine of that executor
+    trying to take it (and the holder could be resumed, and unlock, on another thread).
+    Critical sections must stay short and must not block.
+    */
+    class RoutineMutex
+    {
+        std::mutex m_lock;
+        bool m_preemptible{false};
+
+    public:
+        void lock();
+        bool try_lock();
+        void unlock();
+    };
+
+    /*
+    One blocked routine or thread, possibly waiting on several WaitQueues at once (Go's sudog + selectDone).
+    Exactly one notifier claims it, the claim decides which queue woke it up. The parked routine is handed
+    over without locks: whichever of the parking executor and the notifier comes second makes it runnable.
+    */
+    class Parking
+    {
+        enum State : uint32_t
+        {
+            WAITING = 0, // registered, the owner has not switched out yet
+            PARKED,      // routine handed over in m_routine
+            FIRED        // notified
+        };
+
+        std::atomic<uint32_t> m_state{WAITING};
+        std::atomic_bool m_claimed{false};
+        // Queue whose notify() claimed us, null for timers and cancellations
+        WaitQueue *m_woken_by{nullptr};
+        RoutinePtr m_routine;
+        // Owner is a plain thread, futex waiting on m_state
+        const bool m_thread;
+
+    public:
+        Parking();
+        Parking(const Parking &) = delete;
+        Parking &operator=(const Parking &) = delete;
+
+        // True for exactly one caller, the one that gets to fire()
+        bool claim(WaitQueue *by = nullptr)
+        {
+            if (m_claimed.exchange(true))
+            {
+                return false;
+            }
+            m_woken_by = by;
+            return true;
+        }
+        bool claimed() const { return m_claimed; }
+        bool fired() const { return m_state.load(std::memory_order_acquire) == State::FIRED; }
+        // Valid once block() returned
+        WaitQueue *wokenBy() const { return m_woken_by; }
+        // Wakes the owner, only after a successful claim()
+        void fire();
+
+        // Blocks the owner until fired: parks the calling routine, futex waits a plain thread
+        void block();
+        // Also gives up once `context` is cancelled, returning false. The context then holds the claim,
+        // so no other notifier touches this parking anymore
+        bool block(CancelContext *context);
+
+        // Scheduler side of block(), takes ownership of the switched out routine
+        void commit(RoutinePtr &&routine);
+    };
+
+    /*
+    FIFO of Parkings waiting for a condition protected by lock(). The usual pattern:
+        std::unique_lock<RoutineMutex> guard(queue.lock());
+        while (not condition)
+            queue.wait(guard);
+    and whoever makes the condition true calls notifyOne()/notifyAll() with the lock held.
+    Hot paths can skip the lock instead: waiters queue up before checking the condition (waitUnless()),
+    so a notifier that changed the condition through atomics may call wakeOne()/wakeAll(), which only
+    lock when someone is queued.
+    */
+    class WaitQueue
+    {
+    public:
+        // Intrusive node, lives on the waiter's stack
+        struct Waiter
+        {
+            Parking *m_parking{nullptr};
+            Waiter *m_prev{nullptr};
+            Waiter *m_next{nullptr};
+            bool m_linked{false};
+        };
+
+    private:
+        RoutineMutex m_lock;
+        Waiter *m_head{nullptr};
+        Waiter *m_tail{nullptr};
+        // Queued waiters, read without the lock by wakeOne()/wakeAll()
+        std::atomic<uint32_t> m_size{0};
+        // Bumped and futex woken on every enqueue() if set, see signalEnqueues()
+        std::atomic<uint32_t> *m_enqueues{nullptr};
+
+        // Blocks the owner of the queued `waiter` and dequeues it again, see wait()
+        bool park(std::unique_lock<RoutineMutex> &guard, Waiter &waiter, CancelContext *context);
+
+    public:
+        RoutineMutex &lock() { return m_lock; }
+
+        // Blocks until notified. `guard` must hold lock(), it is released while blocked and re-taken afterwards.
+        // With a `context`, also returns (false) once it is cancelled
+        bool wait(std::unique_lock<RoutineMutex> &guard, CancelContext *context = nullptr);
+
+        // Like wait(), but returns right away if `ready()` holds once queued
+        template <typename Ready>
+        bool waitUnless(std::unique_lock<RoutineMutex> &guard, Ready &&ready, CancelContext *context = nullptr)
+        {
+            Parking parking;
+            Waiter waiter{&parking};
+            enqueue(waiter);
+            if (ready())
+            {
+                remove(waiter);
+                return true;
+            }
+            return park(guard, waiter, context);
+        }
+
+        // Wakes up to `count` waiters, returns how many were woken. lock() must be held
+        size_t notify(size_t count);
+        bool notifyOne() { return notify(1) == 1; }
+        size_t notifyAll() { return notify(SIZE_MAX); }
+
+        // Take lock() themselves, and skip it while nobody is queued. Only for waiters using waitUnless()
+        void wakeOne() { wake(1); }
+        void wakeAll() { wake(SIZE_MAX); }
+        void wake(size_t count)
+        {
+            if (m_size.load() != 0)
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                notify(count);
+            }
+        }
+
+        // Lower level interface for waiting on several queues at once, lock() must be held
+        void enqueue(Waiter &waiter);
+        // Unlinks `waiter` if it is still queued
+        void remove(Waiter &waiter);
+        bool empty() const { return m_head == nullptr; }
+        // Queued waiters, without the lock
+        size_t waiting() const { return m_size.load(); }
+        // Lets a helper thread sleep on `word` until someone queues up here, for queues that are also
+        // notified from outside the process (see ShmChannel). Set before the queue is used
+        void signalEnqueues(std::atomic<uint32_t> *word) { m_enqueues = word; }
+    };
+}
@@ -0,0 +1,196 @@
+#include "BlockProfiler.h"
+#include "Executor.h"
+#include "Metrics.h"
+#include "Pprof.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <pthread.h>
+#include <stdio.h>
+
+namespace gocpp
+{
+    namespace
+    {
+        // Bounds of the calling thread's own stack, looked up once per thread
+        void threadStack(uintptr_t &low, uintptr_t &high)
+        {
+            static thread_local uintptr_t t_low = 0, t_high = 0;
+            if (t_high == 0)
+            {
+                pthread_attr_t attributes;
+                void *address = nullptr;
+                size_t size = 0;
+                if (pthread_getattr_np(pthread_self(), &attributes) == 0)
+                {
+                    pthread_attr_getstack(&attributes, &address, &size);
+                    pthread_attr_destroy(&attributes);
+                }
+                t_low = uintptr_t(address);
+                t_high = t_low + size;
+            }
+            low = t_low;
+            high = t_high;
+        }
+
+        uint64_t nextRandom()
+        {
+            // xorshift64*, plenty for picking samples
+            static thread_local uint64_t t_state = 0;
+            if (t_state == 0)
+            {
+                t_state = nowNanos() ^ uintptr_t(&t_state) ^ 0x9e3779b97f4a7c15ull;
+            }
+            t_state ^= t_state >> 12;
+            t_state ^= t_state << 25;
+            t_state ^= t_state >> 27;
+            return t_state * 0x2545f4914f6cdd1dull;
+        }
+    }
+
+    bool BlockProfiler::start(uint64_t rateNanos)
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        if (enabled())
+        {
+            return false;
+        }
+        s_sites.clear();
+        s_objects.clear();
+        s_started = nowNanos();
+        s_rate.store(std::max<uint64_t>(rateNanos, 1), std::memory_order_relaxed);
+        return true;
+    }
+
+    bool BlockProfiler::stop(const std::string &path)
+    {
+        auto labels = Profiler::labels();
+        std::unique_lock<std::mutex> lock(s_lock);
+        s_rate.store(0, std::memory_order_relaxed);
+
+        PprofBuilder builder({{"contentions", "count"}, {"delay", "nanoseconds"}}, {"contentions", "count"}, 1);
+        builder.setDuration(int64_t(nowNanos() - s_started));
+        for (auto &[site, totals] : s_sites)
+        {
+            auto &[kind, object, label, stack] = site;
+            std::vector<PprofBuilder::Label> sampleLabels{{"kind", BLOCK_KIND_NAMES[kind]}, {"object", nameOf(object)}};
+            if (label != 0 and label < labels.size())
+            {
+                sampleLabels.push_back({"label", labels[label]});
+            }
+            builder.addSample(stack.data(), stack.size(), {int64_t(totals.m_count + 0.5), int64_t(totals.m_nanos + 0.5)},
+                              std::move(sampleLabels));
+        }
+        return builder.write(path);
+    }
+
+    void BlockProfiler::setName(const void *object, const std::string &name)
+    {
+        // Holding s_lock across a preemption could deadlock another routine on this executor
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        {
+            std::unique_lock<std::mutex> lock(s_lock);
+            if (name.empty())
+            {
+                s_names.erase(object);
+            }
+            else
+            {
+                s_names[object] = name;
+            }
+        }
+        if (executor)
+        {
+            executor->setPreemptible(preemptible);
+        }
+    }
+
+    std::string BlockProfiler::nameOf(const void *object)
+    {
+        auto found = s_names.find(object);
+        if (found != s_names.end())
+        {
+            return found->second;
+        }
+        char address[2 + 2 * sizeof(uintptr_t) + 1];
+        snprintf(address, sizeof(address), "%#llx", static_cast<unsigned long long>(uintptr_t(object)));
+        return address;
+    }
+
+    std::vector<BlockProfiler::Contention> BlockProfiler::contentions(size_t limit)
+    {
+        std::vector<Contention> result;
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        {
+            std::unique_lock<std::mutex> lock(s_lock);
+            for (auto &[key, totals] : s_objects)
+            {
+                result.push_back({key.first, key.second, nameOf(key.first), uint64_t(totals.m_count + 0.5),
+                                  uint64_t(totals.m_nanos + 0.5)});
+            }
+        }
+        if (executor)
+        {
+            executor->setPreemptible(preemptible);
+        }
+        std::sort(result.begin(), result.end(), [](const Contention &left, const Contention &right)
+                  { return left.m_nanos > right.m_nanos; });
+        result.resize(std::min(limit, result.size()));
+        return result;
+    }
+
+    __attribute__((noinline)) void BlockProfiler::record(BlockKind kind, const void *object, uint64_t nanos)
+    {
+        auto rate = s_rate.load(std::memory_order_relaxed);
+        if (rate == 0)
+        {
+            return;
+        }
+        double weight = 1;
+        if (nanos < rate)
+        {
+            // Kept with probability nanos / rate, standing in for rate / nanos such waits
+            if (nextRandom() % rate >= nanos)
+            {
+                return;
+            }
+            weight = double(rate) / double(nanos);
+        }
+
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        auto *routine = executor ? executor->activeRoutine() : nullptr;
+        uintptr_t low, high;
+        if (routine and not routine->stackless())
+        {
+            low = uintptr_t(routine->runContext()->stackBegin());
+            high = uintptr_t(routine->runContext()->stackEnd());
+        }
+        else
+        {
+            // Stackless routines run on the scheduler's stack, which isn't the thread's: their stacks end at the leaf
+            threadStack(low, high);
+        }
+        uintptr_t stack[MAX_DEPTH];
+        auto depth = detail::walkFrames(uintptr_t(__builtin_frame_address(0)), low, high, stack, 0, MAX_DEPTH);
+        if (depth == 0)
+        {
+            stack[depth++] = uintptr_t(__builtin_return_address(0));
+        }
+        {
+            std::unique_lock<std::mutex> lock(s_lock);
+            auto &site = s_sites[Site{kind, object, routine ? routine->label() : 0, std::vector<uintptr_t>(stack, stack + depth)}];
+            site.m_count += weight;
+            site.m_nanos += weight * double(nanos);
+            auto &totals = s_objects[{object, kind}];
+            totals.m_count += weight;
+            totals.m_nanos += weight * double(nanos);
+        }
+        if (executor)
+        {
+            executor->setPreemptible(preemptible);
+        }
+    }
+}
@@ -0,0 +1,126 @@
+#include "CancelContext.h"
+
+#include <algorithm>
+
+namespace gocpp
+{
+    bool CancelContext::DoneChannel::tryRead(bool &out)
+    {
+        out = m_context.done();
+        return out;
+    }
+
+    bool CancelContext::DoneChannel::read(bool &out)
+    {
+        m_context.wait();
+        out = true;
+        return true;
+    }
+
+    CancelContext::CancelContext(const CancelContextPtr &parent, Clock::time_point deadline)
+        : m_parent(parent), m_deadline(parent ? std::min(deadline, parent->deadline()) : deadline)
+    {
+    }
+
+    CancelContext::~CancelContext()
+    {
+        if (m_timer.m_id != 0)
+        {
+            detail::Timers::instance().cancel(m_timer);
+        }
+        if (m_parent)
+        {
+            std::unique_lock<RoutineMutex> guard(m_parent->m_waiters.lock());
+            auto &siblings = m_parent->m_children;
+            siblings.erase(std::find(siblings.begin(), siblings.end(), this));
+        }
+    }
+
+    CancelContextPtr CancelContext::create(const CancelContextPtr &parent, Clock::time_point deadline)
+    {
+        auto context = std::make_shared<CancelContext>(parent, deadline);
+        if (parent)
+        {
+            std::unique_lock<RoutineMutex> guard(parent->m_waiters.lock());
+            parent->m_children.push_back(context.get());
+            if (parent->done())
+            {
+                std::unique_lock<RoutineMutex> childGuard(context->m_waiters.lock());
+                context->cancelLocked(parent->reason());
+                return context;
+            }
+        }
+        if (context->m_deadline != Clock::time_point::max())
+        {
+            if (context->m_deadline <= Clock::now())
+            {
+                context->cancel(DEADLINE_EXCEEDED);
+                return context;
+            }
+            std::weak_ptr<CancelContext> weak = context;
+            std::unique_lock<RoutineMutex> guard(context->m_waiters.lock());
+            context->m_timer = detail::Timers::instance().schedule(context->m_deadline, [weak]()
+                                                                   {
+                                                                       if (auto expired = weak.lock())
+                                                                       {
+                                                                           expired->cancel(DEADLINE_EXCEEDED);
+                                                                       }
+                                                                   });
+        }
+        return context;
+    }
+
+    CancelContextPtr CancelContext::withCancel(const CancelContextPtr &parent)
+    {
+        return create(parent, Clock::time_point::max());
+    }
+
+    CancelContextPtr CancelContext::withDeadline(const CancelContextPtr &parent, Clock::time_point deadline)
+    {
+        return create(parent, deadline);
+    }
+
+    void CancelContext::cancel(Reason reason)
+    {
+        detail::Timers::Handle timer;
+        {
+            std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+            if (done())
+            {
+                return;
+            }
+            cancelLocked(reason);
+            std::swap(timer, m_timer);
+        }
+        // Not under our lock, the timer thread may be waiting for it to run this very deadline
+        if (timer.m_id != 0)
+        {
+            detail::Timers::instance().cancel(timer);
+        }
+    }
+
+    void CancelContext::cancelLocked(Reason reason)
+    {
+        if (done())
+        {
+            return;
+        }
+        m_reason = reason;
+        m_waiters.notifyAll();
+        // Locks are always taken parent first, a child can't go away while we hold ours
+        for (auto *child : m_children)
+        {
+            std::unique_lock<RoutineMutex> guard(child->m_waiters.lock());
+            child->cancelLocked(reason);
+        }
+    }
+
+    void CancelContext::wait()
+    {
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        while (not done())
+        {
+            m_waiters.wait(guard);
+        }
+    }
+}
@@ -15,9 +15,13 @@ namespace gocpp
         assert(contextType <= ContextType::NUM_CONTEXT_TYPES);
         getcontext(&m_ucontext);
         // setup stack in user context
-        m_stack.resize(STACK_SIZES[contextType]);
-        m_ucontext.uc_stack.ss_sp = m_stack.data();
-        m_ucontext.uc_stack.ss_size = m_stack.size();
+        if (m_stack_size != STACK_SIZES[contextType])
+        {
+            m_stack_size = STACK_SIZES[contextType];
+            m_stack.reset(new char[m_stack_size]);
+        }
+        m_ucontext.uc_stack.ss_sp = m_stack.get();
+        m_ucontext.uc_stack.ss_size = m_stack_size;
         m_ucontext.uc_stack.ss_flags = 0;
 
         // Setup signal masks
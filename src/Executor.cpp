@@ -1,5 +1,8 @@
 #include "Executor.h"
 #include "Machines.h"
+#include "WaitQueue.h"
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
 
 namespace gocpp
@@ -11,48 +14,140 @@ namespace gocpp
         m_running = true;
         m_thread = std::thread([this]()
                                {
-                                   signal(SIGUSR1, &Machines::sigUsrHandler);
+                                   t_current = this;
+                                   Metrics::bindExecutor(m_id);
+                                   // SA_SIGINFO hands the handler the interrupted machine context for the profiler
+                                   struct sigaction action{};
+                                   action.sa_sigaction = &Machines::sigUsrHandler;
+                                   action.sa_flags = SA_SIGINFO | SA_RESTART;
+                                   sigemptyset(&action.sa_mask);
+                                   sigaction(SIGUSR1, &action, nullptr);
+                                   // Counted idle by Machines::startExecutorLocked() until now, the scheduler counts itself
+                                   Machines::idleCount()--;
                                    switchToScheduler();
                                });
     }
 
     Executor::~Executor()
     {
-        m_thread.join();
+        if (m_thread.joinable())
+        {
+            m_thread.join();
+        }
     }
 
     void Executor::scheduleLoop()
     {
+        auto &metrics = Metrics::local();
+        switchedOut();
         Machines::idleCount()++;
         while (m_running)
         {
             if (m_processor)
             {
-                // std::cerr << TID << " Found processor\n";
                 if (m_active_routine and m_active_routine->done())
                 {
-                    // std::cerr << TID << " Routine done\n";
                     // We might be in this routine's scheduler context
                     // Keep it around to avoid any segmentation faults
-                    m_scheduler_context.swap(m_active_routine->schedulerContext());
+                    if (not m_active_routine->stackless())
+                    {
+                        m_scheduler_context.swap(m_active_routine->schedulerContext());
+                    }
+                    if (m_active_routine->lockedTo())
+                    {
+                        metrics.add(MetricCounter::ROUTINES_UNLOCKED);
+                    }
                     m_active_routine.reset();
+                    metrics.add(MetricCounter::ROUTINES_FINISHED);
+                }
+                else if (m_active_routine and m_active_routine->lockedTo() == this)
+                {
+                    // Yielded or preempted, it waits with the other locked routines rather than in the processor
+                    m_active_routine->markRunnable();
+                    queueLocked(std::move(m_active_routine));
+                }
+                if (size_t(m_processor->id()) >= Machines::getInstance()->maxProcs())
+                {
+                    // setMaxProcs() shrank the processor count, our routines move to the remaining processors
+                    if (m_active_routine)
+                    {
+                        m_active_routine->markRunnable();
+                        m_processor->submitRoutine(std::move(m_active_routine));
+                    }
+                    ProcessorPtr processor;
+                    yieldProcessor(processor);
+                    GO_TRACE(TRACE_PROC_RELEASE, 0, processor->id());
+                    Machines::getInstance()->releaseProcessor(std::move(processor));
+                    continue;
+                }
+                if (Machines::getInstance()->lockedWaiting())
+                {
+                    // Another executor's locked routines wait for a processor, ours and our routines go to it
+                    if (m_active_routine)
+                    {
+                        m_active_routine->markRunnable();
+                        m_processor->submitRoutine(std::move(m_active_routine));
+                    }
+                    if (Machines::getInstance()->handOffProcessor(m_processor))
+                    {
+                        continue;
+                    }
                 }
+                // Whatever asked for a preemption is about to be considered
+                m_preempt_requested = false;
                 RoutinePtr nextRoutine;
-                m_processor->nextRoutine(m_active_routine, nextRoutine);
+                if (m_locked_queued != 0 and (m_locked_turn = not m_locked_turn))
+                {
+                    nextRoutine = takeLocked();
+                    if (nextRoutine and m_active_routine)
+                    {
+                        // The yielded or preempted routine waits in the processor meanwhile, swapping it into
+                        // nextRoutine would drop it
+                        m_active_routine->markRunnable();
+                        m_processor->submitRoutine(std::move(m_active_routine));
+                    }
+                }
+                else
+                {
+                    // Doesn't sleep for work while locked routines are waiting, see Machines::pullRoutines()
+                    m_processor->nextRoutine(m_active_routine, nextRoutine);
+                    if (not nextRoutine and not m_active_routine)
+                    {
+                        nextRoutine = takeLocked();
+                    }
+                }
                 if (nextRoutine)
                 {
-                    // std::cerr << TID << " Found next routine\n";
                     m_active_routine.swap(nextRoutine);
-                    Machines::idleCount()--;
-                    setcontext(m_active_routine->runContext()->userContext());
+                    metrics.add(MetricCounter::CONTEXT_SWITCHES);
+                    metrics.m_sched_latency.record(nowNanos() - m_active_routine->runnableSince());
+                    m_spared_ticks = 0;
+                    m_active_routine->prepare();
                 }
                 else if (m_active_routine)
                 {
                     // just complete this routine's execution
-                    // std::cerr << TID << " Continuing last routine\n";
-                    Machines::idleCount()--;
-                    setcontext(m_active_routine->runContext()->userContext());
+                    GO_TRACE(TRACE_START, m_active_routine->id(), m_processor->id());
+                }
+                else
+                {
+                    continue;
+                }
+                m_running_priority = m_active_routine->priority();
+                Machines::idleCount()--;
+                if (PerfCounters::enabled())
+                {
+                    perfSwitchIn(metrics);
+                }
+                if (m_active_routine->stackless())
+                {
+                    // Runs right here until it suspends, then we pick up as if it had switched back to us
+                    m_active_routine->run();
+                    switchedOut();
+                    Machines::idleCount()++;
+                    continue;
                 }
+                setcontext(m_active_routine->runContext()->userContext());
             }
             else
             {
@@ -62,8 +157,91 @@ namespace gocpp
         Machines::idleCount()--;
     }
 
+    void Executor::switchedOut()
+    {
+        if (m_perf_routine)
+        {
+            perfSwitchOut();
+        }
+        if (m_active_routine)
+        {
+            GO_TRACE(m_active_routine->done() ? TRACE_FINISH : m_switch_reason, m_active_routine->id(), 0);
+        }
+        m_switch_reason = TRACE_YIELD;
+        m_running_priority = NUM_PRIORITIES;
+        if (m_active_routine and m_parking)
+        {
+            // The routine is off its stack now, it can safely become runnable elsewhere
+            auto *parking = m_parking;
+            m_parking = nullptr;
+            parking->commit(std::move(m_active_routine));
+        }
+    }
+
+    void Executor::perfSwitchIn(ExecutorMetrics &metrics)
+    {
+        m_perf.open();
+        PerfCounts now;
+        m_perf.read(now);
+        if (m_perf_switching)
+        {
+            PerfCounts delta;
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                delta[i] = now[i] - m_perf_mark[i];
+            }
+            // Sleeping for work in between is idle time, not switching
+            auto idle = metrics.m_counters[IDLE_NANOS].load(std::memory_order_relaxed) - m_perf_idle_mark;
+            delta[PERF_NANOS] -= std::min(delta[PERF_NANOS], idle);
+            metrics.addPerf(metrics.m_perf_switching, delta);
+        }
+        m_perf_mark = now;
+        m_perf_routine = true;
+        m_perf_switching = false;
+    }
+
+    void Executor::perfSwitchOut()
+    {
+        auto &metrics = Metrics::local();
+        PerfCounts now;
+        m_perf.read(now);
+        PerfCounts delta;
+        auto &totals = m_active_routine->perf();
+        for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            delta[i] = now[i] - m_perf_mark[i];
+            totals[i] += delta[i];
+        }
+        auto label = m_active_routine->label();
+        metrics.addPerf(metrics.m_perf_labels[label < PERF_LABELS ? label : 0], delta);
+        m_perf_mark = now;
+        m_perf_idle_mark = metrics.m_counters[IDLE_NANOS].load(std::memory_order_relaxed);
+        m_perf_routine = false;
+        m_perf_switching = PerfCounters::enabled();
+    }
+
+    PerfCounts Executor::activeRoutinePerf() const
+    {
+        if (not m_active_routine)
+        {
+            return {};
+        }
+        auto totals = m_active_routine->perf();
+        if (m_perf_routine)
+        {
+            PerfCounts now;
+            m_perf.read(now);
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                totals[i] += now[i] - m_perf_mark[i];
+            }
+        }
+        return totals;
+    }
+
     void Executor::switchToScheduler()
     {
+        m_preemptible = false;
         if (m_scheduler_context)
         {
             m_scheduler_context->initialise(ContextType::SCHEDULER);
@@ -76,12 +254,151 @@ namespace gocpp
         if (m_active_routine)
         {
             swapcontext(m_active_routine->runContext()->userContext(), m_scheduler_context->userContext());
-            // std::cerr << "Returned from scheduler!\n";
+            // Parked or stolen routines resume on another executor, `this` is stale from here on
+            resumed();
+        }
+        else
+        {
+            swapcontext(&m_thread_context, m_scheduler_context->userContext());
+        }
+    }
+
+    __attribute__((noinline)) void Executor::resumed()
+    {
+        t_current->m_preemptible = true;
+    }
+
+    __attribute__((noinline)) Executor *Executor::reread()
+    {
+        return t_current;
+    }
+
+    __attribute__((noinline)) Executor *Executor::pin(bool &wasPreemptible)
+    {
+        while (true)
+        {
+            auto *executor = t_current;
+            if (executor == nullptr)
+            {
+                wasPreemptible = false;
+                return nullptr;
+            }
+            wasPreemptible = executor->m_preemptible.exchange(false);
+            // Once off we can't move anymore. If we moved just before, the executor left behind only stays
+            // unpreemptible until its next switch, turning it back on could hit it mid switch
+            if (reread() == executor)
+            {
+                return executor;
+            }
+        }
+    }
+
+    void Executor::requestPreemption()
+    {
+        m_preempt_requested.store(true, std::memory_order_relaxed);
+        if (t_current == this)
+        {
+            if (preemptible())
+            {
+                pthread_kill(pthread_self(), SIGUSR1);
+            }
         }
         else
         {
-            setcontext(m_scheduler_context->userContext());
+            pthread_kill(m_thread.native_handle(), SIGUSR1);
         }
+        // Otherwise setPreemptible(true) or the scheduler picks it up
+    }
+
+    bool Executor::preemptOnTick()
+    {
+        // Lower classes wait for the quantum to run out, another LATENCY routine only for the next tick
+        if (runningPriority() == LATENCY and ++m_spared_ticks < LATENCY_QUANTUM_TICKS and m_processor and
+            m_processor->queued(LATENCY) == 0)
+        {
+            return false;
+        }
+        return true;
+    }
+
+    void Executor::setActivePriority(Priority priority)
+    {
+        if (m_active_routine)
+        {
+            m_active_routine->setPriority(priority);
+            m_running_priority = priority;
+        }
+    }
+
+    void Executor::lockActiveRoutine()
+    {
+        if (m_active_routine and m_active_routine->lockTo(this))
+        {
+            Metrics::local().add(MetricCounter::ROUTINES_LOCKED);
+        }
+    }
+
+    void Executor::unlockActiveRoutine()
+    {
+        if (m_active_routine and m_active_routine->unlock())
+        {
+            Metrics::local().add(MetricCounter::ROUTINES_UNLOCKED);
+        }
+    }
+
+    bool Executor::queueLocked(RoutinePtr &&routine)
+    {
+        // Not preempted while holding m_locked_lock, our own scheduler takes it
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        {
+            std::unique_lock<std::mutex> lock(m_locked_lock);
+            m_locked_ready.emplace_back(std::move(routine));
+            m_locked_queued++;
+        }
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
+        // Pairs with pullRoutines() setting m_idle before its last look at lockedQueued()
+        return m_idle;
+    }
+
+    RoutinePtr Executor::takeLocked()
+    {
+        std::unique_lock<std::mutex> lock(m_locked_lock);
+        if (m_locked_ready.empty())
+        {
+            return nullptr;
+        }
+        RoutinePtr routine = std::move(m_locked_ready.front());
+        m_locked_ready.pop_front();
+        m_locked_queued--;
+        return routine;
+    }
+
+    void Executor::park(Parking *parking)
+    {
+        if (inTask())
+        {
+            // Nothing to switch out from, and unwinding would leave the caller's waiters queued
+            std::cerr << "gocpp: blocking call from a stackless Task, co_await its async:: counterpart instead" << std::endl;
+            std::abort();
+        }
+        m_parking = parking;
+        m_switch_reason = TRACE_PARK;
+        switchToScheduler();
+    }
+
+    void Executor::parkTask(Parking *parking)
+    {
+        m_parking = parking;
+        m_switch_reason = TRACE_PARK;
+    }
+
+    void Executor::exitToThread()
+    {
+        setcontext(&m_thread_context);
     }
 
     void Executor::yieldProcessor(ProcessorPtr& proc)
@@ -94,7 +411,11 @@ namespace gocpp
     {
         if (m_active_routine)
         {
+            m_preemptible = true;
             m_active_routine->run();
+            // The routine may have finished on another executor than the one it started on
+            bool preemptible;
+            pin(preemptible);
         }
         else
         {
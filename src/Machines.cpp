@@ -1,21 +1,208 @@
 #include "Machines.h"
+#include "Profiler.h"
+#include "Futex.h"
 #include <iostream>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <fstream>
+#include <link.h>
+#include <sched.h>
 namespace gocpp
 {
+    namespace
+    {
+        // Executable segments of the shared object providing malloc (glibc, or a preloaded jemalloc or
+        // tcmalloc). Its arena locks are plain locks: a routine preempted while holding one deadlocks the
+        // next routine allocating on the same executor, so preemption waits for it to leave the allocator
+        struct CodeRange
+        {
+            uintptr_t m_begin;
+            uintptr_t m_end;
+        };
+        std::vector<CodeRange> s_allocator_code;
+
+        // Collects the executable segments of the object holding `*data` into `s_allocator_code`, unless it's
+        // the program itself. Returns 2 then, 1 once found elsewhere
+        int collectAllocatorCode(dl_phdr_info *info, size_t, void *data)
+        {
+            auto target = *static_cast<uintptr_t *>(data);
+            std::vector<CodeRange> code;
+            bool found = false;
+            for (int i = 0; i < info->dlpi_phnum; i++)
+            {
+                auto &header = info->dlpi_phdr[i];
+                if (header.p_type == PT_LOAD and (header.p_flags & PF_X))
+                {
+                    uintptr_t begin = info->dlpi_addr + header.p_vaddr;
+                    code.push_back(CodeRange{begin, begin + header.p_memsz});
+                    found = found or (target >= begin and target < begin + header.p_memsz);
+                }
+            }
+            if (not found)
+            {
+                return 0;
+            }
+            if (info->dlpi_name == nullptr or info->dlpi_name[0] == '\0')
+            {
+                return 2;
+            }
+            s_allocator_code = std::move(code);
+            return 1;
+        }
+
+        void findAllocatorCode()
+        {
+            auto target = reinterpret_cast<uintptr_t>(&malloc);
+            if (dl_iterate_phdr(collectAllocatorCode, &target) == 2)
+            {
+                // A non PIE program's PLT stub, its definition comes next. A program defining malloc itself gets
+                // libc's unused one, which only costs preemptions inside it. In a static build there's none,
+                // only NoPreemption scopes help
+                target = reinterpret_cast<uintptr_t>(dlsym(RTLD_NEXT, "malloc"));
+                if (target != 0)
+                {
+                    dl_iterate_phdr(collectAllocatorCode, &target);
+                }
+            }
+        }
+
+        bool inAllocator(const ucontext_t *context)
+        {
+#if defined(__x86_64__)
+            auto pc = uintptr_t(context->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__aarch64__)
+            auto pc = uintptr_t(context->uc_mcontext.pc);
+#else
+            // No way to tell
+            return false;
+#endif
+            for (auto &range : s_allocator_code)
+            {
+                if (pc >= range.m_begin and pc < range.m_end)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // CPUs worth of quota granted by the cgroup at `dir`, 0 when unlimited or unreadable
+        double cgroupQuota(const std::string &dir, bool v2)
+        {
+            if (v2)
+            {
+                // "<quota> <period>" or "max <period>"
+                std::ifstream file(dir + "/cpu.max");
+                std::string quota;
+                double period = 0;
+                if (file >> quota >> period and quota != "max" and period > 0)
+                {
+                    return std::stod(quota) / period;
+                }
+                return 0;
+            }
+            std::ifstream quotaFile(dir + "/cpu.cfs_quota_us"), periodFile(dir + "/cpu.cfs_period_us");
+            double quota = -1, period = 0;
+            if (quotaFile >> quota and periodFile >> period and quota > 0 and period > 0)
+            {
+                return quota / period;
+            }
+            return 0;
+        }
+
+        // Tightest CPU quota on our cgroup or any of its ancestors, 0 without one
+        double cgroupCpus()
+        {
+            std::ifstream cgroups("/proc/self/cgroup");
+            std::string line;
+            double cpus = 0;
+            while (std::getline(cgroups, line))
+            {
+                // "<id>:<controllers>:<path>", v2 has no controllers
+                auto first = line.find(':');
+                auto second = line.find(':', first + 1);
+                if (first == std::string::npos or second == std::string::npos)
+                {
+                    continue;
+                }
+                auto controllers = line.substr(first + 1, second - first - 1);
+                auto path = line.substr(second + 1);
+                bool v2 = controllers.empty();
+                std::vector<std::string> mounts;
+                if (v2)
+                {
+                    mounts = {"/sys/fs/cgroup"};
+                }
+                else if (("," + controllers + ",").find(",cpu,") != std::string::npos)
+                {
+                    mounts = {"/sys/fs/cgroup/" + controllers, "/sys/fs/cgroup/cpu"};
+                }
+                for (auto &mount : mounts)
+                {
+                    // Inside a container the path may not exist below the mount, its root then holds our limits
+                    auto dir = path;
+                    while (true)
+                    {
+                        double quota = cgroupQuota(mount + dir, v2);
+                        if (quota > 0 and (cpus == 0 or quota < cpus))
+                        {
+                            cpus = quota;
+                        }
+                        if (dir.empty() or dir == "/")
+                        {
+                            break;
+                        }
+                        dir = dir.substr(0, dir.rfind('/'));
+                    }
+                }
+            }
+            return cpus;
+        }
+    }
+
+    size_t Machines::detectProcs()
+    {
+        if (auto *env = getenv("GOMAXPROCS"))
+        {
+            int procs = atoi(env);
+            if (procs > 0)
+            {
+                return std::min<size_t>(procs, MAX_PROCS);
+            }
+        }
+        size_t procs = MAX_PROCS;
+        cpu_set_t affinity;
+        if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0)
+        {
+            procs = std::min<size_t>(procs, CPU_COUNT(&affinity));
+        }
+        double quota = cgroupCpus();
+        if (quota > 0)
+        {
+            // A 1.5 CPU quota still leaves room for two routines running half of the time
+            procs = std::min<size_t>(procs, size_t(std::ceil(quota)));
+        }
+        return std::max<size_t>(procs, 1);
+    }
+
     Machines::Machines()
-        : m_routine_list(), m_idleProcessors(MAX_PROCS), m_executors(MAX_PROCS)
+        : m_routine_list(), m_executors(MAX_EXECUTORS)
     {
         m_stopped = false;
         s_idle_count = 0;
-        s_main_thread_id = std::this_thread::get_id();
+        // Before any executor can take a signal
+        findAllocatorCode();
 
-        for (int i = 0; i < MAX_PROCS; i++)
+        m_max_procs = detectProcs();
+        for (size_t i = 0; i < m_max_procs; i++)
         {
-            m_idleProcessors[i] = std::make_unique<Processor>(i);
-            auto executor = std::make_unique<Executor>(i);
-            m_executors[executor->threadId()] = std::move(executor);
+            m_idleProcessors.emplace_back(std::make_unique<Processor>(i));
         }
+        m_created_procs = m_max_procs;
+        m_idle_procs = m_idleProcessors.size();
+        // Executors are started as routines show up, see wakeExecutor()
         // register timer
         m_sa.sa_flags = SA_SIGINFO;
         m_sa.sa_sigaction = timerInterruptHandler;
@@ -69,6 +256,306 @@ namespace gocpp
         return &lInfo;
     }
 
+    RuntimeMetrics Machines::metricsSnapshot()
+    {
+        return Metrics::snapshot();
+    }
+
+    void Machines::submitTask(std::unique_ptr<detail::Resumable> &&task, Priority priority)
+    {
+        RoutinePtr routinePtr;
+        {
+            NoPreemption allocating;
+            routinePtr = std::make_unique<Routine>(std::move(task), priority);
+        }
+        Metrics::local().add(MetricCounter::ROUTINES_SPAWNED);
+        GO_TRACE(TRACE_SPAWN, routinePtr->id(), Tracer::currentRoutine());
+        queueRoutine(std::move(routinePtr));
+    }
+
+    void Machines::readyRoutine(RoutinePtr &&routine)
+    {
+        routine->markRunnable();
+        GO_TRACE(TRACE_UNPARK, routine->id(), 0);
+        if (auto *executor = routine->lockedTo())
+        {
+            if (executor->queueLocked(std::move(routine)))
+            {
+                getInstance()->notifyIdle(*executor);
+            }
+            return;
+        }
+        Machines::getInstance()->queueRoutine(std::move(routine));
+    }
+
+    void Machines::lockToExecutor()
+    {
+        bool preemptible;
+        if (auto *executor = Executor::pin(preemptible))
+        {
+            executor->lockActiveRoutine();
+            executor->setPreemptible(preemptible);
+        }
+        // Plain threads never move anyway
+    }
+
+    void Machines::unlockFromExecutor()
+    {
+        bool preemptible;
+        if (auto *executor = Executor::pin(preemptible))
+        {
+            executor->unlockActiveRoutine();
+            executor->setPreemptible(preemptible);
+        }
+    }
+
+    void Machines::queueRoutine(RoutinePtr &&routine)
+    {
+        // Must not be switched out between picking the processor and queueing on it
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        if (executor and executor->processor())
+        {
+            executor->processor()->submitRoutine(std::move(routine));
+        }
+        else
+        {
+            auto priority = routine->priority();
+            auto *raw = routine.release();
+            inject(raw, raw, priority);
+            preemptFor(priority);
+        }
+        notifyIdle(1);
+        wakeExecutor();
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
+    }
+
+    void Machines::queueRoutines(std::vector<RoutinePtr> &&routines)
+    {
+        if (routines.empty())
+        {
+            return;
+        }
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        if (executor and executor->processor())
+        {
+            executor->processor()->submitRoutines(std::move(routines));
+        }
+        else
+        {
+            auto priority = routines.front()->priority();
+            for (size_t i = 0; i + 1 < routines.size(); i++)
+            {
+                routines[i]->nextInjected() = routines[i + 1].get();
+            }
+            auto *first = routines.front().get();
+            auto *last = routines.back().get();
+            for (auto &routine : routines)
+            {
+                routine.release();
+            }
+            routines.clear();
+            inject(first, last, priority);
+            preemptFor(priority);
+        }
+        // The executor taking the batch wakes the next one, see pullRoutines()
+        notifyIdle(1);
+        wakeExecutor();
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
+    }
+
+    void Machines::wakeExecutor(bool callerIdle)
+    {
+        // Cheap checks first, this runs on every spawn and wake up
+        uint16_t idle = callerIdle ? 1 : 0;
+        if (m_idle_procs.load(std::memory_order_relaxed) == 0 or s_idle_count.load(std::memory_order_relaxed) > idle)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_processors_lock);
+        if (running() and m_idle_procs != 0 and s_idle_count <= idle)
+        {
+            startExecutorLocked();
+        }
+    }
+
+    void Machines::startExecutorLocked()
+    {
+        size_t id = m_num_executors.load(std::memory_order_relaxed);
+        if (id == MAX_EXECUTORS)
+        {
+            return;
+        }
+        // Counted idle from the start (until it enters its scheduler), so that concurrent wake ups don't
+        // start one executor each
+        s_idle_count++;
+        m_executors[id] = std::make_unique<Executor>(int(id));
+        m_num_executors.store(id + 1, std::memory_order_release);
+    }
+
+    void Machines::releaseProcessor(ProcessorPtr &&processor)
+    {
+        std::vector<RoutinePtr> routines;
+        processor->surrenderRoutines(routines, true);
+        if (not routines.empty())
+        {
+            std::unique_lock<std::mutex> routineLock(m_routine_lock);
+            for (auto &routine : routines)
+            {
+                queueGlobalRoutine(std::move(routine));
+            }
+        }
+        {
+            std::unique_lock<std::mutex> procLock(m_processors_lock);
+            if (size_t(processor->id()) < maxProcs())
+            {
+                m_idleProcessors.emplace_back(std::move(processor));
+                m_idle_procs = m_idleProcessors.size();
+                m_idle_proc_cv.notify_one();
+            }
+            else
+            {
+                m_retiredProcessors.emplace_back(std::move(processor));
+            }
+        }
+        if (not routines.empty())
+        {
+            notifyIdle(1);
+            wakeExecutor();
+        }
+    }
+
+    size_t Machines::setMaxProcs(size_t procs)
+    {
+        procs = std::min(std::max<size_t>(procs, 1), MAX_PROCS);
+        // Not preempted while holding m_processors_lock, the scheduler may need it on this executor
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        size_t previous;
+        {
+            std::unique_lock<std::mutex> lock(m_processors_lock);
+            previous = m_max_procs.exchange(procs);
+            for (size_t id = previous; id < procs; id++)
+            {
+                auto retired = std::find_if(m_retiredProcessors.begin(), m_retiredProcessors.end(), [id](const ProcessorPtr &processor)
+                                            { return size_t(processor->id()) == id; });
+                if (retired != m_retiredProcessors.end())
+                {
+                    m_idleProcessors.emplace_back(std::move(*retired));
+                    m_retiredProcessors.erase(retired);
+                }
+                else if (id >= m_created_procs)
+                {
+                    m_idleProcessors.emplace_back(std::make_unique<Processor>(id));
+                    m_created_procs = id + 1;
+                }
+                // Otherwise its executor has not got around to retiring it yet and just keeps it
+            }
+            // Busy processors beyond the new count are retired by their executors, see Executor::scheduleLoop
+            auto retiring = std::stable_partition(m_idleProcessors.begin(), m_idleProcessors.end(), [procs](const ProcessorPtr &processor)
+                                                  { return size_t(processor->id()) < procs; });
+            std::move(retiring, m_idleProcessors.end(), std::back_inserter(m_retiredProcessors));
+            m_idleProcessors.erase(retiring, m_idleProcessors.end());
+            m_idle_procs = m_idleProcessors.size();
+        }
+        if (procs > previous)
+        {
+            m_idle_proc_cv.notify_all();
+            wakeExecutor();
+        }
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
+        return previous;
+    }
+
+    void Machines::inject(Routine *first, Routine *last, Priority priority)
+    {
+        last->nextInjected() = m_injected.load(std::memory_order_relaxed);
+        while (not m_injected.compare_exchange_weak(last->nextInjected(), first))
+        {
+        }
+        // Only after the push: a pull in between merely leaves the count set for nothing
+        if (priority == LATENCY)
+        {
+            m_global_latency++;
+        }
+    }
+
+    void Machines::notifyIdle(int count)
+    {
+        // Sleepers register before their last look at the queues, see pullRoutines()
+        if (m_idle_sleepers.load() != 0)
+        {
+            m_idle_epoch++;
+            detail::futexWake(m_idle_epoch, count);
+        }
+    }
+
+    void Machines::notifyIdle(Executor &executor)
+    {
+        // The bump keeps it from going to sleep if it is just about to, other sleepers ignore wake ups not meant for them
+        m_idle_epoch++;
+        detail::futexWakeBits(m_idle_epoch, executor.idleBit());
+    }
+
+    void Machines::queueGlobalRoutine(RoutinePtr &&routine)
+    {
+        if (routine->priority() == LATENCY)
+        {
+            m_global_latency++;
+        }
+        m_routine_list.emplace_back(std::move(routine));
+    }
+
+    void Machines::preemptFor(Priority priority)
+    {
+        if (priority != LATENCY)
+        {
+            // Only LATENCY routines get pulled from the global queue ahead of the periodic check
+            return;
+        }
+        // The executor running the lowest class gives way, idle ones are woken through notifyIdle()
+        Executor *victim = nullptr;
+        for (size_t i = 0, count = executorCount(); i < count; i++)
+        {
+            auto &executor = m_executors[i];
+            auto running = executor->runningPriority();
+            if (running > priority and running != NUM_PRIORITIES and
+                (victim == nullptr or running > victim->runningPriority()))
+            {
+                victim = executor.get();
+            }
+        }
+        if (victim)
+        {
+            victim->requestPreemption();
+        }
+    }
+
+    Priority Machines::currentPriority()
+    {
+        auto *executor = Executor::current();
+        auto *routine = executor ? executor->activeRoutine() : nullptr;
+        return routine ? routine->priority() : NORMAL;
+    }
+
+    void Machines::setCurrentPriority(Priority priority)
+    {
+        if (auto *executor = Executor::current())
+        {
+            executor->setActivePriority(priority);
+        }
+    }
+
     void Machines::pullProcessor(ProcessorPtr &processor)
     {
         if (processor)
@@ -76,149 +563,284 @@ namespace gocpp
             return;
         }
 
+        auto *self = Executor::current();
         auto const getProcessor = [&]()
         {
             processor.swap(m_idleProcessors.back());
             m_idleProcessors.pop_back();
+            m_idle_procs = m_idleProcessors.size();
+            if (self and self->awaitingProcessor())
+            {
+                self->awaitingProcessor() = false;
+                m_locked_waiting.erase(std::find(m_locked_waiting.begin(), m_locked_waiting.end(), self));
+                m_locked_waiting_count = m_locked_waiting.size();
+            }
         };
         while (running())
         {
             std::unique_lock<std::mutex> lock(m_processors_lock);
+            if (self and self->handedProcessor())
+            {
+                processor = std::move(self->handedProcessor());
+                GO_TRACE(TRACE_PROC_ACQUIRE, 0, processor->id());
+                return;
+            }
             if (m_idleProcessors.empty())
             {
+                if (self and self->lockedQueued() != 0 and not self->awaitingProcessor())
+                {
+                    // Our locked routines can't run anywhere else, eg. after setMaxProcs() retired our processor.
+                    // A busy executor gives us its own at its next scheduling point
+                    self->awaitingProcessor() = true;
+                    m_locked_waiting.emplace_back(self);
+                    m_locked_waiting_count = m_locked_waiting.size();
+                    // An executor sleeping for work in pullRoutines() still holds its processor
+                    notifyIdle(1);
+                }
                 // sleep now
                 using namespace std::chrono_literals;
-                m_idle_proc_cv.wait_for(lock, 10ms, [&]()
-                                        { return not running() or not m_idleProcessors.empty(); });
+                auto idleStart = nowNanos();
+                m_idle_proc_cv.wait_for(lock, 100ms, [&]()
+                                        { return not running() or not m_idleProcessors.empty() or (self and self->handedProcessor()); });
+                Metrics::local().add(MetricCounter::IDLE_NANOS, nowNanos() - idleStart);
             }
             else
             {
                 getProcessor();
+                GO_TRACE(TRACE_PROC_ACQUIRE, 0, processor->id());
                 return;
             }
         }
     }
 
+    bool Machines::handOffProcessor(ProcessorPtr &processor)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_processors_lock);
+            if (m_locked_waiting.empty())
+            {
+                return false;
+            }
+            auto *taker = m_locked_waiting.front();
+            m_locked_waiting.erase(m_locked_waiting.begin());
+            m_locked_waiting_count = m_locked_waiting.size();
+            taker->awaitingProcessor() = false;
+            GO_TRACE(TRACE_PROC_RELEASE, 0, processor->id());
+            taker->handedProcessor() = std::move(processor);
+        }
+        m_idle_proc_cv.notify_all();
+        return true;
+    }
+
     void Machines::pullRoutines(std::vector<RoutinePtr> &routines, int stealerId, bool coreIdle)
     {
         using namespace std::chrono_literals;
+        auto &metrics = Metrics::local();
         while (running())
         {
             // Try stealing first
-            for (auto &[tid, executor] : m_executors)
+            for (size_t i = 0, count = executorCount(); i < count; i++)
             {
-                if (executor->processor() and executor->processor()->id() != stealerId and executor->processor()->surrenderRoutines(routines))
+                auto &executor = m_executors[i];
+                if (executor->processor() and executor->processor()->id() != stealerId)
                 {
-                    return;
+                    metrics.add(MetricCounter::STEALS_ATTEMPTED);
+                    if (executor->processor()->surrenderRoutines(routines))
+                    {
+                        metrics.add(MetricCounter::STEALS_SUCCEEDED);
+                        GO_TRACE(TRACE_STEAL, uint32_t(routines.size()), executor->processor()->id());
+                        // Found work, there may be more for another idle processor
+                        wakeExecutor(true);
+                        return;
+                    }
                 }
             }
 
             std::unique_lock<std::mutex> routineLock(m_routine_lock);
-            if (not m_routine_list.empty())
+            if (takeGlobalRoutines(routines))
             {
-                while (not m_routine_list.empty())
+                routineLock.unlock();
+                if (routines.size() > 1)
                 {
-                    routines.emplace_back(std::move(m_routine_list.back()));
-                    m_routine_list.pop_back();
+                    // More than we need, another idle executor can steal the rest
+                    notifyIdle(1);
                 }
+                wakeExecutor(true);
                 return;
             }
 
-            if (not coreIdle)
+            auto *self = Executor::current();
+            if (not coreIdle or (self and self->lockedQueued() != 0) or lockedWaiting())
             {
-                // no time to waste
+                // no time to waste, or our idle processor goes to locked routines waiting for one
                 return;
             }
-            m_new_routine_cv.wait_for(routineLock, 100ms);
+            // Registered before the last look at the queues: whoever queues work after it sees us and bumps the epoch.
+            // m_routine_list pushers hold the lock, so only injections can have slipped in
+            uint32_t epoch = m_idle_epoch.load();
+            m_idle_sleepers++;
+            // Same for routines locked to us, see Executor::queueLocked()
+            if (self)
+            {
+                self->setIdle(true);
+            }
+            bool woken = m_injected.load() != nullptr or (self and self->lockedQueued() != 0);
+            routineLock.unlock();
+            auto idleStart = nowNanos();
+            if (not woken)
+            {
+                timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_nsec += 100'000'000;
+                if (deadline.tv_nsec >= 1'000'000'000)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1'000'000'000;
+                }
+                // notifyIdle() wakes anyone, notifyIdle(executor) only us
+                detail::futexWaitBits(m_idle_epoch, epoch, self ? self->idleBit() : FUTEX_BITSET_MATCH_ANY, &deadline);
+            }
+            if (self)
+            {
+                self->setIdle(false);
+            }
+            m_idle_sleepers--;
+            metrics.add(MetricCounter::IDLE_NANOS, nowNanos() - idleStart);
         }
     }
 
-    void Machines::runRoutine()
+    bool Machines::takeGlobalRoutines(std::vector<RoutinePtr> &routines)
     {
-        auto threadId = std::this_thread::get_id();
-        if (threadId != s_main_thread_id)
+        // Oldest injection ends up at the back, which is taken first
+        for (auto *routine = m_injected.exchange(nullptr); routine;)
         {
-            auto &executorPtr = Machines::getInstance()->m_executors[threadId];
-            executorPtr->runActiveRoutine();
+            auto *next = routine->nextInjected();
+            routine->nextInjected() = nullptr;
+            m_routine_list.emplace_back(routine);
+            routine = next;
         }
-        else
+        if (m_routine_list.empty())
         {
-            assert(false);
+            return false;
         }
+        Metrics::local().add(MetricCounter::GLOBAL_QUEUE_PULLS);
+        m_global_latency = 0;
+        while (not m_routine_list.empty())
+        {
+            routines.emplace_back(std::move(m_routine_list.back()));
+            m_routine_list.pop_back();
+        }
+        GO_TRACE(TRACE_GLOBAL_PULL, uint32_t(routines.size()), 0);
+        return true;
+    }
+
+    void Machines::pullGlobalRoutines(std::vector<RoutinePtr> &routines)
+    {
+        std::unique_lock<std::mutex> routineLock(m_routine_lock);
+        takeGlobalRoutines(routines);
+    }
+
+    void Machines::runRoutine()
+    {
+        auto *executor = Executor::current();
+        assert(executor);
+        executor->runActiveRoutine();
     }
 
     void Machines::scheduleNext()
     {
-        auto threadId = std::this_thread::get_id();
-        if (threadId != s_main_thread_id)
-        {
-            auto &executorPtr = Machines::getInstance()->m_executors[threadId];
-            executorPtr->scheduleLoop();
-        }
-        else
-        {
-            assert(false);
-        }
+        auto *executor = Executor::current();
+        assert(executor);
+        executor->scheduleLoop();
+        executor->exitToThread();
     }
 
     void Machines::yieldToScheduler()
     {
-        auto threadId = std::this_thread::get_id();
-        if (threadId != s_main_thread_id)
+        bool preemptible;
+        if (auto *executor = Executor::pin(preemptible))
         {
-            auto &executorPtr = Machines::getInstance()->m_executors[threadId];
-            executorPtr->switchToScheduler();
-        }
-        else
-        {
-            // do nothing
+            if (executor->inTask())
+            {
+                // Tasks only suspend at co_await, spin locks held elsewhere are never held for long
+                executor->setPreemptible(preemptible);
+                std::this_thread::yield();
+                return;
+            }
+            executor->switchToScheduler();
         }
+        // Plain threads have nothing to yield to
     }
 
     void Machines::yieldRoutinesAndProcessor()
     {
-        auto threadId = std::this_thread::get_id();
-        auto* machine = Machines::getInstance();
-        if (threadId != s_main_thread_id)
+        auto *executor = Executor::current();
+        assert(executor);
+        ProcessorPtr proc;
+        executor->yieldProcessor(proc);
+        if (proc)
         {
-            auto &executorPtr = machine->m_executors[threadId];
-            ProcessorPtr proc;
-            executorPtr->yieldProcessor(proc);
-            if (proc)
-            {
-                std::unique_lock<std::mutex> routineLock(machine->m_routine_lock);
-                proc->surrenderRoutines(machine->m_routine_list, true);
-                std::unique_lock<std::mutex> procLock(machine->m_processors_lock);
-                machine->m_idleProcessors.emplace_back(std::move(proc));
-            }
-        }
-        else
-        {
-            assert(false);
+            GO_TRACE(TRACE_PROC_RELEASE, executor->activeRoutineId(), proc->id());
+            Machines::getInstance()->releaseProcessor(std::move(proc));
         }
     }
 
-    void Machines::sigUsrHandler(int signal)
+    void Machines::sigUsrHandler(int signal, siginfo_t *si, void *uc)
     {
-        yieldToScheduler();
+        auto *executor = Executor::current();
+        if (executor == nullptr)
+        {
+            return;
+        }
+        // Left pending when not acted upon, the scheduler clears it
+        bool tick = not executor->preemptionRequested();
+        if (tick and Profiler::enabled())
+        {
+            // Whether or not the routine can be switched out, time spent holding a lock is CPU time too
+            Profiler::sample(*executor, static_cast<const ucontext_t *>(uc));
+        }
+        if (not executor->preemptible())
+        {
+            // Signal landed while switching contexts or in a section that must not switch out.
+            // A requestPreemption() stays pending until the executor is preemptible again
+            return;
+        }
+        if (tick and not executor->preemptOnTick())
+        {
+            return;
+        }
+        if (detail::slabBusy() or inAllocator(static_cast<const ucontext_t *>(uc)))
+        {
+            // Try again on the next tick
+            return;
+        }
+        Metrics::local().add(MetricCounter::PREEMPTIONS);
+        executor->setSwitchReason(TRACE_PREEMPT);
+        executor->switchToScheduler();
     }
 
     void Machines::timerInterruptHandler(int sig, siginfo_t *si, void *uc)
     {
-        for (auto &[tid, executorPtr] : Machines::getInstance()->m_executors)
+        auto *machine = Machines::getInstance();
+        for (size_t i = 0, count = machine->executorCount(); i < count; i++)
         {
-            pthread_kill(executorPtr->thread().native_handle(), SIGUSR1);
+            pthread_kill(machine->m_executors[i]->thread().native_handle(), SIGUSR1);
         }
     }
 
     void Machines::finalize()
     {
         using namespace std::chrono_literals;
+        if (m_stopped)
+        {
+            // GO_END already ran, executors are gone
+            return;
+        }
 
         size_t seenIdle = 0;
         while (seenIdle < 20)
         {
-            if (s_idle_count == m_executors.size())
+            if (s_idle_count == executorCount())
             {
                 seenIdle++;
             }
@@ -228,11 +850,23 @@ namespace gocpp
             }
             std::this_thread::sleep_for(100ms);
         }
+        // Executors go away with us, the preemption timer must not signal them anymore
+        timer_delete(m_timer_id);
+        std::unique_lock<std::mutex> procLock(m_processors_lock);
         m_stopped = true;
-        for (auto &[tid, exec] : m_executors)
+        m_idle_proc_cv.notify_all();
+        procLock.unlock();
+        notifyIdle(INT_MAX);
+        size_t count = executorCount();
+        for (size_t i = 0; i < count; i++)
+        {
+            m_executors[i]->finalize();
+        }
+        for (size_t i = 0; i < count; i++)
         {
-            exec->finalize();
-            exec->thread().join();
+            m_executors[i]->thread().join();
         }
+        // Joined threads can't be signalled anymore, nor stolen from
+        m_num_executors = 0;
     }
 }
\ No newline at end of file
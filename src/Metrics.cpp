@@ -0,0 +1,151 @@
+#include "Metrics.h"
+#include "Profiler.h"
+
+#include <algorithm>
+
+namespace gocpp
+{
+    void HistogramSnapshot::merge(const HistogramSnapshot &other)
+    {
+        if (m_counts.size() < other.m_counts.size())
+        {
+            m_counts.resize(other.m_counts.size(), 0);
+        }
+        for (size_t i = 0; i < other.m_counts.size(); i++)
+        {
+            m_counts[i] += other.m_counts[i];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        m_max = std::max(m_max, other.m_max);
+    }
+
+    uint64_t HistogramSnapshot::percentile(double pct) const
+    {
+        if (m_count == 0)
+        {
+            return 0;
+        }
+        uint64_t target = std::max<uint64_t>(1, uint64_t(m_count * std::clamp(pct, 0.0, 100.0) / 100.0 + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < m_counts.size(); i++)
+        {
+            seen += m_counts[i];
+            if (seen >= target)
+            {
+                return std::min(LatencyHistogram::bucketUpperBound(i), m_max);
+            }
+        }
+        return m_max;
+    }
+
+    uint64_t LatencyHistogram::bucketUpperBound(size_t index)
+    {
+        if (index < SUB_BUCKETS)
+        {
+            return index;
+        }
+        size_t magnitude = (index >> SUB_BUCKET_BITS) + SUB_BUCKET_BITS - 1;
+        uint64_t sub = index & (SUB_BUCKETS - 1);
+        uint64_t lower = (SUB_BUCKETS | sub) << (magnitude - SUB_BUCKET_BITS);
+        return lower + ((uint64_t(1) << (magnitude - SUB_BUCKET_BITS)) - 1);
+    }
+
+    HistogramSnapshot LatencyHistogram::snapshot() const
+    {
+        HistogramSnapshot snap;
+        snap.m_counts.resize(NUM_BUCKETS);
+        for (size_t i = 0; i < NUM_BUCKETS; i++)
+        {
+            snap.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+        }
+        snap.m_count = m_count.load(std::memory_order_relaxed);
+        snap.m_sum = m_sum.load(std::memory_order_relaxed);
+        snap.m_max = m_max.load(std::memory_order_relaxed);
+        return snap;
+    }
+
+    void ExecutorMetricsSnapshot::merge(const ExecutorMetricsSnapshot &other)
+    {
+        for (size_t i = 0; i < NUM_METRIC_COUNTERS; i++)
+        {
+            m_counters[i] += other.m_counters[i];
+        }
+        m_sched_latency.merge(other.m_sched_latency);
+        m_channel_block.merge(other.m_channel_block);
+        if (m_perf_labels.size() < other.m_perf_labels.size())
+        {
+            m_perf_labels.resize(other.m_perf_labels.size(), PerfCounts{});
+        }
+        for (size_t label = 0; label < other.m_perf_labels.size(); label++)
+        {
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                m_perf_labels[label][i] += other.m_perf_labels[label][i];
+            }
+        }
+        for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+        {
+            m_perf_switching[i] += other.m_perf_switching[i];
+        }
+    }
+
+    void Metrics::bindExecutor(int id)
+    {
+        auto metrics = std::make_unique<ExecutorMetrics>();
+        metrics->m_executor = id;
+        t_local = metrics.get();
+        std::unique_lock<std::mutex> lock(s_lock);
+        s_executors.emplace_back(std::move(metrics));
+    }
+
+    RuntimeMetrics Metrics::snapshot()
+    {
+        auto const read = [](const ExecutorMetrics &metrics)
+        {
+            ExecutorMetricsSnapshot snap;
+            snap.m_executor = metrics.m_executor;
+            for (size_t i = 0; i < NUM_METRIC_COUNTERS; i++)
+            {
+                snap.m_counters[i] = metrics.m_counters[i].load(std::memory_order_relaxed);
+            }
+            snap.m_sched_latency = metrics.m_sched_latency.snapshot();
+            snap.m_channel_block = metrics.m_channel_block.snapshot();
+            for (size_t label = 0; label < PERF_LABELS; label++)
+            {
+                PerfCounts counts;
+                for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+                {
+                    counts[i] = metrics.m_perf_labels[label][i].load(std::memory_order_relaxed);
+                }
+                if (counts[PERF_NANOS] != 0)
+                {
+                    snap.m_perf_labels.resize(label + 1, PerfCounts{});
+                    snap.m_perf_labels[label] = counts;
+                }
+            }
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                snap.m_perf_switching[i] = metrics.m_perf_switching[i].load(std::memory_order_relaxed);
+            }
+            return snap;
+        };
+
+        RuntimeMetrics result;
+        {
+            // Only guards the registry itself, executors keep updating their counters
+            std::unique_lock<std::mutex> lock(s_lock);
+            for (auto &metrics : s_executors)
+            {
+                result.m_executors.emplace_back(read(*metrics));
+            }
+        }
+        result.m_executors.emplace_back(read(s_external));
+        for (auto &snap : result.m_executors)
+        {
+            result.m_total.merge(snap);
+        }
+        result.m_labels = Profiler::labels();
+        return result;
+    }
+}
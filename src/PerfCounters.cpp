@@ -0,0 +1,197 @@
+#include "PerfCounters.h"
+#include "Executor.h"
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace
+    {
+        const uint64_t EVENT_CONFIGS[] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+        };
+
+        int openEvent(uint64_t config, int leader)
+        {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = config;
+            // Routines run in user space, and perf_event_paranoid > 1 forbids anything else
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP;
+            return int(syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC));
+        }
+
+#if defined(__x86_64__) || defined(__i386__)
+        inline uint64_t rdpmc(uint32_t counter)
+        {
+            uint32_t low, high;
+            asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(counter));
+            return low | uint64_t(high) << 32;
+        }
+#endif
+    }
+
+    namespace detail
+    {
+        PerfGroup::PerfGroup()
+        {
+            for (size_t i = 0; i < NUM_EVENTS; i++)
+            {
+                m_fds[i] = -1;
+                m_pages[i] = nullptr;
+            }
+        }
+
+        PerfGroup::~PerfGroup()
+        {
+            for (size_t i = 0; i < m_count; i++)
+            {
+                if (m_pages[i])
+                {
+                    munmap(m_pages[i], size_t(sysconf(_SC_PAGESIZE)));
+                }
+                ::close(m_fds[i]);
+            }
+        }
+
+        void PerfGroup::open()
+        {
+            if (m_opened)
+            {
+                return;
+            }
+            m_opened = true;
+            auto pageSize = size_t(sysconf(_SC_PAGESIZE));
+            for (size_t event = 0; event < NUM_EVENTS; event++)
+            {
+                int fd = openEvent(EVENT_CONFIGS[event], m_count ? m_fds[0] : -1);
+                if (fd < 0)
+                {
+                    continue;
+                }
+                void *page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+                m_fds[m_count] = fd;
+                m_pages[m_count] = page == MAP_FAILED ? nullptr : static_cast<perf_event_mmap_page *>(page);
+                m_members[m_count] = PerfCounter(event);
+                m_count++;
+            }
+        }
+
+        bool PerfGroup::counts(PerfCounter counter) const
+        {
+            for (size_t i = 0; i < m_count; i++)
+            {
+                if (m_members[i] == counter)
+                {
+                    return true;
+                }
+            }
+            return counter == PERF_NANOS;
+        }
+
+        bool PerfGroup::readMapped(PerfCounts &out) const
+        {
+#if defined(__x86_64__) || defined(__i386__)
+            for (size_t i = 0; i < m_count; i++)
+            {
+                volatile perf_event_mmap_page *page = m_pages[i];
+                if (page == nullptr)
+                {
+                    return false;
+                }
+                uint32_t sequence;
+                uint64_t count;
+                do
+                {
+                    sequence = page->lock;
+                    std::atomic_signal_fence(std::memory_order_seq_cst);
+                    // 0 while the event isn't on the PMU, eg. multiplexed out
+                    uint32_t index = page->index;
+                    if (not page->cap_user_rdpmc or index == 0)
+                    {
+                        return false;
+                    }
+                    count = page->offset;
+                    // The hardware counter is only pmc_width bits wide, sign extend it
+                    auto shift = 64 - page->pmc_width;
+                    count += uint64_t(int64_t(rdpmc(index - 1) << shift) >> shift);
+                    std::atomic_signal_fence(std::memory_order_seq_cst);
+                } while (page->lock != sequence);
+                out[m_members[i]] = count;
+            }
+            return true;
+#else
+            (void)out;
+            return false;
+#endif
+        }
+
+        void PerfGroup::read(PerfCounts &out) const
+        {
+            out = PerfCounts{};
+            out[PERF_NANOS] = nowNanos();
+            if (m_count == 0 or readMapped(out))
+            {
+                return;
+            }
+            uint64_t values[1 + NUM_EVENTS];
+            auto bytes = ::read(m_fds[0], values, sizeof(values));
+            if (bytes < ssize_t(sizeof(uint64_t)))
+            {
+                return;
+            }
+            for (size_t i = 0; i < m_count and i < values[0]; i++)
+            {
+                out[m_members[i]] = values[1 + i];
+            }
+        }
+    }
+
+    bool PerfCounters::start()
+    {
+        return not s_enabled.exchange(true);
+    }
+
+    void PerfCounters::stop()
+    {
+        s_enabled = false;
+    }
+
+    bool PerfCounters::supported(PerfCounter counter)
+    {
+        // Opened once on the calling thread and closed again, executors get the same from the same kernel
+        static const uint32_t available = []()
+        {
+            detail::PerfGroup group;
+            group.open();
+            uint32_t mask = 0;
+            for (size_t i = 0; i < NUM_PERF_COUNTERS; i++)
+            {
+                mask |= group.counts(PerfCounter(i)) ? 1u << i : 0;
+            }
+            return mask;
+        }();
+        return available & (1u << counter);
+    }
+
+    PerfCounts PerfCounters::routine()
+    {
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        if (executor == nullptr)
+        {
+            return {};
+        }
+        auto totals = executor->activeRoutinePerf();
+        executor->setPreemptible(preemptible);
+        return totals;
+    }
+}
@@ -0,0 +1,120 @@
+#include "Poller.h"
+
+#include <sys/epoll.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        bool PollDescriptor::Direction::wait(CancelContext *context)
+        {
+            std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+            while (not m_ready)
+            {
+                if (not m_waiters.wait(guard, context))
+                {
+                    return false;
+                }
+            }
+            // Consumed, the next EAGAIN waits for the next edge
+            m_ready = false;
+            return true;
+        }
+
+        void PollDescriptor::Direction::signal()
+        {
+            std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+            m_ready = true;
+            // All of them retry, whoever still gets EAGAIN waits again
+            m_waiters.notifyAll();
+        }
+
+        PollDescriptor::PollDescriptor(int fd)
+            : m_fd(fd)
+        {
+            Poller::instance().add(*this);
+        }
+
+        PollDescriptor::~PollDescriptor()
+        {
+            Poller::instance().remove(*this);
+        }
+
+        void PollDescriptor::wakeAll()
+        {
+            m_read.signal();
+            m_write.signal();
+        }
+
+        Poller::Poller()
+        {
+            m_epoll = epoll_create1(EPOLL_CLOEXEC);
+            if (m_epoll < 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "epoll_create1");
+            }
+            m_thread = std::thread([this]()
+                                   { run(); });
+            // Lives as long as the process, like the instance itself
+            m_thread.detach();
+        }
+
+        Poller &Poller::instance()
+        {
+            // Never destroyed, descriptors may still unregister from static destructors
+            static Poller *poller = new Poller();
+            return *poller;
+        }
+
+        void Poller::add(PollDescriptor &descriptor)
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            descriptor.m_id = m_next_id++;
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = descriptor.m_id;
+            if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, descriptor.m_fd, &event) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+            }
+            m_descriptors.emplace(descriptor.m_id, &descriptor);
+        }
+
+        void Poller::remove(PollDescriptor &descriptor)
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, descriptor.m_fd, nullptr);
+            m_descriptors.erase(descriptor.m_id);
+        }
+
+        void Poller::run()
+        {
+            epoll_event events[64];
+            while (true)
+            {
+                int count = epoll_wait(m_epoll, events, 64, -1);
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                for (int i = 0; i < count; i++)
+                {
+                    auto found = m_descriptors.find(events[i].data.u64);
+                    if (found == m_descriptors.end())
+                    {
+                        continue;
+                    }
+                    // Errors and hang ups wake both sides, their I/O then fails rather than waiting forever
+                    uint32_t flags = events[i].events;
+                    if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    {
+                        found->second->m_read.signal();
+                    }
+                    if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+                    {
+                        found->second->m_write.signal();
+                    }
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,252 @@
+#include "Pprof.h"
+#include "Protobuf.h"
+
+#include <chrono>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace gocpp
+{
+    namespace
+    {
+        // Field numbers from profile.proto
+        enum : uint32_t
+        {
+            PROFILE_SAMPLE_TYPE = 1,
+            PROFILE_SAMPLE = 2,
+            PROFILE_MAPPING = 3,
+            PROFILE_LOCATION = 4,
+            PROFILE_FUNCTION = 5,
+            PROFILE_STRING_TABLE = 6,
+            PROFILE_TIME_NANOS = 9,
+            PROFILE_DURATION_NANOS = 10,
+            PROFILE_PERIOD_TYPE = 11,
+            PROFILE_PERIOD = 12,
+            VALUE_TYPE_TYPE = 1,
+            VALUE_TYPE_UNIT = 2,
+            SAMPLE_LOCATION_ID = 1,
+            SAMPLE_VALUE = 2,
+            SAMPLE_LABEL = 3,
+            LABEL_KEY = 1,
+            LABEL_STR = 2,
+            LABEL_NUM = 3,
+            MAPPING_ID = 1,
+            MAPPING_MEMORY_START = 2,
+            MAPPING_MEMORY_LIMIT = 3,
+            MAPPING_FILE_OFFSET = 4,
+            MAPPING_FILENAME = 5,
+            MAPPING_HAS_FUNCTIONS = 7,
+            LOCATION_ID = 1,
+            LOCATION_MAPPING_ID = 2,
+            LOCATION_ADDRESS = 3,
+            LOCATION_LINE = 4,
+            LINE_FUNCTION_ID = 1,
+            FUNCTION_ID = 1,
+            FUNCTION_NAME = 2,
+            FUNCTION_SYSTEM_NAME = 3,
+            FUNCTION_FILENAME = 4,
+        };
+
+        class StringTable
+        {
+            std::vector<std::string> m_strings{""};
+            std::unordered_map<std::string, int64_t> m_index{{"", 0}};
+
+        public:
+            int64_t operator()(const std::string &value)
+            {
+                auto it = m_index.find(value);
+                if (it != m_index.end())
+                {
+                    return it->second;
+                }
+                m_strings.emplace_back(value);
+                return m_index[value] = int64_t(m_strings.size() - 1);
+            }
+            const std::vector<std::string> &strings() const { return m_strings; }
+        };
+
+        struct Mapping
+        {
+            uint64_t m_start, m_limit, m_offset;
+            std::string m_file;
+        };
+
+        std::vector<Mapping> executableMappings()
+        {
+            std::vector<Mapping> mappings;
+            std::ifstream maps("/proc/self/maps");
+            std::string line;
+            while (std::getline(maps, line))
+            {
+                std::istringstream fields(line);
+                std::string range, perms, offset, device, inode, file;
+                fields >> range >> perms >> offset >> device >> inode >> file;
+                if (perms.size() < 3 or perms[2] != 'x')
+                {
+                    continue;
+                }
+                auto dash = range.find('-');
+                mappings.push_back(Mapping{std::stoull(range.substr(0, dash), nullptr, 16),
+                                           std::stoull(range.substr(dash + 1), nullptr, 16),
+                                           std::stoull(offset, nullptr, 16), file});
+            }
+            return mappings;
+        }
+
+        std::string demangle(const char *symbol)
+        {
+            int status = 0;
+            std::unique_ptr<char, decltype(&free)> demangled(abi::__cxa_demangle(symbol, nullptr, nullptr, &status), &free);
+            return status == 0 and demangled ? std::string(demangled.get()) : std::string(symbol);
+        }
+    }
+
+    PprofBuilder::PprofBuilder(std::vector<std::pair<std::string, std::string>> sampleTypes,
+                               std::pair<std::string, std::string> periodType, int64_t period)
+        : m_sample_types(std::move(sampleTypes)), m_period_type(std::move(periodType)), m_period(period)
+    {
+        m_time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void PprofBuilder::addSample(const uintptr_t *stack, size_t depth, std::vector<int64_t> values, std::vector<Label> labels)
+    {
+        Sample sample{{}, std::move(values), std::move(labels)};
+        for (size_t i = 0; i < depth; i++)
+        {
+            // Return addresses point past the call, attribute them to the call instruction itself
+            uintptr_t address = i == 0 ? stack[i] : stack[i] - 1;
+            auto it = m_locations.find(address);
+            if (it == m_locations.end())
+            {
+                m_addresses.emplace_back(address);
+                it = m_locations.emplace(address, m_addresses.size()).first;
+            }
+            sample.m_locations.emplace_back(it->second);
+        }
+        m_samples.emplace_back(std::move(sample));
+    }
+
+    std::string PprofBuilder::encode() const
+    {
+        using detail::ProtoWriter;
+        StringTable strings;
+        ProtoWriter profile;
+
+        auto const valueType = [&](const std::pair<std::string, std::string> &type)
+        {
+            ProtoWriter message;
+            message.int64(VALUE_TYPE_TYPE, strings(type.first));
+            message.int64(VALUE_TYPE_UNIT, strings(type.second));
+            return message;
+        };
+
+        for (auto &type : m_sample_types)
+        {
+            profile.message(PROFILE_SAMPLE_TYPE, valueType(type));
+        }
+
+        for (auto &sample : m_samples)
+        {
+            ProtoWriter message;
+            message.packed(SAMPLE_LOCATION_ID, sample.m_locations);
+            message.packed(SAMPLE_VALUE, sample.m_values);
+            for (auto &label : sample.m_labels)
+            {
+                ProtoWriter labelMessage;
+                labelMessage.int64(LABEL_KEY, strings(label.m_key));
+                if (label.m_numeric)
+                {
+                    labelMessage.int64(LABEL_NUM, label.m_num);
+                }
+                else
+                {
+                    labelMessage.int64(LABEL_STR, strings(label.m_str));
+                }
+                message.message(SAMPLE_LABEL, labelMessage);
+            }
+            profile.message(PROFILE_SAMPLE, message);
+        }
+
+        auto mappings = executableMappings();
+        for (size_t i = 0; i < mappings.size(); i++)
+        {
+            ProtoWriter message;
+            message.uint64(MAPPING_ID, i + 1);
+            message.uint64(MAPPING_MEMORY_START, mappings[i].m_start);
+            message.uint64(MAPPING_MEMORY_LIMIT, mappings[i].m_limit);
+            message.uint64(MAPPING_FILE_OFFSET, mappings[i].m_offset);
+            message.int64(MAPPING_FILENAME, strings(mappings[i].m_file));
+            profile.message(PROFILE_MAPPING, message);
+        }
+
+        // One function per distinct symbol dladdr can name
+        std::map<std::string, uint64_t> functions;
+        for (size_t i = 0; i < m_addresses.size(); i++)
+        {
+            auto address = m_addresses[i];
+            ProtoWriter message;
+            message.uint64(LOCATION_ID, i + 1);
+            for (size_t m = 0; m < mappings.size(); m++)
+            {
+                if (address >= mappings[m].m_start and address < mappings[m].m_limit)
+                {
+                    message.uint64(LOCATION_MAPPING_ID, m + 1);
+                    break;
+                }
+            }
+            message.uint64(LOCATION_ADDRESS, address);
+
+            Dl_info info{};
+            if (dladdr(reinterpret_cast<void *>(address), &info) and info.dli_sname)
+            {
+                auto inserted = functions.emplace(info.dli_sname, functions.size() + 1);
+                ProtoWriter line;
+                line.uint64(LINE_FUNCTION_ID, inserted.first->second);
+                message.message(LOCATION_LINE, line);
+            }
+            profile.message(PROFILE_LOCATION, message);
+        }
+        for (auto &[symbol, id] : functions)
+        {
+            ProtoWriter message;
+            message.uint64(FUNCTION_ID, id);
+            message.int64(FUNCTION_NAME, strings(demangle(symbol.c_str())));
+            message.int64(FUNCTION_SYSTEM_NAME, strings(symbol));
+            profile.message(PROFILE_FUNCTION, message);
+        }
+
+        if (m_period != 0)
+        {
+            profile.message(PROFILE_PERIOD_TYPE, valueType(m_period_type));
+            profile.int64(PROFILE_PERIOD, m_period);
+        }
+        profile.int64(PROFILE_TIME_NANOS, m_time);
+        profile.int64(PROFILE_DURATION_NANOS, m_duration);
+
+        // String table goes last since everything above interns into it
+        for (auto &value : strings.strings())
+        {
+            profile.string(PROFILE_STRING_TABLE, value);
+        }
+        return profile.data();
+    }
+
+    bool PprofBuilder::write(const std::string &path) const
+    {
+        auto bytes = encode();
+        FILE *out = fopen(path.c_str(), "wb");
+        if (out == nullptr)
+        {
+            return false;
+        }
+        bool ok = fwrite(bytes.data(), 1, bytes.size(), out) == bytes.size();
+        return fclose(out) == 0 and ok;
+    }
+}
@@ -4,17 +4,71 @@
 namespace gocpp
 {
 
+    void Processor::push(RoutinePtr &&routine)
+    {
+        auto priority = routine->priority();
+        m_routines[priority].emplace_back(std::move(routine));
+        m_queued[priority].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    size_t Processor::size() const
+    {
+        size_t size = 0;
+        for (auto &routines : m_routines)
+        {
+            size += routines.size();
+        }
+        return size;
+    }
+
+    RoutinePtr Processor::popNext()
+    {
+        int best = -1;
+        uint64_t bestDeadline = 0;
+        for (int priority = 0; priority < NUM_PRIORITIES; priority++)
+        {
+            auto &routines = m_routines[priority];
+            if (routines.empty())
+            {
+                continue;
+            }
+            uint64_t deadline = routines.front()->runnableSince() + PRIORITY_SLACK_NANOS[priority];
+            if (best < 0 or deadline < bestDeadline)
+            {
+                best = priority;
+                bestDeadline = deadline;
+            }
+        }
+        if (best < 0)
+        {
+            return nullptr;
+        }
+        RoutinePtr next = std::move(m_routines[best].front());
+        m_routines[best].pop_front();
+        m_queued[best].fetch_sub(1, std::memory_order_relaxed);
+        return next;
+    }
+
     bool Processor::surrenderRoutines(std::vector<RoutinePtr> &stolenRoutines, bool all)
     {
         std::unique_lock<std::mutex> lock(m_lock);
-        size_t routinesToLeave = all ? 0 : (1 + m_routines.size()) >> 1;
-        size_t routinesToSurrender = m_routines.size() - routinesToLeave;
-        while (m_routines.size() > routinesToLeave)
+        size_t routines = size();
+        size_t routinesToLeave = all ? 0 : (1 + routines) >> 1;
+        size_t routinesToSurrender = routines - routinesToLeave;
+        // Latency sensitive routines first, they are the ones waiting on a busy core hurts most
+        size_t surrendered = 0;
+        for (int priority = 0; priority < NUM_PRIORITIES and surrendered < routinesToSurrender; priority++)
         {
-            stolenRoutines.emplace_back(std::move(m_routines.back()));
-            m_routines.pop_back();
+            auto &queue = m_routines[priority];
+            while (not queue.empty() and surrendered < routinesToSurrender)
+            {
+                stolenRoutines.emplace_back(std::move(queue.back()));
+                queue.pop_back();
+                m_queued[priority].fetch_sub(1, std::memory_order_relaxed);
+                surrendered++;
+            }
         }
-        return routinesToLeave > 0;
+        return routinesToSurrender > 0;
     }
 
     bool Processor::pullMoreRoutines(bool coreIdle)
@@ -27,15 +81,26 @@ namespace gocpp
         bool routinesAdded = not moreRoutines.empty();
         for (auto &routine : moreRoutines)
         {
-            m_routines.emplace_back(std::move(routine));
+            push(std::move(routine));
         }
         return routinesAdded;
     }
 
     bool Processor::hasRoutines(bool coreIdle)
     {
+        // Latency sensitive routines queued globally don't wait for the next periodic check
+        if (++m_sched_tick % GLOBAL_QUEUE_CHECK_INTERVAL == 0 or Machines::getInstance()->globalLatencyRoutines() != 0)
+        {
+            std::vector<RoutinePtr> globalRoutines;
+            Machines::getInstance()->pullGlobalRoutines(globalRoutines);
+            std::unique_lock<std::mutex> lock(m_lock);
+            for (auto &routine : globalRoutines)
+            {
+                push(std::move(routine));
+            }
+        }
         std::unique_lock<std::mutex> lock(m_lock);
-        if (not m_routines.empty())
+        if (size() != 0)
         {
             return true;
         }
@@ -52,21 +117,67 @@ namespace gocpp
             return;
         }
         std::unique_lock<std::mutex> lock(m_lock);
-        if (not m_routines.empty())
+        if (size() != 0)
         {
-            next.swap(m_routines.front());
-            m_routines.pop_front();
             if (notIdle)
             {
-                // keep the current routine in the back of work list
-                m_routines.emplace_back(std::move(currentRoutine));
+                // keep the current routine in the back of its work list, it competes with the others on its deadline
+                currentRoutine->markRunnable();
+                push(std::move(currentRoutine));
             }
+            next = popNext();
+            GO_TRACE(TRACE_START, next->id(), m_id);
+        }
+    }
+
+    void Processor::submitRoutines(std::vector<RoutinePtr> &&routines)
+    {
+        if (routines.empty())
+        {
+            return;
+        }
+        // A routine preempted while holding m_lock would deadlock its own scheduler
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        auto priority = routines.front()->priority();
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            for (auto &routine : routines)
+            {
+                push(std::move(routine));
+            }
+        }
+        routines.clear();
+        // From the scheduler itself (nothing running) there is nothing to preempt, it is about to pick anyway
+        if (executor and priority < executor->runningPriority() and executor->runningPriority() != NUM_PRIORITIES)
+        {
+            executor->requestPreemption();
+        }
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
         }
     }
 
     void Processor::submitRoutine(RoutinePtr &&routinePtr)
     {
-        std::unique_lock<std::mutex> lock(m_lock);
-        m_routines.emplace_back(std::move(routinePtr));
+        // A routine preempted while holding m_lock would deadlock its own scheduler
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        auto priority = routinePtr->priority();
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            push(std::move(routinePtr));
+        }
+        if (executor and priority < executor->runningPriority() and executor->runningPriority() != NUM_PRIORITIES)
+        {
+            // Don't make it wait for the end of a lower class routine's quantum. From the scheduler itself (nothing
+            // running) there is nothing to preempt, and a request would cut the routine it picks next short
+            executor->requestPreemption();
+        }
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
     }
-}
\ No newline at end of file
+}
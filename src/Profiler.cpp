@@ -0,0 +1,204 @@
+#include "Profiler.h"
+#include "Executor.h"
+#include "Metrics.h"
+#include "Pprof.h"
+
+#include <map>
+#include <tuple>
+
+namespace gocpp
+{
+    namespace
+    {
+        // Program counter, frame pointer and stack pointer of the interrupted code
+        bool machineRegisters(const ucontext_t *context, uintptr_t &pc, uintptr_t &fp, uintptr_t &sp)
+        {
+#if defined(__x86_64__)
+            pc = uintptr_t(context->uc_mcontext.gregs[REG_RIP]);
+            fp = uintptr_t(context->uc_mcontext.gregs[REG_RBP]);
+            sp = uintptr_t(context->uc_mcontext.gregs[REG_RSP]);
+            return true;
+#elif defined(__aarch64__)
+            pc = uintptr_t(context->uc_mcontext.pc);
+            fp = uintptr_t(context->uc_mcontext.regs[29]);
+            sp = uintptr_t(context->uc_mcontext.sp);
+            return true;
+#else
+            (void)context;
+            pc = fp = sp = 0;
+            return false;
+#endif
+        }
+    }
+
+    namespace detail
+    {
+        size_t walkFrames(uintptr_t fp, uintptr_t low, uintptr_t high, uintptr_t *stack, size_t depth, size_t maxDepth)
+        {
+            // Each frame starts with the caller's frame pointer followed by the return address
+            while (depth < maxDepth and fp >= low and fp + 2 * sizeof(uintptr_t) <= high and fp % sizeof(uintptr_t) == 0)
+            {
+                auto *frame = reinterpret_cast<const uintptr_t *>(fp);
+                uintptr_t next = frame[0], ret = frame[1];
+                if (ret == 0)
+                {
+                    break;
+                }
+                stack[depth++] = ret;
+                if (next <= fp)
+                {
+                    break;
+                }
+                fp = next;
+            }
+            return depth;
+        }
+    }
+
+    bool Profiler::start()
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        if (s_enabled)
+        {
+            return false;
+        }
+        if (s_buffers.empty())
+        {
+            for (size_t i = 0; i < MAX_EXECUTORS; i++)
+            {
+                s_buffers.emplace_back(std::make_unique<SampleBuffer>());
+            }
+        }
+        for (auto &buffer : s_buffers)
+        {
+            buffer->m_count.store(0, std::memory_order_relaxed);
+            buffer->m_dropped.store(0, std::memory_order_relaxed);
+        }
+        s_started = nowNanos();
+        s_enabled.store(true, std::memory_order_release);
+        return true;
+    }
+
+    bool Profiler::stop(const std::string &path)
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        s_enabled.store(false, std::memory_order_release);
+
+        PprofBuilder builder({{"samples", "count"}, {"cpu", "nanoseconds"}}, {"cpu", "nanoseconds"}, TIMER_NANOS);
+        builder.setDuration(int64_t(nowNanos() - s_started));
+
+        // Identical stacks of the same routine collapse into one weighted sample
+        using Key = std::tuple<uint32_t, uint32_t, int32_t, std::vector<uintptr_t>>;
+        std::map<Key, int64_t> counts;
+        for (auto &buffer : s_buffers)
+        {
+            auto count = buffer->m_count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < count; i++)
+            {
+                auto &sample = buffer->m_samples[i];
+                Key key{sample.m_routine, sample.m_label, sample.m_executor,
+                        std::vector<uintptr_t>(sample.m_stack, sample.m_stack + sample.m_depth)};
+                counts[key]++;
+            }
+        }
+        for (auto &[key, count] : counts)
+        {
+            auto &[routine, label, executor, stack] = key;
+            std::vector<PprofBuilder::Label> labels{{"routine", "", routine, true}, {"executor", "", executor, true}};
+            if (label != 0)
+            {
+                labels.push_back({"label", s_labels[label]});
+            }
+            builder.addSample(stack.data(), stack.size(), {count, count * int64_t(TIMER_NANOS)}, std::move(labels));
+        }
+        return builder.write(path);
+    }
+
+    void Profiler::setLabel(const std::string &label)
+    {
+        // Holding s_lock across a preemption could deadlock another routine on this executor
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        auto *routine = executor ? executor->activeRoutine() : nullptr;
+        if (routine == nullptr)
+        {
+            if (executor)
+            {
+                executor->setPreemptible(preemptible);
+            }
+            return;
+        }
+        {
+            std::unique_lock<std::mutex> lock(s_lock);
+            uint32_t index = 0;
+            while (index < s_labels.size() and s_labels[index] != label)
+            {
+                index++;
+            }
+            if (index == s_labels.size())
+            {
+                s_labels.emplace_back(label);
+            }
+            routine->setLabel(index);
+        }
+        executor->setPreemptible(preemptible);
+    }
+
+    std::vector<std::string> Profiler::labels()
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        return s_labels;
+    }
+
+    uint64_t Profiler::dropped()
+    {
+        uint64_t dropped = 0;
+        std::unique_lock<std::mutex> lock(s_lock);
+        for (auto &buffer : s_buffers)
+        {
+            dropped += buffer->m_dropped.load(std::memory_order_relaxed);
+        }
+        return dropped;
+    }
+
+    void Profiler::sample(Executor &executor, const ucontext_t *context)
+    {
+        auto *routine = executor.activeRoutine();
+        if (routine == nullptr or routine->runContext() == nullptr or size_t(executor.id()) >= s_buffers.size())
+        {
+            return;
+        }
+        uintptr_t pc, fp, sp;
+        if (not machineRegisters(context, pc, fp, sp))
+        {
+            return;
+        }
+        // Also taken while the routine can't be preempted (holding a lock, pinned, in the allocator). Only the
+        // routine's own stack counts as the routine: anywhere else the executor is switching or scheduling
+        auto low = uintptr_t(routine->runContext()->stackBegin());
+        auto high = uintptr_t(routine->runContext()->stackEnd());
+        if (sp < low or sp >= high)
+        {
+            return;
+        }
+        auto &buffer = *s_buffers[executor.id()];
+        // Only this executor's signal handler appends to its buffer
+        auto index = buffer.m_count.load(std::memory_order_relaxed);
+        if (index >= SAMPLES_PER_EXECUTOR)
+        {
+            buffer.m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto &sample = buffer.m_samples[index];
+        sample.m_routine = routine->id();
+        sample.m_label = routine->label();
+        sample.m_executor = executor.id();
+        sample.m_depth = 0;
+        sample.m_stack[sample.m_depth++] = pc;
+
+        // Bounded to the routine stack, so nothing is ever dereferenced outside memory we own
+        sample.m_depth = uint32_t(detail::walkFrames(fp, low, high, sample.m_stack, sample.m_depth, MAX_DEPTH));
+        buffer.m_count.store(index + 1, std::memory_order_release);
+    }
+}
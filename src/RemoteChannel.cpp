@@ -0,0 +1,637 @@
+#include "RemoteChannel.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        namespace
+        {
+            [[noreturn]] void fail(const char *what)
+            {
+                throw std::system_error(errno, std::generic_category(), what);
+            }
+
+            constexpr size_t RECEIVE_CHUNK = 64 * 1024;
+
+            void appendUint32(std::string &out, uint32_t value)
+            {
+                out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+            }
+
+            uint32_t readUint32(const char *data)
+            {
+                uint32_t value;
+                std::memcpy(&value, data, sizeof(value));
+                return value;
+            }
+
+            struct SocketAddress
+            {
+                sockaddr_storage m_storage{};
+                socklen_t m_length{0};
+                bool m_tcp{false};
+            };
+
+            // Throws std::invalid_argument for anything but "unix:/path" and "tcp:host:port". Host names are
+            // resolved with getaddrinfo(), which blocks the executor
+            SocketAddress resolve(const std::string &address)
+            {
+                SocketAddress result;
+                if (address.compare(0, 5, "unix:") == 0)
+                {
+                    auto path = address.substr(5);
+                    auto *un = reinterpret_cast<sockaddr_un *>(&result.m_storage);
+                    if (path.empty() or path.size() >= sizeof(un->sun_path))
+                    {
+                        throw std::invalid_argument("Bad unix socket path: " + address);
+                    }
+                    un->sun_family = AF_UNIX;
+                    std::memcpy(un->sun_path, path.c_str(), path.size() + 1);
+                    result.m_length = socklen_t(offsetof(sockaddr_un, sun_path) + path.size() + 1);
+                    return result;
+                }
+                auto colon = address.rfind(':');
+                if (address.compare(0, 4, "tcp:") != 0 or colon == std::string::npos or colon < 4)
+                {
+                    throw std::invalid_argument("Address is neither unix:/path nor tcp:host:port: " + address);
+                }
+                auto host = address.substr(4, colon - 4);
+                auto port = address.substr(colon + 1);
+                // [::1]:port style IPv6 literals
+                if (host.size() >= 2 and host.front() == '[' and host.back() == ']')
+                {
+                    host = host.substr(1, host.size() - 2);
+                }
+                addrinfo hints{};
+                hints.ai_family = AF_UNSPEC;
+                hints.ai_socktype = SOCK_STREAM;
+                hints.ai_flags = AI_NUMERICSERV;
+                addrinfo *found = nullptr;
+                if (int error = getaddrinfo(host.c_str(), port.c_str(), &hints, &found); error != 0)
+                {
+                    throw std::runtime_error("Cannot resolve " + address + ": " + gai_strerror(error));
+                }
+                std::memcpy(&result.m_storage, found->ai_addr, found->ai_addrlen);
+                result.m_length = found->ai_addrlen;
+                result.m_tcp = true;
+                freeaddrinfo(found);
+                return result;
+            }
+
+            // Batching is ours, Nagle would only delay the frames
+            void noDelay(int fd)
+            {
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            }
+        }
+
+        RemoteEndpoint::RemoteEndpoint(int fd, size_t bufferSize)
+            : m_fd(fd), m_buffer_size(uint32_t(std::max<size_t>(1, std::min<size_t>(bufferSize, REMOTE_MAX_FRAME)))),
+              m_credit_batch(std::max<uint32_t>(1, m_buffer_size / 2))
+        {
+            int flags = fcntl(m_fd, F_GETFL);
+            if (flags < 0 or fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) != 0)
+            {
+                ::close(m_fd);
+                fail("fcntl");
+            }
+            try
+            {
+                m_poll = std::make_unique<PollDescriptor>(m_fd);
+            }
+            catch (...)
+            {
+                ::close(m_fd);
+                throw;
+            }
+            auto *machines = Machines::getInstance();
+            machines->submitRoutine([this]()
+                                    { sendLoop(); });
+            machines->submitRoutine([this]()
+                                    { receiveLoop(); });
+        }
+
+        RemoteEndpoint::~RemoteEndpoint()
+        {
+            // Whatever got written goes out first, followed by CLOSE
+            close();
+            m_stopping = true;
+            m_sender.wakeAll();
+            {
+                std::unique_lock<RoutineMutex> guard(m_done.lock());
+                while (m_routines == 2)
+                {
+                    m_done.wait(guard);
+                }
+            }
+            // Only the receiver is left, the peer sees EOF and we see it hang up
+            shutdown(m_fd, SHUT_RDWR);
+            m_poll->wakeAll();
+            {
+                std::unique_lock<RoutineMutex> guard(m_done.lock());
+                while (m_routines != 0)
+                {
+                    m_done.wait(guard);
+                }
+            }
+            m_poll.reset();
+            ::close(m_fd);
+        }
+
+        bool RemoteEndpoint::creditDue() const
+        {
+            uint32_t consumed = m_consumed;
+            return consumed != 0 and (consumed >= m_credit_batch or m_inbox_size == 0);
+        }
+
+        bool RemoteEndpoint::sendPending() const
+        {
+            return m_outbox_records != 0 or m_stopping or m_disconnected or creditDue();
+        }
+
+        bool RemoteEndpoint::send(const std::string &record, CancelContext *context)
+        {
+            BlockTimer blocked(this);
+            while (true)
+            {
+                if (m_closed)
+                {
+                    throw std::runtime_error("Attempted write on a closed channel!");
+                }
+                if (m_disconnected)
+                {
+                    throw std::runtime_error("Remote channel disconnected!");
+                }
+                auto credit = m_credit.load();
+                if (credit > 0)
+                {
+                    if (m_credit.compare_exchange_weak(credit, credit - 1))
+                    {
+                        break;
+                    }
+                    continue;
+                }
+                blocked.park();
+                std::unique_lock<RoutineMutex> guard(m_writers.lock());
+                if (not m_writers.waitUnless(guard, [this]()
+                                             { return m_credit > 0 or m_closed or m_disconnected; },
+                                             context))
+                {
+                    return false;
+                }
+            }
+            // Has to fit a DATA frame on its own, behind its length
+            if (record.size() > REMOTE_MAX_FRAME - sizeof(uint32_t))
+            {
+                throw std::length_error("Remote channel record larger than REMOTE_MAX_FRAME!");
+            }
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                if (m_close_queued)
+                {
+                    // Lost the race with close(), DATA must not follow CLOSE
+                    throw std::runtime_error("Attempted write on a closed channel!");
+                }
+                appendUint32(m_outbox, uint32_t(record.size()));
+                m_outbox.append(record);
+                m_outbox_records++;
+            }
+            m_sender.wakeOne();
+            return true;
+        }
+
+        bool RemoteEndpoint::tryReceive(std::string &out)
+        {
+            if (m_inbox_size == 0)
+            {
+                return false;
+            }
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                if (m_inbox.empty())
+                {
+                    return false;
+                }
+                out = std::move(m_inbox.front());
+                m_inbox.pop_front();
+                m_inbox_size--;
+            }
+            m_consumed++;
+            if (creditDue())
+            {
+                m_sender.wakeOne();
+            }
+            return true;
+        }
+
+        bool RemoteEndpoint::receive(std::string &out, CancelContext *context)
+        {
+            BlockTimer blocked(this);
+            while (true)
+            {
+                if (tryReceive(out))
+                {
+                    return true;
+                }
+                else if (m_peer_closed or m_disconnected)
+                {
+                    // Records that came in right before are still delivered
+                    return tryReceive(out);
+                }
+                blocked.park();
+                std::unique_lock<RoutineMutex> guard(m_readers.lock());
+                if (not m_readers.waitUnless(guard, [this]()
+                                             { return readReady() or m_peer_closed or m_disconnected; },
+                                             context))
+                {
+                    return false;
+                }
+            }
+        }
+
+        void RemoteEndpoint::close()
+        {
+            {
+                std::unique_lock<RoutineMutex> guard(m_lock);
+                if (m_close_queued)
+                {
+                    return;
+                }
+                m_close_queued = true;
+                m_closed = true;
+            }
+            m_sender.wakeOne();
+            // Writers waiting for credit give up
+            m_writers.wakeAll();
+        }
+
+        void RemoteEndpoint::sendLoop()
+        {
+            std::string frames;
+            // Swapped with m_outbox every round, so both keep their capacity
+            std::string outbox;
+            // Our buffer size is the peer's initial credit
+            appendUint32(frames, sizeof(uint32_t));
+            frames.push_back(char(CREDIT));
+            appendUint32(frames, m_buffer_size);
+            while (not m_disconnected)
+            {
+                uint32_t records = 0;
+                uint32_t batches = 0;
+                bool close = false;
+                {
+                    std::unique_lock<RoutineMutex> guard(m_lock);
+                    if (m_outbox_records != 0)
+                    {
+                        // Everything writers queued since the last round
+                        records = m_outbox_records.exchange(0);
+                        outbox.swap(m_outbox);
+                    }
+                    if (m_close_queued and not m_close_sent)
+                    {
+                        close = true;
+                        m_close_sent = true;
+                    }
+                }
+                for (size_t start = 0; start < outbox.size(); batches++)
+                {
+                    // As many whole records as fit in a frame, write() made sure one always does
+                    size_t end = start;
+                    while (end < outbox.size())
+                    {
+                        size_t next = end + sizeof(uint32_t) + readUint32(outbox.data() + end);
+                        if (next - start > REMOTE_MAX_FRAME)
+                        {
+                            break;
+                        }
+                        end = next;
+                    }
+                    appendUint32(frames, uint32_t(end - start));
+                    frames.push_back(char(DATA));
+                    frames.append(outbox, start, end - start);
+                    start = end;
+                }
+                outbox.clear();
+                if (close)
+                {
+                    // After the last DATA
+                    appendUint32(frames, 0);
+                    frames.push_back(char(CLOSE));
+                }
+                if (creditDue())
+                {
+                    appendUint32(frames, sizeof(uint32_t));
+                    frames.push_back(char(CREDIT));
+                    appendUint32(frames, m_consumed.exchange(0));
+                }
+                if (frames.empty())
+                {
+                    if (m_stopping)
+                    {
+                        // The destructor closed before stopping us, CLOSE went out above
+                        break;
+                    }
+                    std::unique_lock<RoutineMutex> guard(m_sender.lock());
+                    m_sender.waitUnless(guard, [this]()
+                                        { return sendPending(); });
+                    continue;
+                }
+                if (not sendAll(frames))
+                {
+                    disconnect();
+                    break;
+                }
+                if (records != 0)
+                {
+                    Metrics::local().add(MetricCounter::REMOTE_BATCHES, batches);
+                    Metrics::local().add(MetricCounter::REMOTE_RECORDS, records);
+                }
+                frames.clear();
+            }
+            routineDone();
+        }
+
+        bool RemoteEndpoint::sendAll(const std::string &bytes)
+        {
+            size_t sent = 0;
+            while (sent < bytes.size())
+            {
+                ssize_t count = ::send(m_fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+                if (count > 0)
+                {
+                    sent += size_t(count);
+                }
+                else if (count < 0 and errno == EINTR)
+                {
+                    continue;
+                }
+                else if (count < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+                {
+                    m_poll->waitWritable();
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        void RemoteEndpoint::receiveLoop()
+        {
+            std::string buffer;
+            while (true)
+            {
+                size_t used = buffer.size();
+                buffer.resize(used + RECEIVE_CHUNK);
+                ssize_t count = recv(m_fd, buffer.data() + used, RECEIVE_CHUNK, 0);
+                buffer.resize(used + size_t(std::max<ssize_t>(0, count)));
+                if (count > 0)
+                {
+                    if (not parse(buffer))
+                    {
+                        break;
+                    }
+                }
+                else if (count < 0 and errno == EINTR)
+                {
+                    continue;
+                }
+                else if (count < 0 and (errno == EAGAIN or errno == EWOULDBLOCK))
+                {
+                    m_poll->waitReadable();
+                }
+                else
+                {
+                    // EOF or a broken connection
+                    break;
+                }
+            }
+            disconnect();
+            routineDone();
+        }
+
+        bool RemoteEndpoint::parse(std::string &buffer)
+        {
+            size_t position = 0;
+            while (buffer.size() - position >= FRAME_HEADER)
+            {
+                uint32_t length = readUint32(buffer.data() + position);
+                auto type = FrameType(buffer[position + sizeof(uint32_t)]);
+                if (length > REMOTE_MAX_FRAME)
+                {
+                    return false;
+                }
+                if (buffer.size() - position - FRAME_HEADER < length)
+                {
+                    break;
+                }
+                const char *payload = buffer.data() + position + FRAME_HEADER;
+                position += FRAME_HEADER + length;
+                if (type == DATA)
+                {
+                    std::deque<std::string> records;
+                    for (size_t offset = 0; offset < length;)
+                    {
+                        if (length - offset < sizeof(uint32_t))
+                        {
+                            return false;
+                        }
+                        uint32_t size = readUint32(payload + offset);
+                        offset += sizeof(uint32_t);
+                        if (length - offset < size)
+                        {
+                            return false;
+                        }
+                        records.emplace_back(payload + offset, size);
+                        offset += size;
+                    }
+                    size_t count = records.size();
+                    {
+                        std::unique_lock<RoutineMutex> guard(m_lock);
+                        if (m_inbox.size() + count > m_buffer_size)
+                        {
+                            // Sent without credit
+                            return false;
+                        }
+                        for (auto &record : records)
+                        {
+                            m_inbox.emplace_back(std::move(record));
+                        }
+                        m_inbox_size += uint32_t(count);
+                    }
+                    m_readers.wake(count);
+                }
+                else if (type == CREDIT and length == sizeof(uint32_t))
+                {
+                    uint32_t credit = readUint32(payload);
+                    m_credit += credit;
+                    m_writers.wake(credit);
+                }
+                else if (type == CLOSE)
+                {
+                    m_peer_closed = true;
+                    m_readers.wakeAll();
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            buffer.erase(0, position);
+            return true;
+        }
+
+        void RemoteEndpoint::disconnect()
+        {
+            m_disconnected = true;
+            m_readers.wakeAll();
+            m_writers.wakeAll();
+            m_sender.wakeAll();
+            // The other loop may be waiting on the socket
+            m_poll->wakeAll();
+        }
+
+        void RemoteEndpoint::routineDone()
+        {
+            std::unique_lock<RoutineMutex> guard(m_done.lock());
+            m_routines--;
+            // The destructor may return as soon as it sees the count, nothing of ours is touched afterwards
+            m_done.notifyAll();
+        }
+
+        int dial(const std::string &address, CancelContext *context)
+        {
+            auto target = resolve(address);
+            int fd = socket(target.m_storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+            {
+                fail("socket");
+            }
+            if (target.m_tcp)
+            {
+                noDelay(fd);
+            }
+            if (connect(fd, reinterpret_cast<sockaddr *>(&target.m_storage), target.m_length) == 0)
+            {
+                return fd;
+            }
+            if (errno != EINPROGRESS and errno != EAGAIN)
+            {
+                int error = errno;
+                ::close(fd);
+                errno = error;
+                fail("connect");
+            }
+            {
+                PollDescriptor descriptor(fd);
+                int error = 0;
+                socklen_t length = sizeof(error);
+                while (true)
+                {
+                    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0)
+                    {
+                        error = errno;
+                    }
+                    if (error != 0)
+                    {
+                        break;
+                    }
+                    // Connected once writable without a pending error
+                    pollfd ready{fd, POLLOUT, 0};
+                    if (::poll(&ready, 1, 0) == 1 and (ready.revents & POLLOUT))
+                    {
+                        return fd;
+                    }
+                    if (not descriptor.waitWritable(context))
+                    {
+                        ::close(fd);
+                        return -1;
+                    }
+                }
+                ::close(fd);
+                errno = error;
+                fail("connect");
+            }
+        }
+    }
+
+    RemoteListener::RemoteListener(const std::string &address)
+    {
+        auto local = detail::resolve(address);
+        m_fd = socket(local.m_storage.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_fd < 0)
+        {
+            detail::fail("socket");
+        }
+        int one = 1;
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(m_fd, reinterpret_cast<sockaddr *>(&local.m_storage), local.m_length) != 0 or listen(m_fd, SOMAXCONN) != 0)
+        {
+            int error = errno;
+            ::close(m_fd);
+            errno = error;
+            detail::fail("bind");
+        }
+        m_address = address;
+        if (local.m_tcp)
+        {
+            // Port 0 got one assigned
+            sockaddr_storage bound{};
+            socklen_t length = sizeof(bound);
+            getsockname(m_fd, reinterpret_cast<sockaddr *>(&bound), &length);
+            uint16_t port = bound.ss_family == AF_INET6 ? reinterpret_cast<sockaddr_in6 *>(&bound)->sin6_port
+                                                        : reinterpret_cast<sockaddr_in *>(&bound)->sin_port;
+            m_address = address.substr(0, address.rfind(':') + 1) + std::to_string(ntohs(port));
+        }
+        m_poll = std::make_unique<detail::PollDescriptor>(m_fd);
+    }
+
+    RemoteListener::~RemoteListener()
+    {
+        m_poll.reset();
+        ::close(m_fd);
+        if (m_address.compare(0, 5, "unix:") == 0)
+        {
+            unlink(m_address.c_str() + 5);
+        }
+    }
+
+    int RemoteListener::accept(CancelContext *context)
+    {
+        while (true)
+        {
+            int fd = accept4(m_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                if (m_address.compare(0, 4, "tcp:") == 0)
+                {
+                    detail::noDelay(fd);
+                }
+                return fd;
+            }
+            if (errno == EINTR or errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if (errno != EAGAIN and errno != EWOULDBLOCK)
+            {
+                detail::fail("accept");
+            }
+            if (not m_poll->waitReadable(context))
+            {
+                return -1;
+            }
+        }
+    }
+}
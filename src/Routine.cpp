@@ -6,18 +6,46 @@
 
 namespace gocpp
 {
-    Routine::Routine(std::packaged_task<void(void)> &&task)
+    Routine::Routine(std::unique_ptr<detail::RoutineBody> &&body, Priority priority)
+        : m_fn(std::move(body)), m_priority(priority)
     {
-        m_fn = std::move(task); // moves the task
         m_done = false;
+        m_id = s_next_id.fetch_add(1, std::memory_order_relaxed);
+        markRunnable();
+    }
 
+    Routine::Routine(std::unique_ptr<detail::Resumable> &&task, Priority priority)
+        : m_task(std::move(task)), m_priority(priority)
+    {
+        m_id = s_next_id.fetch_add(1, std::memory_order_relaxed);
+        markRunnable();
+    }
+
+    void Routine::prepare()
+    {
+        if (m_context or m_task)
+        {
+            return;
+        }
         m_scheduler_context = std::make_unique<Context>(ContextType::SCHEDULER);
         m_context = std::make_unique<Context>(ContextType::ROUTINE, m_scheduler_context.get());
     }
 
     void Routine::run()
     {
-        m_fn();
+        if (m_task)
+        {
+            m_done = m_task->resume();
+            return;
+        }
+        try
+        {
+            (*m_fn)();
+        }
+        catch (...)
+        {
+            // An escaping exception just ends the routine, as it did when bodies were std::packaged_tasks
+        }
         m_done = true;
     }
 
@@ -0,0 +1,165 @@
+#include "ShmChannel.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        namespace
+        {
+            [[noreturn]] void fail(const char *what)
+            {
+                throw std::system_error(errno, std::generic_category(), what);
+            }
+        }
+
+        ShmMapping::ShmMapping(int fd)
+            : m_fd(fd)
+        {
+            struct stat st{};
+            if (fstat(m_fd, &st) != 0)
+            {
+                ::close(m_fd);
+                fail("fstat");
+            }
+            m_size = size_t(st.st_size);
+            void *base = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (base == MAP_FAILED)
+            {
+                ::close(m_fd);
+                fail("mmap");
+            }
+            m_base = static_cast<char *>(base);
+        }
+
+        ShmMapping::~ShmMapping()
+        {
+            munmap(m_base, m_size);
+            ::close(m_fd);
+        }
+
+        int ShmMapping::create(size_t size)
+        {
+            int fd = memfd_create("cppgo-channel", MFD_CLOEXEC);
+            if (fd < 0)
+            {
+                fail("memfd_create");
+            }
+            if (ftruncate(fd, off_t(size)) != 0)
+            {
+                ::close(fd);
+                fail("ftruncate");
+            }
+            return fd;
+        }
+
+        int ShmMapping::open(const std::string &name, size_t size, bool &created)
+        {
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+            created = fd >= 0;
+            if (created)
+            {
+                if (ftruncate(fd, off_t(size)) != 0)
+                {
+                    ::close(fd);
+                    fail("ftruncate");
+                }
+                return fd;
+            }
+            if (errno != EEXIST or (fd = shm_open(name.c_str(), O_RDWR, 0600)) < 0)
+            {
+                fail("shm_open");
+            }
+            // Its creator may not have sized it yet
+            struct stat st{};
+            while (fstat(fd, &st) == 0 and st.st_size == 0)
+            {
+                std::this_thread::yield();
+            }
+            return fd;
+        }
+
+        void ShmMapping::unlink(const std::string &name)
+        {
+            shm_unlink(name.c_str());
+        }
+
+        ShmWatcher::ShmWatcher(ShmHeader &header)
+            : m_header(header)
+        {
+            m_readers.signalEnqueues(&m_enqueues);
+            m_writers.signalEnqueues(&m_enqueues);
+        }
+
+        ShmWatcher::~ShmWatcher()
+        {
+            if (not m_thread.joinable())
+            {
+                return;
+            }
+            m_stop = true;
+            // Bumped rather than only woken, in case the watcher is just about to go to sleep on either
+            m_enqueues++;
+            futexWake(m_enqueues);
+            m_header.m_events++;
+            futexWakeShared(m_header.m_events);
+            m_thread.join();
+        }
+
+        WaitQueue &ShmWatcher::readers()
+        {
+            std::call_once(m_started, [this]()
+                           { m_thread = std::thread([this]()
+                                                    { run(); }); });
+            return m_readers;
+        }
+
+        WaitQueue &ShmWatcher::writers()
+        {
+            readers();
+            return m_writers;
+        }
+
+        void ShmWatcher::run()
+        {
+            while (not m_stop)
+            {
+                uint32_t enqueues = m_enqueues.load();
+                if (m_readers.waiting() == 0 and m_writers.waiting() == 0)
+                {
+                    // Nobody here to wake up, no need for the other processes to wake us
+                    futexWait(m_enqueues, enqueues);
+                    continue;
+                }
+                // Waiters check the ring after queueing up, so whatever got committed since `seen` wakes them
+                uint32_t seen = m_header.m_events.load();
+                m_readers.wakeAll();
+                m_writers.wakeAll();
+                m_header.m_sleepers++;
+                futexWaitShared(m_header.m_events, seen);
+                m_header.m_sleepers--;
+            }
+        }
+
+        void ShmWatcher::notify(WaitQueue &queue, size_t count)
+        {
+            queue.wake(count);
+            m_header.m_events++;
+            if (m_header.m_sleepers.load() != 0)
+            {
+                futexWakeShared(m_header.m_events);
+            }
+        }
+
+        void ShmWatcher::notifyClosed()
+        {
+            m_readers.wakeAll();
+            notify(m_writers, SIZE_MAX);
+        }
+    }
+}
@@ -0,0 +1,254 @@
+#include "Slab.h"
+#include "Executor.h"
+#include "Metrics.h"
+
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <mutex>
+#include <sys/mman.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        namespace
+        {
+            constexpr size_t CLASS_SIZES[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+            constexpr size_t NUM_CLASSES = std::size(CLASS_SIZES);
+            static_assert(CLASS_SIZES[NUM_CLASSES - 1] == SLAB_MAX_OBJECT_SIZE);
+
+            // Size class of every multiple of SLAB_ALIGNMENT up to SLAB_MAX_OBJECT_SIZE
+            constexpr auto CLASS_OF = []()
+            {
+                std::array<uint8_t, SLAB_MAX_OBJECT_SIZE / SLAB_ALIGNMENT + 1> classes{};
+                size_t sizeClass = 0;
+                for (size_t i = 0; i < classes.size(); i++)
+                {
+                    while (CLASS_SIZES[sizeClass] < i * SLAB_ALIGNMENT)
+                    {
+                        sizeClass++;
+                    }
+                    classes[i] = uint8_t(sizeClass);
+                }
+                return classes;
+            }();
+
+            size_t classOf(size_t size)
+            {
+                return CLASS_OF[(size + SLAB_ALIGNMENT - 1) / SLAB_ALIGNMENT];
+            }
+
+            struct FreeBlock
+            {
+                FreeBlock *m_next;
+            };
+
+            class SlabCache;
+
+            // Start of every chunk, objects follow from CHUNK_HEADER on
+            struct ChunkHeader
+            {
+                SlabCache *m_owner;
+            };
+            constexpr size_t CHUNK_HEADER = 64;
+
+            ChunkHeader *chunkOf(void *ptr)
+            {
+                return reinterpret_cast<ChunkHeader *>(uintptr_t(ptr) & ~uintptr_t(SLAB_CHUNK_SIZE - 1));
+            }
+
+            thread_local uint32_t t_busy{0};
+
+            // Keeps the preemption signal from switching the routine out while a cache is half updated.
+            // The fences keep the compiler from moving cache updates out of the guarded section
+            struct BusyGuard
+            {
+                BusyGuard()
+                {
+                    t_busy++;
+                    std::atomic_signal_fence(std::memory_order_seq_cst);
+                }
+                ~BusyGuard()
+                {
+                    std::atomic_signal_fence(std::memory_order_seq_cst);
+                    t_busy--;
+                }
+            };
+
+            class alignas(64) SlabCache
+            {
+                struct alignas(64) SizeClass
+                {
+                    FreeBlock *m_free{nullptr};
+                    // Not yet carved part of the class's newest chunk
+                    char *m_bump{nullptr};
+                    char *m_end{nullptr};
+                };
+
+                struct alignas(64) RemoteFrees
+                {
+                    std::atomic<FreeBlock *> m_head{nullptr};
+                };
+
+                std::array<SizeClass, NUM_CLASSES> m_classes{};
+                std::array<RemoteFrees, NUM_CLASSES> m_remote{};
+
+                void newChunk(SizeClass &sizeClass, size_t size, ExecutorMetrics &metrics)
+                {
+                    // Map twice the size and trim, mmap only guarantees page alignment
+                    auto *raw = static_cast<char *>(mmap(nullptr, 2 * SLAB_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+                    if (raw == MAP_FAILED)
+                    {
+                        throw std::bad_alloc();
+                    }
+                    auto *chunk = reinterpret_cast<char *>((uintptr_t(raw) + SLAB_CHUNK_SIZE - 1) & ~uintptr_t(SLAB_CHUNK_SIZE - 1));
+                    if (chunk != raw)
+                    {
+                        munmap(raw, chunk - raw);
+                    }
+                    munmap(chunk + SLAB_CHUNK_SIZE, raw + SLAB_CHUNK_SIZE - chunk);
+                    metrics.add(MetricCounter::SLAB_CHUNK_BYTES, SLAB_CHUNK_SIZE);
+
+                    reinterpret_cast<ChunkHeader *>(chunk)->m_owner = this;
+                    sizeClass.m_bump = chunk + CHUNK_HEADER;
+                    sizeClass.m_end = sizeClass.m_bump + (SLAB_CHUNK_SIZE - CHUNK_HEADER) / size * size;
+                }
+
+            public:
+                void *allocate(size_t index, ExecutorMetrics &metrics)
+                {
+                    auto &sizeClass = m_classes[index];
+                    if (auto *block = sizeClass.m_free)
+                    {
+                        sizeClass.m_free = block->m_next;
+                        return block;
+                    }
+                    size_t size = CLASS_SIZES[index];
+                    if (sizeClass.m_bump != sizeClass.m_end)
+                    {
+                        void *ptr = sizeClass.m_bump;
+                        sizeClass.m_bump += size;
+                        return ptr;
+                    }
+                    metrics.add(MetricCounter::SLAB_MISSES);
+                    // Take back everything other threads freed meanwhile before growing
+                    if (auto *block = m_remote[index].m_head.exchange(nullptr, std::memory_order_acquire))
+                    {
+                        sizeClass.m_free = block->m_next;
+                        return block;
+                    }
+                    newChunk(sizeClass, size, metrics);
+                    void *ptr = sizeClass.m_bump;
+                    sizeClass.m_bump += size;
+                    return ptr;
+                }
+
+                // Only from the thread owning the cache
+                void free(void *ptr, size_t index)
+                {
+                    auto *block = static_cast<FreeBlock *>(ptr);
+                    block->m_next = m_classes[index].m_free;
+                    m_classes[index].m_free = block;
+                }
+
+                // From any thread. Only ever emptied as a whole, so there is no ABA to worry about
+                void freeRemote(void *ptr, size_t index)
+                {
+                    auto *block = static_cast<FreeBlock *>(ptr);
+                    auto &head = m_remote[index].m_head;
+                    block->m_next = head.load(std::memory_order_relaxed);
+                    while (not head.compare_exchange_weak(block->m_next, block, std::memory_order_release,
+                                                          std::memory_order_relaxed))
+                    {
+                    }
+                }
+            };
+
+            // One cache per processor id, plus one shared by threads without a processor. Never freed, memory
+            // handed out may be released by static destructors
+            SlabCache *caches()
+            {
+                static auto *caches = new SlabCache[MAX_PROCS + 1];
+                return caches;
+            }
+
+            SlabCache *externalCache() { return &caches()[MAX_PROCS]; }
+            std::mutex s_external_lock;
+
+            // Cache of the processor held by the calling executor, null without one
+            SlabCache *localCache()
+            {
+                auto *executor = Executor::current();
+                if (executor == nullptr)
+                {
+                    return nullptr;
+                }
+                auto &processor = executor->processor();
+                return processor ? &caches()[processor->id()] : nullptr;
+            }
+        }
+
+        bool slabBusy()
+        {
+            return t_busy != 0;
+        }
+    }
+
+    void *alloc(size_t size, size_t align)
+    {
+        using namespace detail;
+        if (size > SLAB_MAX_OBJECT_SIZE or align > SLAB_ALIGNMENT)
+        {
+            Metrics::local().add(MetricCounter::SLAB_LARGE_ALLOCS);
+            return align > SLAB_ALIGNMENT ? ::operator new(size, std::align_val_t(align)) : ::operator new(size);
+        }
+        BusyGuard guard;
+        auto &metrics = Metrics::local();
+        metrics.add(MetricCounter::SLAB_ALLOCS);
+        if (auto *cache = localCache())
+        {
+            return cache->allocate(classOf(size), metrics);
+        }
+        std::unique_lock<std::mutex> lock(s_external_lock);
+        return externalCache()->allocate(classOf(size), metrics);
+    }
+
+    void dealloc(void *ptr, size_t size, size_t align) noexcept
+    {
+        using namespace detail;
+        if (ptr == nullptr)
+        {
+            return;
+        }
+        if (size > SLAB_MAX_OBJECT_SIZE or align > SLAB_ALIGNMENT)
+        {
+            if (align > SLAB_ALIGNMENT)
+            {
+                ::operator delete(ptr, size, std::align_val_t(align));
+            }
+            else
+            {
+                ::operator delete(ptr, size);
+            }
+            return;
+        }
+        BusyGuard guard;
+        auto *owner = chunkOf(ptr)->m_owner;
+        auto *cache = localCache();
+        if (owner == cache)
+        {
+            owner->free(ptr, classOf(size));
+            return;
+        }
+        if (cache == nullptr and owner == externalCache())
+        {
+            std::unique_lock<std::mutex> lock(s_external_lock);
+            owner->free(ptr, classOf(size));
+            return;
+        }
+        Metrics::local().add(MetricCounter::SLAB_REMOTE_FREES);
+        owner->freeRemote(ptr, classOf(size));
+    }
+}
@@ -0,0 +1,151 @@
+#include "SpillChannel.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        namespace
+        {
+            [[noreturn]] void fail(const char *what)
+            {
+                throw std::system_error(errno, std::generic_category(), what);
+            }
+
+            size_t windowStart(size_t offset)
+            {
+                return offset / SPILL_WINDOW_SIZE * SPILL_WINDOW_SIZE;
+            }
+        }
+
+        SpillSegment::SpillSegment(const std::string &directory, size_t size)
+        {
+            std::string path = directory + "/cppgo-spill-XXXXXX";
+            m_fd = mkostemp(path.data(), O_CLOEXEC);
+            if (m_fd < 0)
+            {
+                fail("mkostemp");
+            }
+            unlink(path.c_str());
+            // Sparse, blocks are only allocated as records get appended
+            m_size = (size + SPILL_WINDOW_SIZE - 1) / SPILL_WINDOW_SIZE * SPILL_WINDOW_SIZE;
+            if (ftruncate(m_fd, off_t(m_size)) != 0)
+            {
+                ::close(m_fd);
+                fail("ftruncate");
+            }
+            void *base = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+            if (base == MAP_FAILED)
+            {
+                ::close(m_fd);
+                fail("mmap");
+            }
+            m_base = static_cast<char *>(base);
+            madvise(m_base, m_size, MADV_SEQUENTIAL);
+        }
+
+        SpillSegment::~SpillSegment()
+        {
+            munmap(m_base, m_size);
+            ::close(m_fd);
+        }
+
+        bool SpillSegment::append(const std::string &record)
+        {
+            if (record.size() > UINT32_MAX)
+            {
+                throw std::length_error("Spilled record over 4GB!");
+            }
+            if (m_size - m_written < RECORD_HEADER + record.size())
+            {
+                return false;
+            }
+            uint32_t length = uint32_t(record.size());
+            std::memcpy(m_base + m_written, &length, RECORD_HEADER);
+            std::memcpy(m_base + m_written + RECORD_HEADER, record.data(), record.size());
+            m_written += RECORD_HEADER + record.size();
+            return true;
+        }
+
+        std::pair<const char *, size_t> SpillSegment::next()
+        {
+            uint32_t length;
+            std::memcpy(&length, m_base + m_read, RECORD_HEADER);
+            const char *data = m_base + m_read + RECORD_HEADER;
+            m_read += RECORD_HEADER + length;
+            return {data, length};
+        }
+
+        SpillSegment::Maintenance SpillSegment::claimMaintenance()
+        {
+            Maintenance maintenance;
+            // One writeback per full window rather than whenever the kernel runs out of clean pages, which
+            // would stall the writer in the middle of a burst. Unmapped from us meanwhile, so the pages can be
+            // reclaimed once written and the burst doesn't show up in our resident size
+            size_t flushable = windowStart(m_written);
+            if (flushable > m_flushed)
+            {
+                maintenance.m_flush_from = m_flushed;
+                maintenance.m_flush_to = m_flushed = flushable;
+            }
+            if (m_read != 0)
+            {
+                // Keep the window after the current one on its way in
+                size_t wanted = std::min(m_size, windowStart(m_read) + 2 * SPILL_WINDOW_SIZE);
+                if (wanted > m_advised)
+                {
+                    maintenance.m_advise_from = std::max(m_advised, windowStart(m_read));
+                    maintenance.m_advise_to = m_advised = wanted;
+                }
+            }
+            // Windows before the next record's are consumed, they leave the file. Dirty pages in there are
+            // dropped without being written back
+            size_t consumed = windowStart(m_read);
+            if (consumed > m_released)
+            {
+                maintenance.m_release_from = m_released;
+                maintenance.m_release_to = m_released = consumed;
+            }
+            return maintenance;
+        }
+
+        void SpillSegment::maintain(const Maintenance &maintenance) const
+        {
+            if (maintenance.m_flush_to > maintenance.m_flush_from)
+            {
+                size_t length = maintenance.m_flush_to - maintenance.m_flush_from;
+                sync_file_range(m_fd, off_t(maintenance.m_flush_from), off_t(length), SYNC_FILE_RANGE_WRITE);
+                madvise(m_base + maintenance.m_flush_from, length, MADV_DONTNEED);
+            }
+            if (maintenance.m_advise_to > maintenance.m_advise_from)
+            {
+                madvise(m_base + maintenance.m_advise_from, maintenance.m_advise_to - maintenance.m_advise_from, MADV_WILLNEED);
+            }
+            if (maintenance.m_release_to > maintenance.m_release_from)
+            {
+                fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(maintenance.m_release_from),
+                          off_t(maintenance.m_release_to - maintenance.m_release_from));
+            }
+        }
+
+        void SpillSegment::reset()
+        {
+            if (m_written > m_released)
+            {
+                fallocate(m_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off_t(m_released), off_t(m_written - m_released));
+            }
+            m_written = m_read = m_flushed = m_advised = m_released = 0;
+        }
+
+        std::string spillDirectory()
+        {
+            const char *directory = getenv("TMPDIR");
+            return directory and *directory ? directory : "/var/tmp";
+        }
+    }
+}
@@ -0,0 +1,76 @@
+#include "TaskGroup.h"
+
+#include <algorithm>
+
+namespace gocpp
+{
+    TaskGroup::TaskGroup(size_t maxInFlight, const CancelContextPtr &parent)
+        : m_context(CancelContext::withCancel(parent)), m_max_in_flight(std::max<size_t>(1, maxInFlight))
+    {
+    }
+
+    TaskGroup::~TaskGroup()
+    {
+        // Children reference the group until their very last instruction
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        while (m_in_flight != 0)
+        {
+            m_waiters.wait(guard);
+        }
+    }
+
+    bool TaskGroup::acquire()
+    {
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        while (m_in_flight >= m_max_in_flight and not m_context->done())
+        {
+            m_waiters.wait(guard, m_context.get());
+        }
+        if (m_context->done())
+        {
+            return false;
+        }
+        m_in_flight++;
+        return true;
+    }
+
+    void TaskGroup::release()
+    {
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        m_in_flight--;
+        // Spawners and wait() callers share the queue, a single wake up could land on the wrong kind
+        m_waiters.notifyAll();
+    }
+
+    void TaskGroup::fail(std::exception_ptr error)
+    {
+        {
+            std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+            if (m_error)
+            {
+                return;
+            }
+            m_error = std::move(error);
+        }
+        m_context->cancel();
+    }
+
+    void TaskGroup::wait()
+    {
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        while (m_in_flight != 0)
+        {
+            m_waiters.wait(guard);
+        }
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+    }
+
+    size_t TaskGroup::inFlight()
+    {
+        std::unique_lock<RoutineMutex> guard(m_waiters.lock());
+        return m_in_flight;
+    }
+}
@@ -0,0 +1,118 @@
+#include "Timers.h"
+#include "CancelContext.h"
+
+#include <vector>
+
+namespace gocpp
+{
+    namespace detail
+    {
+        Timers::Timers()
+        {
+            m_thread = std::thread([this]()
+                                   { run(); });
+            // Lives as long as the process, like the instance itself
+            m_thread.detach();
+        }
+
+        Timers &Timers::instance()
+        {
+            // Never destroyed, timers may still be cancelled from static destructors
+            static Timers *timers = new Timers();
+            return *timers;
+        }
+
+        void Timers::run()
+        {
+            std::vector<std::function<void()>> callbacks;
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            while (true)
+            {
+                if (m_entries.empty())
+                {
+                    m_changed.wait(guard);
+                    continue;
+                }
+                auto first = m_entries.begin();
+                if (first->first.first > Clock::now())
+                {
+                    m_changed.wait_until(guard, first->first.first);
+                    continue;
+                }
+                auto now = Clock::now();
+                while (not m_entries.empty() and m_entries.begin()->first.first <= now)
+                {
+                    auto &entry = m_entries.begin()->second;
+                    if (entry.m_parking)
+                    {
+                        if (entry.m_parking->claim())
+                        {
+                            entry.m_parking->fire();
+                        }
+                    }
+                    else
+                    {
+                        callbacks.emplace_back(std::move(entry.m_callback));
+                    }
+                    m_entries.erase(m_entries.begin());
+                }
+                if (not callbacks.empty())
+                {
+                    guard.unlock();
+                    for (auto &callback : callbacks)
+                    {
+                        callback();
+                    }
+                    callbacks.clear();
+                    guard.lock();
+                }
+            }
+        }
+
+        Timers::Handle Timers::add(Clock::time_point deadline, Entry &&entry)
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            Handle handle{deadline, m_next_id++};
+            bool earliest = m_entries.empty() or deadline < m_entries.begin()->first.first;
+            m_entries.emplace(std::make_pair(deadline, handle.m_id), std::move(entry));
+            if (earliest)
+            {
+                m_changed.notify_one();
+            }
+            return handle;
+        }
+
+        Timers::Handle Timers::schedule(Clock::time_point deadline, Parking *parking)
+        {
+            return add(deadline, Entry{parking, {}});
+        }
+
+        Timers::Handle Timers::schedule(Clock::time_point deadline, std::function<void()> callback)
+        {
+            return add(deadline, Entry{nullptr, std::move(callback)});
+        }
+
+        bool Timers::cancel(const Handle &handle)
+        {
+            std::unique_lock<RoutineMutex> guard(m_lock);
+            return m_entries.erase(std::make_pair(handle.m_deadline, handle.m_id)) != 0;
+        }
+    }
+
+    bool sleepUntil(Clock::time_point deadline, CancelContext *context)
+    {
+        if (deadline <= Clock::now())
+        {
+            return not (context and context->done());
+        }
+        Parking parking;
+        auto &timers = detail::Timers::instance();
+        auto timer = timers.schedule(deadline, &parking);
+        bool slept = parking.block(context);
+        if (not slept)
+        {
+            timers.cancel(timer);
+        }
+        return slept;
+    }
+}
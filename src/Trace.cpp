@@ -0,0 +1,460 @@
+#include "Trace.h"
+#include "Executor.h"
+#include "Metrics.h"
+#include "Protobuf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string.h>
+
+namespace gocpp
+{
+    void TraceBuffer::push(TraceEventType type, uint32_t routine, uint64_t arg, uint64_t timestamp)
+    {
+        auto head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) >= CAPACITY)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto &event = m_events[head & (CAPACITY - 1)];
+        event.m_timestamp = timestamp;
+        event.m_arg = arg;
+        event.m_routine = routine;
+        event.m_executor = int16_t(m_executor);
+        event.m_type = type;
+        event.m_reserved = 0;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    size_t TraceBuffer::drain(FILE *sink)
+    {
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        auto head = m_head.load(std::memory_order_acquire);
+        size_t drained = head - tail;
+        while (tail != head)
+        {
+            // Write the contiguous run up to the end of the ring in one go
+            size_t begin = tail & (CAPACITY - 1);
+            size_t count = std::min<size_t>(head - tail, CAPACITY - begin);
+            fwrite(&m_events[begin], sizeof(TraceEvent), count, sink);
+            tail += count;
+        }
+        m_tail.store(tail, std::memory_order_release);
+        return drained;
+    }
+
+    void TraceBuffer::discard()
+    {
+        m_tail.store(m_head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    TraceBuffer *Tracer::localBuffer()
+    {
+        if (t_buffer == nullptr)
+        {
+            // Constructed on first use only, so that threads which never trace don't take s_lock on exit
+            struct Owner
+            {
+                ~Owner() { retireBuffer(); }
+            };
+            static thread_local Owner t_owner;
+            (void)t_owner;
+            auto *executor = Executor::current();
+            int id = executor ? executor->id() : -1;
+            std::unique_lock<std::mutex> lock(s_lock);
+            if (s_free.empty())
+            {
+                s_buffers.emplace_back(std::make_unique<TraceBuffer>(id));
+                t_buffer = s_buffers.back().get();
+            }
+            else
+            {
+                t_buffer = s_free.back();
+                s_free.pop_back();
+                t_buffer->setExecutor(id);
+            }
+        }
+        return t_buffer;
+    }
+
+    void Tracer::retireBuffer()
+    {
+        if (t_buffer == nullptr)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(s_lock);
+        // Drained now, the next owner's events carry its own executor id
+        if (s_file)
+        {
+            t_buffer->drain(s_file);
+        }
+        else
+        {
+            t_buffer->discard();
+        }
+        s_free.emplace_back(t_buffer);
+        t_buffer = nullptr;
+    }
+
+    void Tracer::emit(TraceEventType type, uint32_t routine, uint64_t arg)
+    {
+        // A preempted routine may resume on another executor, it must not be switched out halfway
+        // through appending to this thread's buffer
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        localBuffer()->push(type, routine, arg, nowNanos());
+        if (preemptible)
+        {
+            executor->setPreemptible(true);
+        }
+    }
+
+    uint32_t Tracer::currentRoutine()
+    {
+        auto *executor = Executor::current();
+        return executor ? executor->activeRoutineId() : 0;
+    }
+
+    void Tracer::flush()
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        for (auto &buffer : s_buffers)
+        {
+            buffer->drain(s_file);
+        }
+    }
+
+    bool Tracer::start(const std::string &path)
+    {
+        stop();
+        FILE *file = fopen(path.c_str(), "wb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), file);
+        {
+            // Exiting threads drain into s_file, see retireBuffer()
+            std::unique_lock<std::mutex> lock(s_lock);
+            s_file = file;
+            // Stale events from an earlier trace are discarded
+            for (auto &buffer : s_buffers)
+            {
+                buffer->discard();
+            }
+        }
+        s_flushing = true;
+        s_flusher = std::thread([]()
+                                {
+                                    using namespace std::chrono_literals;
+                                    while (s_flushing)
+                                    {
+                                        flush();
+                                        std::this_thread::sleep_for(10ms);
+                                    }
+                                });
+        s_enabled = true;
+        return true;
+    }
+
+    void Tracer::stop()
+    {
+        if (not s_flushing)
+        {
+            return;
+        }
+        s_enabled = false;
+        s_flushing = false;
+        s_flusher.join();
+        flush();
+        std::unique_lock<std::mutex> lock(s_lock);
+        fclose(s_file);
+        s_file = nullptr;
+    }
+
+    uint64_t Tracer::dropped()
+    {
+        std::unique_lock<std::mutex> lock(s_lock);
+        uint64_t total = 0;
+        for (auto &buffer : s_buffers)
+        {
+            total += buffer->dropped();
+        }
+        return total;
+    }
+
+    bool Tracer::load(const std::string &path, std::vector<TraceEvent> &events)
+    {
+        FILE *in = fopen(path.c_str(), "rb");
+        if (in == nullptr)
+        {
+            return false;
+        }
+        char magic[sizeof(TRACE_MAGIC)];
+        if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) or memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+        {
+            fclose(in);
+            return false;
+        }
+        TraceEvent event;
+        while (fread(&event, sizeof(event), 1, in) == 1)
+        {
+            events.emplace_back(event);
+        }
+        fclose(in);
+        // Buffers are flushed one after the other, restore the global order
+        std::stable_sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b)
+                         { return a.m_timestamp < b.m_timestamp; });
+        return true;
+    }
+
+    namespace
+    {
+        // Walks the sorted events and reports routine run slices, syscall slices and instants
+        // per executor. Shared by both exporters so they agree on what a slice is.
+        template <typename Visitor>
+        void visitTimeline(const std::vector<TraceEvent> &events, Visitor &visitor)
+        {
+            struct Open
+            {
+                uint32_t m_routine;
+                uint64_t m_start;
+            };
+            std::map<int, Open> running;
+            std::map<int, uint64_t> syscalls;
+            uint64_t last = 0;
+
+            for (auto &event : events)
+            {
+                last = event.m_timestamp;
+                int executor = event.m_executor;
+                auto const close = [&](const char *reason)
+                {
+                    auto it = running.find(executor);
+                    if (it != running.end())
+                    {
+                        visitor.slice(executor, it->second.m_routine, it->second.m_start, event.m_timestamp, reason);
+                        running.erase(it);
+                    }
+                };
+
+                switch (event.m_type)
+                {
+                case TRACE_START:
+                    close("switch");
+                    running[executor] = Open{event.m_routine, event.m_timestamp};
+                    break;
+                case TRACE_PREEMPT:
+                case TRACE_YIELD:
+                case TRACE_FINISH:
+                    close(TRACE_EVENT_NAMES[event.m_type]);
+                    break;
+                case TRACE_PARK:
+                    // Blocking routines are switched out right after announcing what they block on
+                    close(TRACE_EVENT_NAMES[event.m_type]);
+                    visitor.instant(event);
+                    break;
+                case TRACE_SYSCALL_ENTER:
+                    syscalls[executor] = event.m_timestamp;
+                    break;
+                case TRACE_SYSCALL_EXIT:
+                    if (syscalls.count(executor))
+                    {
+                        visitor.syscall(executor, event.m_routine, syscalls[executor], event.m_timestamp);
+                        syscalls.erase(executor);
+                    }
+                    break;
+                default:
+                    visitor.instant(event);
+                    break;
+                }
+            }
+            for (auto &[executor, open] : running)
+            {
+                visitor.slice(executor, open.m_routine, open.m_start, last, "trace_end");
+            }
+        }
+
+        std::vector<int> executorsOf(const std::vector<TraceEvent> &events)
+        {
+            std::vector<int> executors;
+            for (auto &event : events)
+            {
+                if (std::find(executors.begin(), executors.end(), event.m_executor) == executors.end())
+                {
+                    executors.emplace_back(event.m_executor);
+                }
+            }
+            std::sort(executors.begin(), executors.end());
+            return executors;
+        }
+
+        std::string executorName(int executor)
+        {
+            return executor < 0 ? std::string("external threads") : "executor " + std::to_string(executor);
+        }
+
+        // Syscalls may outlive the routine slice they started in, they get their own lane
+        const int SYSCALL_LANE = 1 << 16;
+    }
+
+    void Tracer::exportChromeJson(const std::vector<TraceEvent> &events, FILE *out)
+    {
+        uint64_t origin = events.empty() ? 0 : events.front().m_timestamp;
+        auto const micros = [origin](uint64_t ts)
+        { return double(ts - origin) / 1000.0; };
+
+        struct Visitor
+        {
+            FILE *m_out;
+            decltype(micros) &m_micros;
+            bool m_first{true};
+
+            void separator()
+            {
+                fputs(m_first ? "\n" : ",\n", m_out);
+                m_first = false;
+            }
+
+            void slice(int executor, uint32_t routine, uint64_t start, uint64_t end, const char *reason)
+            {
+                separator();
+                fprintf(m_out, R"({"name":"routine %u","ph":"X","pid":0,"tid":%d,"ts":%.3f,"dur":%.3f,"args":{"end":"%s"}})",
+                        routine, executor, m_micros(start), m_micros(end) - m_micros(start), reason);
+            }
+
+            void syscall(int executor, uint32_t routine, uint64_t start, uint64_t end)
+            {
+                separator();
+                fprintf(m_out, R"({"name":"syscall","ph":"X","pid":0,"tid":%d,"ts":%.3f,"dur":%.3f,"args":{"routine":%u}})",
+                        executor + SYSCALL_LANE, m_micros(start), m_micros(end) - m_micros(start), routine);
+            }
+
+            void instant(const TraceEvent &event)
+            {
+                separator();
+                fprintf(m_out, R"({"name":"%s","ph":"i","s":"t","pid":0,"tid":%d,"ts":%.3f,"args":{"routine":%u,"arg":%llu}})",
+                        TRACE_EVENT_NAMES[event.m_type], int(event.m_executor), m_micros(event.m_timestamp),
+                        event.m_routine, (unsigned long long)event.m_arg);
+            }
+        } visitor{out, micros};
+
+        fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", out);
+        for (int executor : executorsOf(events))
+        {
+            visitor.separator();
+            fprintf(out, R"({"name":"thread_name","ph":"M","pid":0,"tid":%d,"args":{"name":"%s"}})",
+                    executor, executorName(executor).c_str());
+            visitor.separator();
+            fprintf(out, R"({"name":"thread_name","ph":"M","pid":0,"tid":%d,"args":{"name":"%s syscalls"}})",
+                    executor + SYSCALL_LANE, executorName(executor).c_str());
+        }
+        visitTimeline(events, visitor);
+        fputs("\n]}\n", out);
+    }
+
+    void Tracer::exportPerfetto(const std::vector<TraceEvent> &events, FILE *out)
+    {
+        using detail::ProtoWriter;
+        // Field numbers from perfetto/protos/perfetto/trace/{trace,trace_packet}.proto and track_event/*.proto
+        enum : uint32_t
+        {
+            TRACE_PACKET = 1,
+            PACKET_TIMESTAMP = 8,
+            PACKET_SEQUENCE_ID = 10,
+            PACKET_TRACK_EVENT = 11,
+            PACKET_TRACK_DESCRIPTOR = 60,
+            DESCRIPTOR_UUID = 1,
+            DESCRIPTOR_NAME = 2,
+            EVENT_DEBUG_ANNOTATION = 4,
+            EVENT_TYPE = 9,
+            EVENT_TRACK_UUID = 11,
+            EVENT_NAME = 23,
+            ANNOTATION_UINT_VALUE = 3,
+            ANNOTATION_STRING_VALUE = 6,
+            ANNOTATION_NAME = 10,
+            TYPE_SLICE_BEGIN = 1,
+            TYPE_SLICE_END = 2,
+            TYPE_INSTANT = 3,
+        };
+        auto const trackUuid = [](int executor)
+        { return uint64_t(executor + 2); };
+
+        auto const writePacket = [out](const ProtoWriter &packet)
+        {
+            ProtoWriter trace;
+            trace.message(TRACE_PACKET, packet);
+            fwrite(trace.data().data(), 1, trace.data().size(), out);
+        };
+
+        auto const writeEvent = [&](uint64_t timestamp, uint64_t track, uint64_t type, const std::string &name, const ProtoWriter *annotation)
+        {
+            ProtoWriter event;
+            event.uint64(EVENT_TYPE, type);
+            event.uint64(EVENT_TRACK_UUID, track);
+            if (not name.empty())
+            {
+                event.string(EVENT_NAME, name);
+            }
+            if (annotation)
+            {
+                event.message(EVENT_DEBUG_ANNOTATION, *annotation);
+            }
+            ProtoWriter packet;
+            packet.uint64(PACKET_TIMESTAMP, timestamp);
+            packet.uint64(PACKET_SEQUENCE_ID, 1);
+            packet.message(PACKET_TRACK_EVENT, event);
+            writePacket(packet);
+        };
+
+        for (int executor : executorsOf(events))
+        {
+            for (int lane : {executor, executor + SYSCALL_LANE})
+            {
+                ProtoWriter descriptor;
+                descriptor.uint64(DESCRIPTOR_UUID, trackUuid(lane));
+                descriptor.string(DESCRIPTOR_NAME, executorName(executor) + (lane == executor ? "" : " syscalls"));
+                ProtoWriter packet;
+                packet.message(PACKET_TRACK_DESCRIPTOR, descriptor);
+                writePacket(packet);
+            }
+        }
+
+        struct Visitor
+        {
+            decltype(trackUuid) &m_track;
+            decltype(writeEvent) &m_write;
+
+            void slice(int executor, uint32_t routine, uint64_t start, uint64_t end, const char *reason)
+            {
+                ProtoWriter annotation;
+                annotation.string(ANNOTATION_NAME, "end");
+                annotation.string(ANNOTATION_STRING_VALUE, reason);
+                m_write(start, m_track(executor), TYPE_SLICE_BEGIN, "routine " + std::to_string(routine), nullptr);
+                m_write(end, m_track(executor), TYPE_SLICE_END, "", &annotation);
+            }
+
+            void syscall(int executor, uint32_t routine, uint64_t start, uint64_t end)
+            {
+                ProtoWriter annotation;
+                annotation.string(ANNOTATION_NAME, "routine");
+                annotation.uint64(ANNOTATION_UINT_VALUE, routine);
+                m_write(start, m_track(executor + SYSCALL_LANE), TYPE_SLICE_BEGIN, "syscall", &annotation);
+                m_write(end, m_track(executor + SYSCALL_LANE), TYPE_SLICE_END, "", nullptr);
+            }
+
+            void instant(const TraceEvent &event)
+            {
+                ProtoWriter annotation;
+                annotation.string(ANNOTATION_NAME, "arg");
+                annotation.uint64(ANNOTATION_UINT_VALUE, event.m_arg);
+                m_write(event.m_timestamp, m_track(event.m_executor), TYPE_INSTANT,
+                        std::string(TRACE_EVENT_NAMES[event.m_type]) + " routine " + std::to_string(event.m_routine), &annotation);
+            }
+        } visitor{trackUuid, writeEvent};
+        visitTimeline(events, visitor);
+    }
+}
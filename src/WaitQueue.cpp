@@ -0,0 +1,189 @@
+#include "WaitQueue.h"
+#include "CancelContext.h"
+#include "Machines.h"
+
+namespace gocpp
+{
+    void RoutineMutex::lock()
+    {
+        bool preemptible;
+        Executor::pin(preemptible);
+        m_lock.lock();
+        m_preemptible = preemptible;
+    }
+
+    bool RoutineMutex::try_lock()
+    {
+        bool preemptible;
+        auto *executor = Executor::pin(preemptible);
+        if (not m_lock.try_lock())
+        {
+            if (preemptible)
+            {
+                executor->setPreemptible(true);
+            }
+            return false;
+        }
+        m_preemptible = preemptible;
+        return true;
+    }
+
+    void RoutineMutex::unlock()
+    {
+        bool preemptible = m_preemptible;
+        m_lock.unlock();
+        if (preemptible)
+        {
+            Executor::current()->setPreemptible(true);
+        }
+    }
+
+    Parking::Parking()
+        : m_thread(Executor::current() == nullptr)
+    {
+    }
+
+    void Parking::fire()
+    {
+        // The owner may return (and this object go away) as soon as the state flips, read everything first
+        bool thread = m_thread;
+        auto previous = m_state.exchange(State::FIRED, std::memory_order_acq_rel);
+        if (thread)
+        {
+            detail::futexWake(m_state);
+        }
+        else if (previous == State::PARKED)
+        {
+            Machines::readyRoutine(std::move(m_routine));
+        }
+        // Still WAITING: the owner has not switched out yet, commit() will see FIRED and requeue it
+    }
+
+    void Parking::block()
+    {
+        if (m_thread)
+        {
+            while (m_state.load(std::memory_order_acquire) != State::FIRED)
+            {
+                detail::futexWait(m_state, State::WAITING);
+            }
+            return;
+        }
+        if (m_state.load(std::memory_order_acquire) != State::FIRED)
+        {
+            // Pinned, or a preemption could leave us parking on an executor we already left
+            bool preemptible;
+            Executor::pin(preemptible)->park(this);
+        }
+    }
+
+    bool Parking::block(CancelContext *context)
+    {
+        if (context == nullptr)
+        {
+            block();
+            return true;
+        }
+        auto &cancellations = context->waiters();
+        WaitQueue::Waiter cancellation{this};
+        {
+            std::unique_lock<RoutineMutex> guard(cancellations.lock());
+            if (not context->done())
+            {
+                cancellations.enqueue(cancellation);
+            }
+            else if (claim(&cancellations))
+            {
+                // Already cancelled, compete with the other notifiers like the context would have
+                fire();
+            }
+        }
+        block();
+        {
+            std::unique_lock<RoutineMutex> guard(cancellations.lock());
+            cancellations.remove(cancellation);
+        }
+        return wokenBy() != &cancellations;
+    }
+
+    void Parking::commit(RoutinePtr &&routine)
+    {
+        m_routine = std::move(routine);
+        uint32_t expected = State::WAITING;
+        if (not m_state.compare_exchange_strong(expected, State::PARKED, std::memory_order_acq_rel))
+        {
+            // Fired while we were switching out
+            Machines::readyRoutine(std::move(m_routine));
+        }
+    }
+
+    bool WaitQueue::wait(std::unique_lock<RoutineMutex> &guard, CancelContext *context)
+    {
+        Parking parking;
+        Waiter waiter{&parking};
+        enqueue(waiter);
+        return park(guard, waiter, context);
+    }
+
+    bool WaitQueue::park(std::unique_lock<RoutineMutex> &guard, Waiter &waiter, CancelContext *context)
+    {
+        guard.unlock();
+        bool woken = waiter.m_parking->block(context);
+        // Re-taking the lock also waits out the notifier, which fires under it
+        guard.lock();
+        remove(waiter);
+        return woken;
+    }
+
+    size_t WaitQueue::notify(size_t count)
+    {
+        size_t woken = 0;
+        while (woken < count and m_head != nullptr)
+        {
+            auto *waiter = m_head;
+            remove(*waiter);
+            // Waiters of a multi queue wait may already have been claimed through another queue
+            if (waiter->m_parking->claim(this))
+            {
+                waiter->m_parking->fire();
+                woken++;
+            }
+        }
+        return woken;
+    }
+
+    void WaitQueue::enqueue(Waiter &waiter)
+    {
+        waiter.m_prev = m_tail;
+        waiter.m_next = nullptr;
+        if (m_tail)
+        {
+            m_tail->m_next = &waiter;
+        }
+        else
+        {
+            m_head = &waiter;
+        }
+        m_tail = &waiter;
+        waiter.m_linked = true;
+        m_size++;
+        if (m_enqueues)
+        {
+            m_enqueues->fetch_add(1);
+            detail::futexWake(*m_enqueues);
+        }
+    }
+
+    void WaitQueue::remove(Waiter &waiter)
+    {
+        if (not waiter.m_linked)
+        {
+            return;
+        }
+        (waiter.m_prev ? waiter.m_prev->m_next : m_head) = waiter.m_next;
+        (waiter.m_next ? waiter.m_next->m_prev : m_tail) = waiter.m_prev;
+        waiter.m_prev = waiter.m_next = nullptr;
+        waiter.m_linked = false;
+        m_size--;
+    }
+}